@@ -0,0 +1,154 @@
+#!/bin/bash
+#
+# Insert benchmark of GiST index on signatures.  Table is populated with
+# random signatures and indexed, then pgbench clients insert more random
+# signatures concurrently.  Reports WAL volume per inserted row, which
+# depends on how often GiST support functions cause rewrites of parent keys.
+# Then single backend inserts pregenerated signatures, and its CPU time
+# (user + system, from /proc/self/stat of the backend) per inserted row is
+# reported, which reflects the CPU cost of the support functions.
+#
+# With BENCH_BASELINE set, the benchmark is run twice: with the current tree
+# and with the given git revision, each built and installed in turn, then
+# the current tree is installed back and reduction of both metrics relative
+# to the baseline is reported.
+#
+# Runs against local cluster on Linux configured by the usual libpq
+# environment variables, as superuser, since the backend reads its own
+# /proc/self/stat with pg_read_file().  imgsmlr should be installed, or
+# installable by "make install" when comparing, and must not be in
+# shared_preload_libraries then, since every new backend has to load the
+# freshly installed library.  PostgreSQL 11+ is required.  Settings:
+#
+#   BENCH_DB        database to (re)create, default imgsmlr_bench
+#   BENCH_ROWS      rows in table before the run, default 100000
+#   BENCH_CLIENTS   concurrent pgbench clients, default 8
+#   BENCH_DURATION  seconds to run, default 30
+#   BENCH_CPU_ROWS  rows inserted by single backend, default 20000
+#   BENCH_BASELINE  git revision to compare with, default none
+#
+
+set -eu
+
+dir=$(cd "$(dirname "$0")" && pwd)
+top=$(cd "$dir/.." && pwd)
+db=${BENCH_DB:-imgsmlr_bench}
+rows=${BENCH_ROWS:-100000}
+clients=${BENCH_CLIENTS:-8}
+duration=${BENCH_DURATION:-30}
+cpu_rows=${BENCH_CPU_ROWS:-20000}
+baseline=${BENCH_BASELINE:-}
+
+# Runs the benchmark with the installed build, sets wal_per_insert and
+# cpu_per_insert
+run_bench()
+{
+	local start count inserted index_size
+
+	dropdb --if-exists "$db"
+	createdb "$db"
+
+	# The same data set for every build
+	psql -X -q -d "$db" -v ON_ERROR_STOP=1 -v rows="$rows" <<'SQL'
+CREATE EXTENSION imgsmlr;
+CREATE TABLE bench_sig (id serial, signature signature);
+SELECT setseed(0.5) \gset
+-- Subquery refers to g, so it's evaluated for each row
+INSERT INTO bench_sig (signature)
+	SELECT ('(' || array_to_string(ARRAY(
+				SELECT random() FROM generate_series(1, 16) WHERE g > 0), ', ') ||
+			')')::signature
+	FROM generate_series(1, :rows) g;
+CREATE INDEX bench_sig_idx ON bench_sig USING gist (signature);
+VACUUM ANALYZE bench_sig;
+CHECKPOINT;
+SQL
+
+	start=$(psql -X -A -t -d "$db" -c "SELECT pg_current_wal_insert_lsn()")
+	count=$(psql -X -A -t -d "$db" -c "SELECT count(*) FROM bench_sig")
+
+	PGOPTIONS="-c synchronous_commit=off" \
+		pgbench -n -c "$clients" -j "$clients" -T "$duration" -f "$dir/insert.sql" "$db" |
+		grep -E '^(number of transactions actually processed|latency average|tps)'
+
+	read -r inserted wal_per_insert index_size < <(psql -X -A -t -F ' ' -d "$db" \
+		-v ON_ERROR_STOP=1 -v start="$start" -v count="$count" <<'SQL'
+SELECT
+	inserted,
+	round(wal / inserted),
+	pg_size_pretty(pg_relation_size('bench_sig_idx'))
+FROM (
+	SELECT
+		count(*) - :count AS inserted,
+		pg_wal_lsn_diff(pg_current_wal_insert_lsn(), :'start') AS wal
+	FROM bench_sig
+) x;
+SQL
+	)
+	echo "wal_bytes_per_insert: $wal_per_insert ($inserted rows, index $index_size)"
+
+	cpu_per_insert=$(psql -X -q -A -t -d "$db" -v ON_ERROR_STOP=1 \
+		-v rows="$cpu_rows" -v hz="$(getconf CLK_TCK)" <<'SQL'
+-- utime and stime of the backend in clock ticks, fields 14 and 15 of stat
+CREATE FUNCTION pg_temp.backend_cpu_ticks() RETURNS bigint AS $$
+	SELECT f[12]::bigint + f[13]::bigint
+	FROM (SELECT string_to_array(split_part(pg_read_file('/proc/self/stat', 0, 4096),
+											') ', 2), ' ') AS f) x
+$$ LANGUAGE sql;
+
+SELECT setseed(0.25) \gset
+CREATE TEMP TABLE bench_sig_new AS
+	SELECT ('(' || array_to_string(ARRAY(
+				SELECT random() FROM generate_series(1, 16) WHERE g > 0), ', ') ||
+			')')::signature AS signature
+	FROM generate_series(1, :rows) g;
+
+SELECT pg_temp.backend_cpu_ticks() AS ticks \gset
+INSERT INTO bench_sig (signature) SELECT signature FROM bench_sig_new;
+SELECT round((pg_temp.backend_cpu_ticks() - :ticks) * 1000000.0 / :hz / :rows, 1);
+SQL
+	)
+	echo "backend_cpu_us_per_insert: $cpu_per_insert ($cpu_rows rows)"
+}
+
+if [ -z "$baseline" ]; then
+	run_bench
+	exit 0
+fi
+
+if psql -X -A -t -d postgres -c "SHOW shared_preload_libraries" | grep -q imgsmlr; then
+	echo "imgsmlr must not be in shared_preload_libraries to compare builds" >&2
+	exit 1
+fi
+
+tree=$(mktemp -d)
+cleanup()
+{
+	git -C "$top" worktree remove --force "$tree" || rm -rf "$tree"
+	make -C "$top" USE_PGXS=1 install > /dev/null
+}
+trap cleanup EXIT
+
+git -C "$top" worktree add --detach "$tree" "$baseline" > /dev/null
+
+echo "== current"
+make -C "$top" USE_PGXS=1 install > /dev/null
+run_bench
+current_wal=$wal_per_insert
+current_cpu=$cpu_per_insert
+
+echo "== baseline $baseline"
+make -C "$tree" USE_PGXS=1 install > /dev/null
+run_bench
+baseline_wal=$wal_per_insert
+baseline_cpu=$cpu_per_insert
+
+echo "== comparison"
+awk -v bw="$baseline_wal" -v cw="$current_wal" \
+	-v bc="$baseline_cpu" -v cc="$current_cpu" 'BEGIN {
+	printf "%-26s %10s %10s %10s\n", "metric", "baseline", "current", "reduction"
+	printf "%-26s %10s %10s %9.1f%%\n", "wal_bytes_per_insert", bw, cw,
+		bw > 0 ? 100 * (bw - cw) / bw : 0
+	printf "%-26s %10s %10s %9.1f%%\n", "backend_cpu_us_per_insert", bc, cc,
+		bc > 0 ? 100 * (bc - cc) / bc : 0
+}'
@@ -0,0 +1,5 @@
+-- pgbench script for bench/insert.sh: insert single random signature
+INSERT INTO bench_sig (signature)
+	VALUES (('(' || array_to_string(ARRAY(
+				SELECT random() FROM generate_series(1, 16)), ', ') ||
+			')')::signature);
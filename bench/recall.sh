@@ -0,0 +1,43 @@
+#!/bin/bash
+#
+# Recall-vs-latency benchmark of two-stage search: candidates are found by
+# GiST KNN on signature and reranked by pattern distance.  Synthetic corpus
+# of image variants is generated by bench/variants, ground truth is the exact
+# brute-force top-k by pattern distance.
+#
+# Runs against local cluster configured by the usual libpq environment
+# variables, imgsmlr should be installed.  Settings:
+#
+#   BENCH_DB      database to (re)create, default imgsmlr_bench
+#   BENCH_K       number of results, default 10
+#   BENCH_LIMITS  candidate limits, default "10 20 50 100"
+#   BENCH_IMAGES  source images, default data/*
+#
+
+set -eu
+
+dir=$(cd "$(dirname "$0")" && pwd)
+db=${BENCH_DB:-imgsmlr_bench}
+k=${BENCH_K:-10}
+limits=${BENCH_LIMITS:-"10 20 50 100"}
+images=${BENCH_IMAGES:-"$dir/../data/*.jpg $dir/../data/*.png $dir/../data/*.gif"}
+corpus="$dir/corpus"
+
+rm -rf "$corpus"
+mkdir -p "$corpus"
+"$dir/variants" "$corpus" $images
+
+# psql could load only text, so images are passed as hex
+for f in "$corpus"/*.jpg; do
+	printf '%s\t%s\n' "$(basename "$f")" "$(xxd -p "$f" | tr -d '\n')"
+done > "$corpus/images.tsv"
+
+dropdb --if-exists "$db"
+createdb "$db"
+
+psql -X -q -d "$db" \
+	-v ON_ERROR_STOP=1 \
+	-v k="$k" \
+	-v limits="{$(echo $limits | tr ' ' ',')}" \
+	-v corpus="$corpus/images.tsv" \
+	-f "$dir/recall.sql"
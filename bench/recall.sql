@@ -0,0 +1,118 @@
+--
+-- Recall-vs-latency benchmark, see bench/recall.sh.  Expects psql variables
+-- k (number of results), limits (array of candidate limits) and corpus (file
+-- of image names and hex data).
+--
+
+CREATE EXTENSION imgsmlr;
+
+CREATE TABLE bench_hex (name text, data text);
+\copy bench_hex from :'corpus'
+
+-- Variant file name is "<base>.<variant>.jpg"
+CREATE TABLE bench_image AS
+	SELECT
+		row_number() OVER (ORDER BY name)::integer AS id,
+		split_part(name, '.', 1) AS base,
+		split_part(name, '.', 2) AS variant,
+		decode(data, 'hex') AS data
+	FROM bench_hex;
+DROP TABLE bench_hex;
+
+CREATE TABLE bench_pat AS
+	SELECT
+		id,
+		shuffle_pattern(pattern) AS pattern,
+		pattern2signature(pattern) AS signature
+	FROM (
+		SELECT id, jpeg2pattern(data) AS pattern FROM bench_image
+	) x
+	WHERE pattern IS NOT NULL;
+ALTER TABLE bench_pat ADD PRIMARY KEY (id);
+CREATE INDEX bench_pat_signature_idx ON bench_pat USING gist (signature);
+VACUUM ANALYZE bench_pat;
+
+SELECT count(*) AS images, count(DISTINCT base) AS originals
+FROM bench_image;
+
+-- Exact top-k by brute-force pattern distance
+CREATE TABLE bench_truth AS
+	SELECT q.id AS query_id, t.id
+	FROM bench_pat q CROSS JOIN LATERAL (
+		SELECT p.id
+		FROM bench_pat p
+		WHERE p.id <> q.id
+		ORDER BY p.pattern <-> q.pattern, p.id
+		LIMIT :k
+	) t;
+CREATE INDEX ON bench_truth (query_id);
+
+CREATE TABLE bench_result (
+	candidates integer,
+	query_id integer,
+	found integer,
+	expected integer,
+	latency float8
+);
+
+CREATE FUNCTION bench_run(candidates integer, k integer) RETURNS void AS $$
+DECLARE
+	q		record;
+	t0		timestamptz;
+	latency	float8;
+	ids		integer[];
+BEGIN
+	FOR q IN SELECT id, pattern, signature FROM bench_pat ORDER BY id LOOP
+		t0 := clock_timestamp();
+		SELECT array_agg(id) INTO ids FROM (
+			SELECT id FROM (
+				SELECT id, pattern
+				FROM bench_pat
+				WHERE id <> q.id
+				ORDER BY signature <-> q.signature
+				LIMIT candidates
+			) c
+			ORDER BY pattern <-> q.pattern, id
+			LIMIT k
+		) r;
+		latency := extract(epoch FROM clock_timestamp() - t0) * 1000.0;
+
+		INSERT INTO bench_result
+			SELECT candidates, q.id,
+				count(*) FILTER (WHERE t.id = ANY(ids)), count(*), latency
+			FROM bench_truth t
+			WHERE t.query_id = q.id;
+	END LOOP;
+END;
+$$ LANGUAGE plpgsql;
+
+-- Candidates should be found by index even on small corpus
+SET enable_seqscan = off;
+
+\o /dev/null
+-- Warm up caches and plans
+SELECT bench_run(max(c), :k) FROM unnest(:'limits'::integer[]) c;
+TRUNCATE bench_result;
+
+SELECT bench_run(c, :k) FROM unnest(:'limits'::integer[]) c;
+\o
+
+\echo Recall@k and latency of two-stage search by candidate limit
+SELECT
+	candidates,
+	round(sum(found)::numeric / nullif(sum(expected), 0), 4) AS recall,
+	round(avg(latency)::numeric, 3) AS avg_ms,
+	round(percentile_cont(0.5) WITHIN GROUP (ORDER BY latency)::numeric, 3) AS p50_ms,
+	round(percentile_cont(0.95) WITHIN GROUP (ORDER BY latency)::numeric, 3) AS p95_ms
+FROM bench_result
+GROUP BY candidates
+ORDER BY candidates;
+
+\echo Recall@k by variant of query image
+SELECT
+	i.variant,
+	r.candidates,
+	round(sum(r.found)::numeric / nullif(sum(r.expected), 0), 4) AS recall
+FROM bench_result r JOIN bench_image i ON i.id = r.query_id
+GROUP BY i.variant, r.candidates
+ORDER BY i.variant, r.candidates;
@@ -0,0 +1,74 @@
+#!/bin/bash
+#
+# Scalability benchmark: concurrent inserts into GiST index, two-stage KNN
+# searches and bulk image conversions, each run by pgbench at increasing
+# numbers of clients.  Dataset of random patterns and their signatures is
+# generated in SQL, images for conversions are taken from data/.  Reports
+# TPS, latency percentiles and index size after each run.
+#
+# Runs against local cluster configured by the usual libpq environment
+# variables, imgsmlr should be installed.  pgbench of PostgreSQL 10+ is
+# required for multi-line scripts.  Settings:
+#
+#   BENCH_DB         database to (re)create, default imgsmlr_bench
+#   BENCH_ROWS       synthetic items, default 10000
+#   BENCH_SIZE       pattern size, default 64
+#   BENCH_CLIENTS    client counts, default "1 2 4 8 16"
+#   BENCH_DURATION   seconds of each run, default 30
+#   BENCH_WORKLOADS  workloads to run, default "insert knn convert"
+#
+
+set -eu
+
+dir=$(cd "$(dirname "$0")" && pwd)
+db=${BENCH_DB:-imgsmlr_bench}
+rows=${BENCH_ROWS:-10000}
+size=${BENCH_SIZE:-64}
+clients=${BENCH_CLIENTS:-"1 2 4 8 16"}
+duration=${BENCH_DURATION:-30}
+workloads=${BENCH_WORKLOADS:-"insert knn convert"}
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+# psql could load only text, so images are passed as hex
+for f in "$dir"/../data/*.jpg "$dir"/../data/*.png "$dir"/../data/*.gif; do
+	printf '%s\t%s\n' "$(basename "$f")" "$(xxd -p "$f" | tr -d '\n')"
+done > "$tmp/images.tsv"
+
+dropdb --if-exists "$db"
+createdb "$db"
+
+psql -X -q -d "$db" -v ON_ERROR_STOP=1 \
+	-v rows="$rows" -v size="$size" -v images="$tmp/images.tsv" \
+	-f "$dir/scale.sql"
+
+printf '%-8s %7s %10s %9s %9s %9s %10s\n' \
+	workload clients tps p50_ms p95_ms p99_ms index
+for workload in $workloads; do
+	for c in $clients; do
+		rm -f "$tmp"/log*
+		tps=$(pgbench -n -c "$c" -j "$c" -T "$duration" -D rows="$rows" \
+				-l --log-prefix="$tmp/log" \
+				-f "$dir/scale_$workload.sql" "$db" |
+			awk '/^tps/ { print $3; exit }')
+
+		# Third field of transaction log is latency in microseconds
+		cat "$tmp"/log* | awk '{ print $3 }' | sort -n > "$tmp/latency"
+		percentiles=$(awk '
+			{ v[NR] = $1 }
+			END {
+				split("0.50 0.95 0.99", q, " ");
+				for (i = 1; i <= 3; i++) {
+					n = int(NR * q[i]);
+					if (n < 1) n = 1;
+					printf "%9.2f ", v[n] / 1000.0;
+				}
+			}' "$tmp/latency")
+
+		index=$(psql -X -A -t -d "$db" \
+			-c "SELECT pg_size_pretty(pg_relation_size('bench_item_signature_idx'))")
+
+		printf '%-8s %7d %10.1f %s%10s\n' \
+			"$workload" "$c" "$tps" "$percentiles" "$index"
+	done
+done
@@ -0,0 +1,40 @@
+--
+-- Setup of scalability benchmark, see bench/scale.sh.  Expects psql variables
+-- rows (number of synthetic items), size (pattern size) and images (file of
+-- image names and hex data).
+--
+
+CREATE EXTENSION imgsmlr;
+
+-- Random pattern, values are parsed in order regardless of nesting
+CREATE FUNCTION bench_random_pattern(size integer) RETURNS pattern AS $$
+	SELECT ('(' || string_agg((random() * 2 - 1)::text, ', ') || ')')::pattern
+	FROM generate_series(1, size * size)
+$$ LANGUAGE sql VOLATILE;
+
+-- Signature with small random noise added to every value
+CREATE FUNCTION bench_perturb(s signature) RETURNS signature AS $$
+	SELECT ('(' || string_agg((v + (random() - 0.5) * 0.01)::text, ', ') || ')')::signature
+	FROM unnest(string_to_array(btrim(s::text, '()'), ',')::float4[]) v
+$$ LANGUAGE sql VOLATILE;
+
+CREATE TABLE bench_item (
+	id serial PRIMARY KEY,
+	pattern pattern NOT NULL,
+	signature signature NOT NULL
+);
+INSERT INTO bench_item (pattern, signature)
+	SELECT p, pattern2signature(p)
+	FROM (
+		SELECT bench_random_pattern(:size) AS p
+		FROM generate_series(1, :rows)
+	) x;
+CREATE INDEX bench_item_signature_idx ON bench_item USING gist (signature);
+
+CREATE TABLE bench_hex (name text, data text);
+\copy bench_hex from :'images'
+CREATE TABLE bench_image AS
+	SELECT name, decode(data, 'hex') AS data FROM bench_hex;
+DROP TABLE bench_hex;
+
+VACUUM ANALYZE;
@@ -0,0 +1,2 @@
+-- pgbench script for bench/scale.sh: bulk conversion of all the images
+SELECT count(*) FROM images2patterns(ARRAY(SELECT data FROM bench_image));
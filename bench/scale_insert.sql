@@ -0,0 +1,5 @@
+-- pgbench script for bench/scale.sh: insert perturbed copy of random item,
+-- which goes through signature_penalty and, on full pages, picksplit
+\set id random(1, :rows)
+INSERT INTO bench_item (pattern, signature)
+	SELECT pattern, bench_perturb(signature) FROM bench_item WHERE id = :id;
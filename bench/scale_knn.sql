@@ -0,0 +1,10 @@
+-- pgbench script for bench/scale.sh: two-stage search, GiST KNN by
+-- signature followed by reranking of candidates by pattern distance
+\set id random(1, :rows)
+SELECT id FROM (
+	SELECT id, pattern FROM bench_item
+	ORDER BY signature <-> (SELECT signature FROM bench_item WHERE id = :id)
+	LIMIT 100
+) c
+ORDER BY pattern <-> (SELECT pattern FROM bench_item WHERE id = :id)
+LIMIT 10;
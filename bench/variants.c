@@ -0,0 +1,237 @@
+/*-------------------------------------------------------------------------
+ *
+ *          Image similarity extension
+ *
+ * Copyright (c) 2015, PostgreSQL Global Development Group
+ *
+ * This software is released under the PostgreSQL Licence.
+ *
+ * Generator of transformed image variants for the recall benchmark.  For
+ * each input image it writes the original and a set of its variants (crops,
+ * scales, JPEG recompression, brightness shifts and flips) as JPEG files into
+ * the output directory.  File name is "<base>.<variant>.jpg", so the
+ * original image of a variant could be identified by its name.
+ *
+ * Usage: variants OUTDIR IMAGE...
+ *
+ * IDENTIFICATION
+ *    imgsmlr/bench/variants.c
+ *-------------------------------------------------------------------------
+ */
+#include <gd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef enum
+{
+	VARIANT_COPY,
+	VARIANT_CROP,
+	VARIANT_SCALE,
+	VARIANT_BRIGHTNESS,
+	VARIANT_FLIP
+} VariantKind;
+
+typedef struct
+{
+	const char *name;
+	VariantKind kind;
+	int			param;			/* percent, brightness delta or flip mode */
+	int			quality;		/* JPEG quality of the output */
+} Variant;
+
+static const Variant variants[] = {
+	{"orig", VARIANT_COPY, 0, 95},
+	{"q50", VARIANT_COPY, 0, 50},
+	{"q20", VARIANT_COPY, 0, 20},
+	{"crop90", VARIANT_CROP, 90, 90},
+	{"crop75", VARIANT_CROP, 75, 90},
+	{"scale50", VARIANT_SCALE, 50, 90},
+	{"scale25", VARIANT_SCALE, 25, 90},
+	{"bright+30", VARIANT_BRIGHTNESS, 30, 90},
+	{"bright-30", VARIANT_BRIGHTNESS, -30, 90},
+	{"fliph", VARIANT_FLIP, GD_FLIP_HORINZONTAL, 90},
+	{"flipv", VARIANT_FLIP, GD_FLIP_VERTICAL, 90}
+};
+
+#define NUM_VARIANTS (sizeof(variants) / sizeof(variants[0]))
+
+/*
+ * Read whole file into memory.
+ */
+static void *
+readFile(const char *path, int *size)
+{
+	FILE	   *f = fopen(path, "rb");
+	void	   *data;
+	long		len;
+
+	if (!f)
+		return NULL;
+	fseek(f, 0, SEEK_END);
+	len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	data = malloc(len > 0 ? len : 1);
+	if (!data || fread(data, 1, len, f) != (size_t) len)
+	{
+		free(data);
+		fclose(f);
+		return NULL;
+	}
+	fclose(f);
+	*size = (int) len;
+	return data;
+}
+
+/*
+ * Load image detecting its format by magic bytes.
+ */
+static gdImagePtr
+loadImage(const char *path)
+{
+	int			size;
+	unsigned char *data = readFile(path, &size);
+	gdImagePtr	im = NULL;
+
+	if (!data)
+		return NULL;
+	if (size >= 3 && data[0] == 0xFF && data[1] == 0xD8 && data[2] == 0xFF)
+		im = gdImageCreateFromJpegPtr(size, data);
+	else if (size >= 8 && memcmp(data, "\x89PNG\r\n\x1a\n", 8) == 0)
+		im = gdImageCreateFromPngPtr(size, data);
+	else if (size >= 6 && memcmp(data, "GIF8", 4) == 0)
+		im = gdImageCreateFromGifPtr(size, data);
+	free(data);
+
+	/* Palette images are converted so that all the filters work the same */
+	if (im && !gdImageTrueColor(im))
+		gdImagePaletteToTrueColor(im);
+	return im;
+}
+
+/*
+ * Make variant of the image.  Returned image should be destroyed by caller.
+ */
+static gdImagePtr
+makeVariant(gdImagePtr im, const Variant *variant)
+{
+	int			sx = gdImageSX(im),
+				sy = gdImageSY(im);
+	gdImagePtr	result;
+	gdRect		rect;
+
+	switch (variant->kind)
+	{
+		case VARIANT_COPY:
+			result = gdImageCreateTrueColor(sx, sy);
+			if (result)
+				gdImageCopy(result, im, 0, 0, 0, 0, sx, sy);
+			return result;
+		case VARIANT_CROP:
+			/* Centered crop keeping given percent of each dimension */
+			rect.width = sx * variant->param / 100;
+			rect.height = sy * variant->param / 100;
+			rect.x = (sx - rect.width) / 2;
+			rect.y = (sy - rect.height) / 2;
+			return gdImageCrop(im, &rect);
+		case VARIANT_SCALE:
+			return gdImageScale(im, sx * variant->param / 100,
+								sy * variant->param / 100);
+		case VARIANT_BRIGHTNESS:
+			result = makeVariant(im, &variants[0]);
+			if (result)
+				gdImageBrightness(result, variant->param);
+			return result;
+		case VARIANT_FLIP:
+			result = makeVariant(im, &variants[0]);
+			if (result)
+			{
+				if (variant->param == GD_FLIP_HORINZONTAL)
+					gdImageFlipHorizontal(result);
+				else
+					gdImageFlipVertical(result);
+			}
+			return result;
+	}
+	return NULL;
+}
+
+/*
+ * Base name of the file without directory and extension.
+ */
+static void
+baseName(const char *path, char *dst, size_t len)
+{
+	const char *start = strrchr(path, '/');
+	const char *end;
+	size_t		n;
+
+	start = start ? start + 1 : path;
+	end = strchr(start, '.');
+	n = end ? (size_t) (end - start) : strlen(start);
+	if (n >= len)
+		n = len - 1;
+	memcpy(dst, start, n);
+	dst[n] = '\0';
+}
+
+int
+main(int argc, char **argv)
+{
+	int			i;
+	int			errors = 0;
+
+	if (argc < 3)
+	{
+		fprintf(stderr, "Usage: %s OUTDIR IMAGE...\n", argv[0]);
+		return 1;
+	}
+
+	for (i = 2; i < argc; i++)
+	{
+		gdImagePtr	im = loadImage(argv[i]);
+		char		base[256];
+		size_t		v;
+
+		if (!im)
+		{
+			fprintf(stderr, "could not load image \"%s\"\n", argv[i]);
+			errors++;
+			continue;
+		}
+		baseName(argv[i], base, sizeof(base));
+
+		for (v = 0; v < NUM_VARIANTS; v++)
+		{
+			gdImagePtr	variant = makeVariant(im, &variants[v]);
+			char		path[1024];
+			FILE	   *f;
+
+			if (!variant)
+			{
+				fprintf(stderr, "could not make variant \"%s\" of \"%s\"\n",
+						variants[v].name, argv[i]);
+				errors++;
+				continue;
+			}
+
+			snprintf(path, sizeof(path), "%s/%s.%s.jpg",
+					 argv[1], base, variants[v].name);
+			f = fopen(path, "wb");
+			if (!f)
+			{
+				fprintf(stderr, "could not open \"%s\" for writing\n", path);
+				errors++;
+			}
+			else
+			{
+				gdImageJpeg(variant, f, variants[v].quality);
+				fclose(f);
+			}
+			gdImageDestroy(variant);
+		}
+		gdImageDestroy(im);
+	}
+
+	return errors ? 1 : 0;
+}
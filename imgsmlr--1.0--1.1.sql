@@ -0,0 +1,969 @@
+/* imgsmlr/imgsmlr--1.0--1.1.sql */
+
+-- complain if script is sourced in psql, rather than via ALTER EXTENSION
+\echo Use "ALTER EXTENSION imgsmlr UPDATE TO '1.1'" to load this file. \quit
+
+CREATE FUNCTION bitsignature_in(cstring)
+RETURNS bitsignature
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION bitsignature_out(bitsignature)
+RETURNS cstring
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT;
+
+CREATE TYPE bitsignature (
+	INTERNALLENGTH = 32,
+	INPUT = bitsignature_in,
+	OUTPUT = bitsignature_out,
+	ALIGNMENT = double
+);
+
+CREATE FUNCTION pattern2bitsignature(pattern)
+RETURNS bitsignature
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT COST 100;
+
+CREATE FUNCTION bitsignature_distance(bitsignature, bitsignature)
+RETURNS float4
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT COST 2;
+
+CREATE OPERATOR <-> (
+	LEFTARG = bitsignature,
+	RIGHTARG = bitsignature,
+	PROCEDURE = bitsignature_distance,
+	COMMUTATOR = '<->'
+);
+
+CREATE FUNCTION bitsignature_consistent(internal,bitsignature,int,oid,internal)
+RETURNS bool
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION bitsignature_compress(internal)
+RETURNS internal
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION bitsignature_penalty(internal,internal,internal)
+RETURNS internal
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION bitsignature_picksplit(internal, internal)
+RETURNS internal
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION bitsignature_union(internal, internal)
+RETURNS bytea
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION bitsignature_same(bytea, bytea, internal)
+RETURNS internal
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION bitsignature_gist_distance(internal, text, int, oid)
+RETURNS float8
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OPERATOR CLASS gist_bitsignature_ops
+    DEFAULT FOR TYPE bitsignature USING gist AS
+	OPERATOR    1   <-> FOR ORDER BY pg_catalog.float_ops,
+	FUNCTION	1	bitsignature_consistent (internal, bitsignature, int, oid, internal),
+	FUNCTION	2	bitsignature_union (internal, internal),
+	FUNCTION	3	bitsignature_compress (internal),
+	FUNCTION	4	signature_decompress (internal),
+	FUNCTION	5	bitsignature_penalty (internal, internal, internal),
+	FUNCTION	6	bitsignature_picksplit (internal, internal),
+	FUNCTION	7	bitsignature_same (bytea, bytea, internal),
+	FUNCTION	8	bitsignature_gist_distance (internal, text, int, oid),
+	STORAGE		bytea;
+
+CREATE FUNCTION signature_spg_config(internal, internal)
+RETURNS void
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION signature_spg_choose(internal, internal)
+RETURNS void
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION signature_spg_picksplit(internal, internal)
+RETURNS void
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION signature_spg_inner_consistent(internal, internal)
+RETURNS void
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION signature_spg_leaf_consistent(internal, internal)
+RETURNS bool
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT;
+
+-- SP-GiST supports ordering operators since PostgreSQL 12
+DO $$
+BEGIN
+	IF current_setting('server_version_num')::int >= 120000 THEN
+		CREATE OPERATOR CLASS spgist_signature_ops
+			DEFAULT FOR TYPE signature USING spgist AS
+			OPERATOR	1	<-> (signature, signature) FOR ORDER BY pg_catalog.float_ops,
+			FUNCTION	1	signature_spg_config (internal, internal),
+			FUNCTION	2	signature_spg_choose (internal, internal),
+			FUNCTION	3	signature_spg_picksplit (internal, internal),
+			FUNCTION	4	signature_spg_inner_consistent (internal, internal),
+			FUNCTION	5	signature_spg_leaf_consistent (internal, internal);
+	END IF;
+END;
+$$;
+
+-- Index access method API is available since PostgreSQL 9.6
+DO $$
+BEGIN
+	IF current_setting('server_version_num')::int >= 90600 THEN
+		EXECUTE $sql$
+			CREATE FUNCTION hnsw_handler(internal)
+			RETURNS index_am_handler
+			AS 'MODULE_PATHNAME'
+			LANGUAGE C
+		$sql$;
+		EXECUTE 'CREATE ACCESS METHOD hnsw TYPE INDEX HANDLER hnsw_handler';
+		EXECUTE $sql$
+			CREATE OPERATOR CLASS hnsw_signature_ops
+				DEFAULT FOR TYPE signature USING hnsw AS
+				OPERATOR	1	<-> (signature, signature) FOR ORDER BY pg_catalog.float_ops,
+				FUNCTION	1	signature_distance (signature, signature)
+		$sql$;
+		EXECUTE $sql$
+			CREATE OPERATOR CLASS hnsw_bitsignature_ops
+				DEFAULT FOR TYPE bitsignature USING hnsw AS
+				OPERATOR	1	<-> (bitsignature, bitsignature) FOR ORDER BY pg_catalog.float_ops,
+				FUNCTION	1	bitsignature_distance (bitsignature, bitsignature)
+		$sql$;
+	END IF;
+END;
+$$;
+
+CREATE FUNCTION pattern_typmod_in(cstring[])
+RETURNS integer
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION pattern_typmod_out(integer)
+RETURNS cstring
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT;
+
+-- ALTER TYPE ... SET is available since PostgreSQL 13
+DO $$
+BEGIN
+	IF current_setting('server_version_num')::int >= 130000 THEN
+		EXECUTE 'ALTER TYPE pattern SET (TYPMOD_IN = pattern_typmod_in, TYPMOD_OUT = pattern_typmod_out)';
+	ELSE
+		UPDATE pg_catalog.pg_type
+		SET typmodin = 'pattern_typmod_in'::regproc,
+			typmodout = 'pattern_typmod_out'::regproc
+		WHERE oid = 'pattern'::regtype;
+	END IF;
+END;
+$$;
+
+CREATE FUNCTION pattern(pattern, integer, boolean)
+RETURNS pattern
+AS 'MODULE_PATHNAME', 'pattern_resize'
+LANGUAGE C IMMUTABLE STRICT COST 500;
+
+CREATE CAST (pattern AS pattern)
+	WITH FUNCTION pattern(pattern, integer, boolean) AS IMPLICIT;
+
+CREATE FUNCTION pattern_size(pattern)
+RETURNS integer
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION jpeg2pattern(bytea, integer)
+RETURNS pattern
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT COST 10000;
+
+CREATE FUNCTION png2pattern(bytea, integer)
+RETURNS pattern
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT COST 10000;
+
+CREATE FUNCTION gif2pattern(bytea, integer)
+RETURNS pattern
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT COST 10000;
+
+CREATE FUNCTION pattern_rerank(rel regclass, col name, query pattern, tids tid[], k integer)
+RETURNS TABLE (tid tid, distance float4)
+AS 'MODULE_PATHNAME'
+LANGUAGE C STABLE STRICT COST 10000;
+
+CREATE FUNCTION imgsmlr_stats(cumulative boolean,
+	OUT gist_distance_leaf_calls bigint,
+	OUT gist_distance_internal_calls bigint,
+	OUT knn_scans bigint,
+	OUT pages_visited bigint,
+	OUT consistent_rechecks bigint,
+	OUT penalty_calls bigint,
+	OUT penalty_time float8,
+	OUT picksplit_calls bigint,
+	OUT picksplit_time float8,
+	OUT pattern_distance_calls bigint)
+AS 'MODULE_PATHNAME'
+LANGUAGE C VOLATILE STRICT;
+
+CREATE FUNCTION imgsmlr_stats_reset()
+RETURNS void
+AS 'MODULE_PATHNAME'
+LANGUAGE C VOLATILE;
+
+-- Shared counters are reset for the whole cluster, don't let anyone do that
+REVOKE ALL ON FUNCTION imgsmlr_stats_reset() FROM PUBLIC;
+
+CREATE VIEW pg_stat_imgsmlr AS
+	SELECT * FROM imgsmlr_stats(true);
+
+CREATE FUNCTION imgsmlr_ingest_stats(cumulative boolean,
+	OUT format text,
+	OUT images bigint,
+	OUT failures bigint,
+	OUT bytes_in bigint,
+	OUT pixels bigint,
+	OUT max_pixels bigint,
+	OUT decode_time float8,
+	OUT resample_time float8,
+	OUT normalize_time float8,
+	OUT wavelet_time float8,
+	OUT shuffle_time float8)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C VOLATILE STRICT;
+
+CREATE VIEW pg_stat_imgsmlr_ingest AS
+	SELECT * FROM imgsmlr_ingest_stats(true);
+
+CREATE FUNCTION pattern_recv(internal, oid, integer)
+RETURNS pattern
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT COST 100;
+
+CREATE FUNCTION pattern_send(pattern)
+RETURNS bytea
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT COST 100;
+
+CREATE FUNCTION signature_recv(internal)
+RETURNS signature
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION signature_send(signature)
+RETURNS bytea
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT;
+
+DO $$
+BEGIN
+	IF current_setting('server_version_num')::int >= 130000 THEN
+		EXECUTE 'ALTER TYPE pattern SET (RECEIVE = pattern_recv, SEND = pattern_send)';
+		EXECUTE 'ALTER TYPE signature SET (RECEIVE = signature_recv, SEND = signature_send)';
+	ELSE
+		UPDATE pg_catalog.pg_type
+		SET typreceive = 'pattern_recv'::regproc,
+			typsend = 'pattern_send'::regproc
+		WHERE oid = 'pattern'::regtype;
+		UPDATE pg_catalog.pg_type
+		SET typreceive = 'signature_recv'::regproc,
+			typsend = 'signature_send'::regproc
+		WHERE oid = 'signature'::regtype;
+	END IF;
+END;
+$$;
+
+CREATE FUNCTION images2patterns(bytea[])
+RETURNS SETOF pattern
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT COST 100000;
+
+CREATE FUNCTION images2patterns(bytea[], integer)
+RETURNS SETOF pattern
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT COST 100000;
+
+-- Queue of images whose descriptors are computed asynchronously.  Rows which
+-- couldn't be processed are kept with the error, clear it to retry them.
+CREATE TABLE imgsmlr_ingest_queue (
+	id bigserial PRIMARY KEY,
+	relid regclass NOT NULL,
+	key text NOT NULL,
+	image bytea NOT NULL,
+	enqueued_at timestamptz NOT NULL DEFAULT now(),
+	error text,
+	failed_at timestamptz
+);
+
+CREATE INDEX imgsmlr_ingest_queue_pending_idx ON imgsmlr_ingest_queue (id)
+	WHERE error IS NULL;
+
+-- Columns of the relations filled by the ingest queue
+CREATE TABLE imgsmlr_ingest_target (
+	relid regclass PRIMARY KEY,
+	key_column name NOT NULL,
+	pattern_column name,
+	shuffled_column name,
+	signature_column name
+);
+
+SELECT pg_catalog.pg_extension_config_dump('imgsmlr_ingest_queue', '');
+SELECT pg_catalog.pg_extension_config_dump('imgsmlr_ingest_queue_id_seq', '');
+SELECT pg_catalog.pg_extension_config_dump('imgsmlr_ingest_target', '');
+
+CREATE FUNCTION imgsmlr_ingest_process(batch_size integer DEFAULT 64)
+RETURNS integer AS $$
+DECLARE
+	ids			bigint[];
+	relids		regclass[];
+	keys		text[];
+	images		bytea[];
+	patterns	pattern[];
+	errors		text[];
+	target		record;
+	keytype		text;
+	setlist		text;
+	stmt		text;
+	failure		text;
+	n			integer;
+	i			integer;
+BEGIN
+	SELECT array_agg(id ORDER BY id), array_agg(relid ORDER BY id),
+		   array_agg(key ORDER BY id), array_agg(image ORDER BY id)
+	INTO ids, relids, keys, images
+	FROM (
+		SELECT id, relid, key, image FROM imgsmlr_ingest_queue
+		WHERE error IS NULL
+		ORDER BY id
+		LIMIT batch_size
+		FOR UPDATE SKIP LOCKED
+	) batch;
+
+	IF ids IS NULL THEN
+		RETURN 0;
+	END IF;
+	n := array_length(ids, 1);
+
+	SELECT array_agg(p ORDER BY o) INTO patterns
+	FROM images2patterns(images) WITH ORDINALITY t(p, o);
+
+	errors := array_fill(NULL::text, ARRAY[n]);
+	FOR i IN 1 .. n LOOP
+		IF patterns[i] IS NULL THEN
+			errors[i] := 'could not load image';
+		END IF;
+	END LOOP;
+
+	FOR target IN
+		SELECT t.*, r.relid AS queued
+		FROM (SELECT DISTINCT unnest(relids) AS relid) r
+			LEFT JOIN imgsmlr_ingest_target t ON t.relid = r.relid
+	LOOP
+		stmt := NULL;
+		failure := NULL;
+		BEGIN
+			IF target.relid IS NULL THEN
+				RAISE EXCEPTION 'no ingest target is configured for relation %',
+					target.queued;
+			END IF;
+
+			SELECT format_type(atttypid, atttypmod) INTO keytype
+			FROM pg_catalog.pg_attribute
+			WHERE attrelid = target.relid AND attname = target.key_column AND NOT attisdropped;
+			IF keytype IS NULL THEN
+				RAISE EXCEPTION 'column "%" of relation % does not exist',
+					target.key_column, target.relid;
+			END IF;
+
+			SELECT string_agg(s, ', ') INTO setlist FROM (VALUES
+				(CASE WHEN target.pattern_column IS NOT NULL
+					THEN format('%I = s.p', target.pattern_column) END),
+				(CASE WHEN target.shuffled_column IS NOT NULL
+					THEN format('%I = shuffle_pattern(s.p)', target.shuffled_column) END),
+				(CASE WHEN target.signature_column IS NOT NULL
+					THEN format('%I = pattern2signature(s.p)', target.signature_column) END)
+			) v(s);
+			IF setlist IS NULL THEN
+				CONTINUE;
+			END IF;
+
+			stmt := format('UPDATE %s t SET %s FROM unnest($1, $2, $3) s(relid, k, p) '
+							'WHERE s.relid = $4 AND s.p IS NOT NULL AND t.%I = s.k::%s',
+							target.relid, setlist, target.key_column, keytype);
+			EXECUTE stmt USING relids, keys, patterns, target.relid;
+		EXCEPTION WHEN OTHERS THEN
+			failure := SQLERRM;
+		END;
+
+		IF failure IS NULL THEN
+			CONTINUE;
+		END IF;
+
+		-- Retry the failed batch row by row to find the bad rows
+		FOR i IN 1 .. n LOOP
+			CONTINUE WHEN relids[i] <> target.queued OR errors[i] IS NOT NULL;
+			IF stmt IS NULL THEN
+				errors[i] := failure;
+				CONTINUE;
+			END IF;
+			BEGIN
+				EXECUTE stmt USING relids[i:i], keys[i:i], patterns[i:i], target.queued;
+			EXCEPTION WHEN OTHERS THEN
+				errors[i] := SQLERRM;
+			END;
+		END LOOP;
+	END LOOP;
+
+	DELETE FROM imgsmlr_ingest_queue q
+	USING unnest(ids, errors) b(id, error)
+	WHERE q.id = b.id AND b.error IS NULL;
+
+	UPDATE imgsmlr_ingest_queue q SET error = b.error, failed_at = now()
+	FROM unnest(ids, errors) b(id, error)
+	WHERE q.id = b.id AND b.error IS NOT NULL;
+
+	RETURN n;
+END;
+$$ LANGUAGE plpgsql VOLATILE;
+
+CREATE FUNCTION imgsmlr_cache_stats(
+	OUT hits bigint,
+	OUT misses bigint,
+	OUT evictions bigint,
+	OUT entries bigint,
+	OUT memory bigint)
+RETURNS record
+AS 'MODULE_PATHNAME'
+LANGUAGE C VOLATILE;
+
+CREATE FUNCTION imgsmlr_cache_reset()
+RETURNS void
+AS 'MODULE_PATHNAME'
+LANGUAGE C VOLATILE;
+
+CREATE FUNCTION pattern_eq(pattern, pattern)
+RETURNS bool
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT COST 10;
+
+CREATE FUNCTION pattern_ne(pattern, pattern)
+RETURNS bool
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT COST 10;
+
+CREATE FUNCTION pattern_lt(pattern, pattern)
+RETURNS bool
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT COST 10;
+
+CREATE FUNCTION pattern_le(pattern, pattern)
+RETURNS bool
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT COST 10;
+
+CREATE FUNCTION pattern_gt(pattern, pattern)
+RETURNS bool
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT COST 10;
+
+CREATE FUNCTION pattern_ge(pattern, pattern)
+RETURNS bool
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT COST 10;
+
+CREATE FUNCTION pattern_cmp(pattern, pattern)
+RETURNS integer
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT COST 10;
+
+CREATE FUNCTION pattern_hash(pattern)
+RETURNS integer
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT COST 50;
+
+CREATE OPERATOR = (
+	LEFTARG = pattern,
+	RIGHTARG = pattern,
+	PROCEDURE = pattern_eq,
+	COMMUTATOR = =,
+	NEGATOR = <>,
+	RESTRICT = eqsel,
+	JOIN = eqjoinsel,
+	HASHES,
+	MERGES
+);
+
+CREATE OPERATOR <> (
+	LEFTARG = pattern,
+	RIGHTARG = pattern,
+	PROCEDURE = pattern_ne,
+	COMMUTATOR = <>,
+	NEGATOR = =,
+	RESTRICT = neqsel,
+	JOIN = neqjoinsel
+);
+
+CREATE OPERATOR < (
+	LEFTARG = pattern,
+	RIGHTARG = pattern,
+	PROCEDURE = pattern_lt,
+	COMMUTATOR = >,
+	NEGATOR = >=,
+	RESTRICT = scalarltsel,
+	JOIN = scalarltjoinsel
+);
+
+CREATE OPERATOR <= (
+	LEFTARG = pattern,
+	RIGHTARG = pattern,
+	PROCEDURE = pattern_le,
+	COMMUTATOR = >=,
+	NEGATOR = >,
+	RESTRICT = scalarltsel,
+	JOIN = scalarltjoinsel
+);
+
+CREATE OPERATOR > (
+	LEFTARG = pattern,
+	RIGHTARG = pattern,
+	PROCEDURE = pattern_gt,
+	COMMUTATOR = <,
+	NEGATOR = <=,
+	RESTRICT = scalargtsel,
+	JOIN = scalargtjoinsel
+);
+
+CREATE OPERATOR >= (
+	LEFTARG = pattern,
+	RIGHTARG = pattern,
+	PROCEDURE = pattern_ge,
+	COMMUTATOR = <=,
+	NEGATOR = <,
+	RESTRICT = scalargtsel,
+	JOIN = scalargtjoinsel
+);
+
+CREATE OPERATOR CLASS btree_pattern_ops
+	DEFAULT FOR TYPE pattern USING btree AS
+	OPERATOR	1	<,
+	OPERATOR	2	<=,
+	OPERATOR	3	=,
+	OPERATOR	4	>=,
+	OPERATOR	5	>,
+	FUNCTION	1	pattern_cmp (pattern, pattern);
+
+CREATE OPERATOR CLASS hash_pattern_ops
+	DEFAULT FOR TYPE pattern USING hash AS
+	OPERATOR	1	=,
+	FUNCTION	1	pattern_hash (pattern);
+
+CREATE FUNCTION signature_eq(signature, signature)
+RETURNS bool
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION signature_ne(signature, signature)
+RETURNS bool
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION signature_lt(signature, signature)
+RETURNS bool
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION signature_le(signature, signature)
+RETURNS bool
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION signature_gt(signature, signature)
+RETURNS bool
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION signature_ge(signature, signature)
+RETURNS bool
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION signature_cmp(signature, signature)
+RETURNS integer
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION signature_hash(signature)
+RETURNS integer
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OPERATOR = (
+	LEFTARG = signature,
+	RIGHTARG = signature,
+	PROCEDURE = signature_eq,
+	COMMUTATOR = =,
+	NEGATOR = <>,
+	RESTRICT = eqsel,
+	JOIN = eqjoinsel,
+	HASHES,
+	MERGES
+);
+
+CREATE OPERATOR <> (
+	LEFTARG = signature,
+	RIGHTARG = signature,
+	PROCEDURE = signature_ne,
+	COMMUTATOR = <>,
+	NEGATOR = =,
+	RESTRICT = neqsel,
+	JOIN = neqjoinsel
+);
+
+CREATE OPERATOR < (
+	LEFTARG = signature,
+	RIGHTARG = signature,
+	PROCEDURE = signature_lt,
+	COMMUTATOR = >,
+	NEGATOR = >=,
+	RESTRICT = scalarltsel,
+	JOIN = scalarltjoinsel
+);
+
+CREATE OPERATOR <= (
+	LEFTARG = signature,
+	RIGHTARG = signature,
+	PROCEDURE = signature_le,
+	COMMUTATOR = >=,
+	NEGATOR = >,
+	RESTRICT = scalarltsel,
+	JOIN = scalarltjoinsel
+);
+
+CREATE OPERATOR > (
+	LEFTARG = signature,
+	RIGHTARG = signature,
+	PROCEDURE = signature_gt,
+	COMMUTATOR = <,
+	NEGATOR = <=,
+	RESTRICT = scalargtsel,
+	JOIN = scalargtjoinsel
+);
+
+CREATE OPERATOR >= (
+	LEFTARG = signature,
+	RIGHTARG = signature,
+	PROCEDURE = signature_ge,
+	COMMUTATOR = <=,
+	NEGATOR = <,
+	RESTRICT = scalargtsel,
+	JOIN = scalargtjoinsel
+);
+
+CREATE OPERATOR CLASS btree_signature_ops
+	DEFAULT FOR TYPE signature USING btree AS
+	OPERATOR	1	<,
+	OPERATOR	2	<=,
+	OPERATOR	3	=,
+	OPERATOR	4	>=,
+	OPERATOR	5	>,
+	FUNCTION	1	signature_cmp (signature, signature);
+
+CREATE OPERATOR CLASS hash_signature_ops
+	DEFAULT FOR TYPE signature USING hash AS
+	OPERATOR	1	=,
+	FUNCTION	1	signature_hash (signature);
+
+ALTER FUNCTION pattern_in(cstring) COST 1000;
+ALTER FUNCTION pattern_out(pattern) COST 1000;
+ALTER FUNCTION jpeg2pattern(bytea) COST 10000;
+ALTER FUNCTION png2pattern(bytea) COST 10000;
+ALTER FUNCTION gif2pattern(bytea) COST 10000;
+ALTER FUNCTION pattern2signature(pattern) COST 100;
+ALTER FUNCTION pattern_distance(pattern, pattern) COST 2000;
+ALTER FUNCTION signature_distance(signature, signature) COST 5;
+ALTER FUNCTION shuffle_pattern(pattern) COST 5000;
+
+CREATE FUNCTION signature_typanalyze(internal)
+RETURNS bool
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+
+DO $$
+BEGIN
+	IF current_setting('server_version_num')::int >= 130000 THEN
+		EXECUTE 'ALTER TYPE signature SET (ANALYZE = signature_typanalyze)';
+	ELSE
+		UPDATE pg_catalog.pg_type
+		SET typanalyze = 'signature_typanalyze'::regproc
+		WHERE oid = 'signature'::regtype;
+	END IF;
+END;
+$$;
+
+CREATE FUNCTION signature_distance_within(signature, signature, float4)
+RETURNS bool
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT COST 5;
+
+-- Selectivity of signature_distance_within() is estimated by support function
+DO $$
+BEGIN
+	IF current_setting('server_version_num')::int >= 120000 THEN
+		CREATE FUNCTION signature_distance_within_support(internal)
+		RETURNS internal
+		AS 'MODULE_PATHNAME'
+		LANGUAGE C IMMUTABLE STRICT;
+
+		ALTER FUNCTION signature_distance_within(signature, signature, float4)
+			SUPPORT signature_distance_within_support;
+	END IF;
+END;
+$$;
+
+CREATE FUNCTION signature_store_trigger()
+RETURNS trigger
+AS 'MODULE_PATHNAME'
+LANGUAGE C;
+
+CREATE FUNCTION signature_store_rebuild(rel regclass, col name)
+RETURNS bigint
+AS 'MODULE_PATHNAME'
+LANGUAGE C VOLATILE STRICT;
+
+CREATE FUNCTION signature_store_remove(rel regclass, col name)
+RETURNS void
+AS 'MODULE_PATHNAME'
+LANGUAGE C VOLATILE STRICT;
+
+CREATE FUNCTION signature_store_search(rel regclass, col name, query signature, k integer,
+	OUT tid tid, OUT distance float4)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STABLE STRICT COST 100000 ROWS 10;
+
+-- Create flat store mirroring signature column and the trigger maintaining it
+CREATE FUNCTION signature_store_create(rel regclass, col name)
+RETURNS bigint AS $$
+DECLARE
+	nsp text;
+BEGIN
+	SELECT quote_ident(n.nspname) INTO nsp
+	FROM pg_catalog.pg_extension e
+	JOIN pg_catalog.pg_namespace n ON n.oid = e.extnamespace
+	WHERE e.extname = 'imgsmlr';
+
+	EXECUTE format('CREATE TRIGGER %I AFTER INSERT OR UPDATE ON %s '
+				   'FOR EACH ROW EXECUTE PROCEDURE %s.signature_store_trigger(%L)',
+				   'imgsmlr_store_' || col, rel, nsp, col);
+	RETURN signature_store_rebuild(rel, col);
+END;
+$$ LANGUAGE plpgsql VOLATILE STRICT;
+
+CREATE FUNCTION signature_store_drop(rel regclass, col name)
+RETURNS void AS $$
+BEGIN
+	EXECUTE format('DROP TRIGGER IF EXISTS %I ON %s', 'imgsmlr_store_' || col, rel);
+	PERFORM signature_store_remove(rel, col);
+END;
+$$ LANGUAGE plpgsql VOLATILE STRICT;
+
+-- Codebooks of product quantizers, see pq_train()
+CREATE TABLE imgsmlr_pq_codebook (
+	id serial PRIMARY KEY,
+	pattern_size integer NOT NULL,
+	subspaces integer NOT NULL,
+	centroids integer NOT NULL,
+	data float4[] NOT NULL,
+	trained_at timestamptz NOT NULL DEFAULT now()
+);
+
+SELECT pg_catalog.pg_extension_config_dump('imgsmlr_pq_codebook', '');
+SELECT pg_catalog.pg_extension_config_dump('imgsmlr_pq_codebook_id_seq', '');
+
+-- Codebooks are read with privileges of whoever encodes or compares patterns
+GRANT SELECT ON imgsmlr_pq_codebook TO PUBLIC;
+
+CREATE FUNCTION pq_pattern_in(cstring)
+RETURNS pq_pattern
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION pq_pattern_out(pq_pattern)
+RETURNS cstring
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT;
+
+CREATE TYPE pq_pattern (
+	INTERNALLENGTH = -1,
+	INPUT = pq_pattern_in,
+	OUTPUT = pq_pattern_out,
+	STORAGE = plain
+);
+
+CREATE FUNCTION pq_codebook(pq_pattern)
+RETURNS integer
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION pq_train(rel regclass, col name, subspaces integer DEFAULT 64,
+	sample_size integer DEFAULT 4096, iterations integer DEFAULT 10)
+RETURNS integer
+AS 'MODULE_PATHNAME'
+LANGUAGE C VOLATILE STRICT;
+
+CREATE FUNCTION pattern2pq(pattern, codebook integer)
+RETURNS pq_pattern
+AS 'MODULE_PATHNAME'
+LANGUAGE C STABLE STRICT COST 1000;
+
+CREATE FUNCTION pq_distance(pq_pattern, pattern)
+RETURNS float4
+AS 'MODULE_PATHNAME'
+LANGUAGE C STABLE STRICT COST 10;
+
+CREATE OPERATOR <-> (
+	LEFTARG = pq_pattern,
+	RIGHTARG = pattern,
+	PROCEDURE = pq_distance
+);
+
+CREATE FUNCTION pattern_compress(pattern)
+RETURNS pattern
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT COST 200;
+
+CREATE FUNCTION pattern_decompress(pattern)
+RETURNS pattern
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT COST 50;
+
+CREATE FUNCTION signature_zorder(signature)
+RETURNS bytea
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT COST 10;
+
+-- Rewrite table in Z-order of signatures, see README
+CREATE FUNCTION imgsmlr_reorder(rel regclass, col name,
+	OUT correlation_before float8, OUT correlation_after float8)
+AS $$
+DECLARE
+	nsp text;
+	idx text;
+	correlation text;
+	store_col name;
+BEGIN
+	SELECT quote_ident(n.nspname) INTO nsp
+	FROM pg_catalog.pg_extension e
+	JOIN pg_catalog.pg_namespace n ON n.oid = e.extnamespace
+	WHERE e.extname = 'imgsmlr';
+
+	SELECT c.relname || '_' || col || '_zorder_idx' INTO idx
+	FROM pg_catalog.pg_class c
+	WHERE c.oid = rel;
+
+	-- Correlation between Z-order of rows and their physical position
+	correlation := format('SELECT corr(k, (ctid::text::point)[0] * 65536 + (ctid::text::point)[1]) '
+						  'FROM (SELECT ctid, rank() OVER (ORDER BY %s.signature_zorder(%I)) AS k FROM %s) x',
+						  nsp, col, rel);
+
+	EXECUTE correlation INTO correlation_before;
+	EXECUTE format('CREATE INDEX IF NOT EXISTS %I ON %s (%s.signature_zorder(%I))',
+				   idx, rel, nsp, col);
+	EXECUTE format('CLUSTER %s USING %I', rel, idx);
+	EXECUTE format('ANALYZE %s', rel);
+
+	-- Clustering moves rows to new TIDs, so signature stores must be rebuilt
+	FOR store_col IN
+		SELECT a.attname
+		FROM pg_catalog.pg_attribute a
+		JOIN pg_catalog.pg_trigger t ON t.tgrelid = a.attrelid AND
+			t.tgname = ('imgsmlr_store_' || a.attname)::name
+		WHERE a.attrelid = rel AND a.attnum > 0 AND NOT a.attisdropped
+	LOOP
+		PERFORM signature_store_rebuild(rel, store_col);
+	END LOOP;
+
+	EXECUTE correlation INTO correlation_after;
+END;
+$$ LANGUAGE plpgsql VOLATILE STRICT;
+
+-- Coarse quantizers of signatures, see signature_quantizer_train()
+CREATE TABLE imgsmlr_quantizer (
+	id serial PRIMARY KEY,
+	centroids integer NOT NULL,
+	data float4[] NOT NULL,
+	trained_at timestamptz NOT NULL DEFAULT now()
+);
+
+SELECT pg_catalog.pg_extension_config_dump('imgsmlr_quantizer', '');
+SELECT pg_catalog.pg_extension_config_dump('imgsmlr_quantizer_id_seq', '');
+
+-- Quantizers are read with privileges of whoever assigns or probes cells
+GRANT SELECT ON imgsmlr_quantizer TO PUBLIC;
+
+CREATE FUNCTION signature_quantizer_train(rel regclass, col name, centroids integer,
+	sample_size integer DEFAULT 10000, iterations integer DEFAULT 20)
+RETURNS integer
+AS 'MODULE_PATHNAME'
+LANGUAGE C VOLATILE STRICT;
+
+CREATE FUNCTION signature_assign(signature, quantizer integer)
+RETURNS integer
+AS 'MODULE_PATHNAME'
+LANGUAGE C STABLE STRICT COST 10;
+
+CREATE FUNCTION signature_probe(signature, quantizer integer, nprobe integer)
+RETURNS integer[]
+AS 'MODULE_PATHNAME'
+LANGUAGE C STABLE STRICT COST 10;
+
+-- KNN search in nprobe cells nearest to the query, see README
+CREATE FUNCTION signature_probe_search(rel regclass, col name, cell_col name,
+	query signature, quantizer integer, nprobe integer, k integer,
+	OUT part regclass, OUT tid tid, OUT distance float4)
+RETURNS SETOF record AS $$
+DECLARE
+	nsp text;
+BEGIN
+	SELECT quote_ident(n.nspname) INTO nsp
+	FROM pg_catalog.pg_extension e
+	JOIN pg_catalog.pg_namespace n ON n.oid = e.extnamespace
+	WHERE e.extname = 'imgsmlr';
+
+	-- Cells are passed as parameter value, so partitions are pruned
+	RETURN QUERY EXECUTE format('SELECT tableoid::regclass, ctid, %1$I OPERATOR(%2$s.<->) $1 '
+								'FROM %3$s WHERE %4$I = ANY ($2) '
+								'ORDER BY %1$I OPERATOR(%2$s.<->) $1 LIMIT $3',
+								col, nsp, rel, cell_col)
+		USING query, signature_probe(query, quantizer, nprobe), k;
+END;
+$$ LANGUAGE plpgsql STABLE STRICT;
+
+-- Load signature index, and optionally heap and TOAST of pattern column,
+-- into shared buffers, see README
+CREATE FUNCTION imgsmlr_prewarm(index regclass, col name DEFAULT NULL,
+	tids tid[] DEFAULT NULL,
+	OUT relation regclass, OUT part text, OUT pages bigint,
+	OUT loaded bigint, OUT resident float8)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C VOLATILE;
@@ -17,7 +17,10 @@
 #include "c.h"
 #include "fmgr.h"
 #include "imgsmlr.h"
+#include "imgsmlr_transform.h"
 #include "lib/stringinfo.h"
+#include "libpq/pqformat.h"
+#include "utils/array.h"
 #include "utils/builtins.h"
 
 #include <gd.h>
@@ -28,6 +31,8 @@
 
 PG_MODULE_MAGIC;
 
+void		_PG_init(void);
+
 PG_FUNCTION_INFO_V1(jpeg2pattern);
 Datum		jpeg2pattern(PG_FUNCTION_ARGS);
 PG_FUNCTION_INFO_V1(png2pattern);
@@ -48,95 +53,190 @@ PG_FUNCTION_INFO_V1(pattern_distance);
 Datum		pattern_distance(PG_FUNCTION_ARGS);
 PG_FUNCTION_INFO_V1(signature_distance);
 Datum		signature_distance(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(signature_distance_within);
+Datum		signature_distance_within(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(signature_zorder);
+Datum		signature_zorder(PG_FUNCTION_ARGS);
 PG_FUNCTION_INFO_V1(shuffle_pattern);
 Datum		shuffle_pattern(PG_FUNCTION_ARGS);
-
-static Pattern *image2pattern(gdImagePtr im);
-static void makePattern(gdImagePtr im, PatternData *pattern);
-static void normalizePattern(PatternData *pattern);
-static void waveletTransform(PatternData *dst, PatternData *src, int size);
-static float calcSumm(PatternData *pattern, int x, int y, int sX, int sY);
-static void calcSignature(PatternData *pattern, Signature *signature);
-static float calcDiff(PatternData *patternA, PatternData *patternB, int x, int y, int sX, int sY);
-static void shuffle(PatternData *dst, PatternData *src, int x, int y, int sX, int sY, int w);
+PG_FUNCTION_INFO_V1(pattern2bitsignature);
+Datum		pattern2bitsignature(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(bitsignature_in);
+Datum		bitsignature_in(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(bitsignature_out);
+Datum		bitsignature_out(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(bitsignature_distance);
+Datum		bitsignature_distance(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(pattern_typmod_in);
+Datum		pattern_typmod_in(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(pattern_typmod_out);
+Datum		pattern_typmod_out(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(pattern_resize);
+Datum		pattern_resize(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(pattern_size);
+Datum		pattern_size(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(pattern_recv);
+Datum		pattern_recv(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(pattern_send);
+Datum		pattern_send(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(signature_recv);
+Datum		signature_recv(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(signature_send);
+Datum		signature_send(PG_FUNCTION_ARGS);
+
+static Pattern *image2pattern(gdImagePtr im, int size, ImgsmlrFormat format,
+							  instr_time *lap);
+static Pattern *loadImage(FunctionCallInfo fcinfo, ImgsmlrFormat format,
+						  gdImagePtr (*load) (int size, void *data));
+static float calcDiff(const float *patternA, const float *patternB, int n, int x, int y, int sX, int sY);
 static float read_float(char **s, char *type_name, char *orig_string);
+static bool patternSizeIsValid(int size);
 
 #ifdef DEBUG_INFO
-static void debugPrintPattern(PatternData *pattern, const char *filename, bool color);
+static void debugPrintPattern(float *pattern, int size, const char *filename, bool color);
 static void debugPrintSignature(Signature *signature, const char *filename);
 #endif
 
 /*
- * Transform GD image into pattern.
+ * Module load callback.
+ */
+void
+_PG_init(void)
+{
+	hnswInit();
+	statsInit();
+	batchInit();
+	ingestInit();
+	cacheInit();
+	codecInit();
+}
+
+/*
+ * Transform GD image into pattern.  Time of each stage is accounted to the
+ * ingest statistics of given format, "lap" is the end time of previous stage.
  */
 static Pattern *
-image2pattern(gdImagePtr im)
+image2pattern(gdImagePtr im, int size, ImgsmlrFormat format, instr_time *lap)
 {
 	gdImagePtr	tb;
 	Pattern *pattern;
-	PatternData source;
+	float *source;
 
 	/* Resize image */
-	tb = gdImageCreateTrueColor(PATTERN_SIZE, PATTERN_SIZE);
+	tb = gdImageCreateTrueColor(size, size);
 	if (!tb)
 	{
+		IMGSMLR_INGEST_COUNT(format, IMGSMLR_INGEST_FAILURES, 1);
 		elog(NOTICE, "Error creating pattern");
 		return NULL;
 	}
-	gdImageCopyResampled(tb, im, 0, 0, 0, 0, PATTERN_SIZE, PATTERN_SIZE,
+	gdImageCopyResampled(tb, im, 0, 0, 0, 0, size, size,
 			im->sx, im->sy);
+	IMGSMLR_INGEST_LAP(format, IMGSMLR_INGEST_RESAMPLE_TIME, *lap);
 
 	/* Create source pattern as greyscale image */
-	makePattern(tb, &source);
+	source = (float *)palloc(PATTERN_BYTES(size));
+	makePattern(tb, source, size);
 	gdImageDestroy(tb);
 
 #ifdef DEBUG_INFO
-	debugPrintPattern(&source, "/tmp/pattern1.raw", false);
+	debugPrintPattern(source, size, "/tmp/pattern1.raw", false);
 #endif
 
 	/* "Normalize" intensiveness in the pattern */
-	normalizePattern(&source);
+	normalizePattern(source, size);
+	IMGSMLR_INGEST_LAP(format, IMGSMLR_INGEST_NORMALIZE_TIME, *lap);
 
 #ifdef DEBUG_INFO
-	debugPrintPattern(&source, "/tmp/pattern2.raw", false);
+	debugPrintPattern(source, size, "/tmp/pattern2.raw", false);
 #endif
 
 	/* Allocate pattern */
-	pattern = (Pattern *)palloc(sizeof(Pattern));
-	SET_VARSIZE(pattern, sizeof(Pattern));
+	pattern = (Pattern *)palloc(PATTERN_VARSIZE(size));
+	SET_VARSIZE(pattern, PATTERN_VARSIZE(size));
 
 	/* Do wavelet transform */
-	waveletTransform(&pattern->data, &source, PATTERN_SIZE);
+	waveletTransform(pattern->values, source, size);
+	pfree(source);
+	IMGSMLR_INGEST_LAP(format, IMGSMLR_INGEST_WAVELET_TIME, *lap);
 
 #ifdef DEBUG_INFO
-	debugPrintPattern(transformed, "/tmp/pattern3.raw", true);
+	debugPrintPattern(pattern->values, size, "/tmp/pattern3.raw", true);
 #endif
 
 	return pattern;
 }
 
 /*
- * Load pattern from jpeg image in bytea.
+ * Load image of given format from bytea argument and make pattern of size
+ * given by optional second argument.
  */
-Datum
-jpeg2pattern(PG_FUNCTION_ARGS)
+static Pattern *
+loadImage(FunctionCallInfo fcinfo, ImgsmlrFormat format,
+		  gdImagePtr (*load) (int size, void *data))
 {
 	bytea *img = PG_GETARG_BYTEA_P(0);
+	int size = (PG_NARGS() > 1) ? PG_GETARG_INT32(1) : PATTERN_SIZE;
 	Pattern *pattern;
 	gdImagePtr im;
+	instr_time	lap;
+	uint64		pixels;
 
-	im = gdImageCreateFromJpegPtr(VARSIZE_ANY_EXHDR(img), VARDATA_ANY(img));
-	PG_FREE_IF_COPY(img, 0);
+	if (!patternSizeIsValid(size))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("pattern size must be a power of two between %d and %d",
+						PATTERN_MIN_SIZE, PATTERN_MAX_SIZE)));
+
+	/* Repeated query image is taken from the cache without decoding */
+	pattern = (Pattern *) cacheLookup(format, size, VARDATA_ANY(img),
+									  VARSIZE_ANY_EXHDR(img));
+	if (pattern)
+	{
+		PG_FREE_IF_COPY(img, 0);
+		return pattern;
+	}
+
+	IMGSMLR_INGEST_COUNT(format, IMGSMLR_INGEST_IMAGES, 1);
+	IMGSMLR_INGEST_COUNT(format, IMGSMLR_INGEST_BYTES, VARSIZE_ANY_EXHDR(img));
+
+	INSTR_TIME_SET_CURRENT(lap);
+	im = load(VARSIZE_ANY_EXHDR(img), VARDATA_ANY(img));
+	IMGSMLR_INGEST_LAP(format, IMGSMLR_INGEST_DECODE_TIME, lap);
 	if (!im)
 	{
-		elog(NOTICE, "Error loading jpeg");
-		PG_RETURN_NULL();
+		PG_FREE_IF_COPY(img, 0);
+		IMGSMLR_INGEST_COUNT(format, IMGSMLR_INGEST_FAILURES, 1);
+		elog(NOTICE, "Error loading %s", imgsmlrFormatNames[format]);
+		return NULL;
 	}
-	pattern = image2pattern(im);
+
+	pixels = (uint64) im->sx * (uint64) im->sy;
+	IMGSMLR_INGEST_COUNT(format, IMGSMLR_INGEST_PIXELS, pixels);
+	if (pixels > imgsmlrIngestCounters[format][IMGSMLR_INGEST_MAX_PIXELS])
+		imgsmlrIngestCounters[format][IMGSMLR_INGEST_MAX_PIXELS] = pixels;
+
+	pattern = image2pattern(im, size, format, &lap);
 	gdImageDestroy(im);
 
 	if (pattern)
-		PG_RETURN_BYTEA_P(pattern);
+		cacheInsert(format, size, VARDATA_ANY(img), VARSIZE_ANY_EXHDR(img),
+					pattern, VARSIZE(pattern));
+	PG_FREE_IF_COPY(img, 0);
+
+	return pattern;
+}
+
+/*
+ * Load pattern from jpeg image in bytea.
+ */
+Datum
+jpeg2pattern(PG_FUNCTION_ARGS)
+{
+	Pattern *pattern = loadImage(fcinfo, IMGSMLR_FORMAT_JPEG, gdImageCreateFromJpegPtr);
+
+	if (pattern)
+		PG_RETURN_PATTERN(pattern);
 	else
 		PG_RETURN_NULL();
 }
@@ -147,22 +247,10 @@ jpeg2pattern(PG_FUNCTION_ARGS)
 Datum
 png2pattern(PG_FUNCTION_ARGS)
 {
-	bytea *img = PG_GETARG_BYTEA_P(0);
-	Pattern *pattern;
-	gdImagePtr im;
-
-	im = gdImageCreateFromPngPtr(VARSIZE_ANY_EXHDR(img), VARDATA_ANY(img));
-	PG_FREE_IF_COPY(img, 0);
-	if (!im)
-	{
-		elog(NOTICE, "Error loading png");
-		PG_RETURN_NULL();
-	}
-	pattern = image2pattern(im);
-	gdImageDestroy(im);
+	Pattern *pattern = loadImage(fcinfo, IMGSMLR_FORMAT_PNG, gdImageCreateFromPngPtr);
 
 	if (pattern)
-		PG_RETURN_BYTEA_P(pattern);
+		PG_RETURN_PATTERN(pattern);
 	else
 		PG_RETURN_NULL();
 }
@@ -173,22 +261,10 @@ png2pattern(PG_FUNCTION_ARGS)
 Datum
 gif2pattern(PG_FUNCTION_ARGS)
 {
-	bytea *img = PG_GETARG_BYTEA_P(0);
-	Pattern *pattern;
-	gdImagePtr im;
-
-	im = gdImageCreateFromGifPtr(VARSIZE_ANY_EXHDR(img), VARDATA_ANY(img));
-	PG_FREE_IF_COPY(img, 0);
-	if (!im)
-	{
-		elog(NOTICE, "Error loading gif");
-		PG_RETURN_NULL();
-	}
-	pattern = image2pattern(im);
-	gdImageDestroy(im);
+	Pattern *pattern = loadImage(fcinfo, IMGSMLR_FORMAT_GIF, gdImageCreateFromGifPtr);
 
 	if (pattern)
-		PG_RETURN_BYTEA_P(pattern);
+		PG_RETURN_PATTERN(pattern);
 	else
 		PG_RETURN_NULL();
 }
@@ -199,12 +275,11 @@ gif2pattern(PG_FUNCTION_ARGS)
 Datum
 pattern2signature(PG_FUNCTION_ARGS)
 {
-	bytea *patternData = PG_GETARG_BYTEA_P(0);
-	PatternData *pattern = (PatternData *)VARDATA_ANY(patternData);
+	Pattern *pattern = PG_GETARG_PATTERN(0);
 	Signature *signature = (Signature *)palloc(sizeof(Signature));
 
-	calcSignature(pattern, signature);
-	PG_FREE_IF_COPY(patternData, 0);
+	calcSignature(pattern->values, patternGetSize(pattern), signature);
+	PG_FREE_IF_COPY(pattern, 0);
 
 #ifdef DEBUG_INFO
 	debugPrintSignature(signature, "/tmp/signature.raw");
@@ -214,76 +289,56 @@ pattern2signature(PG_FUNCTION_ARGS)
 }
 
 /*
- * Shuffle pattern values in order to make further comparisons less sensitive
- * to shift. Shuffling is actually a build of "w" radius in rectangle
- * "(x, y) - (x + sX, y + sY)".
+ * Extract binary signature from pattern.
  */
-static void
-shuffle(PatternData *dst, PatternData *src, int x, int y, int sX, int sY, int w)
+Datum
+pattern2bitsignature(PG_FUNCTION_ARGS)
 {
-	int i, j;
+	Pattern *pattern = PG_GETARG_PATTERN(0);
+	BitSignature *signature = (BitSignature *)palloc(sizeof(BitSignature));
 
-	for (i = x; i < x + sX; i++)
-	{
-		for (j = y; j < y + sY; j++)
-		{
-			int ii, jj;
-			int ii_min = Max(x, i - w),
-				ii_max = Min(x + sX, i + w + 1),
-				jj_min = Max(y, j - w),
-				jj_max = Min(y + sY, j + w + 1);
-			float sum = 0.0f, sum_r = 0.0f;
-
-			for (ii = ii_min; ii < ii_max; ii++)
-			{
-				for (jj = jj_min; jj < jj_max; jj++)
-				{
-					float r = (i - ii) * (i - ii) + (j - jj) * (j - jj);
-					r = 1.0f - sqrt(r) / (float)w;
-					if (r <= 0.0f)
-						continue;
-					sum += src->values[ii][jj] * src->values[ii][jj] * r;
-					sum_r += r;
-				}
-			}
-			Assert (sum >= 0.0f);
-			Assert (sum_r > 0.0f);
-			dst->values[i][j] = sqrt(sum / sum_r);
-		}
-	}
+	calcBitSignature(pattern->values, patternGetSize(pattern), signature);
+	PG_FREE_IF_COPY(pattern, 0);
+
+	PG_RETURN_POINTER(signature);
 }
 
 /*
- * Shuffle pattern: call "shuffle" for each region of wavelet-transformed
- * pattern. For each region, blur radius is selected accordingly to its size;
+ * Shuffle pattern in order to make further comparisons less sensitive to
+ * shift, see shufflePattern().
  */
 Datum
 shuffle_pattern(PG_FUNCTION_ARGS)
 {
-	bytea *patternDataSrc = PG_GETARG_BYTEA_P(0);
-	bytea *patternDataDst;
-	PatternData *patternDst, *patternSrc;
-	int size = PATTERN_SIZE;
-
-	patternDataDst = (bytea *)palloc(VARSIZE_ANY(patternDataSrc));
-	memcpy(patternDataDst, patternDataSrc, VARSIZE_ANY(patternDataSrc));
-	patternSrc = (PatternData *)VARDATA_ANY(patternDataSrc);
-	patternDst = (PatternData *)VARDATA_ANY(patternDataDst);
-
-	while (size > 4)
+	Pattern *patternSrc = PG_GETARG_PATTERN(0);
+	Pattern *patternDst;
+	int n = patternGetSize(patternSrc);
+	instr_time	lap;
+
+	patternDst = (Pattern *) cacheLookup(IMGSMLR_FORMAT_PATTERN, n,
+										 patternSrc->values, PATTERN_BYTES(n));
+	if (patternDst)
 	{
-		size /= 2;
-		shuffle(patternDst, patternSrc, size, 0, size, size, size / 4);
-		shuffle(patternDst, patternSrc, 0, size, size, size, size / 4);
-		shuffle(patternDst, patternSrc, size, size, size, size, size / 4);
+		PG_FREE_IF_COPY(patternSrc, 0);
+		PG_RETURN_PATTERN(patternDst);
 	}
+
+	IMGSMLR_INGEST_COUNT(IMGSMLR_FORMAT_PATTERN, IMGSMLR_INGEST_IMAGES, 1);
+	INSTR_TIME_SET_CURRENT(lap);
+
+	patternDst = (Pattern *)palloc(PATTERN_VARSIZE(n));
+	SET_VARSIZE(patternDst, PATTERN_VARSIZE(n));
+	shufflePattern(patternDst->values, patternSrc->values, n);
+	IMGSMLR_INGEST_LAP(IMGSMLR_FORMAT_PATTERN, IMGSMLR_INGEST_SHUFFLE_TIME, lap);
+	cacheInsert(IMGSMLR_FORMAT_PATTERN, n, patternSrc->values, PATTERN_BYTES(n),
+				patternDst, VARSIZE(patternDst));
 #ifdef DEBUG_INFO
-	debugPrintPattern(patternDst, "/tmp/pattern4.raw", false);
+	debugPrintPattern(patternDst->values, n, "/tmp/pattern4.raw", false);
 #endif
 
-	PG_FREE_IF_COPY(patternDataSrc, 0);
+	PG_FREE_IF_COPY(patternSrc, 0);
 
-	PG_RETURN_POINTER(patternDataDst);
+	PG_RETURN_PATTERN(patternDst);
 }
 
 /*
@@ -331,23 +386,74 @@ read_float(char **s, char *type_name, char *orig_string)
 }
 
 /*
- * Input "pattern" type from its textual representation.
+ * Check if there is something besides " ()," symbols left in the string.
+ */
+static bool
+has_more_values(char *s)
+{
+	for (; *s; s++)
+	{
+		if (*s != ' ' && *s != '(' && *s != ')' && *s != ',')
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Input "pattern" type from its textual representation.  Pattern size is
+ * determined by number of values, it must match typmod if specified.
+ * Values are read into buffer for the pattern of typmod size, or of the
+ * minimal size, which is doubled when more values are met.
  */
 Datum
 pattern_in(PG_FUNCTION_ARGS)
 {
 	char	   *source = PG_GETARG_CSTRING(0);
-	Pattern	   *pattern = (Pattern *) palloc(sizeof(Pattern));
+	int32		typmod = (PG_NARGS() > 2) ? PG_GETARG_INT32(2) : -1;
+	int			capacity = (typmod >= 0) ? typmod : PATTERN_MIN_SIZE;
+	Pattern	   *pattern = (Pattern *) palloc(PATTERN_VARSIZE(capacity));
 	char	   *s;
-	int			i, j;
+	int			count = 0,
+				size;
 
-	SET_VARSIZE(pattern, sizeof(Pattern));
 	s = source;
-	for (i = 0; i < PATTERN_SIZE; i++)
-		for (j = 0; j < PATTERN_SIZE; j++)
-			pattern->data.values[i][j] = read_float(&s, "pattern", source);
+	while (has_more_values(s))
+	{
+		if (count == capacity * capacity)
+		{
+			if (capacity >= PATTERN_MAX_SIZE)
+				ereport(ERROR,
+						(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+						 errmsg("invalid input syntax for type %s: \"%s\"",
+								"pattern", source),
+						 errdetail("Pattern must be a square matrix of size between %d and %d.",
+								   PATTERN_MIN_SIZE, PATTERN_MAX_SIZE)));
+			capacity *= 2;
+			pattern = (Pattern *) repalloc(pattern, PATTERN_VARSIZE(capacity));
+		}
+		pattern->values[count++] = read_float(&s, "pattern", source);
+	}
 
-	PG_RETURN_POINTER(pattern);
+	for (size = PATTERN_MIN_SIZE; size <= PATTERN_MAX_SIZE; size *= 2)
+	{
+		if (size * size == count)
+			break;
+	}
+	if (size > PATTERN_MAX_SIZE)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+				 errmsg("invalid input syntax for type %s: \"%s\"",
+						"pattern", source),
+				 errdetail("Pattern must be a square matrix of size between %d and %d.",
+						   PATTERN_MIN_SIZE, PATTERN_MAX_SIZE)));
+	if (typmod >= 0 && size != typmod)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_EXCEPTION),
+				 errmsg("expected pattern of size %d, got %d", typmod, size)));
+
+	SET_VARSIZE(pattern, PATTERN_VARSIZE(size));
+
+	PG_RETURN_PATTERN(pattern);
 }
 
 /*
@@ -356,33 +462,203 @@ pattern_in(PG_FUNCTION_ARGS)
 Datum
 pattern_out(PG_FUNCTION_ARGS)
 {
-	bytea *patternData = PG_GETARG_BYTEA_P(0);
-	PatternData *pattern = (PatternData *) VARDATA_ANY(patternData);
+	Pattern *pattern = PG_GETARG_PATTERN(0);
+	int size = patternGetSize(pattern);
 	StringInfoData buf;
 	int i, j;
 
 	initStringInfo(&buf);
 
 	appendStringInfoChar(&buf, '(');
-	for (i = 0; i < PATTERN_SIZE; i++)
+	for (i = 0; i < size; i++)
 	{
 		if (i > 0)
 			appendStringInfo(&buf, ", ");
 		appendStringInfoChar(&buf, '(');
-		for (j = 0; j < PATTERN_SIZE; j++)
+		for (j = 0; j < size; j++)
 		{
 			if (j > 0)
 				appendStringInfo(&buf, ", ");
-			appendStringInfo(&buf, "%f", pattern->values[i][j]);
+			appendStringInfo(&buf, "%f", PATTERN_VALUE(pattern->values, size, i, j));
 		}
 		appendStringInfoChar(&buf, ')');
 	}
 	appendStringInfoChar(&buf, ')');
 
-	PG_FREE_IF_COPY(patternData, 0);
+	PG_FREE_IF_COPY(pattern, 0);
 	PG_RETURN_CSTRING(buf.data);
 }
 
+/*
+ * Binary input of "pattern": values as float4 row by row.  Pattern size is
+ * determined by the length of message.
+ */
+Datum
+pattern_recv(PG_FUNCTION_ARGS)
+{
+	StringInfo	buf = (StringInfo) PG_GETARG_POINTER(0);
+	int32		typmod = (PG_NARGS() > 2) ? PG_GETARG_INT32(2) : -1;
+	int			len = buf->len - buf->cursor;
+	Pattern	   *pattern;
+	int			size,
+				i;
+
+	for (size = PATTERN_MIN_SIZE; size <= PATTERN_MAX_SIZE; size *= 2)
+	{
+		if (len == PATTERN_BYTES(size))
+			break;
+	}
+	if (size > PATTERN_MAX_SIZE)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+				 errmsg("invalid binary pattern length %d", len)));
+	if (typmod >= 0 && size != typmod)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_EXCEPTION),
+				 errmsg("expected pattern of size %d, got %d", typmod, size)));
+
+	pattern = (Pattern *) palloc(PATTERN_VARSIZE(size));
+	SET_VARSIZE(pattern, PATTERN_VARSIZE(size));
+	for (i = 0; i < size * size; i++)
+		pattern->values[i] = pq_getmsgfloat4(buf);
+
+	PG_RETURN_PATTERN(pattern);
+}
+
+/*
+ * Binary output of "pattern".
+ */
+Datum
+pattern_send(PG_FUNCTION_ARGS)
+{
+	Pattern    *pattern = PG_GETARG_PATTERN(0);
+	int			size = patternGetSize(pattern);
+	StringInfoData buf;
+	int			i;
+
+	pq_begintypsend(&buf);
+	for (i = 0; i < size * size; i++)
+		pq_sendfloat4(&buf, pattern->values[i]);
+
+	PG_FREE_IF_COPY(pattern, 0);
+	PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
+}
+
+static bool
+patternSizeIsValid(int size)
+{
+	return size >= PATTERN_MIN_SIZE && size <= PATTERN_MAX_SIZE &&
+		(size & (size - 1)) == 0;
+}
+
+/*
+ * Get pattern size from the length of the value or from the header of
+ * compressed pattern.
+ */
+int
+patternGetSize(Pattern *pattern)
+{
+	Size		len = VARSIZE_ANY_EXHDR(pattern);
+	int			size;
+
+	if (PATTERN_IS_COMPRESSED(pattern))
+		return compressedPatternGetSize(pattern);
+
+	for (size = PATTERN_MIN_SIZE; size <= PATTERN_MAX_SIZE; size *= 2)
+	{
+		if (len == PATTERN_BYTES(size))
+			return size;
+	}
+	ereport(ERROR,
+			(errcode(ERRCODE_DATA_CORRUPTED),
+			 errmsg("invalid pattern length %u", (unsigned int) len)));
+	return 0;					/* keep compiler quiet */
+}
+
+/*
+ * Typmod input for "pattern": pattern size.
+ */
+Datum
+pattern_typmod_in(PG_FUNCTION_ARGS)
+{
+	ArrayType  *ta = PG_GETARG_ARRAYTYPE_P(0);
+	int32	   *tl;
+	int			n;
+
+	tl = ArrayGetIntegerTypmods(ta, &n);
+
+	if (n != 1)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("invalid type modifier")));
+	if (!patternSizeIsValid(tl[0]))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("pattern size must be a power of two between %d and %d",
+						PATTERN_MIN_SIZE, PATTERN_MAX_SIZE)));
+
+	PG_RETURN_INT32(tl[0]);
+}
+
+Datum
+pattern_typmod_out(PG_FUNCTION_ARGS)
+{
+	int32		typmod = PG_GETARG_INT32(0);
+	char	   *result = (char *) palloc(16);
+
+	if (typmod >= 0)
+		snprintf(result, 16, "(%d)", typmod);
+	else
+		*result = '\0';
+
+	PG_RETURN_CSTRING(result);
+}
+
+/*
+ * Coerce pattern to the size given by typmod.  Coarse wavelet levels of
+ * pattern are located in its top-left corner, so the smaller pattern is
+ * made by cutting off the finest levels, and the larger pattern is made by
+ * adding zero finest levels.  Both are exact for Haar wavelet.
+ */
+Datum
+pattern_resize(PG_FUNCTION_ARGS)
+{
+	Pattern    *src = (Pattern *) PG_GETARG_BYTEA_PP(0);
+	int32		typmod = PG_GETARG_INT32(1);
+	int			srcSize = patternGetSize(src),
+				limit,
+				i;
+	Pattern    *dst;
+
+	/* Keep compressed pattern as is */
+	if (typmod < 0 || typmod == srcSize)
+		PG_RETURN_POINTER(src);
+
+	src = DatumGetPattern(PointerGetDatum(src));
+
+	dst = (Pattern *) palloc0(PATTERN_VARSIZE(typmod));
+	SET_VARSIZE(dst, PATTERN_VARSIZE(typmod));
+
+	limit = Min(srcSize, typmod);
+	for (i = 0; i < limit; i++)
+		memcpy(&PATTERN_VALUE(dst->values, typmod, i, 0),
+			   &PATTERN_VALUE(src->values, srcSize, i, 0),
+			   sizeof(float) * limit);
+
+	PG_FREE_IF_COPY(src, 0);
+	PG_RETURN_PATTERN(dst);
+}
+
+Datum
+pattern_size(PG_FUNCTION_ARGS)
+{
+	Pattern    *pattern = (Pattern *) PG_GETARG_BYTEA_PP(0);
+	int			size = patternGetSize(pattern);
+
+	PG_FREE_IF_COPY(pattern, 0);
+	PG_RETURN_INT32(size);
+}
+
 /*
  * Input "signature" type from its textual representation.
  */
@@ -427,12 +703,115 @@ signature_out(PG_FUNCTION_ARGS)
 	PG_RETURN_CSTRING(buf.data);
 }
 
+/*
+ * Binary input of "signature": values as float4.
+ */
+Datum
+signature_recv(PG_FUNCTION_ARGS)
+{
+	StringInfo	buf = (StringInfo) PG_GETARG_POINTER(0);
+	Signature  *signature = (Signature *) palloc(sizeof(Signature));
+	int			i;
+
+	for (i = 0; i < SIGNATURE_SIZE; i++)
+		signature->values[i] = pq_getmsgfloat4(buf);
+
+	PG_RETURN_POINTER(signature);
+}
+
+/*
+ * Binary output of "signature".
+ */
+Datum
+signature_send(PG_FUNCTION_ARGS)
+{
+	Signature  *signature = (Signature *) PG_GETARG_POINTER(0);
+	StringInfoData buf;
+	int			i;
+
+	pq_begintypsend(&buf);
+	for (i = 0; i < SIGNATURE_SIZE; i++)
+		pq_sendfloat4(&buf, signature->values[i]);
+
+	PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
+}
+
+/*
+ * Input "bitsignature" type from its hexadecimal representation.
+ */
+Datum
+bitsignature_in(PG_FUNCTION_ARGS)
+{
+	char	   *source = PG_GETARG_CSTRING(0);
+	BitSignature *signature = (BitSignature *) palloc0(sizeof(BitSignature));
+	uint8	   *bytes = (uint8 *) signature;
+	char	   *s = source;
+	int			i = 0;
+
+	while (*s)
+	{
+		char		c = *s++;
+		int			nibble;
+
+		if (c == ' ')
+			continue;
+		else if (c >= '0' && c <= '9')
+			nibble = c - '0';
+		else if (c >= 'a' && c <= 'f')
+			nibble = c - 'a' + 10;
+		else if (c >= 'A' && c <= 'F')
+			nibble = c - 'A' + 10;
+		else
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+					 errmsg("invalid input syntax for type %s: \"%s\"",
+							"bitsignature", source)));
+
+		if (i >= 2 * (int) sizeof(BitSignature))
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+					 errmsg("invalid input syntax for type %s: \"%s\"",
+							"bitsignature", source)));
+		bytes[i / 2] |= (i % 2 == 0) ? (nibble << 4) : nibble;
+		i++;
+	}
+
+	if (i != 2 * (int) sizeof(BitSignature))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+				 errmsg("invalid input syntax for type %s: \"%s\"",
+						"bitsignature", source)));
+
+	PG_RETURN_POINTER(signature);
+}
+
+/*
+ * Output for type "bitsignature": return hexadecimal representation of bits.
+ */
+Datum
+bitsignature_out(PG_FUNCTION_ARGS)
+{
+	static const char hextbl[] = "0123456789abcdef";
+	uint8	   *bytes = (uint8 *) PG_GETARG_POINTER(0);
+	char	   *result = (char *) palloc(2 * sizeof(BitSignature) + 1);
+	int			i;
+
+	for (i = 0; i < (int) sizeof(BitSignature); i++)
+	{
+		result[2 * i] = hextbl[(bytes[i] >> 4) & 0xF];
+		result[2 * i + 1] = hextbl[bytes[i] & 0xF];
+	}
+	result[2 * sizeof(BitSignature)] = '\0';
+
+	PG_RETURN_CSTRING(result);
+}
+
 /*
  * Calculate summary of square difference between "patternA" and "patternB"
  * in rectangle "(x, y) - (x + sX, y + sY)".
  */
-static float
-calcDiff(PatternData *patternA, PatternData *patternB, int x, int y,
+static pg_attribute_always_inline float
+calcDiff(const float *patternA, const float *patternB, int n, int x, int y,
 																int sX, int sY)
 {
 	int i, j;
@@ -441,8 +820,8 @@ calcDiff(PatternData *patternA, PatternData *patternB, int x, int y,
 	{
 		for (j = y; j < y + sY; j++)
 		{
-			val =   patternA->values[i][j]
-			      - patternB->values[i][j];
+			val =   PATTERN_VALUE(patternA, n, i, j)
+			      - PATTERN_VALUE(patternB, n, i, j);
 			summ += val * val;
 		}
 	}
@@ -454,189 +833,171 @@ calcDiff(PatternData *patternA, PatternData *patternB, int x, int y,
  * regions of wavelet-transformed pattern corrected by their sized. Difference
  * of each region is summary of square difference between values.
  */
-Datum
-pattern_distance(PG_FUNCTION_ARGS)
+static pg_attribute_always_inline float
+calcPatternDistanceKernel(const float *patternA, const float *patternB, int n)
 {
-	bytea *patternDataA = PG_GETARG_BYTEA_P(0);
-	PatternData *patternA = (PatternData *)VARDATA_ANY(patternDataA);
-	bytea *patternDataB = PG_GETARG_BYTEA_P(1);
-	PatternData *patternB = (PatternData *)VARDATA_ANY(patternDataB);
 	float distance = 0.0f, val;
-	int size = PATTERN_SIZE;
+	int size = n;
 	float mult = 1.0f;
 
 	while (size > 1)
 	{
 		size /= 2;
-		distance += mult * calcDiff(patternA, patternB, size, 0, size, size);
-		distance += mult * calcDiff(patternA, patternB, 0, size, size, size);
-		distance += mult * calcDiff(patternA, patternB, size, size, size, size);
+		distance += mult * calcDiff(patternA, patternB, n, size, 0, size, size);
+		distance += mult * calcDiff(patternA, patternB, n, 0, size, size, size);
+		distance += mult * calcDiff(patternA, patternB, n, size, size, size, size);
 		mult *= 2.0f;
 	}
-	val = patternA->values[0][0] - patternB->values[0][0];
+	val = patternA[0] - patternB[0];
 	distance += mult * val * val;
-	distance = sqrt(distance);
-
-	PG_RETURN_FLOAT4(distance);
+	return sqrt(distance);
 }
 
 /*
- * Distance between signatures: mean-square difference between signatures.
+ * Call pattern distance kernel specialized for common pattern sizes.
  */
-Datum
-signature_distance(PG_FUNCTION_ARGS)
+float
+calcPatternDistance(const float *patternA, const float *patternB, int size)
 {
-	Signature *signatureA = (Signature *)PG_GETARG_POINTER(0);
-	Signature *signatureB = (Signature *)PG_GETARG_POINTER(1);
-	float distance = 0.0f, val;
-	int i;
+	IMGSMLR_COUNT(IMGSMLR_PATTERN_DISTANCE_CALLS);
 
-	for (i = 0; i < SIGNATURE_SIZE; i++)
+	switch (size)
 	{
-		val = signatureA->values[i] - signatureB->values[i];
-		distance += val * val;
+		case 32:
+			return calcPatternDistanceKernel(patternA, patternB, 32);
+		case 64:
+			return calcPatternDistanceKernel(patternA, patternB, 64);
+		default:
+			return calcPatternDistanceKernel(patternA, patternB, size);
 	}
-	distance = sqrt(distance);
+}
+
+Datum
+pattern_distance(PG_FUNCTION_ARGS)
+{
+	Pattern *patternA = PG_GETARG_PATTERN(0);
+	Pattern *patternB = PG_GETARG_PATTERN(1);
+	int size = patternGetSize(patternA);
+	float distance;
+
+	if (patternGetSize(patternB) != size)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_EXCEPTION),
+				 errmsg("different pattern sizes %d and %d",
+						size, patternGetSize(patternB))));
+
+	distance = calcPatternDistance(patternA->values, patternB->values, size);
 
+	PG_FREE_IF_COPY(patternA, 0);
+	PG_FREE_IF_COPY(patternB, 1);
 	PG_RETURN_FLOAT4(distance);
 }
 
 /*
- * Make pattern from gd image.
+ * Distance between signatures: mean-square difference between signatures.
  */
-static void
-makePattern(gdImagePtr im, PatternData *pattern)
+Datum
+signature_distance(PG_FUNCTION_ARGS)
 {
-	int i, j;
-	for (i = 0; i < PATTERN_SIZE; i++)
-		for (j = 0; j < PATTERN_SIZE; j++)
-		{
-			int pixel = gdImageGetTrueColorPixel(im, i, j);
-			float red = (float) gdTrueColorGetRed(pixel) / 255.0,
-				  green = (float) gdTrueColorGetGreen(pixel) / 255.0,
-				  blue = (float) gdTrueColorGetBlue(pixel) / 255.0;
-			pattern->values[i][j] = sqrt((red * red + green * green + blue * blue) / 3.0f);
-		}
+	Signature *signatureA = (Signature *)PG_GETARG_POINTER(0);
+	Signature *signatureB = (Signature *)PG_GETARG_POINTER(1);
+
+	PG_RETURN_FLOAT4(calcSignatureDistance(signatureA, signatureB));
 }
 
 /*
- * Normalize pattern: make it minimal value equal to 0 and
- * maximum value equal to 1.
+ * Check if distance between signatures doesn't exceed given radius.  Its
+ * selectivity is estimated by signature_distance_within_support().
  */
-static void
-normalizePattern(PatternData *pattern)
+Datum
+signature_distance_within(PG_FUNCTION_ARGS)
 {
-	float min = 1.0f, max = 0.0f, val;
-	int i, j;
-	for (i = 0; i < PATTERN_SIZE; i++)
-	{
-		for (j = 0; j < PATTERN_SIZE; j++)
-		{
-			val = pattern->values[i][j];
-			if (val < min) min = val;
-			if (val > max) max = val;
+	Signature *signatureA = (Signature *)PG_GETARG_POINTER(0);
+	Signature *signatureB = (Signature *)PG_GETARG_POINTER(1);
+	float4 radius = PG_GETARG_FLOAT4(2);
 
-		}
-	}
-	for (i = 0; i < PATTERN_SIZE; i++)
-	{
-		for (j = 0; j < PATTERN_SIZE; j++)
-		{
-			pattern->values[i][j] = (pattern->values[i][j] - min) / (max - min);
-		}
-	}
+	PG_RETURN_BOOL(calcSignatureDistance(signatureA, signatureB) <= radius);
 }
 
 /*
- * Do Haar wavelet transform over pattern.
+ * Z-order (Morton) key of signature.  Values are mapped to unsigned integers
+ * preserving their order, and bits of all the values are interleaved
+ * starting from the most significant ones.  Thus byte order of keys follows
+ * Z-order curve, and ordering table by the key puts signatures which are
+ * close to each other close on disk.
  */
-static void
-waveletTransform(PatternData *dst, PatternData *src, int size)
+Datum
+signature_zorder(PG_FUNCTION_ARGS)
 {
-	if (size > 1)
-	{
-		int i, j;
-		size /= 2;
-		for (i = 0; i < size; i++)
-		{
-			for (j = 0; j < size; j++)
-			{
-				dst->values[i + size][j] =        ( - src->values[2 * i][2 * j]     + src->values[2 * i + 1][2 * j]
-				                                    - src->values[2 * i][2 * j + 1] + src->values[2 * i + 1][2 * j + 1]) / 4.0f;
-				dst->values[i][j + size] =        ( - src->values[2 * i][2 * j]     - src->values[2 * i + 1][2 * j]
-				                                    + src->values[2 * i][2 * j + 1] + src->values[2 * i + 1][2 * j + 1]) / 4.0f;
-				dst->values[i + size][j + size] = (   src->values[2 * i][2 * j]     - src->values[2 * i + 1][2 * j]
-				                                    - src->values[2 * i][2 * j + 1] + src->values[2 * i + 1][2 * j + 1]) / 4.0f;
-			}
-		}
-		for (i = 0; i < size; i++)
-		{
-			for (j = 0; j < size; j++)
-			{
-				src->values[i][j] =               (   src->values[2 * i][2 * j]     + src->values[2 * i + 1][2 * j]
-				                                    + src->values[2 * i][2 * j + 1] + src->values[2 * i + 1][2 * j + 1]) / 4.0f;
-			}
-		}
-		waveletTransform(dst, src, size);
-	}
-	else
+	Signature  *signature = (Signature *) PG_GETARG_POINTER(0);
+	bytea	   *result;
+	uint8	   *key;
+	uint32		ordered[SIGNATURE_SIZE];
+	int			i,
+				bit,
+				pos = 0;
+
+	for (i = 0; i < SIGNATURE_SIZE; i++)
 	{
-		dst->values[0][0] = src->values[0][0];
+		float		value = signature->values[i];
+		uint32		bits;
+
+		/* -0 is the same as 0 */
+		if (value == 0.0f)
+			value = 0.0f;
+		memcpy(&bits, &value, sizeof(bits));
+
+		/* Negative values go below positive ones in reverse order */
+		if (bits & 0x80000000)
+			ordered[i] = ~bits;
+		else
+			ordered[i] = bits | 0x80000000;
 	}
-}
 
-/*
- * Calculate summary of squares in rectangle "(x, y) - (x + sX, y + sY)".
- */
-static float
-calcSumm(PatternData *pattern, int x, int y, int sX, int sY)
-{
-	int i, j;
-	float summ = 0.0f, val;
-	for (i = x; i < x + sX; i++)
+	result = (bytea *) palloc0(VARHDRSZ + sizeof(ordered));
+	SET_VARSIZE(result, VARHDRSZ + sizeof(ordered));
+	key = (uint8 *) VARDATA(result);
+	for (bit = 31; bit >= 0; bit--)
 	{
-		for (j = y; j < y + sY; j++)
+		for (i = 0; i < SIGNATURE_SIZE; i++, pos++)
 		{
-			val = pattern->values[i][j];
-			summ += val * val;
+			if (ordered[i] & ((uint32) 1 << bit))
+				key[pos >> 3] |= 0x80 >> (pos & 7);
 		}
 	}
-	return sqrt(summ);
+
+	PG_RETURN_BYTEA_P(result);
 }
 
 /*
- * Make short signature from pattern.
+ * Distance between binary signatures: number of different bits.
  */
-static void
-calcSignature(PatternData *pattern, Signature *signature)
+Datum
+bitsignature_distance(PG_FUNCTION_ARGS)
 {
-	int size = PATTERN_SIZE / 2;
-	int i = 0;
-	float mult = 1.0f;
+	BitSignature *signatureA = (BitSignature *)PG_GETARG_POINTER(0);
+	BitSignature *signatureB = (BitSignature *)PG_GETARG_POINTER(1);
+	int distance = 0;
+	int i;
 
-	while (size > 1)
-	{
-		size /= 2;
-		signature->values[i++] = mult * calcSumm(pattern, size, 0, size, size);
-		signature->values[i++] = mult * calcSumm(pattern, 0, size, size, size);
-		signature->values[i++] = mult * calcSumm(pattern, size, size, size, size);
-		mult *= 2.0f;
-	}
-	signature->values[SIGNATURE_SIZE - 1] = pattern->values[0][0];
+	for (i = 0; i < BITSIGNATURE_WORDS; i++)
+		distance += popcount64(signatureA->words[i] ^ signatureB->words[i]);
+
+	PG_RETURN_FLOAT4((float) distance);
 }
 
 #ifdef DEBUG_INFO
 
 static void
-debugPrintPattern(PatternData *pattern, const char *filename, bool color)
+debugPrintPattern(float *pattern, int size, const char *filename, bool color)
 {
 	int i, j;
 	FILE *out = fopen(filename, "wb");
-	for (j = 0; j < PATTERN_SIZE; j++)
+	for (j = 0; j < size; j++)
 	{
-		for (i = 0; i < PATTERN_SIZE; i++)
+		for (i = 0; i < size; i++)
 		{
-			float val = pattern->values[i][j];
+			float val = PATTERN_VALUE(pattern, size, i, j);
 			if (!color)
 			{
 				fputc((int)(val * 255.999f), out);
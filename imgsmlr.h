@@ -15,25 +15,271 @@
 #ifndef IMGSMLR_H
 #define IMGSMLR_H
 
-#define PATTERN_SIZE 64
+#include <math.h>
+
+#include "portability/instr_time.h"
+
+#if PG_VERSION_NUM >= 120000
+#include "port/pg_bitutils.h"
+#endif
+
+#define PATTERN_SIZE 64			/* default pattern size */
+#define PATTERN_MIN_SIZE 16
+#define PATTERN_MAX_SIZE 128
 #define SIGNATURE_SIZE 16
 
-typedef struct
-{
-	float values[PATTERN_SIZE][PATTERN_SIZE];
-} PatternData;
+/*
+ * Signature is calculated from the coarse wavelet levels which fit into
+ * top-left SIGNATURE_PATTERN_SIZE x SIGNATURE_PATTERN_SIZE block of pattern.
+ * Thus, signatures of the same image are comparable across pattern sizes.
+ */
+#define SIGNATURE_PATTERN_SIZE 32
 
+/*
+ * Pattern is square matrix of wavelet coefficients stored row by row.  Its
+ * size is power of two between PATTERN_MIN_SIZE and PATTERN_MAX_SIZE, and
+ * it's derived from the length of value.  Typmod of "pattern" type is the
+ * pattern size.
+ */
 typedef struct
 {
 	char		vl_len_[4];		/* Do not touch this field directly! */
-	PatternData	data;
+	float		values[FLEXIBLE_ARRAY_MEMBER];
 } Pattern;
 
+#define PATTERN_BYTES(size) (sizeof(float) * (size) * (size))
+#define PATTERN_VARSIZE(size) (offsetof(Pattern, values) + PATTERN_BYTES(size))
+#define PATTERN_VALUE(values, size, i, j) ((values)[(i) * (size) + (j)])
+
+#ifndef pg_attribute_always_inline
+#define pg_attribute_always_inline inline
+#endif
+
 typedef struct
 {
 	float values[SIGNATURE_SIZE];
 } Signature;
 
+/*
+ * Euclidean distance between signatures.
+ */
+static inline float
+calcSignatureDistance(Signature *signatureA, Signature *signatureB)
+{
+	float distance = 0.0f, val;
+	int i;
+
+	for (i = 0; i < SIGNATURE_SIZE; i++)
+	{
+		val = signatureA->values[i] - signatureB->values[i];
+		distance += val * val;
+	}
+	return sqrt(distance);
+}
+
 #define CHECK_SIGNATURE_KEY(key) Assert(VARSIZE_ANY_EXHDR(key) == sizeof(Signature) || VARSIZE_ANY_EXHDR(key) == 2 * sizeof(Signature));
 
+/*
+ * Binary signature: sign bits of the coarse wavelet coefficients, i.e. of
+ * the top-left BITSIGNATURE_SIDE x BITSIGNATURE_SIDE block of the pattern.
+ */
+#define BITSIGNATURE_SIDE 16
+#define BITSIGNATURE_BITS (BITSIGNATURE_SIDE * BITSIGNATURE_SIDE)
+#define BITSIGNATURE_WORDS (BITSIGNATURE_BITS / 64)
+
+typedef struct
+{
+	uint64 words[BITSIGNATURE_WORDS];
+} BitSignature;
+
+#define CHECK_BITSIGNATURE_KEY(key) Assert(VARSIZE_ANY_EXHDR(key) == sizeof(BitSignature) || VARSIZE_ANY_EXHDR(key) == 2 * sizeof(BitSignature));
+
+/*
+ * Count set bits in 64-bit word.  Use hardware popcount when available.
+ */
+static inline int
+popcount64(uint64 word)
+{
+#if PG_VERSION_NUM >= 120000
+	return pg_popcount64(word);
+#elif defined(__GNUC__) || defined(__clang__)
+	return __builtin_popcountll(word);
+#else
+	int count = 0;
+
+	while (word)
+	{
+		word &= word - 1;
+		count++;
+	}
+	return count;
+#endif
+}
+
+/* Pattern routines shared by the modules */
+extern int	patternGetSize(Pattern *pattern);
+extern float calcPatternDistance(const float *patternA, const float *patternB,
+								 int size);
+
+/*
+ * Image formats.  IMGSMLR_FORMAT_PATTERN isn't an image format, it's used in
+ * ingest statistics for shuffle_pattern() calls, which take pattern of any
+ * origin.
+ */
+typedef enum
+{
+	IMGSMLR_FORMAT_JPEG,
+	IMGSMLR_FORMAT_PNG,
+	IMGSMLR_FORMAT_GIF,
+	IMGSMLR_FORMAT_PATTERN,
+	IMGSMLR_NUM_FORMATS
+} ImgsmlrFormat;
+
+/* The rest is available to the backend code only */
+#ifndef FRONTEND
+
+/*
+ * Instrumentation counters, see imgsmlr_stats.c.  Times are in nanoseconds.
+ */
+typedef enum
+{
+	IMGSMLR_GIST_DISTANCE_LEAF,
+	IMGSMLR_GIST_DISTANCE_INTERNAL,
+	IMGSMLR_KNN_SCANS,
+	IMGSMLR_PAGES_VISITED,
+	IMGSMLR_CONSISTENT_RECHECKS,
+	IMGSMLR_PENALTY_CALLS,
+	IMGSMLR_PENALTY_TIME,
+	IMGSMLR_PICKSPLIT_CALLS,
+	IMGSMLR_PICKSPLIT_TIME,
+	IMGSMLR_PATTERN_DISTANCE_CALLS,
+	IMGSMLR_NUM_COUNTERS
+} ImgsmlrCounter;
+
+extern uint64 imgsmlrCounters[IMGSMLR_NUM_COUNTERS];
+extern bool imgsmlr_track_timing;
+
+#define IMGSMLR_COUNT(counter) (imgsmlrCounters[(counter)]++)
+
+#define IMGSMLR_TIMING_START(start) \
+	do { \
+		if (imgsmlr_track_timing) \
+			INSTR_TIME_SET_CURRENT(start); \
+	} while (0)
+
+#define IMGSMLR_TIMING_END(start, counter) \
+	do { \
+		if (imgsmlr_track_timing) \
+		{ \
+			instr_time	end_; \
+			INSTR_TIME_SET_CURRENT(end_); \
+			INSTR_TIME_SUBTRACT(end_, (start)); \
+			imgsmlrCounters[(counter)] += \
+				(uint64) (INSTR_TIME_GET_DOUBLE(end_) * 1000000000.0); \
+		} \
+	} while (0)
+
+extern void imgsmlrCountPage(FmgrInfo *flinfo, Pointer page);
+
+/*
+ * Ingest counters are kept per image format, see ImgsmlrFormat.
+ */
+typedef enum
+{
+	IMGSMLR_INGEST_IMAGES,
+	IMGSMLR_INGEST_FAILURES,
+	IMGSMLR_INGEST_BYTES,
+	IMGSMLR_INGEST_PIXELS,
+	IMGSMLR_INGEST_MAX_PIXELS,
+	IMGSMLR_INGEST_DECODE_TIME,
+	IMGSMLR_INGEST_RESAMPLE_TIME,
+	IMGSMLR_INGEST_NORMALIZE_TIME,
+	IMGSMLR_INGEST_WAVELET_TIME,
+	IMGSMLR_INGEST_SHUFFLE_TIME,
+	IMGSMLR_NUM_INGEST_COUNTERS
+} ImgsmlrIngestCounter;
+
+extern const char *const imgsmlrFormatNames[IMGSMLR_NUM_FORMATS];
+extern uint64 imgsmlrIngestCounters[IMGSMLR_NUM_FORMATS][IMGSMLR_NUM_INGEST_COUNTERS];
+
+#define IMGSMLR_INGEST_COUNT(format, counter, value) \
+	(imgsmlrIngestCounters[(format)][(counter)] += (value))
+
+/*
+ * Ingest stages are expensive enough to be timed unconditionally.  "lap" is
+ * set to the current time, so it could be used for the next stage.
+ */
+#define IMGSMLR_INGEST_LAP(format, counter, lap) \
+	do { \
+		instr_time	end_, diff_; \
+		INSTR_TIME_SET_CURRENT(end_); \
+		diff_ = end_; \
+		INSTR_TIME_SUBTRACT(diff_, (lap)); \
+		imgsmlrIngestCounters[(format)][(counter)] += \
+			(uint64) (INSTR_TIME_GET_DOUBLE(diff_) * 1000000000.0); \
+		(lap) = end_; \
+	} while (0)
+
+/* Module initialization routines, called from _PG_init() */
+extern void hnswInit(void);
+extern void statsInit(void);
+extern void batchInit(void);
+extern void ingestInit(void);
+extern void cacheInit(void);
+extern void codecInit(void);
+
+extern void *cacheLookup(ImgsmlrFormat kind, int size, const void *input,
+						 Size len);
+extern void cacheInsert(ImgsmlrFormat kind, int size, const void *input,
+						Size len, const void *result, Size resultLen);
+
+extern void kmeansCluster(const float *data, int n, int dim, int k,
+						  int iterations, float *centroids);
+extern int	kmeansNearest(const float *centroids, int k, int dim,
+						  const float *vector, float *distance);
+
+/*
+ * Trained model (PQ codebook, coarse quantizer) loaded by id from extension
+ * table and cached for the function call site, see imgsmlr_util.c.  Parser
+ * makes the model from values of the selected columns in current memory
+ * context.
+ */
+typedef void *(*ModelParser) (Datum *values, int32 id);
+
+typedef struct
+{
+	int32		id;
+	MemoryContext mcxt;			/* holds the model, NULL if none is loaded */
+	void	   *model;
+} ModelCache;
+
+extern char *extensionNamespace(FunctionCallInfo fcinfo);
+extern Oid	extensionType(FunctionCallInfo fcinfo, const char *typname);
+extern bool loadModel(FunctionCallInfo fcinfo, ModelCache *cache, int32 id,
+					  const char *table, const char *columns,
+					  const char *kind, ModelParser parse);
+extern int	spiSampleColumn(FunctionCallInfo fcinfo, Oid relid, Name attname,
+							const char *typname, int sampleSize);
+
+/*
+ * Patterns could be stored in compressed form, see imgsmlr_codec.c.  Length
+ * of compressed pattern is never a multiple of 4, unlike length of plain
+ * one.  Functions taking patterns use PG_GETARG_PATTERN(), which returns
+ * plain pattern, and functions making patterns use PG_RETURN_PATTERN(),
+ * which compresses it when imgsmlr.pattern_compression is on.
+ */
+#define PATTERN_IS_COMPRESSED(pattern) ((VARSIZE_ANY_EXHDR(pattern) & 3) != 0)
+
+extern bool patternCompression;
+
+extern int	compressedPatternGetSize(Pattern *pattern);
+extern Pattern *DatumGetPattern(Datum datum);
+extern const float *patternGetValues(Pattern *pattern, float *buffer);
+extern Pattern *patternCompress(Pattern *pattern);
+
+#define PG_GETARG_PATTERN(n) DatumGetPattern(PG_GETARG_DATUM(n))
+#define PG_RETURN_PATTERN(x) PG_RETURN_POINTER(patternCompress(x))
+
+#endif							/* FRONTEND */
+
 #endif   /* IMGSMLR_H */
@@ -0,0 +1,360 @@
+/*-------------------------------------------------------------------------
+ *
+ *          Image similarity extension
+ *
+ * Copyright (c) 2015, PostgreSQL Global Development Group
+ *
+ * This software is released under the PostgreSQL Licence.
+ *
+ * Batch conversion of images into patterns on multiple threads.
+ *
+ * Backend isn't thread-safe, so worker threads run only libgd and the pure
+ * transform code of imgsmlr_transform.c: they never allocate memory by
+ * palloc, report errors or touch backend globals.  All the memory is
+ * allocated, and statistics and errors are reported, by the main thread.
+ * Worker threads block all signals, so signal handlers of the backend always
+ * run on the main thread.  The main thread processes images too, and it
+ * doesn't check for interrupts until all the workers are joined.
+ *
+ * IDENTIFICATION
+ *    imgsmlr/imgsmlr_batch.c
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "imgsmlr.h"
+#include "imgsmlr_transform.h"
+#include "catalog/pg_type.h"
+#include "miscadmin.h"
+#include "port/atomics.h"
+#include "utils/array.h"
+#include "utils/guc.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+
+#include <pthread.h>
+#include <signal.h>
+
+PG_FUNCTION_INFO_V1(images2patterns);
+Datum		images2patterns(PG_FUNCTION_ARGS);
+
+#ifndef SRF_RETURN_NEXT_NULL
+#define SRF_RETURN_NEXT_NULL(_funcctx) \
+	do { \
+		ReturnSetInfo *rsi; \
+		(_funcctx)->call_cntr++; \
+		rsi = (ReturnSetInfo *) fcinfo->resultinfo; \
+		rsi->isDone = ExprMultipleResult; \
+		PG_RETURN_NULL(); \
+	} while (0)
+#endif
+
+/* Stages of conversion timed for the ingest statistics */
+#define BATCH_STAGE_DECODE		0
+#define BATCH_STAGE_RESAMPLE	1
+#define BATCH_STAGE_NORMALIZE	2
+#define BATCH_STAGE_WAVELET		3
+#define BATCH_NUM_STAGES		4
+
+typedef struct
+{
+	/* Input, set by the main thread */
+	const unsigned char *data;
+	size_t		len;
+	Pattern    *pattern;		/* preallocated result */
+
+	/* Output, set by the worker thread */
+	bool		formatKnown;
+	ImgsmlrFormat format;
+	bool		ok;
+	uint64		pixels;
+	uint64		times[BATCH_NUM_STAGES];
+} BatchItem;
+
+typedef struct
+{
+	BatchItem  *items;
+	int			nitems;
+	int			size;
+	pg_atomic_uint32 next;		/* next item to be taken */
+} BatchState;
+
+typedef struct
+{
+	BatchState *state;
+	float	   *source;			/* scratch space of the thread */
+	pthread_t	thread;
+} BatchWorker;
+
+static int	imgsmlr_decode_threads = 4;
+
+static void convertItem(BatchItem *item, int size, float *source);
+static void *batchWorkerMain(void *arg);
+static void runBatch(BatchState *state);
+static void reportItem(BatchItem *item);
+
+void
+batchInit(void)
+{
+	DefineCustomIntVariable("imgsmlr.decode_threads",
+							"Number of threads converting images in images2patterns().",
+							"Including the thread of the backend itself.",
+							&imgsmlr_decode_threads,
+							4, 1, 64,
+							PGC_USERSET,
+							0,
+							NULL, NULL, NULL);
+}
+
+static uint64
+elapsedNs(instr_time *lap)
+{
+	instr_time	end,
+				diff;
+
+	INSTR_TIME_SET_CURRENT(end);
+	diff = end;
+	INSTR_TIME_SUBTRACT(diff, *lap);
+	*lap = end;
+	return (uint64) (INSTR_TIME_GET_DOUBLE(diff) * 1000000000.0);
+}
+
+/*
+ * Convert single image into preallocated pattern, the same way as
+ * image2pattern() does.  Runs on any thread.
+ */
+static void
+convertItem(BatchItem *item, int size, float *source)
+{
+	gdImagePtr	im,
+				tb;
+	instr_time	lap;
+
+	item->ok = false;
+	item->formatKnown = detectImageFormat(item->data, item->len, &item->format);
+	if (!item->formatKnown)
+		return;
+
+	INSTR_TIME_SET_CURRENT(lap);
+	im = loadImageData(item->format, item->data, item->len);
+	item->times[BATCH_STAGE_DECODE] = elapsedNs(&lap);
+	if (!im)
+		return;
+	item->pixels = (uint64) im->sx * (uint64) im->sy;
+
+	tb = gdImageCreateTrueColor(size, size);
+	if (!tb)
+	{
+		gdImageDestroy(im);
+		return;
+	}
+	gdImageCopyResampled(tb, im, 0, 0, 0, 0, size, size, im->sx, im->sy);
+	gdImageDestroy(im);
+	item->times[BATCH_STAGE_RESAMPLE] = elapsedNs(&lap);
+
+	makePattern(tb, source, size);
+	gdImageDestroy(tb);
+	normalizePattern(source, size);
+	item->times[BATCH_STAGE_NORMALIZE] = elapsedNs(&lap);
+
+	waveletTransform(item->pattern->values, source, size);
+	item->times[BATCH_STAGE_WAVELET] = elapsedNs(&lap);
+
+	item->ok = true;
+}
+
+/*
+ * Take items one by one until they are exhausted.
+ */
+static void *
+batchWorkerMain(void *arg)
+{
+	BatchWorker *worker = (BatchWorker *) arg;
+	BatchState *state = worker->state;
+	uint32		i;
+
+	while ((i = pg_atomic_fetch_add_u32(&state->next, 1)) < (uint32) state->nitems)
+		convertItem(&state->items[i], state->size, worker->source);
+
+	return NULL;
+}
+
+/*
+ * Convert all the items of the batch using up to imgsmlr.decode_threads
+ * threads including the current one.
+ */
+static void
+runBatch(BatchState *state)
+{
+	int			nthreads = Min(imgsmlr_decode_threads, state->nitems);
+	BatchWorker *workers;
+	BatchWorker self;
+	sigset_t	blockAll,
+				oldMask;
+	int			nstarted = 0,
+				i;
+
+	pg_atomic_init_u32(&state->next, 0);
+
+	/* Everything used by workers is allocated beforehand */
+	workers = (BatchWorker *) palloc0(sizeof(BatchWorker) * Max(nthreads, 1));
+	for (i = 0; i < nthreads - 1; i++)
+	{
+		workers[i].state = state;
+		workers[i].source = (float *) palloc(PATTERN_BYTES(state->size));
+	}
+	self.state = state;
+	self.source = (float *) palloc(PATTERN_BYTES(state->size));
+
+	/* New threads inherit signal mask */
+	sigfillset(&blockAll);
+	pthread_sigmask(SIG_SETMASK, &blockAll, &oldMask);
+	for (i = 0; i < nthreads - 1; i++)
+	{
+		/* If thread couldn't be started, its share goes to the others */
+		if (pthread_create(&workers[i].thread, NULL, batchWorkerMain,
+						   &workers[i]) != 0)
+			break;
+		nstarted++;
+	}
+	pthread_sigmask(SIG_SETMASK, &oldMask, NULL);
+
+	batchWorkerMain(&self);
+
+	for (i = 0; i < nstarted; i++)
+		pthread_join(workers[i].thread, NULL);
+
+	for (i = 0; i < nthreads - 1; i++)
+		pfree(workers[i].source);
+	pfree(workers);
+	pfree(self.source);
+}
+
+/*
+ * Account converted item in the ingest statistics, and report failure the
+ * same way as jpeg2pattern() and friends do.
+ */
+static void
+reportItem(BatchItem *item)
+{
+	int			i;
+	static const ImgsmlrIngestCounter stageCounters[BATCH_NUM_STAGES] = {
+		IMGSMLR_INGEST_DECODE_TIME,
+		IMGSMLR_INGEST_RESAMPLE_TIME,
+		IMGSMLR_INGEST_NORMALIZE_TIME,
+		IMGSMLR_INGEST_WAVELET_TIME
+	};
+
+	if (!item->formatKnown)
+	{
+		elog(NOTICE, "Error loading image: unknown format");
+		return;
+	}
+
+	IMGSMLR_INGEST_COUNT(item->format, IMGSMLR_INGEST_IMAGES, 1);
+	IMGSMLR_INGEST_COUNT(item->format, IMGSMLR_INGEST_BYTES, item->len);
+	IMGSMLR_INGEST_COUNT(item->format, IMGSMLR_INGEST_PIXELS, item->pixels);
+	if (item->pixels > imgsmlrIngestCounters[item->format][IMGSMLR_INGEST_MAX_PIXELS])
+		imgsmlrIngestCounters[item->format][IMGSMLR_INGEST_MAX_PIXELS] = item->pixels;
+	for (i = 0; i < BATCH_NUM_STAGES; i++)
+		IMGSMLR_INGEST_COUNT(item->format, stageCounters[i], item->times[i]);
+
+	if (!item->ok)
+	{
+		IMGSMLR_INGEST_COUNT(item->format, IMGSMLR_INGEST_FAILURES, 1);
+		elog(NOTICE, "Error loading %s", imgsmlrFormatNames[item->format]);
+	}
+}
+
+/*
+ * images2patterns(images bytea[] [, size integer]) returns patterns of the
+ * images in the same order.  Format of each image is detected by its
+ * content.  Images which couldn't be loaded give NULLs.
+ */
+Datum
+images2patterns(PG_FUNCTION_ARGS)
+{
+	FuncCallContext *funcctx;
+	BatchState *state;
+
+	if (SRF_IS_FIRSTCALL())
+	{
+		MemoryContext oldCtx;
+		ArrayType  *array;
+		int			size = (PG_NARGS() > 1) ? PG_GETARG_INT32(1) : PATTERN_SIZE;
+		Datum	   *elems;
+		bool	   *nulls;
+		int			nelems,
+					i;
+		int16		typlen;
+		bool		typbyval;
+		char		typalign;
+
+		funcctx = SRF_FIRSTCALL_INIT();
+		oldCtx = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		if (size < PATTERN_MIN_SIZE || size > PATTERN_MAX_SIZE ||
+			(size & (size - 1)) != 0)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("pattern size must be a power of two between %d and %d",
+							PATTERN_MIN_SIZE, PATTERN_MAX_SIZE)));
+
+		array = PG_GETARG_ARRAYTYPE_P_COPY(0);
+		if (ARR_NDIM(array) > 1)
+			ereport(ERROR,
+					(errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR),
+					 errmsg("array of images must be one-dimensional")));
+		get_typlenbyvalalign(BYTEAOID, &typlen, &typbyval, &typalign);
+		deconstruct_array(array, BYTEAOID, typlen, typbyval, typalign,
+						  &elems, &nulls, &nelems);
+
+		state = (BatchState *) palloc0(sizeof(BatchState));
+		state->items = (BatchItem *) palloc0(sizeof(BatchItem) * Max(nelems, 1));
+		state->size = size;
+		state->nitems = nelems;
+		for (i = 0; i < nelems; i++)
+		{
+			BatchItem  *item = &state->items[i];
+
+			/* NULL element is taken as image of unknown format */
+			if (nulls[i])
+				continue;
+
+			/* Array elements are never compressed or toasted */
+			item->data = (const unsigned char *) VARDATA_ANY(DatumGetPointer(elems[i]));
+			item->len = VARSIZE_ANY_EXHDR(DatumGetPointer(elems[i]));
+			item->pattern = (Pattern *) palloc(PATTERN_VARSIZE(size));
+			SET_VARSIZE(item->pattern, PATTERN_VARSIZE(size));
+		}
+
+		runBatch(state);
+		CHECK_FOR_INTERRUPTS();
+
+		for (i = 0; i < nelems; i++)
+		{
+			if (!nulls[i])
+				reportItem(&state->items[i]);
+		}
+
+		funcctx->max_calls = nelems;
+		funcctx->user_fctx = state;
+		MemoryContextSwitchTo(oldCtx);
+	}
+
+	funcctx = SRF_PERCALL_SETUP();
+	state = (BatchState *) funcctx->user_fctx;
+
+	if (funcctx->call_cntr < funcctx->max_calls)
+	{
+		BatchItem  *item = &state->items[funcctx->call_cntr];
+
+		if (item->ok)
+			SRF_RETURN_NEXT(funcctx, PointerGetDatum(patternCompress(item->pattern)));
+		else
+			SRF_RETURN_NEXT_NULL(funcctx);
+	}
+
+	SRF_RETURN_DONE(funcctx);
+}
@@ -0,0 +1,546 @@
+/*-------------------------------------------------------------------------
+ *
+ *          Image similarity extension
+ *
+ * Copyright (c) 2015, PostgreSQL Global Development Group
+ *
+ * This software is released under the PostgreSQL Licence.
+ *
+ * imgsmlr_bulk - offline bulk generator of patterns and signatures.
+ *
+ * Images listed in manifest or found in directory are transformed on
+ * multiple threads by the same code as jpeg2pattern(), shuffle_pattern() and
+ * pattern2signature(), and written in PostgreSQL COPY BINARY format as rows
+ * of (id, pattern, shuffled pattern, signature).  Output could be loaded by
+ *
+ *     COPY pat (id, pattern, shuffled, signature) FROM 'file' WITH (FORMAT binary);
+ *
+ * Manifest lines are "id<TAB>path" or just "path".  Files of directory are
+ * numbered in order of their paths starting with 1, as if manifest was made
+ * by "find DIR -type f | sort | nl".
+ *
+ * Work is distributed by stealing: each thread has its own range of images,
+ * and the thread which has finished its range takes upper half of the
+ * largest remaining range of another thread.
+ *
+ * IDENTIFICATION
+ *    imgsmlr/imgsmlr_bulk.c
+ *-------------------------------------------------------------------------
+ */
+#include "postgres_fe.h"
+
+#include "imgsmlr_transform.h"
+
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+typedef struct
+{
+	int64		id;
+	char	   *path;
+} BulkItem;
+
+typedef struct
+{
+	pthread_mutex_t mutex;
+	int			begin;			/* next item to be processed by owner */
+	int			end;			/* end of the range, moved by thieves */
+	pthread_t	thread;
+} BulkWorker;
+
+static const char *progname;
+static BulkItem *items = NULL;
+static int	nitems = 0;
+static int	maxitems = 0;
+static BulkWorker *workers;
+static int	nworkers;
+static int	patternSize = PATTERN_SIZE;
+
+static FILE *output;
+static pthread_mutex_t outputMutex = PTHREAD_MUTEX_INITIALIZER;
+static int	nfailed = 0;
+
+static void
+addItem(int64 id, const char *path)
+{
+	if (nitems >= maxitems)
+	{
+		maxitems = maxitems ? maxitems * 2 : 1024;
+		items = pg_realloc(items, sizeof(BulkItem) * maxitems);
+	}
+	items[nitems].id = id;
+	items[nitems].path = pg_strdup(path);
+	nitems++;
+}
+
+static void
+readManifest(const char *filename)
+{
+	FILE	   *f = strcmp(filename, "-") == 0 ? stdin : fopen(filename, "r");
+	char		line[MAXPGPATH + 32];
+	int64		lineno = 0;
+
+	if (!f)
+	{
+		fprintf(stderr, "%s: could not open manifest \"%s\": %s\n",
+				progname, filename, strerror(errno));
+		exit(1);
+	}
+
+	while (fgets(line, sizeof(line), f))
+	{
+		char	   *tab = strchr(line, '\t');
+		char	   *path = line;
+		int64		id = lineno + 1;
+		size_t		len;
+
+		lineno++;
+		len = strlen(line);
+		while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+			line[--len] = '\0';
+		if (len == 0)
+			continue;
+
+		if (tab)
+		{
+			char	   *endptr;
+
+			*tab = '\0';
+			id = strtoll(line, &endptr, 10);
+			if (*endptr != '\0' || endptr == line)
+			{
+				fprintf(stderr, "%s: invalid id \"%s\" at line " INT64_FORMAT " of manifest\n",
+						progname, line, lineno);
+				exit(1);
+			}
+			path = tab + 1;
+		}
+		addItem(id, path);
+	}
+
+	if (f != stdin)
+		fclose(f);
+}
+
+static int
+cmpItemPath(const void *a, const void *b)
+{
+	return strcmp(((const BulkItem *) a)->path, ((const BulkItem *) b)->path);
+}
+
+static void
+walkDirectory(const char *dirname)
+{
+	DIR		   *dir = opendir(dirname);
+	struct dirent *de;
+
+	if (!dir)
+	{
+		fprintf(stderr, "%s: could not open directory \"%s\": %s\n",
+				progname, dirname, strerror(errno));
+		exit(1);
+	}
+
+	while ((de = readdir(dir)) != NULL)
+	{
+		char		path[MAXPGPATH];
+		struct stat st;
+
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+			continue;
+
+		snprintf(path, sizeof(path), "%s/%s", dirname, de->d_name);
+		if (stat(path, &st) != 0)
+			continue;
+		if (S_ISDIR(st.st_mode))
+			walkDirectory(path);
+		else if (S_ISREG(st.st_mode))
+			addItem(0, path);
+	}
+	closedir(dir);
+}
+
+/*
+ * Load image from file detecting its format by magic bytes.
+ */
+static gdImagePtr
+loadImage(const char *path)
+{
+	FILE	   *f = fopen(path, "rb");
+	unsigned char *data;
+	long		size;
+	ImgsmlrFormat format;
+	gdImagePtr	im = NULL;
+
+	if (!f)
+		return NULL;
+	fseek(f, 0, SEEK_END);
+	size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	if (size <= 0)
+	{
+		fclose(f);
+		return NULL;
+	}
+	data = pg_malloc(size);
+	if (fread(data, 1, size, f) != (size_t) size)
+	{
+		pg_free(data);
+		fclose(f);
+		return NULL;
+	}
+	fclose(f);
+
+	if (detectImageFormat(data, size, &format))
+		im = loadImageData(format, data, size);
+
+	pg_free(data);
+	return im;
+}
+
+static inline char *
+putInt16(char *p, int16 value)
+{
+	uint16		n = htons((uint16) value);
+
+	memcpy(p, &n, 2);
+	return p + 2;
+}
+
+static inline char *
+putInt32(char *p, int32 value)
+{
+	uint32		n = htonl((uint32) value);
+
+	memcpy(p, &n, 4);
+	return p + 4;
+}
+
+static inline char *
+putFloats(char *p, const float *values, int count)
+{
+	int			i;
+
+	for (i = 0; i < count; i++)
+	{
+		union
+		{
+			float		f;
+			uint32		i;
+		}			swap;
+
+		swap.f = values[i];
+		p = putInt32(p, (int32) swap.i);
+	}
+	return p;
+}
+
+/*
+ * Transform the image and append its row to the output.  Float buffers are
+ * the scratch space of the worker.
+ */
+static bool
+processItem(BulkItem *item, float *source, float *pattern, float *shuffled,
+			char *row)
+{
+	int			size = patternSize;
+	gdImagePtr	im,
+				tb;
+	Signature	signature;
+	char	   *p = row;
+
+	im = loadImage(item->path);
+	if (!im)
+		return false;
+
+	/* The same steps as image2pattern() */
+	tb = gdImageCreateTrueColor(size, size);
+	if (!tb)
+	{
+		gdImageDestroy(im);
+		return false;
+	}
+	gdImageCopyResampled(tb, im, 0, 0, 0, 0, size, size,
+						 im->sx, im->sy);
+	gdImageDestroy(im);
+	makePattern(tb, source, size);
+	gdImageDestroy(tb);
+	normalizePattern(source, size);
+	waveletTransform(pattern, source, size);
+
+	shufflePattern(shuffled, pattern, size);
+	calcSignature(pattern, size, &signature);
+
+	p = putInt16(p, 4);
+	p = putInt32(p, 8);
+	p = putInt32(p, (int32) (item->id >> 32));
+	p = putInt32(p, (int32) item->id);
+	p = putInt32(p, (int32) PATTERN_BYTES(size));
+	p = putFloats(p, pattern, size * size);
+	p = putInt32(p, (int32) PATTERN_BYTES(size));
+	p = putFloats(p, shuffled, size * size);
+	p = putInt32(p, (int32) sizeof(Signature));
+	p = putFloats(p, signature.values, SIGNATURE_SIZE);
+
+	pthread_mutex_lock(&outputMutex);
+	if (fwrite(row, 1, p - row, output) != (size_t) (p - row))
+	{
+		fprintf(stderr, "%s: could not write output: %s\n",
+				progname, strerror(errno));
+		exit(1);
+	}
+	pthread_mutex_unlock(&outputMutex);
+
+	return true;
+}
+
+/*
+ * Take next item from the own range, or steal upper half of the largest
+ * remaining range of another worker.  Returns -1 when all work is done.
+ */
+static int
+nextItem(int self)
+{
+	BulkWorker *worker = &workers[self];
+	int			result = -1;
+
+	pthread_mutex_lock(&worker->mutex);
+	if (worker->begin < worker->end)
+		result = worker->begin++;
+	pthread_mutex_unlock(&worker->mutex);
+
+	while (result < 0)
+	{
+		int			victim = -1,
+					largest = 0,
+					i;
+
+		for (i = 0; i < nworkers; i++)
+		{
+			int			remaining;
+
+			if (i == self)
+				continue;
+			pthread_mutex_lock(&workers[i].mutex);
+			remaining = workers[i].end - workers[i].begin;
+			pthread_mutex_unlock(&workers[i].mutex);
+			if (remaining > largest)
+			{
+				largest = remaining;
+				victim = i;
+			}
+		}
+		if (victim < 0)
+			break;
+
+		/*
+		 * Range could have shrunk meanwhile, so recheck under lock.  Victim
+		 * keeps [begin, mid), the rest is taken, so the last item of the
+		 * range goes to the thief.
+		 */
+		pthread_mutex_lock(&workers[victim].mutex);
+		if (workers[victim].begin < workers[victim].end)
+		{
+			int			begin = workers[victim].begin,
+						end = workers[victim].end,
+						mid = begin + (end - begin) / 2;
+
+			workers[victim].end = mid;
+			pthread_mutex_unlock(&workers[victim].mutex);
+
+			pthread_mutex_lock(&worker->mutex);
+			worker->begin = mid + 1;
+			worker->end = end;
+			pthread_mutex_unlock(&worker->mutex);
+			result = mid;
+		}
+		else
+			pthread_mutex_unlock(&workers[victim].mutex);
+	}
+
+	return result;
+}
+
+static void *
+workerMain(void *arg)
+{
+	int			self = (int) (intptr_t) arg;
+	float	   *source = pg_malloc(PATTERN_BYTES(patternSize));
+	float	   *pattern = pg_malloc(PATTERN_BYTES(patternSize));
+	float	   *shuffled = pg_malloc(PATTERN_BYTES(patternSize));
+	char	   *row = pg_malloc(2 + 4 * 4 + 8 + 2 * PATTERN_BYTES(patternSize) +
+								sizeof(Signature));
+	int			i;
+
+	while ((i = nextItem(self)) >= 0)
+	{
+		if (!processItem(&items[i], source, pattern, shuffled, row))
+		{
+			pthread_mutex_lock(&outputMutex);
+			fprintf(stderr, "%s: could not load image \"%s\"\n",
+					progname, items[i].path);
+			nfailed++;
+			pthread_mutex_unlock(&outputMutex);
+		}
+	}
+
+	pg_free(source);
+	pg_free(pattern);
+	pg_free(shuffled);
+	pg_free(row);
+	return NULL;
+}
+
+static void
+usage(void)
+{
+	printf("%s generates imgsmlr patterns and signatures of images in COPY BINARY format.\n\n", progname);
+	printf("Usage:\n");
+	printf("  %s [OPTION]... DIRECTORY\n", progname);
+	printf("  %s [OPTION]... -m MANIFEST\n\n", progname);
+	printf("Options:\n");
+	printf("  -j NUM         number of threads (default: number of CPUs)\n");
+	printf("  -m MANIFEST    read \"id<TAB>path\" lines from file, \"-\" for stdin\n");
+	printf("  -o FILE        output file (default: stdout)\n");
+	printf("  -s SIZE        pattern size, power of two from %d to %d (default: %d)\n",
+		   PATTERN_MIN_SIZE, PATTERN_MAX_SIZE, PATTERN_SIZE);
+	printf("  -?             show this help, then exit\n\n");
+	printf("Images which could not be loaded are reported and skipped, exit status is 2 then.\n");
+}
+
+int
+main(int argc, char **argv)
+{
+	static const char header[] = "PGCOPY\n\377\r\n\0";
+	const char *manifest = NULL;
+	const char *outfile = NULL;
+	char		buf[8];
+	int			c,
+				i;
+
+	progname = get_progname(argv[0]);
+	nworkers = (int) sysconf(_SC_NPROCESSORS_ONLN);
+
+	while ((c = getopt(argc, argv, "j:m:o:s:?")) != -1)
+	{
+		switch (c)
+		{
+			case 'j':
+				nworkers = atoi(optarg);
+				break;
+			case 'm':
+				manifest = optarg;
+				break;
+			case 'o':
+				outfile = optarg;
+				break;
+			case 's':
+				patternSize = atoi(optarg);
+				break;
+			case '?':
+				if (optopt == 0 || optopt == '?')
+				{
+					usage();
+					exit(0);
+				}
+				/* FALLTHROUGH */
+			default:
+				fprintf(stderr, "Try \"%s -?\" for more information.\n", progname);
+				exit(1);
+		}
+	}
+
+	if (patternSize < PATTERN_MIN_SIZE || patternSize > PATTERN_MAX_SIZE ||
+		(patternSize & (patternSize - 1)) != 0)
+	{
+		fprintf(stderr, "%s: pattern size must be a power of two between %d and %d\n",
+				progname, PATTERN_MIN_SIZE, PATTERN_MAX_SIZE);
+		exit(1);
+	}
+	if (nworkers < 1)
+		nworkers = 1;
+
+	if (manifest)
+	{
+		if (optind != argc)
+		{
+			fprintf(stderr, "%s: directory and manifest could not be both specified\n",
+					progname);
+			exit(1);
+		}
+		readManifest(manifest);
+	}
+	else if (optind == argc - 1)
+	{
+		walkDirectory(argv[optind]);
+		qsort(items, nitems, sizeof(BulkItem), cmpItemPath);
+		for (i = 0; i < nitems; i++)
+			items[i].id = i + 1;
+	}
+	else
+	{
+		fprintf(stderr, "%s: no directory or manifest specified\n", progname);
+		fprintf(stderr, "Try \"%s -?\" for more information.\n", progname);
+		exit(1);
+	}
+
+	if (outfile)
+	{
+		output = fopen(outfile, "wb");
+		if (!output)
+		{
+			fprintf(stderr, "%s: could not open output file \"%s\": %s\n",
+					progname, outfile, strerror(errno));
+			exit(1);
+		}
+	}
+	else
+		output = stdout;
+
+	/* Signature, flags field and header extension length */
+	fwrite(header, 1, 11, output);
+	putInt32(buf, 0);
+	putInt32(buf + 4, 0);
+	fwrite(buf, 1, 8, output);
+
+	/* Split images into equal ranges and start the workers */
+	if (nworkers > nitems && nitems > 0)
+		nworkers = nitems;
+	workers = pg_malloc0(sizeof(BulkWorker) * nworkers);
+	for (i = 0; i < nworkers; i++)
+	{
+		pthread_mutex_init(&workers[i].mutex, NULL);
+		workers[i].begin = (int) ((int64) nitems * i / nworkers);
+		workers[i].end = (int) ((int64) nitems * (i + 1) / nworkers);
+	}
+	for (i = 0; i < nworkers; i++)
+	{
+		if (pthread_create(&workers[i].thread, NULL, workerMain,
+						   (void *) (intptr_t) i) != 0)
+		{
+			fprintf(stderr, "%s: could not create thread\n", progname);
+			exit(1);
+		}
+	}
+	for (i = 0; i < nworkers; i++)
+		pthread_join(workers[i].thread, NULL);
+
+	/* File trailer */
+	putInt16(buf, -1);
+	fwrite(buf, 1, 2, output);
+
+	if (fflush(output) != 0 || (output != stdout && fclose(output) != 0))
+	{
+		fprintf(stderr, "%s: could not write output: %s\n",
+				progname, strerror(errno));
+		exit(1);
+	}
+
+	fprintf(stderr, "%s: %d images processed, %d failed\n",
+			progname, nitems - nfailed, nfailed);
+
+	return nfailed > 0 ? 2 : 0;
+}
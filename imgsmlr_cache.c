@@ -0,0 +1,249 @@
+/*-------------------------------------------------------------------------
+ *
+ *          Image similarity extension
+ *
+ * Copyright (c) 2015, PostgreSQL Global Development Group
+ *
+ * This software is released under the PostgreSQL Licence.
+ *
+ * Per-backend cache of conversion results, so that repeated query images
+ * aren't decoded again.  Entries are keyed by kind of conversion, pattern
+ * size and input bytes, and evicted in LRU order when the total size exceeds
+ * imgsmlr.cache_size.  Conversions are deterministic, so the entries never
+ * need invalidation.
+ *
+ * Input is hashed to find the entry, and compared in full, so hash collision
+ * may cause only a miss.
+ *
+ * IDENTIFICATION
+ *    imgsmlr/imgsmlr_cache.c
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "imgsmlr.h"
+#include "access/hash.h"
+#include "access/htup_details.h"
+#include "lib/ilist.h"
+#include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/memutils.h"
+
+PG_FUNCTION_INFO_V1(imgsmlr_cache_stats);
+Datum		imgsmlr_cache_stats(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(imgsmlr_cache_reset);
+Datum		imgsmlr_cache_reset(PG_FUNCTION_ARGS);
+
+typedef struct
+{
+	ImgsmlrFormat kind;
+	int			size;
+	uint32		hash;
+	uint32		len;
+} CacheKey;
+
+typedef struct
+{
+	CacheKey	key;			/* hash key, must be first */
+	dlist_node	lruNode;		/* the most recently used at the head */
+	char	   *input;
+	char	   *result;
+	Size		resultLen;
+} CacheEntry;
+
+/* Memory accounted per entry besides input and result */
+#define CACHE_ENTRY_OVERHEAD (sizeof(CacheEntry) + 64)
+
+static int	imgsmlr_cache_size = 0;
+
+static HTAB *cache = NULL;
+static MemoryContext cacheContext = NULL;
+static dlist_head lru = DLIST_STATIC_INIT(lru);
+static Size cacheMemory = 0;
+static int64 cacheHits = 0;
+static int64 cacheMisses = 0;
+static int64 cacheEvictions = 0;
+
+static void cacheRemove(CacheEntry *entry);
+static void cacheShrink(Size limit);
+static void cacheSizeAssign(int newval, void *extra);
+
+void
+cacheInit(void)
+{
+	DefineCustomIntVariable("imgsmlr.cache_size",
+							"Size of per-backend cache of converted images.",
+							"Zero disables the cache.",
+							&imgsmlr_cache_size,
+							0, 0, MAX_KILOBYTES,
+							PGC_USERSET,
+							GUC_UNIT_KB,
+							NULL, cacheSizeAssign, NULL);
+}
+
+static void
+cacheSizeAssign(int newval, void *extra)
+{
+	/* Assign hook is not allowed to fail, eviction can't */
+	if (cache)
+		cacheShrink((Size) newval * 1024);
+}
+
+static void
+cacheRemove(CacheEntry *entry)
+{
+	dlist_delete(&entry->lruNode);
+	cacheMemory -= entry->key.len + entry->resultLen + CACHE_ENTRY_OVERHEAD;
+	pfree(entry->input);
+	pfree(entry->result);
+	hash_search(cache, &entry->key, HASH_REMOVE, NULL);
+}
+
+/*
+ * Evict the least recently used entries until cache fits the limit.
+ */
+static void
+cacheShrink(Size limit)
+{
+	while (cacheMemory > limit && !dlist_is_empty(&lru))
+	{
+		cacheRemove(dlist_tail_element(CacheEntry, lruNode, &lru));
+		cacheEvictions++;
+	}
+}
+
+static void
+cacheMakeKey(CacheKey *key, ImgsmlrFormat kind, int size,
+			 const void *input, Size len)
+{
+	memset(key, 0, sizeof(CacheKey));
+	key->kind = kind;
+	key->size = size;
+	key->len = (uint32) len;
+	key->hash = DatumGetUInt32(hash_any((const unsigned char *) input, (int) len));
+}
+
+/*
+ * Look up result of conversion of given input.  Returns palloc'd copy of
+ * result, or NULL if it isn't cached.
+ */
+void *
+cacheLookup(ImgsmlrFormat kind, int size, const void *input, Size len)
+{
+	CacheKey	key;
+	CacheEntry *entry;
+	void	   *result;
+
+	if (imgsmlr_cache_size <= 0)
+		return NULL;
+
+	if (cache == NULL)
+	{
+		cacheMisses++;
+		return NULL;
+	}
+
+	cacheMakeKey(&key, kind, size, input, len);
+	entry = (CacheEntry *) hash_search(cache, &key, HASH_FIND, NULL);
+	if (!entry || memcmp(entry->input, input, len) != 0)
+	{
+		cacheMisses++;
+		return NULL;
+	}
+
+	cacheHits++;
+	dlist_move_head(&lru, &entry->lruNode);
+	result = palloc(entry->resultLen);
+	memcpy(result, entry->result, entry->resultLen);
+	return result;
+}
+
+/*
+ * Remember result of conversion of given input.
+ */
+void
+cacheInsert(ImgsmlrFormat kind, int size, const void *input, Size len,
+			const void *result, Size resultLen)
+{
+	Size		limit = (Size) imgsmlr_cache_size * 1024;
+	Size		entryMemory = len + resultLen + CACHE_ENTRY_OVERHEAD;
+	CacheKey	key;
+	CacheEntry *entry;
+	bool		found;
+
+	if (imgsmlr_cache_size <= 0 || entryMemory > limit || len > PG_UINT32_MAX)
+		return;
+
+	if (cache == NULL)
+	{
+		HASHCTL		ctl;
+
+		cacheContext = AllocSetContextCreate(TopMemoryContext,
+											 "imgsmlr cache",
+											 ALLOCSET_DEFAULT_SIZES);
+		memset(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(CacheKey);
+		ctl.entrysize = sizeof(CacheEntry);
+		ctl.hcxt = cacheContext;
+		cache = hash_create("imgsmlr cache", 256, &ctl,
+							HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	}
+
+	cacheMakeKey(&key, kind, size, input, len);
+
+	/* Entry with colliding hash is replaced */
+	entry = (CacheEntry *) hash_search(cache, &key, HASH_FIND, NULL);
+	if (entry)
+		cacheRemove(entry);
+
+	cacheShrink(limit - entryMemory);
+
+	entry = (CacheEntry *) hash_search(cache, &key, HASH_ENTER, &found);
+	Assert(!found);
+	entry->input = MemoryContextAlloc(cacheContext, len);
+	memcpy(entry->input, input, len);
+	entry->result = MemoryContextAlloc(cacheContext, resultLen);
+	memcpy(entry->result, result, resultLen);
+	entry->resultLen = resultLen;
+	dlist_push_head(&lru, &entry->lruNode);
+	cacheMemory += entryMemory;
+}
+
+/*
+ * imgsmlr_cache_stats() returns counters of the cache of current backend.
+ */
+Datum
+imgsmlr_cache_stats(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupdesc;
+	Datum		values[5];
+	bool		nulls[5];
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	memset(nulls, 0, sizeof(nulls));
+	values[0] = Int64GetDatum(cacheHits);
+	values[1] = Int64GetDatum(cacheMisses);
+	values[2] = Int64GetDatum(cacheEvictions);
+	values[3] = Int64GetDatum(cache ? (int64) hash_get_num_entries(cache) : 0);
+	values[4] = Int64GetDatum((int64) cacheMemory);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+/*
+ * imgsmlr_cache_reset() empties the cache and resets its counters.
+ */
+Datum
+imgsmlr_cache_reset(PG_FUNCTION_ARGS)
+{
+	if (cache)
+		cacheShrink(0);
+	cacheHits = 0;
+	cacheMisses = 0;
+	cacheEvictions = 0;
+
+	PG_RETURN_VOID();
+}
@@ -0,0 +1,248 @@
+/*-------------------------------------------------------------------------
+ *
+ *          Image similarity extension
+ *
+ * Copyright (c) 2015, PostgreSQL Global Development Group
+ *
+ * This software is released under the PostgreSQL Licence.
+ *
+ * Exact comparison and hashing of patterns and signatures, which back B-tree
+ * and hash operator classes.  Values are compared element-wise the same way
+ * as float4: -0.0 is equal to 0.0, and NaN is equal to NaN and greater than
+ * any other value.  Hash is calculated over canonical representation of the
+ * elements, so it's consistent with the equality.  Patterns of different
+ * sizes are never equal, smaller pattern goes first.
+ *
+ * IDENTIFICATION
+ *    imgsmlr/imgsmlr_cmp.c
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+#include "fmgr.h"
+#include "imgsmlr.h"
+#include "access/hash.h"
+
+PG_FUNCTION_INFO_V1(pattern_eq);
+Datum		pattern_eq(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(pattern_ne);
+Datum		pattern_ne(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(pattern_lt);
+Datum		pattern_lt(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(pattern_le);
+Datum		pattern_le(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(pattern_gt);
+Datum		pattern_gt(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(pattern_ge);
+Datum		pattern_ge(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(pattern_cmp);
+Datum		pattern_cmp(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(pattern_hash);
+Datum		pattern_hash(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(signature_eq);
+Datum		signature_eq(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(signature_ne);
+Datum		signature_ne(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(signature_lt);
+Datum		signature_lt(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(signature_le);
+Datum		signature_le(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(signature_gt);
+Datum		signature_gt(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(signature_ge);
+Datum		signature_ge(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(signature_cmp);
+Datum		signature_cmp(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(signature_hash);
+Datum		signature_hash(PG_FUNCTION_ARGS);
+
+static int	floatArrayCmp(const float *a, int na, const float *b, int nb);
+static uint32 floatArrayHash(const float *values, int n);
+
+static inline int
+floatCmp(float a, float b)
+{
+	if (isnan(a))
+		return isnan(b) ? 0 : 1;
+	if (isnan(b))
+		return -1;
+	if (a > b)
+		return 1;
+	if (a < b)
+		return -1;
+	return 0;
+}
+
+static int
+floatArrayCmp(const float *a, int na, const float *b, int nb)
+{
+	int			i;
+
+	if (na != nb)
+		return (na > nb) ? 1 : -1;
+
+	for (i = 0; i < na; i++)
+	{
+		int			cmp = floatCmp(a[i], b[i]);
+
+		if (cmp != 0)
+			return cmp;
+	}
+	return 0;
+}
+
+/*
+ * Hash canonical copy of float array: zero without sign and single NaN.
+ */
+static uint32
+floatArrayHash(const float *values, int n)
+{
+	float	   *canonical = (float *) palloc(sizeof(float) * n);
+	uint32		result;
+	int			i;
+
+	for (i = 0; i < n; i++)
+	{
+		float		v = values[i];
+
+		if (isnan(v))
+			v = (float) NAN;
+		else if (v == 0.0f)
+			v = 0.0f;
+		canonical[i] = v;
+	}
+
+	result = DatumGetUInt32(hash_any((const unsigned char *) canonical,
+									 sizeof(float) * n));
+	pfree(canonical);
+	return result;
+}
+
+static int
+patternCmpArgs(FunctionCallInfo fcinfo)
+{
+	Pattern    *a = PG_GETARG_PATTERN(0);
+	Pattern    *b = PG_GETARG_PATTERN(1);
+	int			na = patternGetSize(a),
+				nb = patternGetSize(b);
+	int			result;
+
+	result = floatArrayCmp(a->values, na * na, b->values, nb * nb);
+
+	PG_FREE_IF_COPY(a, 0);
+	PG_FREE_IF_COPY(b, 1);
+	return result;
+}
+
+static int
+signatureCmpArgs(FunctionCallInfo fcinfo)
+{
+	Signature  *a = (Signature *) PG_GETARG_POINTER(0);
+	Signature  *b = (Signature *) PG_GETARG_POINTER(1);
+
+	return floatArrayCmp(a->values, SIGNATURE_SIZE, b->values, SIGNATURE_SIZE);
+}
+
+Datum
+pattern_eq(PG_FUNCTION_ARGS)
+{
+	PG_RETURN_BOOL(patternCmpArgs(fcinfo) == 0);
+}
+
+Datum
+pattern_ne(PG_FUNCTION_ARGS)
+{
+	PG_RETURN_BOOL(patternCmpArgs(fcinfo) != 0);
+}
+
+Datum
+pattern_lt(PG_FUNCTION_ARGS)
+{
+	PG_RETURN_BOOL(patternCmpArgs(fcinfo) < 0);
+}
+
+Datum
+pattern_le(PG_FUNCTION_ARGS)
+{
+	PG_RETURN_BOOL(patternCmpArgs(fcinfo) <= 0);
+}
+
+Datum
+pattern_gt(PG_FUNCTION_ARGS)
+{
+	PG_RETURN_BOOL(patternCmpArgs(fcinfo) > 0);
+}
+
+Datum
+pattern_ge(PG_FUNCTION_ARGS)
+{
+	PG_RETURN_BOOL(patternCmpArgs(fcinfo) >= 0);
+}
+
+Datum
+pattern_cmp(PG_FUNCTION_ARGS)
+{
+	PG_RETURN_INT32(patternCmpArgs(fcinfo));
+}
+
+Datum
+pattern_hash(PG_FUNCTION_ARGS)
+{
+	Pattern    *pattern = PG_GETARG_PATTERN(0);
+	int			n = patternGetSize(pattern);
+	uint32		result;
+
+	result = floatArrayHash(pattern->values, n * n);
+	PG_FREE_IF_COPY(pattern, 0);
+
+	PG_RETURN_UINT32(result);
+}
+
+Datum
+signature_eq(PG_FUNCTION_ARGS)
+{
+	PG_RETURN_BOOL(signatureCmpArgs(fcinfo) == 0);
+}
+
+Datum
+signature_ne(PG_FUNCTION_ARGS)
+{
+	PG_RETURN_BOOL(signatureCmpArgs(fcinfo) != 0);
+}
+
+Datum
+signature_lt(PG_FUNCTION_ARGS)
+{
+	PG_RETURN_BOOL(signatureCmpArgs(fcinfo) < 0);
+}
+
+Datum
+signature_le(PG_FUNCTION_ARGS)
+{
+	PG_RETURN_BOOL(signatureCmpArgs(fcinfo) <= 0);
+}
+
+Datum
+signature_gt(PG_FUNCTION_ARGS)
+{
+	PG_RETURN_BOOL(signatureCmpArgs(fcinfo) > 0);
+}
+
+Datum
+signature_ge(PG_FUNCTION_ARGS)
+{
+	PG_RETURN_BOOL(signatureCmpArgs(fcinfo) >= 0);
+}
+
+Datum
+signature_cmp(PG_FUNCTION_ARGS)
+{
+	PG_RETURN_INT32(signatureCmpArgs(fcinfo));
+}
+
+Datum
+signature_hash(PG_FUNCTION_ARGS)
+{
+	Signature  *signature = (Signature *) PG_GETARG_POINTER(0);
+
+	PG_RETURN_UINT32(floatArrayHash(signature->values, SIGNATURE_SIZE));
+}
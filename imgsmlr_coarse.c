@@ -0,0 +1,248 @@
+/*-------------------------------------------------------------------------
+ *
+ *          Image similarity extension
+ *
+ * Copyright (c) 2015, PostgreSQL Global Development Group
+ *
+ * This software is released under the PostgreSQL Licence.
+ *
+ * Coarse quantizer of signatures.  Signatures are clustered by k-means, and
+ * each row is assigned to the cell of the nearest centroid.  Table could be
+ * partitioned by cell, so that search probes only the cells nearest to the
+ * query instead of all the partitions.
+ *
+ * Quantizers are trained by signature_quantizer_train() and stored in
+ * imgsmlr_quantizer.  They must not be modified after rows were assigned to
+ * their cells.
+ *
+ * IDENTIFICATION
+ *    imgsmlr/imgsmlr_coarse.c
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+#include "fmgr.h"
+#include "imgsmlr.h"
+#include "catalog/pg_type.h"
+#include "executor/spi.h"
+#include "utils/array.h"
+#include "utils/memutils.h"
+
+PG_FUNCTION_INFO_V1(signature_quantizer_train);
+Datum		signature_quantizer_train(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(signature_assign);
+Datum		signature_assign(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(signature_probe);
+Datum		signature_probe(PG_FUNCTION_ARGS);
+
+#define QUANTIZER_MAX_CENTROIDS	65536
+
+typedef struct
+{
+	int32		id;
+	int			centroids;
+	float	   *data;			/* [centroids][SIGNATURE_SIZE] */
+} CoarseQuantizer;
+
+typedef struct
+{
+	int			cell;
+	float		distance;
+} CellDistance;
+
+/*
+ * Make quantizer from the row of imgsmlr_quantizer, see loadModel().
+ */
+static void *
+parseQuantizer(Datum *values, int32 id)
+{
+	CoarseQuantizer *quantizer = (CoarseQuantizer *) palloc0(sizeof(CoarseQuantizer));
+	ArrayType  *array;
+	Size		nvalues;
+
+	quantizer->id = id;
+	quantizer->centroids = DatumGetInt32(values[0]);
+	array = DatumGetArrayTypeP(values[1]);
+
+	nvalues = (Size) quantizer->centroids * SIGNATURE_SIZE;
+	if (quantizer->centroids < 1 ||
+		ARR_NDIM(array) != 1 || ARR_HASNULL(array) ||
+		ARR_ELEMTYPE(array) != FLOAT4OID ||
+		ArrayGetNItems(ARR_NDIM(array), ARR_DIMS(array)) != nvalues)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("invalid signature quantizer %d", id)));
+
+	quantizer->data = (float *) palloc(sizeof(float) * nvalues);
+	memcpy(quantizer->data, ARR_DATA_PTR(array), sizeof(float) * nvalues);
+
+	if ((Pointer) array != DatumGetPointer(values[1]))
+		pfree(array);
+	return quantizer;
+}
+
+/*
+ * Get quantizer of given id, loading it into fn_extra when needed.
+ */
+static CoarseQuantizer *
+getQuantizer(FunctionCallInfo fcinfo, int32 id)
+{
+	ModelCache *cache = (ModelCache *) fcinfo->flinfo->fn_extra;
+
+	if (!cache)
+	{
+		cache = (ModelCache *) MemoryContextAllocZero(fcinfo->flinfo->fn_mcxt,
+													  sizeof(ModelCache));
+		fcinfo->flinfo->fn_extra = cache;
+	}
+
+	loadModel(fcinfo, cache, id, "imgsmlr_quantizer", "centroids, data",
+			  "signature quantizer", parseQuantizer);
+	return (CoarseQuantizer *) cache->model;
+}
+
+static int
+cmp_cell_distance(const void *a, const void *b)
+{
+	const CellDistance *ca = (const CellDistance *) a;
+	const CellDistance *cb = (const CellDistance *) b;
+
+	if (ca->distance < cb->distance)
+		return -1;
+	if (ca->distance > cb->distance)
+		return 1;
+	return (ca->cell > cb->cell) - (ca->cell < cb->cell);
+}
+
+/*
+ * signature_assign(signature, quantizer) returns number of cell of the
+ * nearest centroid, starting from 0.
+ */
+Datum
+signature_assign(PG_FUNCTION_ARGS)
+{
+	Signature  *signature = (Signature *) PG_GETARG_POINTER(0);
+	CoarseQuantizer *quantizer = getQuantizer(fcinfo, PG_GETARG_INT32(1));
+
+	PG_RETURN_INT32(kmeansNearest(quantizer->data, quantizer->centroids,
+								  SIGNATURE_SIZE, signature->values, NULL));
+}
+
+/*
+ * signature_probe(signature, quantizer, nprobe) returns array of numbers of
+ * nprobe cells nearest to the signature, ordered by distance.
+ */
+Datum
+signature_probe(PG_FUNCTION_ARGS)
+{
+	Signature  *signature = (Signature *) PG_GETARG_POINTER(0);
+	CoarseQuantizer *quantizer = getQuantizer(fcinfo, PG_GETARG_INT32(1));
+	int32		nprobe = PG_GETARG_INT32(2);
+	CellDistance *cells;
+	Datum	   *elems;
+	int			i;
+
+	if (nprobe < 1)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("number of probed cells must be positive")));
+	nprobe = Min(nprobe, quantizer->centroids);
+
+	cells = (CellDistance *) palloc(sizeof(CellDistance) * quantizer->centroids);
+	for (i = 0; i < quantizer->centroids; i++)
+	{
+		cells[i].cell = i;
+		kmeansNearest(quantizer->data + (Size) i * SIGNATURE_SIZE, 1,
+					  SIGNATURE_SIZE, signature->values, &cells[i].distance);
+	}
+	qsort(cells, quantizer->centroids, sizeof(CellDistance), cmp_cell_distance);
+
+	elems = (Datum *) palloc(sizeof(Datum) * nprobe);
+	for (i = 0; i < nprobe; i++)
+		elems[i] = Int32GetDatum(cells[i].cell);
+
+	PG_RETURN_ARRAYTYPE_P(construct_array(elems, nprobe, INT4OID,
+										  sizeof(int32), true, 'i'));
+}
+
+/*
+ * signature_quantizer_train(rel, col, centroids, sample_size, iterations)
+ * clusters signatures of given column and returns id of the new quantizer.
+ */
+Datum
+signature_quantizer_train(PG_FUNCTION_ARGS)
+{
+	Oid			relid = PG_GETARG_OID(0);
+	Name		attname = PG_GETARG_NAME(1);
+	int32		centroids = PG_GETARG_INT32(2);
+	int32		sampleSize = PG_GETARG_INT32(3);
+	int32		iterations = PG_GETARG_INT32(4);
+	char	   *nsp = extensionNamespace(fcinfo);
+	int			nsamples,
+				ret,
+				i;
+	float	   *matrix,
+			   *data;
+	Datum	   *elems;
+	Size		nvalues,
+				j;
+	Oid			argtypes[2] = {INT4OID, FLOAT4ARRAYOID};
+	Datum		args[2];
+	bool		isnull;
+	int32		id;
+
+	if (centroids < 1 || centroids > QUANTIZER_MAX_CENTROIDS)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("number of centroids must be between 1 and %d",
+						QUANTIZER_MAX_CENTROIDS)));
+	if (sampleSize < centroids || iterations < 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("sample size must not be less than number of centroids and number of iterations must not be negative")));
+
+	SPI_connect();
+
+	nsamples = spiSampleColumn(fcinfo, relid, attname, "signature", sampleSize);
+	if (nsamples < centroids)
+		ereport(ERROR,
+				(errcode(ERRCODE_NO_DATA),
+				 errmsg("%d signatures are not enough to train %d centroids",
+						nsamples, centroids)));
+
+	matrix = (float *) palloc(sizeof(float) * SIGNATURE_SIZE * nsamples);
+	for (i = 0; i < nsamples; i++)
+	{
+		Signature  *signature;
+
+		signature = (Signature *) DatumGetPointer(SPI_getbinval(SPI_tuptable->vals[i],
+																SPI_tuptable->tupdesc,
+																1, &isnull));
+		memcpy(matrix + (Size) i * SIGNATURE_SIZE, signature->values,
+			   sizeof(float) * SIGNATURE_SIZE);
+	}
+
+	nvalues = (Size) centroids * SIGNATURE_SIZE;
+	data = (float *) palloc(sizeof(float) * nvalues);
+	kmeansCluster(matrix, nsamples, SIGNATURE_SIZE, centroids, iterations, data);
+	pfree(matrix);
+
+	elems = (Datum *) palloc(sizeof(Datum) * nvalues);
+	for (j = 0; j < nvalues; j++)
+		elems[j] = Float4GetDatum(data[j]);
+
+	args[0] = Int32GetDatum(centroids);
+	args[1] = PointerGetDatum(construct_array(elems, (int) nvalues, FLOAT4OID,
+											  sizeof(float4), FLOAT4PASSBYVAL, 'i'));
+	ret = SPI_execute_with_args(psprintf("INSERT INTO %s.imgsmlr_quantizer "
+										 "(centroids, data) "
+										 "VALUES ($1, $2) RETURNING id", nsp),
+								2, argtypes, args, NULL, false, 1);
+	if (ret != SPI_OK_INSERT_RETURNING || SPI_processed != 1)
+		elog(ERROR, "could not store quantizer: error code %d", ret);
+	id = DatumGetInt32(SPI_getbinval(SPI_tuptable->vals[0],
+									 SPI_tuptable->tupdesc, 1, &isnull));
+
+	SPI_finish();
+
+	PG_RETURN_INT32(id);
+}
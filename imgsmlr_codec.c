@@ -0,0 +1,354 @@
+/*-------------------------------------------------------------------------
+ *
+ *          Image similarity extension
+ *
+ * Copyright (c) 2015, PostgreSQL Global Development Group
+ *
+ * This software is released under the PostgreSQL Licence.
+ *
+ * Lossless compression of patterns.  pglz barely compresses raw float4
+ * values, so they are transformed first.  Coefficients are taken level by
+ * level of wavelet decomposition, where neighbouring coefficients have
+ * similar magnitude, and each one is XORed with the previous one, so that
+ * sign, exponent and high mantissa bits mostly become zero.  Then bytes of
+ * each level are split into planes: high bytes of all the coefficients of
+ * the level go first, then the next bytes and so on.  The result is
+ * compressed by pglz.
+ *
+ * Compressed pattern is stored in the same "pattern" varlena:
+ *
+ *   uint8 log2 of pattern size
+ *   uint8 flags
+ *   pglz data
+ *   optional padding byte
+ *
+ * Padding byte is added when needed to make the length not a multiple of 4,
+ * so compressed pattern is always distinguishable from plain one.
+ *
+ * IDENTIFICATION
+ *    imgsmlr/imgsmlr_codec.c
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+#include "fmgr.h"
+#include "imgsmlr.h"
+#include "common/pg_lzcompress.h"
+#include "utils/guc.h"
+#include "utils/memutils.h"
+
+PG_FUNCTION_INFO_V1(pattern_compress);
+Datum		pattern_compress(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(pattern_decompress);
+Datum		pattern_decompress(PG_FUNCTION_ARGS);
+
+#define CODEC_HEADER_SIZE	2
+#define CODEC_FLAG_PADDED	0x01
+
+/* Number of wavelet levels in pattern of maximal size */
+#define CODEC_MAX_LEVELS	8
+
+bool		patternCompression = false;
+
+/*
+ * Order of coefficients by wavelet level for each pattern size, built on
+ * first use.  Level 0 is top-left coefficient, level L > 0 consists of
+ * coefficients with max(i, j) in [2^(L-1), 2^L), it starts at position
+ * 4^(L-1) of the order.
+ */
+static uint16 *levelOrders[CODEC_MAX_LEVELS];
+
+/* Buffer for decompressed pglz data, it's reused by all the calls */
+static uint8 *planesBuffer = NULL;
+
+void
+codecInit(void)
+{
+	DefineCustomBoolVariable("imgsmlr.pattern_compression",
+							 "Store patterns made by imgsmlr functions compressed.",
+							 "Compression is lossless, but patterns have to be "
+							 "decompressed on each access.",
+							 &patternCompression,
+							 false,
+							 PGC_USERSET,
+							 0,
+							 NULL, NULL, NULL);
+}
+
+static int
+sizeLog2(int size)
+{
+	int			log = 0;
+
+	while ((1 << log) < size)
+		log++;
+	return log;
+}
+
+static const uint16 *
+getLevelOrder(int size)
+{
+	int			log = sizeLog2(size);
+	uint16	   *order;
+	int			k = 0,
+				lo,
+				i,
+				j;
+
+	if (levelOrders[log])
+		return levelOrders[log];
+
+	order = (uint16 *) MemoryContextAlloc(TopMemoryContext,
+										  sizeof(uint16) * size * size);
+	order[k++] = 0;
+	for (lo = 1; lo < size; lo *= 2)
+	{
+		/* Rows above the level block, then rows of the level block */
+		for (i = 0; i < lo; i++)
+			for (j = lo; j < 2 * lo; j++)
+				order[k++] = i * size + j;
+		for (i = lo; i < 2 * lo; i++)
+			for (j = 0; j < 2 * lo; j++)
+				order[k++] = i * size + j;
+	}
+	Assert(k == size * size);
+
+	levelOrders[log] = order;
+	return order;
+}
+
+/*
+ * Transform plain values into byte planes.
+ */
+static void
+encodePlanes(const float *values, int size, uint8 *planes)
+{
+	const uint32 *bits = (const uint32 *) values;
+	const uint16 *order = getLevelOrder(size);
+	uint32		prev = 0;
+	int			start = 0,
+				end = 1;
+
+	while (start < size * size)
+	{
+		int			count = end - start;
+		uint8	   *p0 = planes + 4 * start,
+				   *p1 = p0 + count,
+				   *p2 = p1 + count,
+				   *p3 = p2 + count;
+		int			k;
+
+		for (k = 0; k < count; k++)
+		{
+			uint32		value = bits[order[start + k]];
+			uint32		word = value ^ prev;
+
+			p0[k] = (uint8) (word >> 24);
+			p1[k] = (uint8) (word >> 16);
+			p2[k] = (uint8) (word >> 8);
+			p3[k] = (uint8) word;
+			prev = value;
+		}
+		start = end;
+		end *= 4;
+	}
+}
+
+/*
+ * Inverse of encodePlanes().  This is on the hot path of reranking, so
+ * values are written straight to their places in pattern.
+ */
+static void
+decodePlanes(const uint8 *planes, int size, float *values)
+{
+	uint32	   *bits = (uint32 *) values;
+	const uint16 *order = getLevelOrder(size);
+	uint32		prev = 0;
+	int			start = 0,
+				end = 1;
+
+	while (start < size * size)
+	{
+		int			count = end - start;
+		const uint8 *p0 = planes + 4 * start,
+				   *p1 = p0 + count,
+				   *p2 = p1 + count,
+				   *p3 = p2 + count;
+		const uint16 *o = order + start;
+		int			k;
+
+		for (k = 0; k < count; k++)
+		{
+			prev ^= ((uint32) p0[k] << 24) | ((uint32) p1[k] << 16) |
+				((uint32) p2[k] << 8) | (uint32) p3[k];
+			bits[o[k]] = prev;
+		}
+		start = end;
+		end *= 4;
+	}
+}
+
+/*
+ * Get size of compressed pattern from its header.
+ */
+int
+compressedPatternGetSize(Pattern *pattern)
+{
+	Size		len = VARSIZE_ANY_EXHDR(pattern);
+	const uint8 *header = (const uint8 *) VARDATA_ANY(pattern);
+
+	if (len <= CODEC_HEADER_SIZE ||
+		header[0] < sizeLog2(PATTERN_MIN_SIZE) ||
+		header[0] > sizeLog2(PATTERN_MAX_SIZE))
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("invalid compressed pattern")));
+	return 1 << header[0];
+}
+
+/*
+ * Decompress values of compressed pattern into given buffer.
+ */
+static void
+decompressValues(Pattern *pattern, int size, float *values)
+{
+	const uint8 *header = (const uint8 *) VARDATA_ANY(pattern);
+	int32		rawlen = PATTERN_BYTES(size),
+				len = VARSIZE_ANY_EXHDR(pattern) - CODEC_HEADER_SIZE;
+
+	if (header[1] & CODEC_FLAG_PADDED)
+		len--;
+
+	if (!planesBuffer)
+		planesBuffer = (uint8 *) MemoryContextAlloc(TopMemoryContext,
+													PATTERN_BYTES(PATTERN_MAX_SIZE));
+
+#if PG_VERSION_NUM >= 120000
+	if (pglz_decompress((const char *) header + CODEC_HEADER_SIZE, len,
+						(char *) planesBuffer, rawlen, true) != rawlen)
+#else
+	if (pglz_decompress((const char *) header + CODEC_HEADER_SIZE, len,
+						(char *) planesBuffer, rawlen) != rawlen)
+#endif
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("invalid compressed pattern")));
+
+	decodePlanes(planesBuffer, size, values);
+}
+
+/*
+ * Detoast pattern and decompress it if needed.
+ */
+Pattern *
+DatumGetPattern(Datum datum)
+{
+	Pattern    *pattern = (Pattern *) PG_DETOAST_DATUM_PACKED(datum);
+	Pattern    *result;
+	int			size;
+
+	/* Plain patterns are too long for short varlena header */
+	if (!PATTERN_IS_COMPRESSED(pattern))
+		return pattern;
+
+	size = compressedPatternGetSize(pattern);
+	result = (Pattern *) palloc(PATTERN_VARSIZE(size));
+	SET_VARSIZE(result, PATTERN_VARSIZE(size));
+	decompressValues(pattern, size, result->values);
+
+	if ((Pointer) pattern != DatumGetPointer(datum))
+		pfree(pattern);
+	return result;
+}
+
+/*
+ * Get values of detoasted pattern, which might be compressed.  Compressed
+ * pattern is decompressed into the buffer, which must fit the values, so
+ * that loops over many patterns don't allocate memory for each of them.
+ */
+const float *
+patternGetValues(Pattern *pattern, float *buffer)
+{
+	if (!PATTERN_IS_COMPRESSED(pattern))
+		return pattern->values;
+
+	decompressValues(pattern, compressedPatternGetSize(pattern), buffer);
+	return buffer;
+}
+
+/*
+ * Compress plain pattern.  Pattern is returned as is when compression
+ * doesn't save space.
+ */
+static Pattern *
+compressPattern(Pattern *pattern)
+{
+	int			size,
+				rawlen;
+	int32		len;
+	uint8	   *planes;
+	Pattern    *result;
+	uint8	   *header;
+
+	size = patternGetSize(pattern);
+	rawlen = PATTERN_BYTES(size);
+	planes = (uint8 *) palloc(rawlen);
+	encodePlanes(pattern->values, size, planes);
+
+	result = (Pattern *) palloc(VARHDRSZ + CODEC_HEADER_SIZE + 1 +
+								PGLZ_MAX_OUTPUT(rawlen));
+	header = (uint8 *) VARDATA(result);
+	len = pglz_compress((const char *) planes, rawlen,
+						(char *) header + CODEC_HEADER_SIZE,
+						PGLZ_strategy_always);
+	pfree(planes);
+
+	if (len < 0 || CODEC_HEADER_SIZE + len + 1 >= rawlen)
+	{
+		pfree(result);
+		return pattern;
+	}
+
+	header[0] = (uint8) sizeLog2(size);
+	header[1] = 0;
+	len += CODEC_HEADER_SIZE;
+	if ((len & 3) == 0)
+	{
+		header[1] |= CODEC_FLAG_PADDED;
+		header[len++] = 0;
+	}
+	SET_VARSIZE(result, VARHDRSZ + len);
+	return result;
+}
+
+/*
+ * Compress pattern made by imgsmlr function when imgsmlr.pattern_compression
+ * is on.
+ */
+Pattern *
+patternCompress(Pattern *pattern)
+{
+	if (!patternCompression || PATTERN_IS_COMPRESSED(pattern))
+		return pattern;
+	return compressPattern(pattern);
+}
+
+/*
+ * Compress pattern regardless of imgsmlr.pattern_compression, e.g. for
+ * conversion of already stored patterns.
+ */
+Datum
+pattern_compress(PG_FUNCTION_ARGS)
+{
+	Pattern    *pattern = (Pattern *) PG_GETARG_BYTEA_PP(0);
+
+	if (PATTERN_IS_COMPRESSED(pattern))
+		PG_RETURN_POINTER(pattern);
+
+	PG_RETURN_POINTER(compressPattern(DatumGetPattern(PointerGetDatum(pattern))));
+}
+
+Datum
+pattern_decompress(PG_FUNCTION_ARGS)
+{
+	PG_RETURN_POINTER(PG_GETARG_PATTERN(0));
+}
@@ -0,0 +1,1568 @@
+/*-------------------------------------------------------------------------
+ *
+ *          Image similarity extension
+ *
+ * Copyright (c) 2015, PostgreSQL Global Development Group
+ *
+ * This software is released under the PostgreSQL Licence.
+ *
+ * HNSW (hierarchical navigable small world) index access method for
+ * approximate nearest neighbour search.  Every indexed value is an element
+ * of multilayer proximity graph.  Element is stored as a single index tuple
+ * containing heap pointer, copy of the value and fixed number of neighbor
+ * slots for each layer it belongs to.  Neighbor lists are updated in place.
+ *
+ * Index works for any fixed-length by-reference type with opclass support
+ * function 1 being float4 distance between two values, which is the same
+ * as the ordering operator.  All the changes are WAL-logged using generic
+ * WAL records.
+ *
+ * Inserts are serialized by heavyweight lock on the metapage, searches
+ * only take short-term buffer locks.  VACUUM marks dead elements as deleted
+ * but keeps them in graph for navigation; REINDEX reclaims the space.
+ *
+ * IDENTIFICATION
+ *    imgsmlr/imgsmlr_hnsw.c
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+#include "fmgr.h"
+#include "imgsmlr.h"
+
+#if PG_VERSION_NUM >= 90600
+
+#include "access/amapi.h"
+#include "access/amvalidate.h"
+#include "access/generic_xlog.h"
+#include "access/htup_details.h"
+#include "access/reloptions.h"
+#include "access/relscan.h"
+#include "access/xloginsert.h"
+#include "catalog/index.h"
+#include "catalog/pg_amop.h"
+#include "catalog/pg_amproc.h"
+#include "catalog/pg_opclass.h"
+#include "catalog/pg_opfamily.h"
+#include "catalog/pg_type.h"
+#include "commands/vacuum.h"
+#include "lib/pairingheap.h"
+#include "miscadmin.h"
+#include "storage/bufmgr.h"
+#include "storage/lmgr.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
+#include "utils/selfuncs.h"
+#include "utils/syscache.h"
+#if PG_VERSION_NUM >= 110000
+#include "utils/regproc.h"
+#endif
+#if PG_VERSION_NUM >= 120000
+#include "access/tableam.h"
+#endif
+#if PG_VERSION_NUM >= 150000
+#include "common/pg_prng.h"
+#endif
+#include <math.h>
+
+#if PG_VERSION_NUM < 100000
+#define TupleDescAttr(tupdesc, i) ((tupdesc)->attrs[(i)])
+#endif
+
+#define HNSW_METAPAGE_BLKNO		0
+#define HNSW_MAGIC_NUMBER		0x484E5357
+#define HNSW_DEFAULT_M			16
+#define HNSW_DEFAULT_EF_CONSTRUCTION 64
+#define HNSW_MAX_LEVEL			15
+
+/* Ordering operator and support function of opclass */
+#define HNSW_DISTANCE_STRATEGY	1
+#define HNSW_DISTANCE_PROC		1
+
+/* Page flags */
+#define HNSW_META				(1 << 0)
+
+typedef struct HnswPageOpaqueData
+{
+	uint16		flags;
+	uint16		unused;
+} HnswPageOpaqueData;
+
+typedef HnswPageOpaqueData *HnswPageOpaque;
+
+#define HnswPageGetOpaque(page) ((HnswPageOpaque) PageGetSpecialPointer(page))
+
+typedef struct HnswMetaPageData
+{
+	uint32		magic;
+	uint16		m;
+	uint16		efConstruction;
+	uint16		valueSize;
+	int16		entryLevel;		/* -1 for empty index */
+	ItemPointerData entry;		/* entry point element */
+	BlockNumber insertPage;		/* page to append new elements to */
+} HnswMetaPageData;
+
+#define HnswPageGetMeta(page) ((HnswMetaPageData *) PageGetContents(page))
+
+/*
+ * Element tuple: value of valueSize bytes followed by neighbor slots.  Layer
+ * 0 has 2 * m slots, every upper layer has m slots.  Used slots go first,
+ * invalid item pointer marks the end of neighbor list.
+ */
+typedef struct HnswElementTupleData
+{
+	ItemPointerData heaptid;
+	uint8		level;
+	uint8		deleted;
+	char		data[FLEXIBLE_ARRAY_MEMBER];
+} HnswElementTupleData;
+
+typedef HnswElementTupleData *HnswElementTuple;
+
+#define HNSW_LEVEL_SLOTS(lc, m) ((lc) == 0 ? 2 * (m) : (m))
+#define HNSW_SLOT_OFFSET(lc, m) ((lc) == 0 ? 0 : ((lc) + 1) * (m))
+#define HNSW_TOTAL_SLOTS(level, m) (((level) + 2) * (m))
+#define HNSW_TUPLE_SIZE(valueSize, level, m) \
+	(offsetof(HnswElementTupleData, data) + (valueSize) + \
+	 HNSW_TOTAL_SLOTS(level, m) * sizeof(ItemPointerData))
+#define HNSW_MAX_TUPLE_SIZE \
+	(BLCKSZ - MAXALIGN(SizeOfPageHeaderData + sizeof(ItemIdData)) - \
+	 MAXALIGN(sizeof(HnswPageOpaqueData)))
+
+typedef struct HnswOptions
+{
+	int32		vl_len_;		/* varlena header (do not touch directly!) */
+	int			m;
+	int			efConstruction;
+} HnswOptions;
+
+/* In-memory copy of element */
+typedef struct HnswElement
+{
+	ItemPointerData tid;		/* location of element in the index */
+	ItemPointerData heaptid;
+	int			level;
+	bool		deleted;
+	Datum		value;
+	ItemPointerData *neighbors;
+} HnswElement;
+
+/* Element together with its distance to the query */
+typedef struct HnswCandidate
+{
+	pairingheap_node nearestNode;	/* node in queue of candidates */
+	pairingheap_node furthestNode;	/* node in queue of results */
+	HnswElement *element;
+	double		distance;
+} HnswCandidate;
+
+/* Entry of hash of elements already loaded by current search */
+typedef struct HnswCacheEntry
+{
+	ItemPointerData tid;		/* hash key */
+	int			visitedLevel;
+	HnswCandidate *candidate;
+} HnswCacheEntry;
+
+typedef struct HnswState
+{
+	Relation	index;
+	FmgrInfo   *procinfo;
+	Oid			collation;
+	int			m;
+	int			efConstruction;
+	int			valueSize;
+} HnswState;
+
+typedef struct HnswResult
+{
+	ItemPointerData heaptid;
+	double		distance;
+} HnswResult;
+
+typedef struct HnswScanOpaqueData
+{
+	MemoryContext scanCtx;
+	bool		searched;
+	int			ef;				/* size of candidates list of last search */
+	bool		exhausted;		/* last search reached all the elements */
+	HTAB	   *returned;		/* heap TIDs returned so far */
+	int			nresults;
+	int			current;
+	HnswResult *results;
+} HnswScanOpaqueData;
+
+typedef HnswScanOpaqueData *HnswScanOpaque;
+
+typedef struct HnswBuildState
+{
+	HnswState	state;
+	MemoryContext tmpCtx;
+	double		indtuples;
+} HnswBuildState;
+
+static relopt_kind hnsw_relopt_kind;
+static int	hnsw_ef_search = 40;
+
+PG_FUNCTION_INFO_V1(hnsw_handler);
+Datum		hnsw_handler(PG_FUNCTION_ARGS);
+
+static void hnswInitState(HnswState *state, Relation index);
+static void hnswInitPage(Page page, uint16 flags);
+static void hnswFillMetapage(Relation index, Page page);
+static Buffer hnswNewBuffer(Relation index, ForkNumber forknum);
+static int	hnswRandomLevel(int m);
+static double hnswDistance(HnswState *state, Datum a, Datum b);
+static HnswElement *hnswLoadElement(HnswState *state, ItemPointer tid);
+static HTAB *hnswCreateCache(void);
+static HnswCandidate *hnswGetCandidate(HnswState *state, HTAB *cache,
+									   Datum query, ItemPointer tid);
+static HnswElement *hnswGetElement(HnswState *state, HTAB *cache,
+								   ItemPointer tid);
+static HnswCandidate **hnswSearchLayer(HnswState *state, HTAB *cache,
+									   Datum query, HnswCandidate **entries,
+									   int nentries, int ef, int lc,
+									   int *nresults);
+static int	hnswSelectNeighbors(HnswState *state, HnswCandidate **candidates,
+								int ncandidates, int mmax,
+								HnswCandidate **result);
+static void hnswWriteElement(HnswState *state, ItemPointer heaptid, int level,
+							 Datum value, ItemPointerData *slots,
+							 bool newEntry, ItemPointer result);
+static void hnswAddBacklink(HnswState *state, HTAB *cache,
+							HnswElement *element, ItemPointer newtid,
+							double distance, int lc);
+static void hnswInsertElement(HnswState *state, Datum value,
+							  ItemPointer heaptid);
+
+static IndexBuildResult *hnswbuild(Relation heap, Relation index,
+								   IndexInfo *indexInfo);
+static void hnswbuildempty(Relation index);
+static bool hnswinsert(Relation index, Datum *values, bool *isnull,
+					   ItemPointer ht_ctid, Relation heapRel,
+					   IndexUniqueCheck checkUnique
+#if PG_VERSION_NUM >= 140000
+					   ,bool indexUnchanged
+#endif
+#if PG_VERSION_NUM >= 100000
+					   ,IndexInfo *indexInfo
+#endif
+);
+static IndexBulkDeleteResult *hnswbulkdelete(IndexVacuumInfo *info,
+											 IndexBulkDeleteResult *stats,
+											 IndexBulkDeleteCallback callback,
+											 void *callback_state);
+static IndexBulkDeleteResult *hnswvacuumcleanup(IndexVacuumInfo *info,
+												IndexBulkDeleteResult *stats);
+static void hnswcostestimate(PlannerInfo *root, IndexPath *path,
+							 double loop_count, Cost *indexStartupCost,
+							 Cost *indexTotalCost,
+							 Selectivity *indexSelectivity,
+							 double *indexCorrelation
+#if PG_VERSION_NUM >= 100000
+							 ,double *indexPages
+#endif
+);
+static bytea *hnswoptions(Datum reloptions, bool validate);
+static bool hnswvalidate(Oid opclassoid);
+static IndexScanDesc hnswbeginscan(Relation index, int nkeys, int norderbys);
+static void hnswrescan(IndexScanDesc scan, ScanKey keys, int nkeys,
+					   ScanKey orderbys, int norderbys);
+static bool hnswgettuple(IndexScanDesc scan, ScanDirection dir);
+static void hnswendscan(IndexScanDesc scan);
+
+/*
+ * Register relation options and GUC.
+ */
+void
+hnswInit(void)
+{
+	hnsw_relopt_kind = add_reloption_kind();
+	add_int_reloption(hnsw_relopt_kind, "m",
+					  "Maximum number of neighbors per element on upper layers",
+					  HNSW_DEFAULT_M, 2, 32
+#if PG_VERSION_NUM >= 130000
+					  ,AccessExclusiveLock
+#endif
+		);
+	add_int_reloption(hnsw_relopt_kind, "ef_construction",
+					  "Size of candidates list used during index build",
+					  HNSW_DEFAULT_EF_CONSTRUCTION, 4, 1000
+#if PG_VERSION_NUM >= 130000
+					  ,AccessExclusiveLock
+#endif
+		);
+
+	DefineCustomIntVariable("imgsmlr.hnsw_ef_search",
+							"Size of candidates list used during HNSW index search.",
+							"Scan repeats the search with larger list when it runs out of rows.",
+							&hnsw_ef_search,
+							40, 1, 1000,
+							PGC_USERSET,
+							0,
+							NULL, NULL, NULL);
+}
+
+Datum
+hnsw_handler(PG_FUNCTION_ARGS)
+{
+	IndexAmRoutine *amroutine = makeNode(IndexAmRoutine);
+
+	amroutine->amstrategies = HNSW_DISTANCE_STRATEGY;
+	amroutine->amsupport = HNSW_DISTANCE_PROC;
+	amroutine->amcanorder = false;
+	amroutine->amcanorderbyop = true;
+	amroutine->amcanbackward = false;
+	amroutine->amcanunique = false;
+	amroutine->amcanmulticol = false;
+	amroutine->amoptionalkey = true;
+	amroutine->amsearcharray = false;
+	amroutine->amsearchnulls = false;
+	amroutine->amstorage = false;
+	amroutine->amclusterable = false;
+	amroutine->ampredlocks = false;
+	amroutine->amkeytype = InvalidOid;
+
+	amroutine->ambuild = hnswbuild;
+	amroutine->ambuildempty = hnswbuildempty;
+	amroutine->aminsert = hnswinsert;
+	amroutine->ambulkdelete = hnswbulkdelete;
+	amroutine->amvacuumcleanup = hnswvacuumcleanup;
+	amroutine->amcanreturn = NULL;
+	amroutine->amcostestimate = hnswcostestimate;
+	amroutine->amoptions = hnswoptions;
+	amroutine->amvalidate = hnswvalidate;
+	amroutine->ambeginscan = hnswbeginscan;
+	amroutine->amrescan = hnswrescan;
+	amroutine->amgettuple = hnswgettuple;
+	amroutine->amgetbitmap = NULL;
+	amroutine->amendscan = hnswendscan;
+	amroutine->ammarkpos = NULL;
+	amroutine->amrestrpos = NULL;
+
+	PG_RETURN_POINTER(amroutine);
+}
+
+/*
+ * Fill state from the index metapage.
+ */
+static void
+hnswInitState(HnswState *state, Relation index)
+{
+	Buffer		buf;
+	HnswMetaPageData *meta;
+
+	state->index = index;
+	state->procinfo = index_getprocinfo(index, 1, HNSW_DISTANCE_PROC);
+	state->collation = index->rd_indcollation[0];
+
+	buf = ReadBuffer(index, HNSW_METAPAGE_BLKNO);
+	LockBuffer(buf, BUFFER_LOCK_SHARE);
+	meta = HnswPageGetMeta(BufferGetPage(buf));
+	if (meta->magic != HNSW_MAGIC_NUMBER)
+		elog(ERROR, "index \"%s\" is not an hnsw index",
+			 RelationGetRelationName(index));
+	state->m = meta->m;
+	state->efConstruction = meta->efConstruction;
+	state->valueSize = meta->valueSize;
+	UnlockReleaseBuffer(buf);
+}
+
+static void
+hnswInitPage(Page page, uint16 flags)
+{
+	PageInit(page, BLCKSZ, sizeof(HnswPageOpaqueData));
+	HnswPageGetOpaque(page)->flags = flags;
+}
+
+static void
+hnswFillMetapage(Relation index, Page page)
+{
+	HnswOptions *opts = (HnswOptions *) index->rd_options;
+	Form_pg_attribute attr = TupleDescAttr(RelationGetDescr(index), 0);
+	HnswMetaPageData *meta;
+
+	if (attr->attlen <= 0 || attr->attbyval)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("hnsw index supports only fixed-length by-reference types")));
+
+	hnswInitPage(page, HNSW_META);
+	meta = HnswPageGetMeta(page);
+	memset(meta, 0, sizeof(HnswMetaPageData));
+	meta->magic = HNSW_MAGIC_NUMBER;
+	meta->m = opts ? opts->m : HNSW_DEFAULT_M;
+	meta->efConstruction = opts ? opts->efConstruction : HNSW_DEFAULT_EF_CONSTRUCTION;
+	meta->valueSize = attr->attlen;
+	meta->entryLevel = -1;
+	ItemPointerSetInvalid(&meta->entry);
+	meta->insertPage = InvalidBlockNumber;
+
+	if (HNSW_TUPLE_SIZE(meta->valueSize, HNSW_MAX_LEVEL, meta->m) > HNSW_MAX_TUPLE_SIZE)
+		ereport(ERROR,
+				(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+				 errmsg("hnsw element size exceeds page size"),
+				 errhint("Decrease \"m\" parameter.")));
+
+	((PageHeader) page)->pd_lower =
+		((char *) meta + sizeof(HnswMetaPageData)) - (char *) page;
+}
+
+/*
+ * Add new page to the given fork of the index.  Returns exclusively locked
+ * buffer.
+ */
+static Buffer
+hnswNewBuffer(Relation index, ForkNumber forknum)
+{
+	Buffer		buf;
+
+#if PG_VERSION_NUM >= 160000
+	buf = ExtendBufferedRel(BMR_REL(index), forknum, NULL, EB_LOCK_FIRST);
+#else
+	bool		needLock = !RELATION_IS_LOCAL(index);
+
+	if (needLock)
+		LockRelationForExtension(index, ExclusiveLock);
+	buf = ReadBufferExtended(index, forknum, P_NEW, RBM_NORMAL, NULL);
+	LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+	if (needLock)
+		UnlockRelationForExtension(index, ExclusiveLock);
+#endif
+
+	return buf;
+}
+
+/*
+ * Level of new element has exponentially decaying distribution with
+ * normalization factor 1 / ln(m).
+ */
+static int
+hnswRandomLevel(int m)
+{
+	double		r;
+	int			level;
+
+#if PG_VERSION_NUM >= 150000
+	r = pg_prng_double(&pg_global_prng_state);
+#else
+	r = (double) random() / ((double) MAX_RANDOM_VALUE + 1.0);
+#endif
+	level = (int) floor(-log(1.0 - r) / log((double) m));
+
+	return Min(level, HNSW_MAX_LEVEL);
+}
+
+static double
+hnswDistance(HnswState *state, Datum a, Datum b)
+{
+	return DatumGetFloat4(FunctionCall2Coll(state->procinfo,
+											state->collation, a, b));
+}
+
+static HnswElement *
+hnswLoadElement(HnswState *state, ItemPointer tid)
+{
+	HnswElement *element = (HnswElement *) palloc(sizeof(HnswElement));
+	HnswElementTuple etup;
+	Buffer		buf;
+	Page		page;
+	int			nslots;
+	char	   *value;
+
+	buf = ReadBuffer(state->index, ItemPointerGetBlockNumber(tid));
+	LockBuffer(buf, BUFFER_LOCK_SHARE);
+	page = BufferGetPage(buf);
+	etup = (HnswElementTuple) PageGetItem(page,
+				PageGetItemId(page, ItemPointerGetOffsetNumber(tid)));
+
+	element->tid = *tid;
+	element->heaptid = etup->heaptid;
+	element->level = etup->level;
+	element->deleted = (etup->deleted != 0);
+
+	value = (char *) palloc(state->valueSize);
+	memcpy(value, etup->data, state->valueSize);
+	element->value = PointerGetDatum(value);
+
+	nslots = HNSW_TOTAL_SLOTS(element->level, state->m);
+	element->neighbors = (ItemPointerData *) palloc(sizeof(ItemPointerData) * nslots);
+	memcpy(element->neighbors, etup->data + state->valueSize,
+		   sizeof(ItemPointerData) * nslots);
+
+	UnlockReleaseBuffer(buf);
+
+	return element;
+}
+
+static HTAB *
+hnswCreateCache(void)
+{
+	HASHCTL		ctl;
+
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(ItemPointerData);
+	ctl.entrysize = sizeof(HnswCacheEntry);
+	ctl.hcxt = CurrentMemoryContext;
+
+	return hash_create("hnsw elements", 256, &ctl,
+					   HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+}
+
+/*
+ * Get element with its distance to the query, loading it if needed.
+ */
+static HnswCandidate *
+hnswGetCandidate(HnswState *state, HTAB *cache, Datum query, ItemPointer tid)
+{
+	HnswCacheEntry *entry;
+	bool		found;
+
+	entry = (HnswCacheEntry *) hash_search(cache, tid, HASH_ENTER, &found);
+	if (!found)
+	{
+		HnswCandidate *candidate = (HnswCandidate *) palloc(sizeof(HnswCandidate));
+
+		candidate->element = hnswLoadElement(state, tid);
+		candidate->distance = hnswDistance(state, query,
+										   candidate->element->value);
+		entry->candidate = candidate;
+		entry->visitedLevel = -1;
+	}
+	return entry->candidate;
+}
+
+/*
+ * Get element without computing its distance to the query.  Elements already
+ * loaded by the search are taken from the cache, others are loaded but not
+ * cached, since they have no distance to the query.
+ */
+static HnswElement *
+hnswGetElement(HnswState *state, HTAB *cache, ItemPointer tid)
+{
+	HnswCacheEntry *entry;
+
+	entry = (HnswCacheEntry *) hash_search(cache, tid, HASH_FIND, NULL);
+	if (entry)
+		return entry->candidate->element;
+	return hnswLoadElement(state, tid);
+}
+
+static int
+hnswCompareNearest(const pairingheap_node *a, const pairingheap_node *b,
+				   void *arg)
+{
+	const HnswCandidate *ca = pairingheap_const_container(HnswCandidate, nearestNode, a);
+	const HnswCandidate *cb = pairingheap_const_container(HnswCandidate, nearestNode, b);
+
+	if (ca->distance < cb->distance)
+		return 1;
+	if (ca->distance > cb->distance)
+		return -1;
+	return 0;
+}
+
+static int
+hnswCompareFurthest(const pairingheap_node *a, const pairingheap_node *b,
+					void *arg)
+{
+	const HnswCandidate *ca = pairingheap_const_container(HnswCandidate, furthestNode, a);
+	const HnswCandidate *cb = pairingheap_const_container(HnswCandidate, furthestNode, b);
+
+	if (ca->distance > cb->distance)
+		return 1;
+	if (ca->distance < cb->distance)
+		return -1;
+	return 0;
+}
+
+static void
+hnswMarkVisited(HTAB *cache, HnswCandidate *candidate, int lc)
+{
+	HnswCacheEntry *entry;
+
+	entry = (HnswCacheEntry *) hash_search(cache, &candidate->element->tid,
+										   HASH_FIND, NULL);
+	Assert(entry);
+	entry->visitedLevel = lc;
+}
+
+/*
+ * Greedy search of ef nearest elements on layer lc starting from entry
+ * points.  Returns found elements in ascending order of distance.
+ */
+static HnswCandidate **
+hnswSearchLayer(HnswState *state, HTAB *cache, Datum query,
+				HnswCandidate **entries, int nentries, int ef, int lc,
+				int *nresults)
+{
+	pairingheap *nearest = pairingheap_allocate(hnswCompareNearest, NULL);
+	pairingheap *furthest = pairingheap_allocate(hnswCompareFurthest, NULL);
+	HnswCandidate **result;
+	int			count = 0;
+	int			i;
+
+	for (i = 0; i < nentries; i++)
+	{
+		hnswMarkVisited(cache, entries[i], lc);
+		pairingheap_add(nearest, &entries[i]->nearestNode);
+		pairingheap_add(furthest, &entries[i]->furthestNode);
+		count++;
+	}
+	while (count > ef)
+	{
+		pairingheap_remove_first(furthest);
+		count--;
+	}
+
+	while (!pairingheap_is_empty(nearest))
+	{
+		HnswCandidate *c = pairingheap_container(HnswCandidate, nearestNode,
+												 pairingheap_remove_first(nearest));
+		HnswCandidate *f = pairingheap_container(HnswCandidate, furthestNode,
+												 pairingheap_first(furthest));
+		ItemPointerData *neighbors;
+
+		if (c->distance > f->distance)
+			break;
+		if (c->element->level < lc)
+			continue;
+
+		CHECK_FOR_INTERRUPTS();
+
+		neighbors = c->element->neighbors + HNSW_SLOT_OFFSET(lc, state->m);
+		for (i = 0; i < HNSW_LEVEL_SLOTS(lc, state->m); i++)
+		{
+			HnswCacheEntry *entry;
+			HnswCandidate *e;
+
+			if (!ItemPointerIsValid(&neighbors[i]))
+				break;
+
+			entry = (HnswCacheEntry *) hash_search(cache, &neighbors[i],
+												   HASH_FIND, NULL);
+			if (entry && entry->visitedLevel == lc)
+				continue;
+
+			e = hnswGetCandidate(state, cache, query, &neighbors[i]);
+			hnswMarkVisited(cache, e, lc);
+
+			f = pairingheap_container(HnswCandidate, furthestNode,
+									  pairingheap_first(furthest));
+			if (count < ef || e->distance < f->distance)
+			{
+				pairingheap_add(nearest, &e->nearestNode);
+				pairingheap_add(furthest, &e->furthestNode);
+				count++;
+				if (count > ef)
+				{
+					pairingheap_remove_first(furthest);
+					count--;
+				}
+			}
+		}
+	}
+
+	result = (HnswCandidate **) palloc(sizeof(HnswCandidate *) * count);
+	for (i = count - 1; i >= 0; i--)
+		result[i] = pairingheap_container(HnswCandidate, furthestNode,
+										  pairingheap_remove_first(furthest));
+	*nresults = count;
+
+	pairingheap_free(nearest);
+	pairingheap_free(furthest);
+
+	return result;
+}
+
+/*
+ * Select up to mmax neighbors from candidates sorted by distance.  Candidate
+ * is preferred when it's closer to the new element than to any of already
+ * selected neighbors, which keeps graph connected across clusters.  The rest
+ * of slots are filled with closest of pruned candidates.
+ */
+static int
+hnswSelectNeighbors(HnswState *state, HnswCandidate **candidates,
+					int ncandidates, int mmax, HnswCandidate **result)
+{
+	bool	   *pruned = (bool *) palloc0(sizeof(bool) * ncandidates);
+	int			nresult = 0;
+	int			i,
+				j;
+
+	for (i = 0; i < ncandidates && nresult < mmax; i++)
+	{
+		HnswCandidate *e = candidates[i];
+		bool		good = true;
+
+		for (j = 0; j < nresult; j++)
+		{
+			if (hnswDistance(state, e->element->value,
+							 result[j]->element->value) < e->distance)
+			{
+				good = false;
+				break;
+			}
+		}
+		if (good)
+			result[nresult++] = e;
+		else
+			pruned[i] = true;
+	}
+
+	for (i = 0; i < ncandidates && nresult < mmax; i++)
+	{
+		if (pruned[i])
+			result[nresult++] = candidates[i];
+	}
+
+	pfree(pruned);
+	return nresult;
+}
+
+/*
+ * Append new element tuple to the index.  When newEntry is set, element
+ * becomes the new entry point.
+ */
+static void
+hnswWriteElement(HnswState *state, ItemPointer heaptid, int level,
+				 Datum value, ItemPointerData *slots, bool newEntry,
+				 ItemPointer result)
+{
+	Relation	index = state->index;
+	Size		size = HNSW_TUPLE_SIZE(state->valueSize, level, state->m);
+	HnswElementTuple etup = (HnswElementTuple) palloc0(size);
+	GenericXLogState *xlogState;
+	Buffer		metaBuffer,
+				buffer = InvalidBuffer;
+	Page		metaPage,
+				page;
+	HnswMetaPageData *meta;
+	OffsetNumber offnum;
+
+	etup->heaptid = *heaptid;
+	etup->level = level;
+	etup->deleted = 0;
+	memcpy(etup->data, DatumGetPointer(value), state->valueSize);
+	memcpy(etup->data + state->valueSize, slots,
+		   HNSW_TOTAL_SLOTS(level, state->m) * sizeof(ItemPointerData));
+
+	metaBuffer = ReadBuffer(index, HNSW_METAPAGE_BLKNO);
+	LockBuffer(metaBuffer, BUFFER_LOCK_EXCLUSIVE);
+	meta = HnswPageGetMeta(BufferGetPage(metaBuffer));
+
+	if (meta->insertPage != InvalidBlockNumber)
+	{
+		buffer = ReadBuffer(index, meta->insertPage);
+		LockBuffer(buffer, BUFFER_LOCK_EXCLUSIVE);
+		if (PageGetFreeSpace(BufferGetPage(buffer)) < MAXALIGN(size))
+		{
+			UnlockReleaseBuffer(buffer);
+			buffer = InvalidBuffer;
+		}
+	}
+
+	xlogState = GenericXLogStart(index);
+	metaPage = GenericXLogRegisterBuffer(xlogState, metaBuffer, 0);
+	meta = HnswPageGetMeta(metaPage);
+	if (BufferIsValid(buffer))
+	{
+		page = GenericXLogRegisterBuffer(xlogState, buffer, 0);
+	}
+	else
+	{
+		buffer = hnswNewBuffer(index, MAIN_FORKNUM);
+		page = GenericXLogRegisterBuffer(xlogState, buffer,
+										 GENERIC_XLOG_FULL_IMAGE);
+		hnswInitPage(page, 0);
+		meta->insertPage = BufferGetBlockNumber(buffer);
+	}
+
+	offnum = PageAddItem(page, (Item) etup, size, InvalidOffsetNumber,
+						 false, false);
+	if (offnum == InvalidOffsetNumber)
+		elog(ERROR, "failed to add element to index \"%s\"",
+			 RelationGetRelationName(index));
+	ItemPointerSet(result, BufferGetBlockNumber(buffer), offnum);
+
+	if (newEntry)
+	{
+		meta->entry = *result;
+		meta->entryLevel = level;
+	}
+
+	GenericXLogFinish(xlogState);
+	UnlockReleaseBuffer(buffer);
+	UnlockReleaseBuffer(metaBuffer);
+	pfree(etup);
+}
+
+/*
+ * Add link to the new element into neighbor list of existing element on
+ * layer lc.  If the list is full, the farthest neighbor is replaced, unless
+ * the new element is farther than all of them.
+ */
+static void
+hnswAddBacklink(HnswState *state, HTAB *cache, HnswElement *element,
+				ItemPointer newtid, double distance, int lc)
+{
+	ItemPointerData *slots = element->neighbors + HNSW_SLOT_OFFSET(lc, state->m);
+	int			nslots = HNSW_LEVEL_SLOTS(lc, state->m);
+	int			target = -1;
+	int			i;
+	GenericXLogState *xlogState;
+	Buffer		buffer;
+	Page		page;
+	HnswElementTuple etup;
+
+	for (i = 0; i < nslots; i++)
+	{
+		if (!ItemPointerIsValid(&slots[i]))
+		{
+			target = i;
+			break;
+		}
+	}
+
+	if (target < 0)
+	{
+		double		maxDistance = distance;
+
+		for (i = 0; i < nslots; i++)
+		{
+			HnswElement *neighbor = hnswGetElement(state, cache, &slots[i]);
+			double		d = hnswDistance(state, element->value,
+										 neighbor->value);
+
+			if (d > maxDistance)
+			{
+				maxDistance = d;
+				target = i;
+			}
+		}
+		if (target < 0)
+			return;
+	}
+
+	slots[target] = *newtid;
+
+	buffer = ReadBuffer(state->index, ItemPointerGetBlockNumber(&element->tid));
+	LockBuffer(buffer, BUFFER_LOCK_EXCLUSIVE);
+	xlogState = GenericXLogStart(state->index);
+	page = GenericXLogRegisterBuffer(xlogState, buffer, 0);
+	etup = (HnswElementTuple) PageGetItem(page,
+				PageGetItemId(page, ItemPointerGetOffsetNumber(&element->tid)));
+	memcpy(etup->data + state->valueSize +
+		   (HNSW_SLOT_OFFSET(lc, state->m) + target) * sizeof(ItemPointerData),
+		   newtid, sizeof(ItemPointerData));
+	GenericXLogFinish(xlogState);
+	UnlockReleaseBuffer(buffer);
+}
+
+/*
+ * Insert new element into the graph.
+ */
+static void
+hnswInsertElement(HnswState *state, Datum value, ItemPointer heaptid)
+{
+	Relation	index = state->index;
+	int			m = state->m;
+	int			level = hnswRandomLevel(m);
+	int			entryLevel;
+	ItemPointerData entryTid;
+	ItemPointerData *slots;
+	ItemPointerData newtid;
+	HnswCandidate **selected[HNSW_MAX_LEVEL + 1];
+	int			nselected[HNSW_MAX_LEVEL + 1];
+	HTAB	   *cache = NULL;
+	Buffer		metaBuffer;
+	HnswMetaPageData *meta;
+	int			lc,
+				i;
+
+	/* Serialize inserts */
+	LockPage(index, HNSW_METAPAGE_BLKNO, ExclusiveLock);
+
+	metaBuffer = ReadBuffer(index, HNSW_METAPAGE_BLKNO);
+	LockBuffer(metaBuffer, BUFFER_LOCK_SHARE);
+	meta = HnswPageGetMeta(BufferGetPage(metaBuffer));
+	entryLevel = meta->entryLevel;
+	entryTid = meta->entry;
+	UnlockReleaseBuffer(metaBuffer);
+
+	slots = (ItemPointerData *) palloc(sizeof(ItemPointerData) *
+									   HNSW_TOTAL_SLOTS(level, m));
+	for (i = 0; i < HNSW_TOTAL_SLOTS(level, m); i++)
+		ItemPointerSetInvalid(&slots[i]);
+	memset(nselected, 0, sizeof(nselected));
+
+	if (entryLevel >= 0)
+	{
+		HnswCandidate **entries;
+		int			nentries = 1;
+
+		cache = hnswCreateCache();
+		entries = (HnswCandidate **) palloc(sizeof(HnswCandidate *));
+		entries[0] = hnswGetCandidate(state, cache, value, &entryTid);
+
+		for (lc = entryLevel; lc > level; lc--)
+			entries = hnswSearchLayer(state, cache, value, entries, nentries,
+									  1, lc, &nentries);
+
+		for (lc = Min(level, entryLevel); lc >= 0; lc--)
+		{
+			int			mmax = HNSW_LEVEL_SLOTS(lc, m);
+
+			entries = hnswSearchLayer(state, cache, value, entries, nentries,
+									  state->efConstruction, lc, &nentries);
+			selected[lc] = (HnswCandidate **) palloc(sizeof(HnswCandidate *) * mmax);
+			nselected[lc] = hnswSelectNeighbors(state, entries, nentries,
+												mmax, selected[lc]);
+			for (i = 0; i < nselected[lc]; i++)
+				slots[HNSW_SLOT_OFFSET(lc, m) + i] = selected[lc][i]->element->tid;
+		}
+	}
+
+	hnswWriteElement(state, heaptid, level, value, slots,
+					 level > entryLevel, &newtid);
+
+	for (lc = Min(level, entryLevel); lc >= 0; lc--)
+	{
+		for (i = 0; i < nselected[lc]; i++)
+			hnswAddBacklink(state, cache, selected[lc][i]->element,
+							&newtid, selected[lc][i]->distance, lc);
+	}
+
+	UnlockPage(index, HNSW_METAPAGE_BLKNO, ExclusiveLock);
+}
+
+static void
+#if PG_VERSION_NUM >= 130000
+hnswBuildCallback(Relation index, ItemPointer tid, Datum *values,
+				  bool *isnull, bool tupleIsAlive, void *state)
+#else
+hnswBuildCallback(Relation index, HeapTuple htup, Datum *values,
+				  bool *isnull, bool tupleIsAlive, void *state)
+#endif
+{
+	HnswBuildState *buildstate = (HnswBuildState *) state;
+	MemoryContext oldCtx;
+#if PG_VERSION_NUM < 130000
+	ItemPointer tid = &htup->t_self;
+#endif
+
+	if (isnull[0])
+		return;
+
+	oldCtx = MemoryContextSwitchTo(buildstate->tmpCtx);
+	hnswInsertElement(&buildstate->state, values[0], tid);
+	MemoryContextSwitchTo(oldCtx);
+	MemoryContextReset(buildstate->tmpCtx);
+
+	buildstate->indtuples += 1;
+}
+
+static IndexBuildResult *
+hnswbuild(Relation heap, Relation index, IndexInfo *indexInfo)
+{
+	IndexBuildResult *result;
+	HnswBuildState buildstate;
+	GenericXLogState *xlogState;
+	Buffer		metaBuffer;
+	double		reltuples;
+
+	if (RelationGetNumberOfBlocks(index) != 0)
+		elog(ERROR, "index \"%s\" already contains data",
+			 RelationGetRelationName(index));
+
+	metaBuffer = hnswNewBuffer(index, MAIN_FORKNUM);
+	Assert(BufferGetBlockNumber(metaBuffer) == HNSW_METAPAGE_BLKNO);
+	xlogState = GenericXLogStart(index);
+	hnswFillMetapage(index, GenericXLogRegisterBuffer(xlogState, metaBuffer,
+													  GENERIC_XLOG_FULL_IMAGE));
+	GenericXLogFinish(xlogState);
+	UnlockReleaseBuffer(metaBuffer);
+
+	memset(&buildstate, 0, sizeof(buildstate));
+	hnswInitState(&buildstate.state, index);
+	buildstate.tmpCtx = AllocSetContextCreate(CurrentMemoryContext,
+											  "hnsw build temporary context",
+											  ALLOCSET_DEFAULT_SIZES);
+
+#if PG_VERSION_NUM >= 120000
+	reltuples = table_index_build_scan(heap, index, indexInfo, true, true,
+									   hnswBuildCallback, (void *) &buildstate,
+									   NULL);
+#else
+	reltuples = IndexBuildHeapScan(heap, index, indexInfo, true,
+								   hnswBuildCallback, (void *) &buildstate);
+#endif
+
+	MemoryContextDelete(buildstate.tmpCtx);
+
+	result = (IndexBuildResult *) palloc(sizeof(IndexBuildResult));
+	result->heap_tuples = reltuples;
+	result->index_tuples = buildstate.indtuples;
+
+	return result;
+}
+
+static void
+hnswbuildempty(Relation index)
+{
+	Buffer		metaBuffer;
+
+	metaBuffer = hnswNewBuffer(index, INIT_FORKNUM);
+	START_CRIT_SECTION();
+	hnswFillMetapage(index, BufferGetPage(metaBuffer));
+	MarkBufferDirty(metaBuffer);
+	log_newpage_buffer(metaBuffer, true);
+	END_CRIT_SECTION();
+	UnlockReleaseBuffer(metaBuffer);
+}
+
+static bool
+hnswinsert(Relation index, Datum *values, bool *isnull,
+		   ItemPointer ht_ctid, Relation heapRel,
+		   IndexUniqueCheck checkUnique
+#if PG_VERSION_NUM >= 140000
+		   ,bool indexUnchanged
+#endif
+#if PG_VERSION_NUM >= 100000
+		   ,IndexInfo *indexInfo
+#endif
+)
+{
+	HnswState	state;
+	MemoryContext insertCtx,
+				oldCtx;
+
+	if (isnull[0])
+		return false;
+
+	insertCtx = AllocSetContextCreate(CurrentMemoryContext,
+									  "hnsw insert temporary context",
+									  ALLOCSET_DEFAULT_SIZES);
+	oldCtx = MemoryContextSwitchTo(insertCtx);
+
+	hnswInitState(&state, index);
+	hnswInsertElement(&state, values[0], ht_ctid);
+
+	MemoryContextSwitchTo(oldCtx);
+	MemoryContextDelete(insertCtx);
+
+	return false;
+}
+
+/*
+ * Mark elements pointing to dead heap tuples as deleted.  They stay in the
+ * graph to keep it navigable, but are never returned by scans.
+ */
+static IndexBulkDeleteResult *
+hnswbulkdelete(IndexVacuumInfo *info, IndexBulkDeleteResult *stats,
+			   IndexBulkDeleteCallback callback, void *callback_state)
+{
+	Relation	index = info->index;
+	BlockNumber blkno,
+				npages;
+
+	if (stats == NULL)
+		stats = (IndexBulkDeleteResult *) palloc0(sizeof(IndexBulkDeleteResult));
+
+	npages = RelationGetNumberOfBlocks(index);
+	for (blkno = HNSW_METAPAGE_BLKNO + 1; blkno < npages; blkno++)
+	{
+		Buffer		buffer;
+		Page		page;
+		GenericXLogState *xlogState = NULL;
+		OffsetNumber offnum,
+					maxoff;
+
+		vacuum_delay_point();
+
+		buffer = ReadBufferExtended(index, MAIN_FORKNUM, blkno,
+									RBM_NORMAL, info->strategy);
+		LockBuffer(buffer, BUFFER_LOCK_EXCLUSIVE);
+		page = BufferGetPage(buffer);
+		maxoff = PageGetMaxOffsetNumber(page);
+
+		for (offnum = FirstOffsetNumber; offnum <= maxoff; offnum = OffsetNumberNext(offnum))
+		{
+			HnswElementTuple etup = (HnswElementTuple)
+				PageGetItem(page, PageGetItemId(page, offnum));
+
+			if (etup->deleted)
+				continue;
+
+			if (callback(&etup->heaptid, callback_state))
+			{
+				if (xlogState == NULL)
+				{
+					xlogState = GenericXLogStart(index);
+					page = GenericXLogRegisterBuffer(xlogState, buffer, 0);
+					etup = (HnswElementTuple)
+						PageGetItem(page, PageGetItemId(page, offnum));
+				}
+				etup->deleted = 1;
+				stats->tuples_removed += 1;
+			}
+			else
+				stats->num_index_tuples += 1;
+		}
+
+		if (xlogState)
+			GenericXLogFinish(xlogState);
+		UnlockReleaseBuffer(buffer);
+	}
+
+	stats->num_pages = npages;
+
+	return stats;
+}
+
+static IndexBulkDeleteResult *
+hnswvacuumcleanup(IndexVacuumInfo *info, IndexBulkDeleteResult *stats)
+{
+	if (info->analyze_only)
+		return stats;
+
+	if (stats == NULL)
+	{
+		stats = (IndexBulkDeleteResult *) palloc0(sizeof(IndexBulkDeleteResult));
+		stats->num_index_tuples = info->num_heap_tuples;
+		stats->estimated_count = true;
+	}
+	stats->num_pages = RelationGetNumberOfBlocks(info->index);
+
+	return stats;
+}
+
+static void
+hnswcostestimate(PlannerInfo *root, IndexPath *path, double loop_count,
+				 Cost *indexStartupCost, Cost *indexTotalCost,
+				 Selectivity *indexSelectivity, double *indexCorrelation
+#if PG_VERSION_NUM >= 100000
+				 ,double *indexPages
+#endif
+)
+{
+	GenericCosts costs;
+
+	MemSet(&costs, 0, sizeof(costs));
+
+#if PG_VERSION_NUM >= 120000
+	genericcostestimate(root, path, loop_count, &costs);
+#else
+	genericcostestimate(root, path, loop_count,
+						deconstruct_indexquals(path), &costs);
+#endif
+
+	*indexStartupCost = costs.indexStartupCost;
+	*indexTotalCost = costs.indexTotalCost;
+	*indexSelectivity = costs.indexSelectivity;
+	*indexCorrelation = costs.indexCorrelation;
+#if PG_VERSION_NUM >= 100000
+	*indexPages = costs.numIndexPages;
+#endif
+}
+
+static bytea *
+hnswoptions(Datum reloptions, bool validate)
+{
+	static const relopt_parse_elt tab[] = {
+		{"m", RELOPT_TYPE_INT, offsetof(HnswOptions, m)},
+		{"ef_construction", RELOPT_TYPE_INT, offsetof(HnswOptions, efConstruction)},
+	};
+
+#if PG_VERSION_NUM >= 130000
+	return (bytea *) build_reloptions(reloptions, validate, hnsw_relopt_kind,
+									  sizeof(HnswOptions), tab, lengthof(tab));
+#else
+	relopt_value *options;
+	int			numoptions;
+	HnswOptions *rdopts;
+
+	options = parseRelOptions(reloptions, validate, hnsw_relopt_kind,
+							  &numoptions);
+	rdopts = allocateReloptStruct(sizeof(HnswOptions), options, numoptions);
+	fillRelOptions((void *) rdopts, sizeof(HnswOptions), options, numoptions,
+				   validate, tab, lengthof(tab));
+	pfree(options);
+
+	return (bytea *) rdopts;
+#endif
+}
+
+/*
+ * Check opclass: the only operator must be float4 ordering operator and the
+ * only support function must be float4 distance, both of opclass input type,
+ * which must be fixed-length and passed by reference.  Problems are reported
+ * as INFO messages, the same way core access methods do.
+ */
+static bool
+hnswvalidate(Oid opclassoid)
+{
+	bool		result = true;
+	HeapTuple	classtup;
+	Form_pg_opclass classform;
+	Oid			opfamilyoid;
+	Oid			opcintype;
+	char	   *opclassname;
+	HeapTuple	familytup;
+	Form_pg_opfamily familyform;
+	char	   *opfamilyname;
+	CatCList   *proclist,
+			   *oprlist;
+	int16		typlen;
+	bool		typbyval;
+	bool		hasDistance = false;
+	bool		hasOperator = false;
+	int			i;
+
+	classtup = SearchSysCache1(CLAOID, ObjectIdGetDatum(opclassoid));
+	if (!HeapTupleIsValid(classtup))
+		elog(ERROR, "cache lookup failed for operator class %u", opclassoid);
+	classform = (Form_pg_opclass) GETSTRUCT(classtup);
+
+	opfamilyoid = classform->opcfamily;
+	opcintype = classform->opcintype;
+	opclassname = NameStr(classform->opcname);
+
+	familytup = SearchSysCache1(OPFAMILYOID, ObjectIdGetDatum(opfamilyoid));
+	if (!HeapTupleIsValid(familytup))
+		elog(ERROR, "cache lookup failed for operator family %u", opfamilyoid);
+	familyform = (Form_pg_opfamily) GETSTRUCT(familytup);
+
+	opfamilyname = NameStr(familyform->opfname);
+
+	/* Values are copied into element tuples as is */
+	get_typlenbyval(opcintype, &typlen, &typbyval);
+	if (typlen <= 0 || typbyval)
+	{
+		ereport(INFO,
+				(errcode(ERRCODE_INVALID_OBJECT_DEFINITION),
+				 errmsg("operator class \"%s\" of access method %s is for type %s, which is not fixed-length passed by reference",
+						opclassname, "hnsw", format_type_be(opcintype))));
+		result = false;
+	}
+
+	proclist = SearchSysCacheList1(AMPROCNUM, ObjectIdGetDatum(opfamilyoid));
+	for (i = 0; i < proclist->n_members; i++)
+	{
+		HeapTuple	proctup = &proclist->members[i]->tuple;
+		Form_pg_amproc procform = (Form_pg_amproc) GETSTRUCT(proctup);
+
+		if (procform->amprocnum != HNSW_DISTANCE_PROC)
+		{
+			ereport(INFO,
+					(errcode(ERRCODE_INVALID_OBJECT_DEFINITION),
+					 errmsg("operator family \"%s\" of access method %s contains function %s with invalid support number %d",
+							opfamilyname, "hnsw",
+							format_procedure(procform->amproc),
+							procform->amprocnum)));
+			result = false;
+			continue;
+		}
+
+		if (procform->amproclefttype != opcintype ||
+			procform->amprocrighttype != opcintype ||
+			!check_amproc_signature(procform->amproc, FLOAT4OID, false,
+									2, 2, opcintype, opcintype))
+		{
+			ereport(INFO,
+					(errcode(ERRCODE_INVALID_OBJECT_DEFINITION),
+					 errmsg("operator family \"%s\" of access method %s contains function %s with wrong signature for support number %d",
+							opfamilyname, "hnsw",
+							format_procedure(procform->amproc),
+							procform->amprocnum)));
+			result = false;
+			continue;
+		}
+		hasDistance = true;
+	}
+
+	oprlist = SearchSysCacheList1(AMOPSTRATEGY, ObjectIdGetDatum(opfamilyoid));
+	for (i = 0; i < oprlist->n_members; i++)
+	{
+		HeapTuple	oprtup = &oprlist->members[i]->tuple;
+		Form_pg_amop oprform = (Form_pg_amop) GETSTRUCT(oprtup);
+
+		if (oprform->amopstrategy != HNSW_DISTANCE_STRATEGY)
+		{
+			ereport(INFO,
+					(errcode(ERRCODE_INVALID_OBJECT_DEFINITION),
+					 errmsg("operator family \"%s\" of access method %s contains operator %s with invalid strategy number %d",
+							opfamilyname, "hnsw",
+							format_operator(oprform->amopopr),
+							oprform->amopstrategy)));
+			result = false;
+			continue;
+		}
+
+		/* Index can only order by distance, there are no search operators */
+		if (oprform->amoppurpose != AMOP_ORDER ||
+			!OidIsValid(oprform->amopsortfamily))
+		{
+			ereport(INFO,
+					(errcode(ERRCODE_INVALID_OBJECT_DEFINITION),
+					 errmsg("operator family \"%s\" of access method %s contains operator %s which is not an ordering operator",
+							opfamilyname, "hnsw",
+							format_operator(oprform->amopopr))));
+			result = false;
+			continue;
+		}
+
+		/* Scan returns distance computed by support function as float4 */
+		if (oprform->amoplefttype != opcintype ||
+			oprform->amoprighttype != opcintype ||
+			!check_amop_signature(oprform->amopopr, FLOAT4OID,
+								  opcintype, opcintype))
+		{
+			ereport(INFO,
+					(errcode(ERRCODE_INVALID_OBJECT_DEFINITION),
+					 errmsg("operator family \"%s\" of access method %s contains operator %s with wrong signature",
+							opfamilyname, "hnsw",
+							format_operator(oprform->amopopr))));
+			result = false;
+			continue;
+		}
+		hasOperator = true;
+	}
+
+	if (!hasDistance)
+	{
+		ereport(INFO,
+				(errcode(ERRCODE_INVALID_OBJECT_DEFINITION),
+				 errmsg("operator class \"%s\" of access method %s is missing support function %d",
+						opclassname, "hnsw", HNSW_DISTANCE_PROC)));
+		result = false;
+	}
+	if (!hasOperator)
+	{
+		ereport(INFO,
+				(errcode(ERRCODE_INVALID_OBJECT_DEFINITION),
+				 errmsg("operator class \"%s\" of access method %s is missing operator %d",
+						opclassname, "hnsw", HNSW_DISTANCE_STRATEGY)));
+		result = false;
+	}
+
+	ReleaseCatCacheList(proclist);
+	ReleaseCatCacheList(oprlist);
+	ReleaseSysCache(familytup);
+	ReleaseSysCache(classtup);
+
+	return result;
+}
+
+static IndexScanDesc
+hnswbeginscan(Relation index, int nkeys, int norderbys)
+{
+	IndexScanDesc scan = RelationGetIndexScan(index, nkeys, norderbys);
+	HnswScanOpaque so = (HnswScanOpaque) palloc0(sizeof(HnswScanOpaqueData));
+
+	so->scanCtx = AllocSetContextCreate(CurrentMemoryContext,
+										"hnsw scan context",
+										ALLOCSET_DEFAULT_SIZES);
+	so->ef = hnsw_ef_search;
+	scan->opaque = so;
+
+	return scan;
+}
+
+static void
+hnswrescan(IndexScanDesc scan, ScanKey keys, int nkeys,
+		   ScanKey orderbys, int norderbys)
+{
+	HnswScanOpaque so = (HnswScanOpaque) scan->opaque;
+
+	if (keys && scan->numberOfKeys > 0)
+		memmove(scan->keyData, keys, scan->numberOfKeys * sizeof(ScanKeyData));
+	if (orderbys && scan->numberOfOrderBys > 0)
+		memmove(scan->orderByData, orderbys,
+				scan->numberOfOrderBys * sizeof(ScanKeyData));
+
+	MemoryContextReset(so->scanCtx);
+	so->searched = false;
+	so->ef = hnsw_ef_search;
+	so->exhausted = false;
+	so->returned = NULL;
+	so->nresults = 0;
+	so->current = 0;
+	so->results = NULL;
+}
+
+/*
+ * Search ef nearest elements, which are then returned in order of distance
+ * by following calls.  Elements whose heap TIDs were already returned by
+ * previous searches of the scan are skipped.  Search is done in the scan
+ * context, while elements are loaded into temporary one.
+ */
+static void
+hnswSearch(IndexScanDesc scan)
+{
+	HnswScanOpaque so = (HnswScanOpaque) scan->opaque;
+	Relation	index = scan->indexRelation;
+	HnswState	state;
+	HnswCandidate **entries;
+	int			nentries = 1;
+	int			entryLevel;
+	ItemPointerData entryTid;
+	Datum		query;
+	HTAB	   *cache;
+	Buffer		metaBuffer;
+	HnswMetaPageData *meta;
+	MemoryContext tmpCtx,
+				oldCtx;
+	int			lc,
+				i;
+
+	so->searched = true;
+	so->exhausted = true;
+	so->nresults = 0;
+	so->current = 0;
+
+	if (scan->numberOfOrderBys == 0 ||
+		(scan->orderByData[0].sk_flags & SK_ISNULL))
+		return;
+	query = scan->orderByData[0].sk_argument;
+
+	hnswInitState(&state, index);
+
+	metaBuffer = ReadBuffer(index, HNSW_METAPAGE_BLKNO);
+	LockBuffer(metaBuffer, BUFFER_LOCK_SHARE);
+	meta = HnswPageGetMeta(BufferGetPage(metaBuffer));
+	entryLevel = meta->entryLevel;
+	entryTid = meta->entry;
+	UnlockReleaseBuffer(metaBuffer);
+
+	if (entryLevel < 0)
+		return;
+
+	tmpCtx = AllocSetContextCreate(CurrentMemoryContext,
+								   "hnsw search temporary context",
+								   ALLOCSET_DEFAULT_SIZES);
+	oldCtx = MemoryContextSwitchTo(tmpCtx);
+
+	cache = hnswCreateCache();
+	entries = (HnswCandidate **) palloc(sizeof(HnswCandidate *));
+	entries[0] = hnswGetCandidate(&state, cache, query, &entryTid);
+
+	for (lc = entryLevel; lc >= 1; lc--)
+		entries = hnswSearchLayer(&state, cache, query, entries, nentries,
+								  1, lc, &nentries);
+	entries = hnswSearchLayer(&state, cache, query, entries, nentries,
+							  so->ef, 0, &nentries);
+
+	/* List wasn't filled, so there is nothing more to find */
+	so->exhausted = (nentries < so->ef);
+
+	MemoryContextSwitchTo(oldCtx);
+
+	if (so->results)
+		pfree(so->results);
+	so->results = (HnswResult *) palloc(sizeof(HnswResult) * Max(nentries, 1));
+	for (i = 0; i < nentries; i++)
+	{
+		if (entries[i]->element->deleted)
+			continue;
+		if (so->returned &&
+			hash_search(so->returned, &entries[i]->element->heaptid,
+						HASH_FIND, NULL))
+			continue;
+		so->results[so->nresults].heaptid = entries[i]->element->heaptid;
+		so->results[so->nresults].distance = entries[i]->distance;
+		so->nresults++;
+	}
+
+	MemoryContextDelete(tmpCtx);
+}
+
+/*
+ * Remember heap TID returned by the scan, so that it's not returned again
+ * by wider search.
+ */
+static void
+hnswRememberReturned(HnswScanOpaque so, ItemPointer heaptid)
+{
+	if (!so->returned)
+	{
+		HASHCTL		ctl;
+
+		memset(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(ItemPointerData);
+		ctl.entrysize = sizeof(ItemPointerData);
+		ctl.hcxt = so->scanCtx;
+		so->returned = hash_create("hnsw returned tids", 256, &ctl,
+								   HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	}
+	hash_search(so->returned, heaptid, HASH_ENTER, NULL);
+}
+
+/*
+ * Search is done on the first call, following calls return found elements
+ * in order of distance.  When they run out while the candidates list was
+ * full, there might be more rows than ef_search, so search is repeated with
+ * twice larger list.  Rows found by the wider search, which are nearer than
+ * the ones already returned, are returned out of order.
+ */
+static bool
+hnswgettuple(IndexScanDesc scan, ScanDirection dir)
+{
+	HnswScanOpaque so = (HnswScanOpaque) scan->opaque;
+	HnswResult *result;
+
+	if (!so->searched || so->current >= so->nresults)
+	{
+		MemoryContext oldCtx = MemoryContextSwitchTo(so->scanCtx);
+
+		if (!so->searched)
+			hnswSearch(scan);
+		while (so->current >= so->nresults && !so->exhausted)
+		{
+			/* Everything found so far is returned, but list was full */
+			so->ef = (so->ef > INT_MAX / 2) ? INT_MAX : so->ef * 2;
+			hnswSearch(scan);
+		}
+		MemoryContextSwitchTo(oldCtx);
+	}
+
+	if (so->current >= so->nresults)
+		return false;
+
+	result = &so->results[so->current++];
+	hnswRememberReturned(so, &result->heaptid);
+#if PG_VERSION_NUM >= 120000
+	scan->xs_heaptid = result->heaptid;
+#else
+	scan->xs_ctup.t_self = result->heaptid;
+#endif
+	scan->xs_recheck = false;
+	scan->xs_recheckorderby = false;
+	scan->xs_orderbyvals[0] = Float4GetDatum((float4) result->distance);
+	scan->xs_orderbynulls[0] = false;
+
+	return true;
+}
+
+static void
+hnswendscan(IndexScanDesc scan)
+{
+	HnswScanOpaque so = (HnswScanOpaque) scan->opaque;
+
+	MemoryContextDelete(so->scanCtx);
+	pfree(so);
+	scan->opaque = NULL;
+}
+
+#else							/* PG_VERSION_NUM < 90600 */
+
+/* Index access method API isn't available */
+void
+hnswInit(void)
+{
+}
+
+#endif
@@ -32,6 +32,13 @@ PG_FUNCTION_INFO_V1(signature_picksplit);
 PG_FUNCTION_INFO_V1(signature_union);
 PG_FUNCTION_INFO_V1(signature_same);
 PG_FUNCTION_INFO_V1(signature_gist_distance);
+PG_FUNCTION_INFO_V1(bitsignature_consistent);
+PG_FUNCTION_INFO_V1(bitsignature_compress);
+PG_FUNCTION_INFO_V1(bitsignature_penalty);
+PG_FUNCTION_INFO_V1(bitsignature_picksplit);
+PG_FUNCTION_INFO_V1(bitsignature_union);
+PG_FUNCTION_INFO_V1(bitsignature_same);
+PG_FUNCTION_INFO_V1(bitsignature_gist_distance);
 
 Datum		signature_consistent(PG_FUNCTION_ARGS);
 Datum		signature_compress(PG_FUNCTION_ARGS);
@@ -41,27 +48,47 @@ Datum		signature_picksplit(PG_FUNCTION_ARGS);
 Datum		signature_union(PG_FUNCTION_ARGS);
 Datum		signature_same(PG_FUNCTION_ARGS);
 Datum		signature_gist_distance(PG_FUNCTION_ARGS);
-
-static void set_signature(Signature  *dst, bytea *src);
-static void extend_signature(Signature  *dst, bytea *srcBytea);
-static void union_intersect_size(bytea  *dstBytea, bytea *srcBytea, float *unionSize, float *intersectSize);
-static float key_size(bytea *key);
+Datum		bitsignature_consistent(PG_FUNCTION_ARGS);
+Datum		bitsignature_compress(PG_FUNCTION_ARGS);
+Datum		bitsignature_penalty(PG_FUNCTION_ARGS);
+Datum		bitsignature_picksplit(PG_FUNCTION_ARGS);
+Datum		bitsignature_union(PG_FUNCTION_ARGS);
+Datum		bitsignature_same(PG_FUNCTION_ARGS);
+Datum		bitsignature_gist_distance(PG_FUNCTION_ARGS);
+
+static void get_signature_key(bytea *key, Signature *keyMinMax);
+static bytea *make_signature_key(Signature *keyMinMax);
+static void extend_signature(Signature *dst, Signature *src);
+static void union_intersect_size(Signature *dst, Signature *src, float *unionSize, float *intersectSize);
+static float key_size(Signature *key);
+static void get_bitsignature_key(bytea *key, BitSignature *andKey, BitSignature *orKey);
+static int uncertain_bits(BitSignature *andKey, BitSignature *orKey);
+
+/*
+ * Signature keys are small enough to be stored with short varlena header.
+ * They are never compressed, so support functions use DatumGetByteaPP() and
+ * access keys in place instead of making detoasted copies.  Key data isn't
+ * aligned then, so it's copied into local arrays of two signatures: minimum
+ * and maximum.
+ */
 
 Datum
 signature_compress(PG_FUNCTION_ARGS)
 {
 	GISTENTRY  *entry = (GISTENTRY *) PG_GETARG_POINTER(0);
-	bytea *res;
 
 	if (entry->leafkey)
 	{
 		GISTENTRY  *retval;
+		bytea	   *res;
 
-		res = (bytea *)palloc(sizeof(Signature) + VARHDRSZ);
+		/* Entry and key are allocated together */
+		retval = (GISTENTRY *) palloc(MAXALIGN(sizeof(GISTENTRY)) +
+									  VARHDRSZ + sizeof(Signature));
+		res = (bytea *) ((char *) retval + MAXALIGN(sizeof(GISTENTRY)));
 		SET_VARSIZE(res, sizeof(Signature) + VARHDRSZ);
 		memcpy(VARDATA(res), DatumGetPointer(entry->key), sizeof(Signature));
 
-		retval = (GISTENTRY *) palloc(sizeof(GISTENTRY));
 		gistentryinit(*retval, PointerGetDatum(res),
 					  entry->rel, entry->page,
 					  entry->offset, FALSE);
@@ -78,9 +105,9 @@ Datum
 signature_decompress(PG_FUNCTION_ARGS)
 {
 	GISTENTRY  *entry = (GISTENTRY *) PG_GETARG_POINTER(0);
-	bytea	   *key = DatumGetByteaP(PG_DETOAST_DATUM(entry->key));
+	bytea	   *key = DatumGetByteaPP(entry->key);
 
-	if (key != DatumGetByteaP(entry->key))
+	if (key != (bytea *) DatumGetPointer(entry->key))
 	{
 		GISTENTRY  *retval = (GISTENTRY *) palloc(sizeof(GISTENTRY));
 
@@ -97,41 +124,55 @@ signature_consistent(PG_FUNCTION_ARGS)
 {
 	bool	   *recheck = (bool *) PG_GETARG_POINTER(4);
 	*recheck = true;
+	IMGSMLR_COUNT(IMGSMLR_CONSISTENT_RECHECKS);
 
 	PG_RETURN_BOOL(true);
 }
 
+/*
+ * Copy minimum and maximum signatures of the key into keyMinMax[0] and
+ * keyMinMax[1].  Leaf keys contain single signature which serves as both.
+ */
 static void
-set_signature(Signature  *dst, bytea *src)
+get_signature_key(bytea *key, Signature *keyMinMax)
 {
-	CHECK_SIGNATURE_KEY(src);
+	CHECK_SIGNATURE_KEY(key);
 
-	memcpy(dst, VARDATA_ANY(src), sizeof(Signature));
-	if (VARSIZE_ANY_EXHDR(src) == sizeof(Signature))
-		memcpy(dst + 1, VARDATA_ANY(src), sizeof(Signature));
+	if (VARSIZE_ANY_EXHDR(key) == sizeof(Signature))
+	{
+		memcpy(&keyMinMax[0], VARDATA_ANY(key), sizeof(Signature));
+		keyMinMax[1] = keyMinMax[0];
+	}
 	else
-		memcpy(dst + 1, VARDATA_ANY(src) + sizeof(Signature), sizeof(Signature));
+		memcpy(keyMinMax, VARDATA_ANY(key), 2 * sizeof(Signature));
 }
 
-static void
-extend_signature(Signature  *dst, bytea *srcBytea)
+static bytea *
+make_signature_key(Signature *keyMinMax)
 {
-	Signature *src = (Signature *)VARDATA_ANY(srcBytea);
-	int i;
-
-	CHECK_SIGNATURE_KEY(srcBytea);
+	bytea	   *key = (bytea *) palloc(2 * sizeof(Signature) + VARHDRSZ);
 
-	for (i = 0; i < SIGNATURE_SIZE; i++)
-		dst->values[i] = Min(dst->values[i], src->values[i]);
+	SET_VARSIZE(key, 2 * sizeof(Signature) + VARHDRSZ);
+	memcpy(VARDATA(key), keyMinMax, 2 * sizeof(Signature));
+	return key;
+}
 
-	dst++;
-	if (VARSIZE_ANY_EXHDR(srcBytea) == 2 * sizeof(Signature))
-		src++;
+static void
+extend_signature(Signature *dst, Signature *src)
+{
+	int i;
 
 	for (i = 0; i < SIGNATURE_SIZE; i++)
-		dst->values[i] = Max(dst->values[i], src->values[i]);
+	{
+		dst[0].values[i] = Min(dst[0].values[i], src[0].values[i]);
+		dst[1].values[i] = Max(dst[1].values[i], src[1].values[i]);
+	}
 }
 
+/*
+ * Union key is always freshly allocated: gistSplit() keeps unions of both
+ * halves at once, so single reusable buffer isn't an option.
+ */
 Datum
 signature_union(PG_FUNCTION_ARGS)
 {
@@ -139,42 +180,40 @@ signature_union(PG_FUNCTION_ARGS)
 	int		   *sizep = (int *) PG_GETARG_POINTER(1);
 	int			i;
 	bytea	   *out;
-	Signature  *outSignature;
+	Signature	outKey[2],
+				key[2];
 
-	out = (bytea *)palloc(2 * sizeof(Signature) + VARHDRSZ);
-	SET_VARSIZE(out, 2 * sizeof(Signature) + VARHDRSZ);
-	outSignature = (Signature  *)VARDATA(out);
-	set_signature(outSignature, DatumGetByteaP(entryvec->vector[0].key));
+	get_signature_key(DatumGetByteaPP(entryvec->vector[0].key), outKey);
 
 	for (i = 1; i < entryvec->n; i++)
 	{
-		extend_signature(outSignature, DatumGetByteaP(entryvec->vector[i].key));
+		get_signature_key(DatumGetByteaPP(entryvec->vector[i].key), key);
+		extend_signature(outKey, key);
 	}
 
+	out = make_signature_key(outKey);
 	*sizep = VARSIZE(out);
 	PG_RETURN_POINTER(out);
 }
 
+/*
+ * GiST doesn't rewrite parent key when new union is the same as old one.
+ * Bitwise comparison is fine here: -0 and NaN variants could only cause
+ * needless update.
+ */
 Datum
 signature_same(PG_FUNCTION_ARGS)
 {
-	bytea	   *b1 = PG_GETARG_BYTEA_P(0);
-	bytea	   *b2 = PG_GETARG_BYTEA_P(1);
+	bytea	   *b1 = PG_GETARG_BYTEA_PP(0);
+	bytea	   *b2 = PG_GETARG_BYTEA_PP(1);
 	bool	   *result = (bool *) PG_GETARG_POINTER(2);
+	Signature	key1[2],
+				key2[2];
 
-	Assert(VARSIZE_ANY_EXHDR(b1) == sizeof(Signature) ||
-		   VARSIZE_ANY_EXHDR(b1) == 2 * sizeof(Signature));
-	Assert(VARSIZE_ANY_EXHDR(b2) == sizeof(Signature) ||
-		   VARSIZE_ANY_EXHDR(b2) == 2 * sizeof(Signature));
+	get_signature_key(b1, key1);
+	get_signature_key(b2, key2);
 
-	if (VARSIZE_ANY_EXHDR(b1) == VARSIZE_ANY_EXHDR(b2))
-	{
-		*result = (memcpy(b1, b2, VARSIZE_ANY_EXHDR(b1)) == 0);
-	}
-	else
-	{
-		*result = false;
-	}
+	*result = (memcmp(key1, key2, sizeof(key1)) == 0);
 
 	PG_RETURN_POINTER(result);
 }
@@ -186,43 +225,36 @@ signature_penalty(PG_FUNCTION_ARGS)
 	GISTENTRY  *newentry = (GISTENTRY *) PG_GETARG_POINTER(1);
 	float	   *result = (float *) PG_GETARG_POINTER(2);
 	float		intersect_size, union_size;
+	Signature	origKey[2],
+				newKey[2];
+	instr_time	start;
+
+	IMGSMLR_COUNT(IMGSMLR_PENALTY_CALLS);
+	IMGSMLR_TIMING_START(start);
+
+	get_signature_key(DatumGetByteaPP(origentry->key), origKey);
+	get_signature_key(DatumGetByteaPP(newentry->key), newKey);
 
-	union_intersect_size(
-		DatumGetByteaP(origentry->key),
-		DatumGetByteaP(newentry->key),
-		&union_size,
-		&intersect_size);
+	union_intersect_size(origKey, newKey, &union_size, &intersect_size);
 
-	*result = union_size - key_size(DatumGetByteaP(origentry->key));
+	*result = union_size - key_size(origKey);
 
+	IMGSMLR_TIMING_END(start, IMGSMLR_PENALTY_TIME);
 	PG_RETURN_FLOAT8(*result);
 }
 
 static void
-union_intersect_size(bytea  *dstBytea, bytea *srcBytea, float *unionSize, float *intersectSize)
+union_intersect_size(Signature *dst, Signature *src, float *unionSize, float *intersectSize)
 {
-	Signature *dstMin = (Signature *)VARDATA_ANY(dstBytea), *dstMax;
-	Signature *srcMin = (Signature *)VARDATA_ANY(srcBytea), *srcMax;
 	float unionSizeAccum = 1.0f, intersectSizeAccum = 1.0f;
 	int i;
 
-	CHECK_SIGNATURE_KEY(dstBytea);
-	CHECK_SIGNATURE_KEY(srcBytea);
-
-	srcMax = srcMin;
-	if (VARSIZE_ANY_EXHDR(srcBytea) == 2 * sizeof(Signature))
-		srcMax++;
-
-	dstMax = dstMin;
-	if (VARSIZE_ANY_EXHDR(dstBytea) == 2 * sizeof(Signature))
-		dstMax++;
-
 	for (i = 0; i < SIGNATURE_SIZE; i++)
 	{
-		float unionRange = Max(dstMax->values[i], srcMax->values[i]) -
-						   Min(dstMin->values[i], srcMin->values[i]);
-		float intersectRange = Min(dstMax->values[i], srcMax->values[i]) -
-							   Max(dstMin->values[i], srcMin->values[i]);
+		float unionRange = Max(dst[1].values[i], src[1].values[i]) -
+						   Min(dst[0].values[i], src[0].values[i]);
+		float intersectRange = Min(dst[1].values[i], src[1].values[i]) -
+							   Max(dst[0].values[i], src[0].values[i]);
 		unionSizeAccum *= unionRange;
 		if (intersectRange < 0.0f)
 			intersectRange = 0.0f;
@@ -234,21 +266,14 @@ union_intersect_size(bytea  *dstBytea, bytea *srcBytea, float *unionSize, float
 }
 
 static float
-key_size(bytea *key)
+key_size(Signature *key)
 {
-	Signature *keyMin = (Signature *)VARDATA_ANY(key), *keyMax;
 	float size = 1.0f;
 	int i;
 
-	CHECK_SIGNATURE_KEY(key);
-
-	keyMax = keyMin;
-	if (VARSIZE_ANY_EXHDR(key) == 2 * sizeof(Signature))
-		keyMax++;
-
 	for (i = 0; i < SIGNATURE_SIZE; i++)
 	{
-		float range = keyMax->values[i] - keyMin->values[i];
+		float range = key[1].values[i] - key[0].values[i];
 		size *= range;
 	}
 	return size;
@@ -261,10 +286,9 @@ signature_picksplit(PG_FUNCTION_ARGS)
 	GIST_SPLITVEC *v = (GIST_SPLITVEC *) PG_GETARG_POINTER(1);
 	OffsetNumber i,
 				j;
-	bytea	   *datum_alpha,
-			   *datum_beta;
-	bytea	   *datum_l,
-			   *datum_r;
+	Signature  *keys;
+	Signature	key_l[2],
+				key_r[2];
 	bool		firsttime;
 	float		size_waste,
 				waste;
@@ -276,33 +300,36 @@ signature_picksplit(PG_FUNCTION_ARGS)
 	OffsetNumber *left,
 			   *right;
 	OffsetNumber maxoff;
-	Signature *signature_l, *signature_r;
 	bool *distributed;
 	int undistributed_count;
+	instr_time	start;
+
+	IMGSMLR_COUNT(IMGSMLR_PICKSPLIT_CALLS);
+	IMGSMLR_TIMING_START(start);
 
-	/*
-	 * fprintf(stderr, "picksplit\n");
-	 */
 	maxoff = entryvec->n - 1;
 	nbytes = (maxoff + 1) * sizeof(OffsetNumber);
 	distributed = (bool *)palloc0(sizeof(bool) * (maxoff + 1));
 	v->spl_left = (OffsetNumber *) palloc(nbytes);
 	v->spl_right = (OffsetNumber *) palloc(nbytes);
 
+	/* Extract all the keys at once, they are used many times below */
+	keys = (Signature *) palloc(2 * sizeof(Signature) * (maxoff + 1));
+	for (i = FirstOffsetNumber; i <= maxoff; i = OffsetNumberNext(i))
+		get_signature_key(DatumGetByteaPP(entryvec->vector[i].key),
+						  &keys[2 * i]);
+
 	firsttime = true;
 	waste = 0.0;
 
 	for (i = FirstOffsetNumber; i < maxoff; i = OffsetNumberNext(i))
 	{
-		datum_alpha = DatumGetByteaP(entryvec->vector[i].key);
 		for (j = OffsetNumberNext(i); j <= maxoff; j = OffsetNumberNext(j))
 		{
 			float unionSize, intersectSize;
 
-			datum_beta = DatumGetByteaP(entryvec->vector[j].key);
-
-			union_intersect_size(datum_alpha, datum_beta,
-													&unionSize, &intersectSize);
+			union_intersect_size(&keys[2 * i], &keys[2 * j],
+								 &unionSize, &intersectSize);
 
 			size_waste = unionSize - intersectSize;
 
@@ -325,17 +352,11 @@ signature_picksplit(PG_FUNCTION_ARGS)
 	right = v->spl_right;
 	v->spl_nright = 0;
 
-	datum_l = (bytea *)palloc(2 * sizeof(Signature) + VARHDRSZ);
-	SET_VARSIZE(datum_l, 2 * sizeof(Signature) + VARHDRSZ);
-	signature_l = (Signature  *)VARDATA(datum_l);
-	set_signature(signature_l, DatumGetByteaP(entryvec->vector[seed_1].key));
-	size_l = key_size(datum_l);
+	memcpy(key_l, &keys[2 * seed_1], 2 * sizeof(Signature));
+	size_l = key_size(key_l);
 
-	datum_r = (bytea *)palloc(2 * sizeof(Signature) + VARHDRSZ);
-	SET_VARSIZE(datum_r, 2 * sizeof(Signature) + VARHDRSZ);
-	signature_r = (Signature  *)VARDATA(datum_r);
-	set_signature(signature_r, DatumGetByteaP(entryvec->vector[seed_2].key));
-	size_r = key_size(datum_r);
+	memcpy(key_r, &keys[2 * seed_2], 2 * sizeof(Signature));
+	size_r = key_size(key_r);
 
 	distributed[seed_1] = true;
 	*left++ = seed_1;
@@ -373,18 +394,8 @@ signature_picksplit(PG_FUNCTION_ARGS)
 			if (distributed[i])
 				continue;
 
-			/*memcpy(signature_tmp, signature_l, sizeof(Signature) * 2);
-			extend_signature(signature_tmp, DatumGetByteaP(entryvec->vector[i].key));
-			union_intersect_size(tmp, datum_r, &union_l, &intersect_l);
-
-			memcpy(signature_tmp, signature_r, sizeof(Signature) * 2);
-			extend_signature(signature_tmp, DatumGetByteaP(entryvec->vector[i].key));
-			union_intersect_size(tmp, datum_l, &union_r, &intersect_r);
-
-			delta = intersect_l - intersect_r;*/
-
-			union_intersect_size(datum_l, DatumGetByteaP(entryvec->vector[i].key), &union_l, &intersect_l);
-			union_intersect_size(datum_r, DatumGetByteaP(entryvec->vector[i].key), &union_r, &intersect_r);
+			union_intersect_size(key_l, &keys[2 * i], &union_l, &intersect_l);
+			union_intersect_size(key_r, &keys[2 * i], &union_r, &intersect_r);
 
 			delta = union_l - size_l - union_r + size_r;
 
@@ -407,15 +418,15 @@ signature_picksplit(PG_FUNCTION_ARGS)
 		/* pick which page to add it to */
 		if (max_delta < 0 || (max_delta == 0 && v->spl_nleft < v->spl_nright))
 		{
-			extend_signature(signature_l, DatumGetByteaP(entryvec->vector[selected].key));
-			size_l = key_size(datum_l);
+			extend_signature(key_l, &keys[2 * selected]);
+			size_l = key_size(key_l);
 			*left++ = selected;
 			v->spl_nleft++;
 		}
 		else
 		{
-			extend_signature(signature_r, DatumGetByteaP(entryvec->vector[selected].key));
-			size_r = key_size(datum_r);
+			extend_signature(key_r, &keys[2 * selected]);
+			size_r = key_size(key_r);
 			*right++ = selected;
 			v->spl_nright++;
 		}
@@ -424,9 +435,13 @@ signature_picksplit(PG_FUNCTION_ARGS)
 	}
 	*left = *right = FirstOffsetNumber; /* sentinel value, see dosplit() */
 
-	v->spl_ldatum = PointerGetDatum(datum_l);
-	v->spl_rdatum = PointerGetDatum(datum_r);
+	pfree(keys);
+	pfree(distributed);
 
+	v->spl_ldatum = PointerGetDatum(make_signature_key(key_l));
+	v->spl_rdatum = PointerGetDatum(make_signature_key(key_r));
+
+	IMGSMLR_TIMING_END(start, IMGSMLR_PICKSPLIT_TIME);
 	PG_RETURN_POINTER(v);
 }
 
@@ -435,25 +450,347 @@ signature_gist_distance(PG_FUNCTION_ARGS)
 {
 	GISTENTRY  *entry = (GISTENTRY *) PG_GETARG_POINTER(0);
 	/* StrategyNumber strategy = (StrategyNumber) PG_GETARG_UINT16(2);*/
-	Signature *arg = (Signature *)PG_GETARG_POINTER(1), *keyMin, *keyMax;
-	bytea *key = DatumGetByteaP(entry->key);
+	Signature *arg = (Signature *)PG_GETARG_POINTER(1);
+	Signature	key[2];
 	double		distance = 0.0;
 	int i = 0;
 
-	CHECK_SIGNATURE_KEY(key);
+	IMGSMLR_COUNT(GIST_LEAF(entry) ? IMGSMLR_GIST_DISTANCE_LEAF : IMGSMLR_GIST_DISTANCE_INTERNAL);
+	imgsmlrCountPage(fcinfo->flinfo, entry->page);
 
-	keyMin = (Signature *)VARDATA_ANY(key);
-	keyMax = keyMin;
-	if (VARSIZE_ANY_EXHDR(key) == 2 * sizeof(Signature))
-		keyMax++;
+	get_signature_key(DatumGetByteaPP(entry->key), key);
 
 	for (i = 0; i < SIGNATURE_SIZE; i++)
 	{
-		if (arg->values[i] < keyMin->values[i])
-			distance += (arg->values[i] - keyMin->values[i]) * (arg->values[i] - keyMin->values[i]);
-		if (arg->values[i] > keyMax->values[i])
-			distance += (arg->values[i] - keyMax->values[i]) * (arg->values[i] - keyMax->values[i]);
+		if (arg->values[i] < key[0].values[i])
+			distance += (arg->values[i] - key[0].values[i]) * (arg->values[i] - key[0].values[i]);
+		if (arg->values[i] > key[1].values[i])
+			distance += (arg->values[i] - key[1].values[i]) * (arg->values[i] - key[1].values[i]);
 	}
 
 	PG_RETURN_FLOAT8(sqrt(distance));
 }
+
+/*
+ * GiST support for binary signatures.  Internal keys hold two binary
+ * signatures: bitwise AND and bitwise OR of all the underlying signatures.
+ * Bits which differ between AND and OR are "uncertain" for the subtree.
+ */
+
+Datum
+bitsignature_compress(PG_FUNCTION_ARGS)
+{
+	GISTENTRY  *entry = (GISTENTRY *) PG_GETARG_POINTER(0);
+
+	if (entry->leafkey)
+	{
+		GISTENTRY  *retval;
+		bytea	   *res;
+
+		/* Entry and key are allocated together */
+		retval = (GISTENTRY *) palloc(MAXALIGN(sizeof(GISTENTRY)) +
+									  VARHDRSZ + sizeof(BitSignature));
+		res = (bytea *) ((char *) retval + MAXALIGN(sizeof(GISTENTRY)));
+		SET_VARSIZE(res, sizeof(BitSignature) + VARHDRSZ);
+		memcpy(VARDATA(res), DatumGetPointer(entry->key), sizeof(BitSignature));
+
+		gistentryinit(*retval, PointerGetDatum(res),
+					  entry->rel, entry->page,
+					  entry->offset, false);
+
+		PG_RETURN_POINTER(retval);
+	}
+	else
+	{
+		PG_RETURN_POINTER(entry);
+	}
+}
+
+Datum
+bitsignature_consistent(PG_FUNCTION_ARGS)
+{
+	bool	   *recheck = (bool *) PG_GETARG_POINTER(4);
+	*recheck = true;
+	IMGSMLR_COUNT(IMGSMLR_CONSISTENT_RECHECKS);
+
+	PG_RETURN_BOOL(true);
+}
+
+/*
+ * Extract AND and OR signatures from the key.  Leaf keys contain single
+ * signature which serves as both.
+ */
+static void
+get_bitsignature_key(bytea *key, BitSignature *andKey, BitSignature *orKey)
+{
+	CHECK_BITSIGNATURE_KEY(key);
+
+	memcpy(andKey, VARDATA_ANY(key), sizeof(BitSignature));
+	if (VARSIZE_ANY_EXHDR(key) == sizeof(BitSignature))
+		memcpy(orKey, VARDATA_ANY(key), sizeof(BitSignature));
+	else
+		memcpy(orKey, VARDATA_ANY(key) + sizeof(BitSignature), sizeof(BitSignature));
+}
+
+static int
+uncertain_bits(BitSignature *andKey, BitSignature *orKey)
+{
+	int count = 0;
+	int i;
+
+	for (i = 0; i < BITSIGNATURE_WORDS; i++)
+		count += popcount64(orKey->words[i] & ~andKey->words[i]);
+	return count;
+}
+
+Datum
+bitsignature_union(PG_FUNCTION_ARGS)
+{
+	GistEntryVector *entryvec = (GistEntryVector *) PG_GETARG_POINTER(0);
+	int		   *sizep = (int *) PG_GETARG_POINTER(1);
+	int			i, k;
+	bytea	   *out;
+	BitSignature *outAnd, *outOr;
+
+	out = (bytea *)palloc(2 * sizeof(BitSignature) + VARHDRSZ);
+	SET_VARSIZE(out, 2 * sizeof(BitSignature) + VARHDRSZ);
+	outAnd = (BitSignature *)VARDATA(out);
+	outOr = outAnd + 1;
+	get_bitsignature_key(DatumGetByteaPP(entryvec->vector[0].key), outAnd, outOr);
+
+	for (i = 1; i < entryvec->n; i++)
+	{
+		BitSignature keyAnd, keyOr;
+
+		get_bitsignature_key(DatumGetByteaPP(entryvec->vector[i].key), &keyAnd, &keyOr);
+		for (k = 0; k < BITSIGNATURE_WORDS; k++)
+		{
+			outAnd->words[k] &= keyAnd.words[k];
+			outOr->words[k] |= keyOr.words[k];
+		}
+	}
+
+	*sizep = VARSIZE(out);
+	PG_RETURN_POINTER(out);
+}
+
+Datum
+bitsignature_same(PG_FUNCTION_ARGS)
+{
+	bytea	   *b1 = PG_GETARG_BYTEA_PP(0);
+	bytea	   *b2 = PG_GETARG_BYTEA_PP(1);
+	bool	   *result = (bool *) PG_GETARG_POINTER(2);
+
+	CHECK_BITSIGNATURE_KEY(b1);
+	CHECK_BITSIGNATURE_KEY(b2);
+
+	if (VARSIZE_ANY_EXHDR(b1) == VARSIZE_ANY_EXHDR(b2))
+	{
+		*result = (memcmp(VARDATA_ANY(b1), VARDATA_ANY(b2),
+						  VARSIZE_ANY_EXHDR(b1)) == 0);
+	}
+	else
+	{
+		*result = false;
+	}
+
+	PG_RETURN_POINTER(result);
+}
+
+/*
+ * Penalty is number of bits which become uncertain after adding new entry.
+ */
+Datum
+bitsignature_penalty(PG_FUNCTION_ARGS)
+{
+	GISTENTRY  *origentry = (GISTENTRY *) PG_GETARG_POINTER(0);
+	GISTENTRY  *newentry = (GISTENTRY *) PG_GETARG_POINTER(1);
+	float	   *result = (float *) PG_GETARG_POINTER(2);
+	BitSignature origAnd, origOr, newAnd, newOr;
+	int			k;
+	instr_time	start;
+
+	IMGSMLR_COUNT(IMGSMLR_PENALTY_CALLS);
+	IMGSMLR_TIMING_START(start);
+
+	get_bitsignature_key(DatumGetByteaPP(origentry->key), &origAnd, &origOr);
+	get_bitsignature_key(DatumGetByteaPP(newentry->key), &newAnd, &newOr);
+
+	*result = 0.0f;
+	for (k = 0; k < BITSIGNATURE_WORDS; k++)
+	{
+		uint64 unionAnd = origAnd.words[k] & newAnd.words[k],
+			   unionOr = origOr.words[k] | newOr.words[k];
+
+		*result += popcount64((unionOr & ~unionAnd) ^ (origOr.words[k] & ~origAnd.words[k]));
+	}
+
+	IMGSMLR_TIMING_END(start, IMGSMLR_PENALTY_TIME);
+	PG_RETURN_POINTER(result);
+}
+
+Datum
+bitsignature_picksplit(PG_FUNCTION_ARGS)
+{
+	GistEntryVector *entryvec = (GistEntryVector *) PG_GETARG_POINTER(0);
+	GIST_SPLITVEC *v = (GIST_SPLITVEC *) PG_GETARG_POINTER(1);
+	OffsetNumber i,
+				j;
+	OffsetNumber maxoff = entryvec->n - 1;
+	OffsetNumber seed_1 = 1,
+				seed_2 = 2;
+	OffsetNumber *left,
+			   *right;
+	BitSignature *keys;
+	bytea	   *datum_l,
+			   *datum_r;
+	BitSignature *and_l, *or_l, *and_r, *or_r;
+	int			waste = -1;
+	int			size_l, size_r;
+	int			k;
+	instr_time	start;
+
+	IMGSMLR_COUNT(IMGSMLR_PICKSPLIT_CALLS);
+	IMGSMLR_TIMING_START(start);
+
+	/* Extract all the keys at once */
+	keys = (BitSignature *) palloc(2 * sizeof(BitSignature) * (maxoff + 1));
+	for (i = FirstOffsetNumber; i <= maxoff; i = OffsetNumberNext(i))
+		get_bitsignature_key(DatumGetByteaPP(entryvec->vector[i].key),
+							 &keys[2 * i], &keys[2 * i + 1]);
+
+	/* Pick the pair of keys which are the most wasteful to put together */
+	for (i = FirstOffsetNumber; i < maxoff; i = OffsetNumberNext(i))
+	{
+		for (j = OffsetNumberNext(i); j <= maxoff; j = OffsetNumberNext(j))
+		{
+			int size_waste = 0;
+
+			for (k = 0; k < BITSIGNATURE_WORDS; k++)
+			{
+				uint64 unionAnd = keys[2 * i].words[k] & keys[2 * j].words[k],
+					   unionOr = keys[2 * i + 1].words[k] | keys[2 * j + 1].words[k];
+
+				size_waste += popcount64(unionOr & ~unionAnd);
+			}
+
+			if (size_waste > waste)
+			{
+				waste = size_waste;
+				seed_1 = i;
+				seed_2 = j;
+			}
+		}
+	}
+
+	v->spl_left = (OffsetNumber *) palloc((maxoff + 1) * sizeof(OffsetNumber));
+	v->spl_right = (OffsetNumber *) palloc((maxoff + 1) * sizeof(OffsetNumber));
+	left = v->spl_left;
+	v->spl_nleft = 0;
+	right = v->spl_right;
+	v->spl_nright = 0;
+
+	datum_l = (bytea *)palloc(2 * sizeof(BitSignature) + VARHDRSZ);
+	SET_VARSIZE(datum_l, 2 * sizeof(BitSignature) + VARHDRSZ);
+	and_l = (BitSignature *)VARDATA(datum_l);
+	or_l = and_l + 1;
+	memcpy(and_l, &keys[2 * seed_1], 2 * sizeof(BitSignature));
+	size_l = uncertain_bits(and_l, or_l);
+
+	datum_r = (bytea *)palloc(2 * sizeof(BitSignature) + VARHDRSZ);
+	SET_VARSIZE(datum_r, 2 * sizeof(BitSignature) + VARHDRSZ);
+	and_r = (BitSignature *)VARDATA(datum_r);
+	or_r = and_r + 1;
+	memcpy(and_r, &keys[2 * seed_2], 2 * sizeof(BitSignature));
+	size_r = uncertain_bits(and_r, or_r);
+
+	/*
+	 * Distribute the rest of keys in order: each key goes to the side where
+	 * it adds less uncertain bits.  Keep offsets in each side sorted, as
+	 * gistSplit expects.
+	 */
+	for (i = FirstOffsetNumber; i <= maxoff; i = OffsetNumberNext(i))
+	{
+		BitSignature *keyAnd = &keys[2 * i],
+					 *keyOr = &keys[2 * i + 1];
+		int			union_l = 0, union_r = 0;
+		bool		toLeft;
+
+		if (i == seed_1)
+			toLeft = true;
+		else if (i == seed_2)
+			toLeft = false;
+		else
+		{
+			for (k = 0; k < BITSIGNATURE_WORDS; k++)
+			{
+				union_l += popcount64((or_l->words[k] | keyOr->words[k]) &
+									  ~(and_l->words[k] & keyAnd->words[k]));
+				union_r += popcount64((or_r->words[k] | keyOr->words[k]) &
+									  ~(and_r->words[k] & keyAnd->words[k]));
+			}
+			if (union_l - size_l != union_r - size_r)
+				toLeft = (union_l - size_l < union_r - size_r);
+			else
+				toLeft = (v->spl_nleft <= v->spl_nright);
+		}
+
+		if (toLeft)
+		{
+			for (k = 0; k < BITSIGNATURE_WORDS; k++)
+			{
+				and_l->words[k] &= keyAnd->words[k];
+				or_l->words[k] |= keyOr->words[k];
+			}
+			size_l = uncertain_bits(and_l, or_l);
+			*left++ = i;
+			v->spl_nleft++;
+		}
+		else
+		{
+			for (k = 0; k < BITSIGNATURE_WORDS; k++)
+			{
+				and_r->words[k] &= keyAnd->words[k];
+				or_r->words[k] |= keyOr->words[k];
+			}
+			size_r = uncertain_bits(and_r, or_r);
+			*right++ = i;
+			v->spl_nright++;
+		}
+	}
+
+	pfree(keys);
+
+	v->spl_ldatum = PointerGetDatum(datum_l);
+	v->spl_rdatum = PointerGetDatum(datum_r);
+
+	IMGSMLR_TIMING_END(start, IMGSMLR_PICKSPLIT_TIME);
+	PG_RETURN_POINTER(v);
+}
+
+/*
+ * Lower bound of Hamming distance between the query and any signature in the
+ * subtree: count bits which are set in all the signatures but not in the
+ * query, and bits which are set in query but not in any of signatures.  For
+ * leaf keys it's exact distance.
+ */
+Datum
+bitsignature_gist_distance(PG_FUNCTION_ARGS)
+{
+	GISTENTRY  *entry = (GISTENTRY *) PG_GETARG_POINTER(0);
+	BitSignature *arg = (BitSignature *)PG_GETARG_POINTER(1);
+	BitSignature keyAnd, keyOr;
+	int			distance = 0;
+	int			k;
+
+	IMGSMLR_COUNT(GIST_LEAF(entry) ? IMGSMLR_GIST_DISTANCE_LEAF : IMGSMLR_GIST_DISTANCE_INTERNAL);
+	imgsmlrCountPage(fcinfo->flinfo, entry->page);
+
+	get_bitsignature_key(DatumGetByteaPP(entry->key), &keyAnd, &keyOr);
+
+	for (k = 0; k < BITSIGNATURE_WORDS; k++)
+		distance += popcount64((keyAnd.words[k] & ~arg->words[k]) |
+							   (arg->words[k] & ~keyOr.words[k]));
+
+	PG_RETURN_FLOAT8((double) distance);
+}
@@ -0,0 +1,243 @@
+/*-------------------------------------------------------------------------
+ *
+ *          Image similarity extension
+ *
+ * Copyright (c) 2015, PostgreSQL Global Development Group
+ *
+ * This software is released under the PostgreSQL Licence.
+ *
+ * Background workers computing descriptors of queued images.  Each worker
+ * repeatedly calls imgsmlr_ingest_process() in its own transaction.  Rows
+ * of the queue are claimed with SKIP LOCKED, so the workers don't contend.
+ * Worker sleeps for imgsmlr.ingest_naptime when the queue is drained.
+ * Rows which fail are marked with the error by imgsmlr_ingest_process() and
+ * skipped afterwards, so a bad row doesn't stop the queue.
+ *
+ * Workers are started only when imgsmlr is loaded via
+ * shared_preload_libraries and imgsmlr.ingest_workers is positive.
+ *
+ * IDENTIFICATION
+ *    imgsmlr/imgsmlr_ingest.c
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+#include "fmgr.h"
+#include "imgsmlr.h"
+#include "access/xact.h"
+#include "catalog/pg_type.h"
+#include "executor/spi.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "postmaster/bgworker.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/snapmgr.h"
+
+PGDLLEXPORT void imgsmlr_ingest_main(Datum main_arg);
+
+static int	imgsmlr_ingest_workers = 0;
+static int	imgsmlr_ingest_batch_size = 64;
+static int	imgsmlr_ingest_naptime = 1000;
+static char *imgsmlr_ingest_database = NULL;
+
+static volatile sig_atomic_t got_sighup = false;
+static volatile sig_atomic_t got_sigterm = false;
+
+static void ingest_sighup(SIGNAL_ARGS);
+static void ingest_sigterm(SIGNAL_ARGS);
+static int	ingestBatch(void);
+
+void
+ingestInit(void)
+{
+	BackgroundWorker worker;
+	int			i;
+
+	DefineCustomIntVariable("imgsmlr.ingest_workers",
+							"Number of background workers processing the ingest queue.",
+							NULL,
+							&imgsmlr_ingest_workers,
+							0, 0, 64,
+							PGC_POSTMASTER,
+							0,
+							NULL, NULL, NULL);
+	DefineCustomIntVariable("imgsmlr.ingest_batch_size",
+							"Number of images processed by ingest worker in single transaction.",
+							NULL,
+							&imgsmlr_ingest_batch_size,
+							64, 1, 10000,
+							PGC_SIGHUP,
+							0,
+							NULL, NULL, NULL);
+	DefineCustomIntVariable("imgsmlr.ingest_naptime",
+							"Sleep time of ingest worker when the queue is empty.",
+							NULL,
+							&imgsmlr_ingest_naptime,
+							1000, 1, INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_MS,
+							NULL, NULL, NULL);
+	DefineCustomStringVariable("imgsmlr.ingest_database",
+							   "Database whose ingest queue is processed by ingest workers.",
+							   NULL,
+							   &imgsmlr_ingest_database,
+							   "postgres",
+							   PGC_POSTMASTER,
+							   0,
+							   NULL, NULL, NULL);
+
+	if (!process_shared_preload_libraries_in_progress)
+		return;
+
+	memset(&worker, 0, sizeof(worker));
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS |
+		BGWORKER_BACKEND_DATABASE_CONNECTION;
+	worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+	worker.bgw_restart_time = 10;
+	snprintf(worker.bgw_library_name, BGW_MAXLEN, "imgsmlr");
+	snprintf(worker.bgw_function_name, BGW_MAXLEN, "imgsmlr_ingest_main");
+#if PG_VERSION_NUM >= 110000
+	snprintf(worker.bgw_type, BGW_MAXLEN, "imgsmlr ingest worker");
+#endif
+	worker.bgw_notify_pid = 0;
+
+	for (i = 0; i < imgsmlr_ingest_workers; i++)
+	{
+		snprintf(worker.bgw_name, BGW_MAXLEN, "imgsmlr ingest worker %d", i + 1);
+		worker.bgw_main_arg = Int32GetDatum(i);
+		RegisterBackgroundWorker(&worker);
+	}
+}
+
+static void
+ingest_sighup(SIGNAL_ARGS)
+{
+	int			save_errno = errno;
+
+	got_sighup = true;
+	SetLatch(MyLatch);
+
+	errno = save_errno;
+}
+
+static void
+ingest_sigterm(SIGNAL_ARGS)
+{
+	int			save_errno = errno;
+
+	got_sigterm = true;
+	SetLatch(MyLatch);
+
+	errno = save_errno;
+}
+
+/*
+ * Process single batch of the queue in its own transaction.  Returns number
+ * of processed images, or -1 when extension isn't installed in the database.
+ */
+static int
+ingestBatch(void)
+{
+	int			result = -1;
+	int			ret;
+	bool		isnull;
+
+	SetCurrentStatementStartTimestamp();
+	StartTransactionCommand();
+	SPI_connect();
+	PushActiveSnapshot(GetTransactionSnapshot());
+	pgstat_report_activity(STATE_RUNNING, "imgsmlr_ingest_process");
+
+	/* Extension is relocatable, so make its schema visible */
+	ret = SPI_execute("SELECT n.nspname FROM pg_catalog.pg_extension e "
+					  "JOIN pg_catalog.pg_namespace n ON n.oid = e.extnamespace "
+					  "WHERE e.extname = 'imgsmlr'", true, 1);
+	if (ret != SPI_OK_SELECT)
+		elog(ERROR, "could not look up imgsmlr extension: error code %d", ret);
+
+	if (SPI_processed > 0)
+	{
+		char	   *schema = SPI_getvalue(SPI_tuptable->vals[0],
+										  SPI_tuptable->tupdesc, 1);
+		Oid			argtypes[1] = {INT4OID};
+		Datum		args[1];
+
+		ret = SPI_execute(psprintf("SET LOCAL search_path = %s, pg_catalog",
+								   quote_identifier(schema)), false, 0);
+		if (ret != SPI_OK_UTILITY)
+			elog(ERROR, "could not set search_path: error code %d", ret);
+
+		args[0] = Int32GetDatum(imgsmlr_ingest_batch_size);
+		ret = SPI_execute_with_args("SELECT imgsmlr_ingest_process($1)",
+									1, argtypes, args, NULL, false, 1);
+		if (ret != SPI_OK_SELECT || SPI_processed != 1)
+			elog(ERROR, "could not process ingest queue: error code %d", ret);
+
+		result = DatumGetInt32(SPI_getbinval(SPI_tuptable->vals[0],
+											 SPI_tuptable->tupdesc, 1,
+											 &isnull));
+	}
+
+	SPI_finish();
+	PopActiveSnapshot();
+	CommitTransactionCommand();
+	pgstat_report_stat(false);
+	pgstat_report_activity(STATE_IDLE, NULL);
+
+	return result;
+}
+
+void
+imgsmlr_ingest_main(Datum main_arg)
+{
+	pqsignal(SIGHUP, ingest_sighup);
+	pqsignal(SIGTERM, ingest_sigterm);
+	BackgroundWorkerUnblockSignals();
+
+#if PG_VERSION_NUM >= 110000
+	BackgroundWorkerInitializeConnection(imgsmlr_ingest_database, NULL, 0);
+#else
+	BackgroundWorkerInitializeConnection(imgsmlr_ingest_database, NULL);
+#endif
+
+	elog(LOG, "imgsmlr ingest worker %d started", DatumGetInt32(main_arg) + 1);
+
+	while (!got_sigterm)
+	{
+		int			processed;
+		int			rc;
+
+		CHECK_FOR_INTERRUPTS();
+
+		if (got_sighup)
+		{
+			got_sighup = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+
+		processed = ingestBatch();
+
+		/* Full batch means there are more images, so don't sleep */
+		if (processed >= imgsmlr_ingest_batch_size)
+			continue;
+
+#if PG_VERSION_NUM >= 100000
+		rc = WaitLatch(MyLatch,
+					   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+					   imgsmlr_ingest_naptime,
+					   PG_WAIT_EXTENSION);
+#else
+		rc = WaitLatch(MyLatch,
+					   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+					   imgsmlr_ingest_naptime);
+#endif
+		ResetLatch(MyLatch);
+
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+	}
+
+	proc_exit(0);
+}
@@ -0,0 +1,194 @@
+/*-------------------------------------------------------------------------
+ *
+ *          Image similarity extension
+ *
+ * Copyright (c) 2015, PostgreSQL Global Development Group
+ *
+ * This software is released under the PostgreSQL Licence.
+ *
+ * K-means clustering used for training of quantizers.  Centroids are seeded
+ * by k-means++ with fixed random seed, so training on the same sample gives
+ * the same centroids.
+ *
+ * IDENTIFICATION
+ *    imgsmlr/imgsmlr_kmeans.c
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+#include "fmgr.h"
+#include "imgsmlr.h"
+#include "miscadmin.h"
+
+/*
+ * Simple deterministic generator of numbers in [0, 1).
+ */
+static double
+kmeansRandom(uint64 *state)
+{
+	/* xorshift64* */
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return (double) ((*state * UINT64CONST(2685821657736338717)) >> 11) /
+		(double) (UINT64CONST(1) << 53);
+}
+
+static inline float
+squareDistance(const float *a, const float *b, int dim)
+{
+	float		sum = 0.0f;
+	int			d;
+
+	for (d = 0; d < dim; d++)
+	{
+		float		diff = a[d] - b[d];
+
+		sum += diff * diff;
+	}
+	return sum;
+}
+
+/*
+ * Find centroid nearest to the vector.  Squared distance to it is returned
+ * into *distance when it's not NULL.
+ */
+int
+kmeansNearest(const float *centroids, int k, int dim, const float *vector,
+			  float *distance)
+{
+	int			best = 0,
+				c;
+	float		bestDistance = squareDistance(vector, centroids, dim);
+
+	for (c = 1; c < k; c++)
+	{
+		float		dist = squareDistance(vector, centroids + (Size) c * dim, dim);
+
+		if (dist < bestDistance)
+		{
+			bestDistance = dist;
+			best = c;
+		}
+	}
+	if (distance)
+		*distance = bestDistance;
+	return best;
+}
+
+/*
+ * Cluster n vectors of given dimension into k clusters.  Centroids are
+ * written into preallocated array of k * dim values.  k must not exceed n.
+ */
+void
+kmeansCluster(const float *data, int n, int dim, int k, int iterations,
+			  float *centroids)
+{
+	int		   *assignment = (int *) palloc(sizeof(int) * n);
+	int		   *counts = (int *) palloc(sizeof(int) * k);
+	float	   *distances = (float *) palloc(sizeof(float) * n);
+	uint64		seed = UINT64CONST(0x9E3779B97F4A7C15);
+	int			i,
+				c,
+				iter;
+
+	Assert(k > 0 && k <= n);
+
+	/* k-means++ seeding */
+	memcpy(centroids, data + (Size) ((int) (kmeansRandom(&seed) * n)) * dim,
+		   sizeof(float) * dim);
+	for (i = 0; i < n; i++)
+		distances[i] = squareDistance(data + (Size) i * dim, centroids, dim);
+	for (c = 1; c < k; c++)
+	{
+		double		total = 0.0,
+					target;
+		int			chosen = n - 1;
+
+		CHECK_FOR_INTERRUPTS();
+
+		for (i = 0; i < n; i++)
+			total += distances[i];
+		target = kmeansRandom(&seed) * total;
+		for (i = 0; i < n; i++)
+		{
+			target -= distances[i];
+			if (target < 0.0)
+			{
+				chosen = i;
+				break;
+			}
+		}
+		memcpy(centroids + (Size) c * dim, data + (Size) chosen * dim,
+			   sizeof(float) * dim);
+		for (i = 0; i < n; i++)
+		{
+			float		dist = squareDistance(data + (Size) i * dim,
+											  centroids + (Size) c * dim, dim);
+
+			if (dist < distances[i])
+				distances[i] = dist;
+		}
+	}
+
+	/* Lloyd iterations */
+	for (iter = 0; iter < iterations; iter++)
+	{
+		bool		changed = false;
+
+		CHECK_FOR_INTERRUPTS();
+
+		for (i = 0; i < n; i++)
+		{
+			int			nearest = kmeansNearest(centroids, k, dim,
+												data + (Size) i * dim,
+												&distances[i]);
+
+			if (iter == 0 || nearest != assignment[i])
+				changed = true;
+			assignment[i] = nearest;
+		}
+		if (!changed)
+			break;
+
+		memset(centroids, 0, sizeof(float) * k * dim);
+		memset(counts, 0, sizeof(int) * k);
+		for (i = 0; i < n; i++)
+		{
+			float	   *centroid = centroids + (Size) assignment[i] * dim;
+			const float *vector = data + (Size) i * dim;
+			int			d;
+
+			for (d = 0; d < dim; d++)
+				centroid[d] += vector[d];
+			counts[assignment[i]]++;
+		}
+
+		for (c = 0; c < k; c++)
+		{
+			float	   *centroid = centroids + (Size) c * dim;
+			int			d;
+
+			if (counts[c] == 0)
+			{
+				/* Move empty cluster to the point farthest from its centroid */
+				int			farthest = 0;
+
+				for (i = 1; i < n; i++)
+				{
+					if (distances[i] > distances[farthest])
+						farthest = i;
+				}
+				memcpy(centroid, data + (Size) farthest * dim,
+					   sizeof(float) * dim);
+				distances[farthest] = 0.0f;
+				continue;
+			}
+			for (d = 0; d < dim; d++)
+				centroid[d] /= counts[c];
+		}
+	}
+
+	pfree(assignment);
+	pfree(counts);
+	pfree(distances);
+}
@@ -0,0 +1,519 @@
+/*-------------------------------------------------------------------------
+ *
+ *          Image similarity extension
+ *
+ * Copyright (c) 2015, PostgreSQL Global Development Group
+ *
+ * This software is released under the PostgreSQL Licence.
+ *
+ * Product quantization of patterns.  Pattern is split into equal subspaces
+ * of consecutive coefficients, and each subspace is encoded by number of the
+ * nearest of up to 256 centroids, so pq_pattern takes one byte per
+ * subspace.  Before quantization, coefficients are multiplied by square root
+ * of their weights in pattern_distance(), so that quantization error is
+ * measured in the same metric.
+ *
+ * Distance from code to pattern is asymmetric: the query pattern isn't
+ * quantized.  For each query a table of distances from its subvectors to all
+ * the centroids is calculated once and cached in fn_extra, then distance to
+ * each code is just sum of table lookups.
+ *
+ * Codebooks are trained by pq_train() and stored in imgsmlr_pq_codebook.
+ * They must not be modified after codes were made with them.
+ *
+ * IDENTIFICATION
+ *    imgsmlr/imgsmlr_pq.c
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+#include "fmgr.h"
+#include "imgsmlr.h"
+#include "catalog/pg_type.h"
+#include "executor/spi.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/memutils.h"
+
+PG_FUNCTION_INFO_V1(pq_pattern_in);
+Datum		pq_pattern_in(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(pq_pattern_out);
+Datum		pq_pattern_out(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(pq_codebook);
+Datum		pq_codebook(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(pq_train);
+Datum		pq_train(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(pattern2pq);
+Datum		pattern2pq(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(pq_distance);
+Datum		pq_distance(PG_FUNCTION_ARGS);
+
+#define PQ_MAX_CENTROIDS	256
+#define PQ_MIN_SUBSPACES	8
+#define PQ_MAX_SUBSPACES	256
+
+/*
+ * pq_pattern is varlena containing int32 id of codebook followed by one
+ * byte per subspace.  It's short enough to be stored with 1-byte header,
+ * so it's accessed unaligned.
+ */
+#define PQ_CODES_OFFSET		sizeof(int32)
+#define PQ_GET_SUBSPACES(p)	((int) (VARSIZE_ANY_EXHDR(p) - PQ_CODES_OFFSET))
+#define PQ_GET_CODES(p)		((uint8 *) VARDATA_ANY(p) + PQ_CODES_OFFSET)
+
+typedef struct
+{
+	int32		id;
+	int			size;			/* pattern size */
+	int			subspaces;
+	int			centroids;		/* number of centroids in each subspace */
+	int			dsub;			/* dimension of subspace */
+	float	   *weights;		/* square roots of coefficient weights */
+	float	   *data;			/* [subspaces][centroids][dsub] */
+} PqCodebook;
+
+typedef struct
+{
+	ModelCache	cache;
+	PqCodebook *codebook;		/* the model of cache */
+	Pattern    *query;			/* query the table was calculated for */
+	float	   *table;			/* [subspaces][centroids] */
+} PqState;
+
+static int32
+pqGetCodebookId(struct varlena *code)
+{
+	int32		id;
+
+	memcpy(&id, VARDATA_ANY(code), sizeof(int32));
+	return id;
+}
+
+/*
+ * Multiplier of coefficient in pattern distance, see
+ * calcPatternDistanceKernel(): coarser wavelet levels weigh more.
+ */
+static float
+coefficientWeight(int n, int i, int j)
+{
+	int			m = Max(i, j),
+				band = 1;
+
+	if (m == 0)
+		return (float) n;
+	while (band * 2 <= m)
+		band *= 2;
+	return (float) n / (float) (2 * band);
+}
+
+static float *
+makeWeights(int n, MemoryContext mcxt)
+{
+	float	   *weights = (float *) MemoryContextAlloc(mcxt, PATTERN_BYTES(n));
+	int			i,
+				j;
+
+	for (i = 0; i < n; i++)
+		for (j = 0; j < n; j++)
+			PATTERN_VALUE(weights, n, i, j) = sqrtf(coefficientWeight(n, i, j));
+	return weights;
+}
+
+/*
+ * Make codebook from the row of imgsmlr_pq_codebook, see loadModel().
+ */
+static void *
+parseCodebook(Datum *values, int32 id)
+{
+	PqCodebook *codebook = (PqCodebook *) palloc0(sizeof(PqCodebook));
+	ArrayType  *array;
+	Size		nvalues;
+
+	codebook->id = id;
+	codebook->size = DatumGetInt32(values[0]);
+	codebook->subspaces = DatumGetInt32(values[1]);
+	codebook->centroids = DatumGetInt32(values[2]);
+	array = DatumGetArrayTypeP(values[3]);
+	codebook->dsub = codebook->size * codebook->size / Max(codebook->subspaces, 1);
+
+	nvalues = (Size) codebook->subspaces * codebook->centroids * codebook->dsub;
+	if (ARR_NDIM(array) != 1 || ARR_HASNULL(array) ||
+		ARR_ELEMTYPE(array) != FLOAT4OID ||
+		ArrayGetNItems(ARR_NDIM(array), ARR_DIMS(array)) != nvalues)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("invalid product quantizer codebook %d", id)));
+
+	codebook->data = (float *) palloc(sizeof(float) * nvalues);
+	memcpy(codebook->data, ARR_DATA_PTR(array), sizeof(float) * nvalues);
+	codebook->weights = makeWeights(codebook->size, CurrentMemoryContext);
+
+	if ((Pointer) array != DatumGetPointer(values[3]))
+		pfree(array);
+	return codebook;
+}
+
+/*
+ * Get codebook of given id, loading it into fn_extra when needed.
+ */
+static PqState *
+getState(FunctionCallInfo fcinfo, int32 id)
+{
+	PqState    *state = (PqState *) fcinfo->flinfo->fn_extra;
+
+	if (!state)
+	{
+		state = (PqState *) MemoryContextAllocZero(fcinfo->flinfo->fn_mcxt,
+												   sizeof(PqState));
+		fcinfo->flinfo->fn_extra = state;
+	}
+
+	if (loadModel(fcinfo, &state->cache, id, "imgsmlr_pq_codebook",
+				  "pattern_size, subspaces, centroids, data",
+				  "product quantizer codebook", parseCodebook))
+	{
+		/* Distance table was calculated for the previous codebook */
+		if (state->query)
+		{
+			pfree(state->query);
+			pfree(state->table);
+			state->query = NULL;
+			state->table = NULL;
+		}
+		state->codebook = (PqCodebook *) state->cache.model;
+	}
+	return state;
+}
+
+static void
+checkPatternSize(PqCodebook *codebook, Pattern *pattern)
+{
+	if (patternGetSize(pattern) != codebook->size)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_EXCEPTION),
+				 errmsg("pattern size %d doesn't match size %d of codebook %d",
+						patternGetSize(pattern), codebook->size, codebook->id)));
+}
+
+Datum
+pq_pattern_in(PG_FUNCTION_ARGS)
+{
+	char	   *source = PG_GETARG_CSTRING(0);
+	char	   *s;
+	long		id;
+	int32		id32;
+	int			len,
+				subspaces;
+	struct varlena *result;
+
+	errno = 0;
+	id = strtol(source, &s, 10);
+	if (s == source || *s != ':' || errno != 0 || id < PG_INT32_MIN || id > PG_INT32_MAX)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+				 errmsg("invalid input syntax for type %s: \"%s\"",
+						"pq_pattern", source)));
+	s++;
+
+	len = strlen(s);
+	subspaces = len / 2;
+	if (len % 2 != 0 || subspaces < PQ_MIN_SUBSPACES || subspaces > PQ_MAX_SUBSPACES)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+				 errmsg("invalid input syntax for type %s: \"%s\"",
+						"pq_pattern", source)));
+
+	result = (struct varlena *) palloc(VARHDRSZ + PQ_CODES_OFFSET + subspaces);
+	SET_VARSIZE(result, VARHDRSZ + PQ_CODES_OFFSET + subspaces);
+	id32 = (int32) id;
+	memcpy(VARDATA(result), &id32, sizeof(int32));
+	hex_decode(s, len, (char *) VARDATA(result) + PQ_CODES_OFFSET);
+
+	PG_RETURN_POINTER(result);
+}
+
+Datum
+pq_pattern_out(PG_FUNCTION_ARGS)
+{
+	struct varlena *code = PG_GETARG_VARLENA_PP(0);
+	int			subspaces = PQ_GET_SUBSPACES(code);
+	char	   *result = (char *) palloc(2 * subspaces + 16);
+	int			len;
+
+	len = sprintf(result, "%d:", pqGetCodebookId(code));
+	len += hex_encode((char *) PQ_GET_CODES(code), subspaces, result + len);
+	result[len] = '\0';
+
+	PG_RETURN_CSTRING(result);
+}
+
+Datum
+pq_codebook(PG_FUNCTION_ARGS)
+{
+	struct varlena *code = PG_GETARG_VARLENA_PP(0);
+
+	PG_RETURN_INT32(pqGetCodebookId(code));
+}
+
+/*
+ * pattern2pq(pattern, codebook) encodes pattern with given codebook.
+ */
+Datum
+pattern2pq(PG_FUNCTION_ARGS)
+{
+	Pattern    *pattern = PG_GETARG_PATTERN(0);
+	int32		id = PG_GETARG_INT32(1);
+	PqState    *state = getState(fcinfo, id);
+	PqCodebook *codebook = state->codebook;
+	int			n2 = codebook->size * codebook->size;
+	float	   *scaled;
+	struct varlena *result;
+	uint8	   *codes;
+	int			i;
+
+	checkPatternSize(codebook, pattern);
+
+	scaled = (float *) palloc(sizeof(float) * n2);
+	for (i = 0; i < n2; i++)
+		scaled[i] = pattern->values[i] * codebook->weights[i];
+
+	result = (struct varlena *) palloc(VARHDRSZ + PQ_CODES_OFFSET + codebook->subspaces);
+	SET_VARSIZE(result, VARHDRSZ + PQ_CODES_OFFSET + codebook->subspaces);
+	memcpy(VARDATA(result), &id, sizeof(int32));
+	codes = (uint8 *) VARDATA(result) + PQ_CODES_OFFSET;
+	for (i = 0; i < codebook->subspaces; i++)
+	{
+		Size		offset = (Size) i * codebook->centroids * codebook->dsub;
+
+		codes[i] = (uint8) kmeansNearest(codebook->data + offset,
+										 codebook->centroids, codebook->dsub,
+										 scaled + (Size) i * codebook->dsub,
+										 NULL);
+	}
+
+	pfree(scaled);
+	PG_FREE_IF_COPY(pattern, 0);
+
+	PG_RETURN_POINTER(result);
+}
+
+/*
+ * Calculate table of squared distances from query subvectors to centroids.
+ */
+static void
+calcDistanceTable(PqState *state, Pattern *query, MemoryContext mcxt)
+{
+	PqCodebook *codebook = state->codebook;
+	int			dsub = codebook->dsub;
+	int			m,
+				c,
+				d;
+
+	if (state->query)
+	{
+		pfree(state->query);
+		pfree(state->table);
+	}
+	state->query = (Pattern *) MemoryContextAlloc(mcxt, VARSIZE(query));
+	memcpy(state->query, query, VARSIZE(query));
+	state->table = (float *) MemoryContextAlloc(mcxt, sizeof(float) *
+												codebook->subspaces *
+												codebook->centroids);
+
+	for (m = 0; m < codebook->subspaces; m++)
+	{
+		const float *q = query->values + (Size) m * dsub;
+		const float *w = codebook->weights + (Size) m * dsub;
+
+		for (c = 0; c < codebook->centroids; c++)
+		{
+			const float *centroid = codebook->data +
+				((Size) m * codebook->centroids + c) * dsub;
+			float		sum = 0.0f;
+
+			for (d = 0; d < dsub; d++)
+			{
+				float		diff = q[d] * w[d] - centroid[d];
+
+				sum += diff * diff;
+			}
+			state->table[m * codebook->centroids + c] = sum;
+		}
+	}
+}
+
+/*
+ * pq_distance(code, query) approximates pattern_distance() between encoded
+ * pattern and the query pattern.
+ */
+Datum
+pq_distance(PG_FUNCTION_ARGS)
+{
+	struct varlena *code = PG_GETARG_VARLENA_PP(0);
+	Pattern    *query = PG_GETARG_PATTERN(1);
+	PqState    *state = getState(fcinfo, pqGetCodebookId(code));
+	PqCodebook *codebook = state->codebook;
+	const uint8 *codes = PQ_GET_CODES(code);
+	const float *table;
+	float		sum = 0.0f;
+	int			m;
+
+	if (PQ_GET_SUBSPACES(code) != codebook->subspaces)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("pq_pattern doesn't match codebook %d", codebook->id)));
+
+	if (!state->query || VARSIZE(state->query) != VARSIZE(query) ||
+		memcmp(state->query, query, VARSIZE(query)) != 0)
+	{
+		checkPatternSize(codebook, query);
+		calcDistanceTable(state, query, fcinfo->flinfo->fn_mcxt);
+	}
+
+	/* Codes come from user input, so they aren't trusted to fit codebook */
+	table = state->table;
+	for (m = 0; m < codebook->subspaces; m++)
+	{
+		if (codes[m] >= codebook->centroids)
+			ereport(ERROR,
+					(errcode(ERRCODE_DATA_CORRUPTED),
+					 errmsg("pq_pattern code %d is out of range of %d centroids of codebook %d",
+							codes[m], codebook->centroids, codebook->id)));
+		sum += table[m * codebook->centroids + codes[m]];
+	}
+
+	PG_FREE_IF_COPY(query, 1);
+
+	PG_RETURN_FLOAT4(sqrtf(sum));
+}
+
+/*
+ * pq_train(rel, col, subspaces, sample_size, iterations) trains codebook on
+ * the patterns of given column and returns id of the new codebook.
+ */
+Datum
+pq_train(PG_FUNCTION_ARGS)
+{
+	Oid			relid = PG_GETARG_OID(0);
+	Name		attname = PG_GETARG_NAME(1);
+	int32		subspaces = PG_GETARG_INT32(2);
+	int32		sampleSize = PG_GETARG_INT32(3);
+	int32		iterations = PG_GETARG_INT32(4);
+	char	   *nsp = extensionNamespace(fcinfo);
+	int			nsamples,
+				size = 0,
+				n2,
+				dsub,
+				centroids,
+				ret,
+				i,
+				m;
+	float	   *weights,
+			   *matrix,
+			   *subvectors,
+			   *data;
+	Datum	   *elems;
+	Size		nvalues,
+				j;
+	Oid			argtypes[4] = {INT4OID, INT4OID, INT4OID, FLOAT4ARRAYOID};
+	Datum		args[4];
+	bool		isnull;
+	int32		id;
+
+	if (subspaces < PQ_MIN_SUBSPACES || subspaces > PQ_MAX_SUBSPACES)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("number of subspaces must be between %d and %d",
+						PQ_MIN_SUBSPACES, PQ_MAX_SUBSPACES)));
+	if (sampleSize < 1 || iterations < 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("sample size must be positive and number of iterations must not be negative")));
+
+	SPI_connect();
+
+	nsamples = spiSampleColumn(fcinfo, relid, attname, "pattern", sampleSize);
+	if (nsamples == 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_NO_DATA),
+				 errmsg("no patterns to train codebook on")));
+
+	/* Collect scaled patterns */
+	matrix = NULL;
+	weights = NULL;
+	n2 = 0;
+	for (i = 0; i < nsamples; i++)
+	{
+		Datum		value = SPI_getbinval(SPI_tuptable->vals[i],
+										  SPI_tuptable->tupdesc, 1, &isnull);
+		Pattern    *pattern = DatumGetPattern(value);
+
+		if (i == 0)
+		{
+			size = patternGetSize(pattern);
+			n2 = size * size;
+			if (n2 % subspaces != 0)
+				ereport(ERROR,
+						(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+						 errmsg("number of subspaces must divide number of pattern coefficients %d",
+								n2)));
+			if ((Size) nsamples * n2 > MaxAllocSize / sizeof(float))
+				ereport(ERROR,
+						(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+						 errmsg("sample of %d patterns of size %d is too large",
+								nsamples, size)));
+			weights = makeWeights(size, CurrentMemoryContext);
+			matrix = (float *) palloc(sizeof(float) * nsamples * n2);
+		}
+		else if (patternGetSize(pattern) != size)
+			ereport(ERROR,
+					(errcode(ERRCODE_DATA_EXCEPTION),
+					 errmsg("different pattern sizes %d and %d",
+							size, patternGetSize(pattern))));
+
+		for (j = 0; j < (Size) n2; j++)
+			matrix[(Size) i * n2 + j] = pattern->values[j] * weights[j];
+
+		if ((Pointer) pattern != DatumGetPointer(value))
+			pfree(pattern);
+	}
+
+	/* Cluster each subspace independently */
+	dsub = n2 / subspaces;
+	centroids = Min(nsamples, PQ_MAX_CENTROIDS);
+	nvalues = (Size) subspaces * centroids * dsub;
+	data = (float *) palloc(sizeof(float) * nvalues);
+	subvectors = (float *) palloc(sizeof(float) * nsamples * dsub);
+	for (m = 0; m < subspaces; m++)
+	{
+		for (i = 0; i < nsamples; i++)
+			memcpy(subvectors + (Size) i * dsub,
+				   matrix + (Size) i * n2 + (Size) m * dsub,
+				   sizeof(float) * dsub);
+		kmeansCluster(subvectors, nsamples, dsub, centroids, iterations,
+					  data + (Size) m * centroids * dsub);
+	}
+	pfree(subvectors);
+	pfree(matrix);
+
+	elems = (Datum *) palloc(sizeof(Datum) * nvalues);
+	for (j = 0; j < nvalues; j++)
+		elems[j] = Float4GetDatum(data[j]);
+
+	args[0] = Int32GetDatum(size);
+	args[1] = Int32GetDatum(subspaces);
+	args[2] = Int32GetDatum(centroids);
+	args[3] = PointerGetDatum(construct_array(elems, (int) nvalues, FLOAT4OID,
+											  sizeof(float4), FLOAT4PASSBYVAL, 'i'));
+	ret = SPI_execute_with_args(psprintf("INSERT INTO %s.imgsmlr_pq_codebook "
+										 "(pattern_size, subspaces, centroids, data) "
+										 "VALUES ($1, $2, $3, $4) RETURNING id", nsp),
+								4, argtypes, args, NULL, false, 1);
+	if (ret != SPI_OK_INSERT_RETURNING || SPI_processed != 1)
+		elog(ERROR, "could not store codebook: error code %d", ret);
+	id = DatumGetInt32(SPI_getbinval(SPI_tuptable->vals[0],
+									 SPI_tuptable->tupdesc, 1, &isnull));
+
+	SPI_finish();
+
+	PG_RETURN_INT32(id);
+}
@@ -0,0 +1,554 @@
+/*-------------------------------------------------------------------------
+ *
+ *          Image similarity extension
+ *
+ * Copyright (c) 2015, PostgreSQL Global Development Group
+ *
+ * This software is released under the PostgreSQL Licence.
+ *
+ * Prewarm of shared buffers for similarity search.  Pages are loaded in
+ * order of their usefulness for KNN scans: internal pages of GiST index on
+ * signature are visited by every scan, leaf pages by many of them, and heap
+ * pages and TOASTed patterns only for the candidates.  Internal pages are
+ * found by walking the tree from the root level by level, leaf pages and
+ * the rest are read in block order.
+ *
+ * Residency of each part is checked by scanning buffer descriptors, as
+ * pg_buffercache does.
+ *
+ * IDENTIFICATION
+ *    imgsmlr/imgsmlr_prewarm.c
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "imgsmlr.h"
+#include "access/gist_private.h"
+#include "access/heapam.h"
+#include "access/htup_details.h"
+#if PG_VERSION_NUM >= 120000
+#include "access/relation.h"
+#include "access/tableam.h"
+#include "executor/tuptable.h"
+#endif
+#if PG_VERSION_NUM >= 130000
+#include "access/detoast.h"
+#else
+#include "access/tuptoaster.h"
+#endif
+#include "catalog/index.h"
+#include "catalog/pg_am.h"
+#include "catalog/pg_type.h"
+#include "executor/instrument.h"
+#include "miscadmin.h"
+#include "storage/buf_internals.h"
+#include "storage/bufmgr.h"
+#include "utils/acl.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/datum.h"
+#include "utils/lsyscache.h"
+#include "utils/rel.h"
+#include "utils/snapmgr.h"
+#include "utils/tuplestore.h"
+
+/* Number of blocks to prefetch ahead of the current one */
+#define PREWARM_PREFETCH_DISTANCE 32
+
+/* Kinds of index blocks */
+#define PREWARM_OTHER		0
+#define PREWARM_INTERNAL	1
+#define PREWARM_LEAF		2
+
+PG_FUNCTION_INFO_V1(imgsmlr_prewarm);
+Datum		imgsmlr_prewarm(PG_FUNCTION_ARGS);
+
+static int64
+blocksRead(void)
+{
+	return (int64) pgBufferUsage.shared_blks_read;
+}
+
+/*
+ * Read given blocks into shared buffers, prefetching ahead.  NULL blocks
+ * means all the blocks of relation.
+ */
+static void
+readBlocks(Relation rel, BlockNumber *blocks, BlockNumber n)
+{
+	BlockNumber i,
+				nextPrefetch = 0;
+
+	for (i = 0; i < n; i++)
+	{
+		CHECK_FOR_INTERRUPTS();
+
+		while (nextPrefetch < n && nextPrefetch <= i + PREWARM_PREFETCH_DISTANCE)
+		{
+			PrefetchBuffer(rel, MAIN_FORKNUM, blocks ? blocks[nextPrefetch] : nextPrefetch);
+			nextPrefetch++;
+		}
+		ReleaseBuffer(ReadBufferExtended(rel, MAIN_FORKNUM,
+										 blocks ? blocks[i] : i,
+										 RBM_NORMAL, NULL));
+	}
+}
+
+static bool
+bufferTagMatches(BufferTag *tag, Relation rel)
+{
+#if PG_VERSION_NUM >= 160000
+	return tag->spcOid == rel->rd_locator.spcOid &&
+		tag->dbOid == rel->rd_locator.dbOid &&
+		BufTagGetRelNumber(tag) == rel->rd_locator.relNumber &&
+		tag->forkNum == MAIN_FORKNUM;
+#else
+	return RelFileNodeEquals(tag->rnode, rel->rd_node) &&
+		tag->forkNum == MAIN_FORKNUM;
+#endif
+}
+
+/*
+ * Find which blocks of relation are in shared buffers.
+ */
+static bool *
+residentBlocks(Relation rel, BlockNumber nblocks)
+{
+	bool	   *resident = (bool *) palloc0(sizeof(bool) * Max(nblocks, 1));
+	int			i;
+
+	for (i = 0; i < NBuffers; i++)
+	{
+		BufferDesc *bufHdr = GetBufferDescriptor(i);
+		BufferTag	tag;
+		bool		valid;
+
+#if PG_VERSION_NUM >= 90600
+		uint32		state = LockBufHdr(bufHdr);
+
+		tag = bufHdr->tag;
+		valid = (state & BM_VALID) != 0;
+		UnlockBufHdr(bufHdr, state);
+#else
+		LockBufHdr(bufHdr);
+		tag = bufHdr->tag;
+		valid = (bufHdr->flags & BM_VALID) != 0;
+		UnlockBufHdr(bufHdr);
+#endif
+
+		if (valid && bufferTagMatches(&tag, rel) && tag.blockNum < nblocks)
+			resident[tag.blockNum] = true;
+	}
+	return resident;
+}
+
+/*
+ * Read internal pages of GiST index level by level and mark them in kinds.
+ */
+static void
+prewarmGistInternal(Relation index, uint8 *kinds, BlockNumber nblocks)
+{
+	BlockNumber *queue;
+	int		   *depths;
+	BlockNumber blkno = GIST_ROOT_BLKNO;
+	int			height = 0,
+				head = 0,
+				tail = 0;
+
+	/* All the leaves are on the same level, descend to the leftmost one */
+	while (true)
+	{
+		Buffer		buffer = ReadBuffer(index, blkno);
+		Page		page;
+		bool		leaf;
+
+		LockBuffer(buffer, GIST_SHARE);
+		page = BufferGetPage(buffer);
+		leaf = GistPageIsLeaf(page) ||
+			PageGetMaxOffsetNumber(page) < FirstOffsetNumber;
+		if (!leaf)
+		{
+			IndexTuple	itup = (IndexTuple) PageGetItem(page,
+														PageGetItemId(page, FirstOffsetNumber));
+
+			blkno = ItemPointerGetBlockNumber(&itup->t_tid);
+		}
+		UnlockReleaseBuffer(buffer);
+
+		if (leaf || blkno >= nblocks)
+			break;
+		height++;
+	}
+
+	if (height == 0)
+		return;
+
+	queue = (BlockNumber *) palloc(sizeof(BlockNumber) * nblocks);
+	depths = (int *) palloc(sizeof(int) * nblocks);
+	kinds[GIST_ROOT_BLKNO] = PREWARM_INTERNAL;
+	queue[tail] = GIST_ROOT_BLKNO;
+	depths[tail++] = 0;
+
+	while (head < tail)
+	{
+		Buffer		buffer;
+		Page		page;
+		int			depth = depths[head];
+
+		CHECK_FOR_INTERRUPTS();
+
+		blkno = queue[head++];
+		buffer = ReadBuffer(index, blkno);
+		LockBuffer(buffer, GIST_SHARE);
+		page = BufferGetPage(buffer);
+
+		if (GistPageIsLeaf(page) || GistPageIsDeleted(page))
+		{
+			/* Tree was changed concurrently, leave it to the leaf pass */
+			kinds[blkno] = PREWARM_OTHER;
+		}
+		else if (depth + 1 < height)
+		{
+			OffsetNumber maxoff = PageGetMaxOffsetNumber(page),
+						off;
+
+			for (off = FirstOffsetNumber; off <= maxoff; off = OffsetNumberNext(off))
+			{
+				IndexTuple	itup = (IndexTuple) PageGetItem(page, PageGetItemId(page, off));
+				BlockNumber child = ItemPointerGetBlockNumber(&itup->t_tid);
+
+				if (child < nblocks && kinds[child] == PREWARM_OTHER)
+				{
+					kinds[child] = PREWARM_INTERNAL;
+					queue[tail] = child;
+					depths[tail++] = depth + 1;
+				}
+			}
+		}
+		UnlockReleaseBuffer(buffer);
+	}
+
+	pfree(queue);
+	pfree(depths);
+}
+
+/*
+ * Read the rest of GiST index in block order and mark leaf pages in kinds.
+ */
+static void
+prewarmGistLeaves(Relation index, uint8 *kinds, BlockNumber nblocks)
+{
+	BlockNumber *blocks = (BlockNumber *) palloc(sizeof(BlockNumber) * Max(nblocks, 1));
+	BlockNumber n = 0,
+				i;
+
+	for (i = 0; i < nblocks; i++)
+	{
+		if (kinds[i] != PREWARM_INTERNAL)
+			blocks[n++] = i;
+	}
+	readBlocks(index, blocks, n);
+
+	/* Pages are in buffers now, classify them */
+	for (i = 0; i < n; i++)
+	{
+		Buffer		buffer = ReadBuffer(index, blocks[i]);
+		Page		page;
+
+		LockBuffer(buffer, GIST_SHARE);
+		page = BufferGetPage(buffer);
+		if (!PageIsNew(page) && !GistPageIsDeleted(page) && GistPageIsLeaf(page))
+			kinds[blocks[i]] = PREWARM_LEAF;
+		UnlockReleaseBuffer(buffer);
+	}
+	pfree(blocks);
+}
+
+static int
+cmp_tid(const void *a, const void *b)
+{
+	return ItemPointerCompare((ItemPointer) a, (ItemPointer) b);
+}
+
+/*
+ * Read heap tuples of given TIDs and TOAST chunks of their values in given
+ * column.
+ */
+static void
+prewarmRows(Relation rel, AttrNumber attnum, ArrayType *tids)
+{
+	Snapshot	snapshot = GetActiveSnapshot();
+	BlockNumber nblocks = RelationGetNumberOfBlocks(rel);
+	Datum	   *tidDatums;
+	bool	   *tidNulls;
+	ItemPointerData *items;
+	int			ntids,
+				n = 0,
+				i;
+#if PG_VERSION_NUM >= 120000
+	TupleTableSlot *slot = table_slot_create(rel, NULL);
+#endif
+
+	deconstruct_array(tids, TIDOID, sizeof(ItemPointerData), false, 's',
+					  &tidDatums, &tidNulls, &ntids);
+	items = (ItemPointerData *) palloc(sizeof(ItemPointerData) * Max(ntids, 1));
+	for (i = 0; i < ntids; i++)
+	{
+		if (!tidNulls[i] &&
+			ItemPointerGetBlockNumber(DatumGetItemPointer(tidDatums[i])) < nblocks)
+			items[n++] = *DatumGetItemPointer(tidDatums[i]);
+	}
+	qsort(items, n, sizeof(ItemPointerData), cmp_tid);
+
+	for (i = 0; i < n; i++)
+	{
+		struct varlena *value = NULL;
+		bool		isnull;
+		Datum		datum;
+
+		CHECK_FOR_INTERRUPTS();
+
+#if PG_VERSION_NUM >= 120000
+		if (!table_tuple_fetch_row_version(rel, &items[i], snapshot, slot))
+			continue;
+		datum = slot_getattr(slot, attnum, &isnull);
+		if (!isnull)
+			value = (struct varlena *) DatumGetPointer(datumCopy(datum, false, -1));
+		ExecClearTuple(slot);
+#else
+		{
+			HeapTupleData tuple;
+			Buffer		buffer;
+
+			tuple.t_self = items[i];
+			if (!heap_fetch(rel, snapshot, &tuple, &buffer, false, NULL))
+				continue;
+			datum = heap_getattr(&tuple, attnum, RelationGetDescr(rel), &isnull);
+			if (!isnull)
+				value = (struct varlena *) DatumGetPointer(datumCopy(datum, false, -1));
+			ReleaseBuffer(buffer);
+		}
+#endif
+
+		/* Fetch TOAST chunks, there is no need to decompress the value */
+		if (value && VARATT_IS_EXTERNAL_ONDISK(value))
+#if PG_VERSION_NUM >= 130000
+			pfree(detoast_external_attr(value));
+#else
+			pfree(heap_tuple_fetch_attr(value));
+#endif
+		if (value)
+			pfree(value);
+	}
+
+#if PG_VERSION_NUM >= 120000
+	ExecDropSingleTupleTableSlot(slot);
+#endif
+	pfree(items);
+}
+
+/*
+ * Read all the blocks of TOAST relation and its indexes.
+ */
+static void
+prewarmToast(Relation toastrel)
+{
+	List	   *indexes = RelationGetIndexList(toastrel);
+	ListCell   *lc;
+
+	readBlocks(toastrel, NULL, RelationGetNumberOfBlocks(toastrel));
+	foreach(lc, indexes)
+	{
+		Relation	index = index_open(lfirst_oid(lc), AccessShareLock);
+
+		readBlocks(index, NULL, RelationGetNumberOfBlocks(index));
+		index_close(index, AccessShareLock);
+	}
+	list_free(indexes);
+}
+
+static void
+putPart(Tuplestorestate *tupstore, TupleDesc tupdesc, Relation rel,
+		const char *part, bool *resident, uint8 *kinds, uint8 kind,
+		BlockNumber nblocks, int64 loaded)
+{
+	Datum		values[5];
+	bool		nulls[5];
+	int64		pages = 0,
+				residentPages = 0;
+	BlockNumber i;
+
+	for (i = 0; i < nblocks; i++)
+	{
+		if (kinds && kinds[i] != kind)
+			continue;
+		pages++;
+		if (resident[i])
+			residentPages++;
+	}
+
+	memset(nulls, 0, sizeof(nulls));
+	values[0] = ObjectIdGetDatum(RelationGetRelid(rel));
+	values[1] = CStringGetTextDatum(part);
+	values[2] = Int64GetDatum(pages);
+	values[3] = Int64GetDatum(loaded);
+	if (pages > 0)
+		values[4] = Float8GetDatum((double) residentPages / (double) pages);
+	else
+		nulls[4] = true;
+	tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+}
+
+/*
+ * imgsmlr_prewarm(index, col, tids) loads GiST index on signatures into
+ * shared buffers: internal pages first, then leaf pages.  When column is
+ * given, heap and TOAST of the indexed table are loaded too, or only the
+ * rows of given TIDs and their values in the column.  Returns number of
+ * pages of each part, number of pages read from disk and fraction of pages
+ * resident in shared buffers.
+ */
+Datum
+imgsmlr_prewarm(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext oldcontext;
+	Oid			indexOid,
+				heapOid;
+	Relation	index,
+				rel = NULL,
+				toastrel = NULL;
+	AclResult	aclresult;
+	AttrNumber	attnum = InvalidAttrNumber;
+	BlockNumber nblocks;
+	uint8	   *kinds;
+	bool	   *resident;
+	int64		start,
+				internalLoaded,
+				leafLoaded,
+				heapLoaded = 0,
+				toastLoaded = 0;
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo) ||
+		!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	if (PG_ARGISNULL(0))
+		ereport(ERROR,
+				(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+				 errmsg("index must not be null")));
+	indexOid = PG_GETARG_OID(0);
+	if (get_rel_relkind(indexOid) != RELKIND_INDEX)
+		ereport(ERROR,
+				(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+				 errmsg("\"%s\" is not an index", get_rel_name(indexOid))));
+	heapOid = IndexGetRelation(indexOid, false);
+
+	aclresult = pg_class_aclcheck(heapOid, GetUserId(), ACL_SELECT);
+	if (aclresult != ACLCHECK_OK)
+		aclcheck_error(aclresult,
+#if PG_VERSION_NUM >= 110000
+					   OBJECT_TABLE,
+#else
+					   ACL_KIND_CLASS,
+#endif
+					   get_rel_name(heapOid));
+
+	if (!PG_ARGISNULL(1))
+	{
+		Name		attname = PG_GETARG_NAME(1);
+
+		attnum = get_attnum(heapOid, NameStr(*attname));
+		if (attnum == InvalidAttrNumber)
+			ereport(ERROR,
+					(errcode(ERRCODE_UNDEFINED_COLUMN),
+					 errmsg("column \"%s\" of relation \"%s\" does not exist",
+							NameStr(*attname), get_rel_name(heapOid))));
+	}
+
+	oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+	tupdesc = CreateTupleDescCopy(tupdesc);
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	MemoryContextSwitchTo(oldcontext);
+
+	index = index_open(indexOid, AccessShareLock);
+	if (index->rd_rel->relam != GIST_AM_OID)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("\"%s\" is not a GiST index",
+						RelationGetRelationName(index))));
+
+	nblocks = RelationGetNumberOfBlocks(index);
+	kinds = (uint8 *) palloc0(Max(nblocks, 1));
+
+	start = blocksRead();
+	if (nblocks > 0)
+		prewarmGistInternal(index, kinds, nblocks);
+	internalLoaded = blocksRead() - start;
+
+	start = blocksRead();
+	prewarmGistLeaves(index, kinds, nblocks);
+	leafLoaded = blocksRead() - start;
+
+	if (attnum != InvalidAttrNumber)
+	{
+		rel = relation_open(heapOid, AccessShareLock);
+		if (OidIsValid(rel->rd_rel->reltoastrelid))
+			toastrel = relation_open(rel->rd_rel->reltoastrelid, AccessShareLock);
+
+		if (PG_ARGISNULL(2))
+		{
+			start = blocksRead();
+			readBlocks(rel, NULL, RelationGetNumberOfBlocks(rel));
+			heapLoaded = blocksRead() - start;
+
+			start = blocksRead();
+			if (toastrel)
+				prewarmToast(toastrel);
+			toastLoaded = blocksRead() - start;
+		}
+		else
+		{
+			/* Heap and TOAST reads are interleaved, count them together */
+			start = blocksRead();
+			prewarmRows(rel, attnum, PG_GETARG_ARRAYTYPE_P(2));
+			heapLoaded = blocksRead() - start;
+		}
+	}
+
+	resident = residentBlocks(index, nblocks);
+	putPart(tupstore, tupdesc, index, "internal", resident, kinds,
+			PREWARM_INTERNAL, nblocks, internalLoaded);
+	putPart(tupstore, tupdesc, index, "leaf", resident, kinds,
+			PREWARM_LEAF, nblocks, leafLoaded);
+	index_close(index, AccessShareLock);
+
+	if (rel)
+	{
+		nblocks = RelationGetNumberOfBlocks(rel);
+		putPart(tupstore, tupdesc, rel, "heap", residentBlocks(rel, nblocks),
+				NULL, 0, nblocks, heapLoaded);
+		relation_close(rel, AccessShareLock);
+	}
+	if (toastrel)
+	{
+		nblocks = RelationGetNumberOfBlocks(toastrel);
+		putPart(tupstore, tupdesc, toastrel, "toast",
+				residentBlocks(toastrel, nblocks), NULL, 0, nblocks,
+				toastLoaded);
+		relation_close(toastrel, AccessShareLock);
+	}
+
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	return (Datum) 0;
+}
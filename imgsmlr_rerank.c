@@ -0,0 +1,378 @@
+/*-------------------------------------------------------------------------
+ *
+ *          Image similarity extension
+ *
+ * Copyright (c) 2015, PostgreSQL Global Development Group
+ *
+ * This software is released under the PostgreSQL Licence.
+ *
+ * Rerank of candidates found by signature search using patterns.  Rows are
+ * fetched in physical order instead of order of signature distance: heap
+ * tuples are read in block order with prefetching, then TOASTed patterns
+ * are detoasted in order of their TOAST value ids, which follows the order
+ * of chunks in TOAST table for the values inserted sequentially.
+ *
+ * IDENTIFICATION
+ *    imgsmlr/imgsmlr_rerank.c
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "imgsmlr.h"
+#include "access/heapam.h"
+#include "access/htup_details.h"
+#if PG_VERSION_NUM >= 120000
+#include "access/relation.h"
+#include "access/tableam.h"
+#include "executor/tuptable.h"
+#endif
+#if PG_VERSION_NUM >= 130000
+#include "access/detoast.h"
+#else
+#include "access/tuptoaster.h"
+#endif
+#include "catalog/pg_class.h"
+#include "catalog/pg_type.h"
+#include "miscadmin.h"
+#include "storage/bufmgr.h"
+#include "utils/acl.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/datum.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
+#include "utils/rls.h"
+#include "utils/snapmgr.h"
+
+/* Number of heap blocks to prefetch ahead of the current one */
+#define RERANK_PREFETCH_DISTANCE 32
+
+PG_FUNCTION_INFO_V1(pattern_rerank);
+Datum		pattern_rerank(PG_FUNCTION_ARGS);
+
+typedef struct
+{
+	ItemPointerData tid;
+	Oid			toastValueId;	/* InvalidOid for not TOASTed value */
+	struct varlena *value;		/* raw attribute value, NULL if not found */
+	float		distance;
+} RerankCandidate;
+
+static int cmp_tid(const void *a, const void *b);
+static int cmp_toast_value(const void *a, const void *b);
+static int cmp_distance(const void *a, const void *b);
+static void fetchCandidates(Relation rel, AttrNumber attnum,
+							RerankCandidate *candidates, int n);
+static int	rerankCandidates(FunctionCallInfo fcinfo,
+							 RerankCandidate **result);
+
+static int
+cmp_tid(const void *a, const void *b)
+{
+	return ItemPointerCompare((ItemPointer) &((const RerankCandidate *) a)->tid,
+							  (ItemPointer) &((const RerankCandidate *) b)->tid);
+}
+
+static int
+cmp_toast_value(const void *a, const void *b)
+{
+	Oid			oa = ((const RerankCandidate *) a)->toastValueId;
+	Oid			ob = ((const RerankCandidate *) b)->toastValueId;
+
+	if (oa < ob)
+		return -1;
+	else if (oa > ob)
+		return 1;
+	else
+		return cmp_tid(a, b);
+}
+
+static int
+cmp_distance(const void *a, const void *b)
+{
+	float		da = ((const RerankCandidate *) a)->distance;
+	float		db = ((const RerankCandidate *) b)->distance;
+
+	if (da < db)
+		return -1;
+	else if (da > db)
+		return 1;
+	else
+		return cmp_tid(a, b);
+}
+
+/*
+ * Fetch attribute values of visible candidates.  Candidates must be sorted
+ * by TID, so heap blocks are read sequentially while next blocks are being
+ * prefetched.
+ */
+static void
+fetchCandidates(Relation rel, AttrNumber attnum,
+				RerankCandidate *candidates, int n)
+{
+	Snapshot	snapshot = GetActiveSnapshot();
+	BlockNumber nblocks = RelationGetNumberOfBlocks(rel);
+	BlockNumber *blocks;
+	int			nblocksToRead = 0,
+				current = -1,
+				nextPrefetch = 0,
+				i;
+#if PG_VERSION_NUM >= 120000
+	TupleTableSlot *slot = table_slot_create(rel, NULL);
+#endif
+
+	/* Collect distinct blocks to read */
+	blocks = (BlockNumber *) palloc(sizeof(BlockNumber) * Max(n, 1));
+	for (i = 0; i < n; i++)
+	{
+		BlockNumber blkno = ItemPointerGetBlockNumber(&candidates[i].tid);
+
+		if (blkno < nblocks &&
+			(nblocksToRead == 0 || blocks[nblocksToRead - 1] != blkno))
+			blocks[nblocksToRead++] = blkno;
+	}
+
+	for (i = 0; i < n; i++)
+	{
+		RerankCandidate *c = &candidates[i];
+		BlockNumber blkno = ItemPointerGetBlockNumber(&c->tid);
+		bool		isnull;
+		Datum		value;
+
+		c->value = NULL;
+		c->toastValueId = InvalidOid;
+
+		/* TID may be stale after the table was truncated */
+		if (blkno >= nblocks)
+			continue;
+
+		if (current < 0 || blocks[current] != blkno)
+			current++;
+		while (nextPrefetch < nblocksToRead &&
+			   nextPrefetch <= current + RERANK_PREFETCH_DISTANCE)
+			PrefetchBuffer(rel, MAIN_FORKNUM, blocks[nextPrefetch++]);
+
+		CHECK_FOR_INTERRUPTS();
+
+#if PG_VERSION_NUM >= 120000
+		if (!table_tuple_fetch_row_version(rel, &c->tid, snapshot, slot))
+			continue;
+		value = slot_getattr(slot, attnum, &isnull);
+		if (!isnull)
+			c->value = (struct varlena *) DatumGetPointer(datumCopy(value, false, -1));
+		ExecClearTuple(slot);
+#else
+		{
+			HeapTupleData tuple;
+			Buffer		buffer;
+
+			tuple.t_self = c->tid;
+			if (!heap_fetch(rel, snapshot, &tuple, &buffer, false, NULL))
+				continue;
+			value = heap_getattr(&tuple, attnum, RelationGetDescr(rel), &isnull);
+			if (!isnull)
+				c->value = (struct varlena *) DatumGetPointer(datumCopy(value, false, -1));
+			ReleaseBuffer(buffer);
+		}
+#endif
+
+		if (c->value && VARATT_IS_EXTERNAL_ONDISK(c->value))
+		{
+			struct varatt_external toast_pointer;
+
+			VARATT_EXTERNAL_GET_POINTER(toast_pointer, c->value);
+			c->toastValueId = toast_pointer.va_valueid;
+		}
+	}
+
+#if PG_VERSION_NUM >= 120000
+	ExecDropSingleTupleTableSlot(slot);
+#endif
+	pfree(blocks);
+}
+
+/*
+ * Calculate pattern distances for candidates and return up to k nearest of
+ * them ordered by distance.
+ */
+static int
+rerankCandidates(FunctionCallInfo fcinfo, RerankCandidate **result)
+{
+	Oid			relid = PG_GETARG_OID(0);
+	Name		attname = PG_GETARG_NAME(1);
+	Pattern    *query = PG_GETARG_PATTERN(2);
+	ArrayType  *tids = PG_GETARG_ARRAYTYPE_P(3);
+	int32		k = PG_GETARG_INT32(4);
+	int			size = patternGetSize(query);
+	Relation	rel;
+	AttrNumber	attnum;
+	AclResult	aclresult;
+	Datum	   *tidDatums;
+	bool	   *tidNulls;
+	int			ntids,
+				n = 0,
+				nfound = 0,
+				i;
+	RerankCandidate *candidates;
+	float	   *buffer;
+	MemoryContext rerankCtx,
+				oldCtx;
+
+	aclresult = pg_class_aclcheck(relid, GetUserId(), ACL_SELECT);
+	if (aclresult != ACLCHECK_OK)
+		aclcheck_error(aclresult,
+#if PG_VERSION_NUM >= 110000
+					   OBJECT_TABLE,
+#else
+					   ACL_KIND_CLASS,
+#endif
+					   get_rel_name(relid));
+	if (check_enable_rls(relid, InvalidOid, false) == RLS_ENABLED)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("pattern rerank is not supported for tables with row level security")));
+
+	attnum = get_attnum(relid, NameStr(*attname));
+	if (attnum == InvalidAttrNumber)
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_COLUMN),
+				 errmsg("column \"%s\" of relation \"%s\" does not exist",
+						NameStr(*attname), get_rel_name(relid))));
+	if (get_atttype(relid, attnum) != get_fn_expr_argtype(fcinfo->flinfo, 2))
+		ereport(ERROR,
+				(errcode(ERRCODE_DATATYPE_MISMATCH),
+				 errmsg("column \"%s\" is not of pattern type",
+						NameStr(*attname))));
+
+	rel = relation_open(relid, AccessShareLock);
+	if (rel->rd_rel->relkind != RELKIND_RELATION &&
+		rel->rd_rel->relkind != RELKIND_MATVIEW)
+		ereport(ERROR,
+				(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+				 errmsg("\"%s\" is not a table or materialized view",
+						RelationGetRelationName(rel))));
+
+	deconstruct_array(tids, TIDOID, sizeof(ItemPointerData), false, 's',
+					  &tidDatums, &tidNulls, &ntids);
+
+	candidates = (RerankCandidate *) palloc(sizeof(RerankCandidate) * Max(ntids, 1));
+	for (i = 0; i < ntids; i++)
+	{
+		if (tidNulls[i])
+			continue;
+		candidates[n].tid = *DatumGetItemPointer(tidDatums[i]);
+		n++;
+	}
+
+	/* Sort candidates in physical order and remove duplicates */
+	qsort(candidates, n, sizeof(RerankCandidate), cmp_tid);
+	if (n > 1)
+	{
+		int			j = 0;
+
+		for (i = 1; i < n; i++)
+		{
+			if (!ItemPointerEquals(&candidates[i].tid, &candidates[j].tid))
+				candidates[++j] = candidates[i];
+		}
+		n = j + 1;
+	}
+
+	/* Values are needed only until distance is calculated */
+	rerankCtx = AllocSetContextCreate(CurrentMemoryContext,
+									  "pattern rerank context",
+									  ALLOCSET_DEFAULT_SIZES);
+	oldCtx = MemoryContextSwitchTo(rerankCtx);
+
+	fetchCandidates(rel, attnum, candidates, n);
+
+	/* Compressed candidates are all decompressed into the same buffer */
+	buffer = (float *) palloc(PATTERN_BYTES(size));
+
+	/* Detoast in order of TOAST values */
+	qsort(candidates, n, sizeof(RerankCandidate), cmp_toast_value);
+	for (i = 0; i < n; i++)
+	{
+		RerankCandidate *c = &candidates[i];
+		Pattern    *pattern;
+
+		if (!c->value)
+			continue;
+
+		CHECK_FOR_INTERRUPTS();
+
+		pattern = (Pattern *) PG_DETOAST_DATUM_PACKED(PointerGetDatum(c->value));
+		if (patternGetSize(pattern) != size)
+			ereport(ERROR,
+					(errcode(ERRCODE_DATA_EXCEPTION),
+					 errmsg("different pattern sizes %d and %d",
+							size, patternGetSize(pattern))));
+		c->distance = calcPatternDistance(query->values,
+										  patternGetValues(pattern, buffer),
+										  size);
+
+		if ((Pointer) pattern != (Pointer) c->value)
+			pfree(pattern);
+		pfree(c->value);
+		candidates[nfound++] = *c;
+	}
+
+	MemoryContextSwitchTo(oldCtx);
+	MemoryContextDelete(rerankCtx);
+	relation_close(rel, AccessShareLock);
+
+	qsort(candidates, nfound, sizeof(RerankCandidate), cmp_distance);
+
+	*result = candidates;
+	return Min(nfound, Max(k, 0));
+}
+
+/*
+ * pattern_rerank(rel, column, query, tids, k) returns up to k rows among
+ * given TIDs nearest to the query pattern, ordered by pattern distance.
+ */
+Datum
+pattern_rerank(PG_FUNCTION_ARGS)
+{
+	FuncCallContext *funcctx;
+	RerankCandidate *candidates;
+
+	if (SRF_IS_FIRSTCALL())
+	{
+		MemoryContext oldCtx;
+		TupleDesc	tupdesc;
+
+		funcctx = SRF_FIRSTCALL_INIT();
+		oldCtx = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+			elog(ERROR, "return type must be a row type");
+		funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+		funcctx->max_calls = rerankCandidates(fcinfo, &candidates);
+		funcctx->user_fctx = candidates;
+
+		MemoryContextSwitchTo(oldCtx);
+	}
+
+	funcctx = SRF_PERCALL_SETUP();
+	candidates = (RerankCandidate *) funcctx->user_fctx;
+
+	if (funcctx->call_cntr < funcctx->max_calls)
+	{
+		RerankCandidate *c = &candidates[funcctx->call_cntr];
+		Datum		values[2];
+		bool		nulls[2] = {false, false};
+		HeapTuple	tuple;
+
+		values[0] = ItemPointerGetDatum(&c->tid);
+		values[1] = Float4GetDatum(c->distance);
+		tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+
+		SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+	}
+
+	SRF_RETURN_DONE(funcctx);
+}
@@ -0,0 +1,385 @@
+/*-------------------------------------------------------------------------
+ *
+ *          Image similarity extension
+ *
+ * Copyright (c) 2015, PostgreSQL Global Development Group
+ *
+ * This software is released under the PostgreSQL Licence.
+ *
+ * Statistics and selectivity estimation for signatures.
+ *
+ * ANALYZE collects equi-depth histogram of each dimension of signature.
+ * Selectivity of signature_distance_within(col, query, radius) is estimated
+ * by approximating the distribution of squared distance to query with normal
+ * distribution: each dimension contributes its own mean and variance of
+ * squared difference, assuming values are uniform within histogram bins and
+ * dimensions are independent.
+ *
+ * IDENTIFICATION
+ *    imgsmlr/imgsmlr_selfuncs.c
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+#include "fmgr.h"
+#include "imgsmlr.h"
+#include "access/htup_details.h"
+#include "catalog/pg_statistic.h"
+#include "commands/vacuum.h"
+#include "utils/memutils.h"
+
+#if PG_VERSION_NUM >= 120000
+#include "nodes/supportnodes.h"
+#include "optimizer/optimizer.h"
+#include "utils/lsyscache.h"
+#include "utils/selfuncs.h"
+#endif
+
+PG_FUNCTION_INFO_V1(signature_typanalyze);
+Datum		signature_typanalyze(PG_FUNCTION_ARGS);
+#if PG_VERSION_NUM >= 120000
+PG_FUNCTION_INFO_V1(signature_distance_within_support);
+Datum		signature_distance_within_support(PG_FUNCTION_ARGS);
+#endif
+
+/*
+ * Private kind of pg_statistic slot.  stanumbers contains histogram bounds
+ * of all the dimensions one after another.
+ */
+#define STATISTIC_KIND_SIGNATURE_HISTOGRAM 10771
+
+/* Selectivity of distance restriction when there are no statistics */
+#define DEFAULT_SIGNATURE_DISTANCE_SEL 0.005
+
+static void compute_signature_stats(VacAttrStats *stats,
+									AnalyzeAttrFetchFunc fetchfunc,
+									int samplerows, double totalrows);
+
+static int
+float_cmp(const void *a, const void *b)
+{
+	float		fa = *(const float *) a,
+				fb = *(const float *) b;
+
+	return (fa > fb) ? 1 : ((fa < fb) ? -1 : 0);
+}
+
+static int
+signature_ptr_cmp(const void *a, const void *b)
+{
+	return memcmp(*(Signature *const *) a, *(Signature *const *) b,
+				  sizeof(Signature));
+}
+
+/*
+ * signature_typanalyze(internal) replaces the standard statistics of
+ * signature columns with per-dimension histograms.
+ */
+Datum
+signature_typanalyze(PG_FUNCTION_ARGS)
+{
+	VacAttrStats *stats = (VacAttrStats *) PG_GETARG_POINTER(0);
+#if PG_VERSION_NUM >= 170000
+	int			target = stats->attstattarget;
+#else
+	int			target = stats->attr->attstattarget;
+#endif
+
+	if (target < 0)
+		target = default_statistics_target;
+
+	stats->compute_stats = compute_signature_stats;
+	stats->minrows = 300 * target;
+
+	PG_RETURN_BOOL(true);
+}
+
+static void
+compute_signature_stats(VacAttrStats *stats, AnalyzeAttrFetchFunc fetchfunc,
+						int samplerows, double totalrows)
+{
+	Signature **rows;
+	float	   *values,
+			   *numbers;
+	int			nonnull = 0,
+				nulls = 0,
+				ndistinct,
+				nsingle,
+				nbounds,
+				target,
+				i,
+				j,
+				d;
+	MemoryContext oldCtx;
+
+#if PG_VERSION_NUM >= 170000
+	target = stats->attstattarget;
+#else
+	target = stats->attr->attstattarget;
+#endif
+	if (target < 0)
+		target = default_statistics_target;
+
+	rows = (Signature **) palloc(sizeof(Signature *) * Max(samplerows, 1));
+	for (i = 0; i < samplerows; i++)
+	{
+		bool		isnull;
+		Datum		value;
+		Signature  *signature;
+
+#if PG_VERSION_NUM >= 180000
+		vacuum_delay_point(true);
+#else
+		vacuum_delay_point();
+#endif
+
+		value = fetchfunc(stats, i, &isnull);
+		if (isnull)
+		{
+			nulls++;
+			continue;
+		}
+
+		/* Histograms can't represent NaNs */
+		signature = (Signature *) DatumGetPointer(value);
+		for (d = 0; d < SIGNATURE_SIZE; d++)
+		{
+			if (isnan(signature->values[d]))
+				break;
+		}
+		if (d < SIGNATURE_SIZE)
+			continue;
+
+		rows[nonnull++] = signature;
+	}
+
+	stats->stats_valid = true;
+	stats->stanullfrac = (samplerows > 0) ? (double) nulls / samplerows : 0.0;
+	stats->stawidth = sizeof(Signature);
+	stats->stadistinct = 0.0;
+
+	if (nonnull < 2)
+	{
+		pfree(rows);
+		return;
+	}
+
+	/* Estimate number of distinct values the same way as analyze.c does */
+	qsort(rows, nonnull, sizeof(Signature *), signature_ptr_cmp);
+	ndistinct = 0;
+	nsingle = 0;
+	for (i = 0; i < nonnull; i = j)
+	{
+		for (j = i + 1; j < nonnull; j++)
+		{
+			if (signature_ptr_cmp(&rows[i], &rows[j]) != 0)
+				break;
+		}
+		ndistinct++;
+		if (j - i == 1)
+			nsingle++;
+	}
+	if (nsingle == nonnull)
+		stats->stadistinct = -1.0 * (1.0 - stats->stanullfrac);
+	else if ((double) samplerows >= totalrows)
+		stats->stadistinct = ndistinct;
+	else
+	{
+		double		n = samplerows,
+					N = totalrows;
+
+		stats->stadistinct = floor((n * ndistinct) /
+								   ((n - nsingle) + nsingle * n / N) + 0.5);
+		if (stats->stadistinct > 0.1 * N)
+			stats->stadistinct = -(stats->stadistinct / N);
+	}
+
+	/* Equi-depth histogram of each dimension */
+	nbounds = Min(target + 1, nonnull);
+	oldCtx = MemoryContextSwitchTo(stats->anl_context);
+	numbers = (float *) palloc(sizeof(float) * SIGNATURE_SIZE * nbounds);
+	MemoryContextSwitchTo(oldCtx);
+
+	values = (float *) palloc(sizeof(float) * nonnull);
+	for (d = 0; d < SIGNATURE_SIZE; d++)
+	{
+		for (i = 0; i < nonnull; i++)
+			values[i] = rows[i]->values[d];
+		qsort(values, nonnull, sizeof(float), float_cmp);
+
+		for (j = 0; j < nbounds; j++)
+			numbers[d * nbounds + j] =
+				values[(int) (((int64) j * (nonnull - 1)) / (nbounds - 1))];
+	}
+	pfree(values);
+	pfree(rows);
+
+	stats->stakind[0] = STATISTIC_KIND_SIGNATURE_HISTOGRAM;
+	stats->staop[0] = InvalidOid;
+#if PG_VERSION_NUM >= 120000
+	stats->stacoll[0] = InvalidOid;
+#endif
+	stats->stanumbers[0] = numbers;
+	stats->numnumbers[0] = SIGNATURE_SIZE * nbounds;
+	stats->numvalues[0] = 0;
+}
+
+#if PG_VERSION_NUM >= 120000
+
+/*
+ * Moments E[(x - q)^2] and E[(x - q)^4] of x uniformly distributed in
+ * [lo + q, hi + q].
+ */
+static void
+binMoments(double lo, double hi, double *m2, double *m4)
+{
+	double		w = hi - lo;
+
+	if (w < 1e-9)
+	{
+		*m2 = lo * lo;
+		*m4 = *m2 * *m2;
+	}
+	else
+	{
+		double		lo2 = lo * lo,
+					hi2 = hi * hi;
+
+		*m2 = (hi2 * hi - lo2 * lo) / (3.0 * w);
+		*m4 = (hi2 * hi2 * hi - lo2 * lo2 * lo) / (5.0 * w);
+	}
+}
+
+/*
+ * Estimate fraction of rows whose distance to the query is within radius.
+ */
+static Selectivity
+signatureWithinSelectivity(VariableStatData *vardata, Signature *query,
+						   float radius)
+{
+	AttStatsSlot sslot;
+	double		nullfrac,
+				mean = 0.0,
+				var = 0.0,
+				r2;
+	int			nbounds,
+				d,
+				j;
+	Selectivity sel;
+
+	if (radius < 0.0f)
+		return 0.0;
+
+	if (!HeapTupleIsValid(vardata->statsTuple))
+		return DEFAULT_SIGNATURE_DISTANCE_SEL;
+
+	nullfrac = ((Form_pg_statistic) GETSTRUCT(vardata->statsTuple))->stanullfrac;
+
+	if (!get_attstatsslot(&sslot, vardata->statsTuple,
+						  STATISTIC_KIND_SIGNATURE_HISTOGRAM, InvalidOid,
+						  ATTSTATSSLOT_NUMBERS))
+		return DEFAULT_SIGNATURE_DISTANCE_SEL;
+
+	nbounds = sslot.nnumbers / SIGNATURE_SIZE;
+	if (nbounds < 2)
+	{
+		free_attstatsslot(&sslot);
+		return DEFAULT_SIGNATURE_DISTANCE_SEL;
+	}
+
+	for (d = 0; d < SIGNATURE_SIZE; d++)
+	{
+		float4	   *bounds = sslot.numbers + d * nbounds;
+		double		q = query->values[d],
+					m2 = 0.0,
+					m4 = 0.0;
+
+		for (j = 0; j < nbounds - 1; j++)
+		{
+			double		b2,
+						b4;
+
+			binMoments(bounds[j] - q, bounds[j + 1] - q, &b2, &b4);
+			m2 += b2;
+			m4 += b4;
+		}
+		m2 /= (nbounds - 1);
+		m4 /= (nbounds - 1);
+
+		mean += m2;
+		var += Max(m4 - m2 * m2, 0.0);
+	}
+	free_attstatsslot(&sslot);
+
+	r2 = (double) radius * radius;
+	if (var <= 0.0)
+		sel = (r2 >= mean) ? 1.0 : 0.0;
+	else
+		sel = 0.5 * erfc((mean - r2) / sqrt(2.0 * var));
+
+	sel *= (1.0 - nullfrac);
+	CLAMP_PROBABILITY(sel);
+	return sel;
+}
+
+/*
+ * Planner support function of signature_distance_within(): estimates its
+ * selectivity when the query signature and radius are known at plan time.
+ */
+Datum
+signature_distance_within_support(PG_FUNCTION_ARGS)
+{
+	Node	   *rawreq = (Node *) PG_GETARG_POINTER(0);
+	SupportRequestSelectivity *req;
+	Node	   *left,
+			   *right,
+			   *radius,
+			   *var;
+	Const	   *query;
+	VariableStatData vardata;
+
+	if (!IsA(rawreq, SupportRequestSelectivity))
+		PG_RETURN_POINTER(NULL);
+
+	req = (SupportRequestSelectivity *) rawreq;
+	req->selectivity = DEFAULT_SIGNATURE_DISTANCE_SEL;
+
+	if (req->is_join || list_length(req->args) != 3)
+		PG_RETURN_POINTER(req);
+
+	left = estimate_expression_value(req->root, linitial(req->args));
+	right = estimate_expression_value(req->root, lsecond(req->args));
+	radius = estimate_expression_value(req->root, lthird(req->args));
+
+	if (IsA(right, Const))
+	{
+		var = left;
+		query = (Const *) right;
+	}
+	else if (IsA(left, Const))
+	{
+		var = right;
+		query = (Const *) left;
+	}
+	else
+		PG_RETURN_POINTER(req);
+
+	if (!IsA(radius, Const) || ((Const *) radius)->constisnull ||
+		query->constisnull)
+	{
+		/* Strict function returns NULL for NULL arguments */
+		if ((IsA(radius, Const) && ((Const *) radius)->constisnull) ||
+			query->constisnull)
+			req->selectivity = 0.0;
+		PG_RETURN_POINTER(req);
+	}
+
+	examine_variable(req->root, var, req->varRelid, &vardata);
+	req->selectivity = signatureWithinSelectivity(&vardata,
+												  (Signature *) DatumGetPointer(query->constvalue),
+												  DatumGetFloat4(((Const *) radius)->constvalue));
+	ReleaseVariableStats(vardata);
+
+	PG_RETURN_POINTER(req);
+}
+
+#endif   /* PG_VERSION_NUM >= 120000 */
@@ -0,0 +1,310 @@
+/*-------------------------------------------------------------------------
+ *
+ *          Image similarity extension
+ *
+ * Copyright (c) 2015, PostgreSQL Global Development Group
+ *
+ * This software is released under the PostgreSQL Licence.
+ *
+ * SP-GiST vantage-point tree over signatures.  Each inner tuple has vantage
+ * point as its prefix and two nodes: signatures which are not farther from
+ * vantage point than the node label radius and signatures which are farther.
+ * Unlike GiST boxes, the partitions never overlap.
+ *
+ * KNN search is supported since PostgreSQL 12.
+ *
+ * IDENTIFICATION
+ *    imgsmlr/imgsmlr_spgist.c
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+#include "fmgr.h"
+#include "imgsmlr.h"
+#include "access/spgist.h"
+#include "access/skey.h"
+#include "catalog/pg_type.h"
+#include "utils/memutils.h"
+#include "c.h"
+#include <math.h>
+
+
+PG_FUNCTION_INFO_V1(signature_spg_config);
+PG_FUNCTION_INFO_V1(signature_spg_choose);
+PG_FUNCTION_INFO_V1(signature_spg_picksplit);
+PG_FUNCTION_INFO_V1(signature_spg_inner_consistent);
+PG_FUNCTION_INFO_V1(signature_spg_leaf_consistent);
+
+Datum		signature_spg_config(PG_FUNCTION_ARGS);
+Datum		signature_spg_choose(PG_FUNCTION_ARGS);
+Datum		signature_spg_picksplit(PG_FUNCTION_ARGS);
+Datum		signature_spg_inner_consistent(PG_FUNCTION_ARGS);
+Datum		signature_spg_leaf_consistent(PG_FUNCTION_ARGS);
+
+typedef struct
+{
+	int		index;
+	float	distance;
+} SortedDistance;
+
+static int cmp_distance(const void *a, const void *b);
+
+Datum
+signature_spg_config(PG_FUNCTION_ARGS)
+{
+	spgConfigIn *cfgin = (spgConfigIn *) PG_GETARG_POINTER(0);
+	spgConfigOut *cfg = (spgConfigOut *) PG_GETARG_POINTER(1);
+
+	cfg->prefixType = cfgin->attType;
+	cfg->labelType = FLOAT4OID;
+	cfg->canReturnData = true;
+	cfg->longValuesOK = false;
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * Both nodes of inner tuple are labeled with the same radius.  Node 0 holds
+ * signatures within the radius from vantage point, node 1 holds the rest.
+ */
+Datum
+signature_spg_choose(PG_FUNCTION_ARGS)
+{
+	spgChooseIn *in = (spgChooseIn *) PG_GETARG_POINTER(0);
+	spgChooseOut *out = (spgChooseOut *) PG_GETARG_POINTER(1);
+	Signature  *signature = (Signature *) DatumGetPointer(in->datum);
+	Signature  *center;
+	float		radius;
+
+	out->resultType = spgMatchNode;
+	out->result.matchNode.restDatum = PointerGetDatum(signature);
+
+	if (in->allTheSame)
+	{
+		/* nodeN will be set by core */
+		out->result.matchNode.levelAdd = 0;
+		PG_RETURN_VOID();
+	}
+
+	Assert(in->hasPrefix);
+	Assert(in->nNodes == 2);
+
+	center = (Signature *) DatumGetPointer(in->prefixDatum);
+	radius = DatumGetFloat4(in->nodeLabels[0]);
+
+	out->result.matchNode.nodeN =
+		(calcSignatureDistance(center, signature) <= radius) ? 0 : 1;
+	out->result.matchNode.levelAdd = 1;
+
+	PG_RETURN_VOID();
+}
+
+static int
+cmp_distance(const void *a, const void *b)
+{
+	float		da = ((const SortedDistance *) a)->distance;
+	float		db = ((const SortedDistance *) b)->distance;
+
+	if (da < db)
+		return -1;
+	else if (da > db)
+		return 1;
+	else
+		return 0;
+}
+
+/*
+ * Vantage point is the signature farthest from the mean of all signatures,
+ * radius is the median distance from vantage point.
+ */
+Datum
+signature_spg_picksplit(PG_FUNCTION_ARGS)
+{
+	spgPickSplitIn *in = (spgPickSplitIn *) PG_GETARG_POINTER(0);
+	spgPickSplitOut *out = (spgPickSplitOut *) PG_GETARG_POINTER(1);
+	Signature	mean;
+	Signature  *center;
+	SortedDistance *sorted;
+	float		radius,
+				maxDistance = -1.0f;
+	int			i,
+				j,
+				best = 0;
+
+	memset(&mean, 0, sizeof(Signature));
+	for (i = 0; i < in->nTuples; i++)
+	{
+		Signature  *signature = (Signature *) DatumGetPointer(in->datums[i]);
+
+		for (j = 0; j < SIGNATURE_SIZE; j++)
+			mean.values[j] += signature->values[j];
+	}
+	for (j = 0; j < SIGNATURE_SIZE; j++)
+		mean.values[j] /= (float) in->nTuples;
+
+	for (i = 0; i < in->nTuples; i++)
+	{
+		float		distance = calcSignatureDistance(&mean,
+									(Signature *) DatumGetPointer(in->datums[i]));
+
+		if (distance > maxDistance)
+		{
+			maxDistance = distance;
+			best = i;
+		}
+	}
+
+	center = (Signature *) palloc(sizeof(Signature));
+	memcpy(center, DatumGetPointer(in->datums[best]), sizeof(Signature));
+
+	sorted = (SortedDistance *) palloc(sizeof(SortedDistance) * in->nTuples);
+	for (i = 0; i < in->nTuples; i++)
+	{
+		sorted[i].index = i;
+		sorted[i].distance = calcSignatureDistance(center,
+									(Signature *) DatumGetPointer(in->datums[i]));
+	}
+	qsort(sorted, in->nTuples, sizeof(SortedDistance), cmp_distance);
+	radius = sorted[(in->nTuples - 1) / 2].distance;
+
+	out->hasPrefix = true;
+	out->prefixDatum = PointerGetDatum(center);
+	out->nNodes = 2;
+	out->nodeLabels = (Datum *) palloc(sizeof(Datum) * 2);
+	out->nodeLabels[0] = Float4GetDatum(radius);
+	out->nodeLabels[1] = Float4GetDatum(radius);
+	out->mapTuplesToNodes = (int *) palloc(sizeof(int) * in->nTuples);
+	out->leafTupleDatums = (Datum *) palloc(sizeof(Datum) * in->nTuples);
+
+	/*
+	 * Signatures equidistant with the median go to the inner node.  If all of
+	 * them are equidistant, core will make allTheSame inner tuple.
+	 */
+	for (i = 0; i < in->nTuples; i++)
+	{
+		int			index = sorted[i].index;
+
+		out->mapTuplesToNodes[index] = (sorted[i].distance <= radius) ? 0 : 1;
+		out->leafTupleDatums[index] = in->datums[index];
+	}
+
+	pfree(sorted);
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * There are no search operators, so every node is consistent.  For KNN,
+ * lower bound of distance to node is calculated from triangle inequality
+ * and combined with the bound of parent node passed as traversal value.
+ */
+Datum
+signature_spg_inner_consistent(PG_FUNCTION_ARGS)
+{
+	spgInnerConsistentIn *in = (spgInnerConsistentIn *) PG_GETARG_POINTER(0);
+	spgInnerConsistentOut *out = (spgInnerConsistentOut *) PG_GETARG_POINTER(1);
+	int			i;
+#if PG_VERSION_NUM >= 120000
+	double	   *parentBounds = (double *) in->traversalValue;
+	double	   *centerDistances = NULL;
+	Signature  *center = NULL;
+	int			j;
+#endif
+
+	out->nNodes = 0;
+	out->nodeNumbers = (int *) palloc(sizeof(int) * in->nNodes);
+
+#if PG_VERSION_NUM >= 120000
+	if (in->norderbys > 0)
+	{
+		out->distances = (double **) palloc(sizeof(double *) * in->nNodes);
+		out->traversalValues = (void **) palloc(sizeof(void *) * in->nNodes);
+
+		if (!in->allTheSame)
+		{
+			Assert(in->hasPrefix);
+			center = (Signature *) DatumGetPointer(in->prefixDatum);
+			centerDistances = (double *) palloc(sizeof(double) * in->norderbys);
+			for (j = 0; j < in->norderbys; j++)
+			{
+				Signature  *query = (Signature *)
+					DatumGetPointer(in->orderbys[j].sk_argument);
+
+				centerDistances[j] = calcSignatureDistance(center, query);
+			}
+		}
+	}
+#endif
+
+	for (i = 0; i < in->nNodes; i++)
+	{
+		out->nodeNumbers[out->nNodes] = i;
+
+#if PG_VERSION_NUM >= 120000
+		if (in->norderbys > 0)
+		{
+			MemoryContext oldCtx;
+			double	   *bounds;
+			double		radius = DatumGetFloat4(in->nodeLabels[i]);
+
+			oldCtx = MemoryContextSwitchTo(in->traversalMemoryContext);
+			bounds = (double *) palloc(sizeof(double) * in->norderbys);
+			MemoryContextSwitchTo(oldCtx);
+
+			for (j = 0; j < in->norderbys; j++)
+			{
+				double		bound = 0.0;
+
+				/* Nothing is known about nodes of allTheSame tuple */
+				if (!in->allTheSame)
+				{
+					if (i == 0)
+						bound = centerDistances[j] - radius;
+					else
+						bound = radius - centerDistances[j];
+				}
+				if (parentBounds)
+					bound = Max(bound, parentBounds[j]);
+				bounds[j] = Max(bound, 0.0);
+			}
+
+			out->distances[out->nNodes] = bounds;
+			out->traversalValues[out->nNodes] = bounds;
+		}
+#endif
+
+		out->nNodes++;
+	}
+
+	PG_RETURN_VOID();
+}
+
+Datum
+signature_spg_leaf_consistent(PG_FUNCTION_ARGS)
+{
+	spgLeafConsistentIn *in = (spgLeafConsistentIn *) PG_GETARG_POINTER(0);
+	spgLeafConsistentOut *out = (spgLeafConsistentOut *) PG_GETARG_POINTER(1);
+#if PG_VERSION_NUM >= 120000
+	Signature  *signature = (Signature *) DatumGetPointer(in->leafDatum);
+	int			j;
+#endif
+
+	out->leafValue = in->leafDatum;
+	out->recheck = false;
+
+#if PG_VERSION_NUM >= 120000
+	if (in->norderbys > 0)
+	{
+		out->recheckDistances = false;
+		out->distances = (double *) palloc(sizeof(double) * in->norderbys);
+		for (j = 0; j < in->norderbys; j++)
+		{
+			Signature  *query = (Signature *)
+				DatumGetPointer(in->orderbys[j].sk_argument);
+
+			out->distances[j] = calcSignatureDistance(signature, query);
+		}
+	}
+#endif
+
+	PG_RETURN_BOOL(true);
+}
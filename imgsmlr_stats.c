@@ -0,0 +1,466 @@
+/*-------------------------------------------------------------------------
+ *
+ *          Image similarity extension
+ *
+ * Copyright (c) 2015, PostgreSQL Global Development Group
+ *
+ * This software is released under the PostgreSQL Licence.
+ *
+ * Instrumentation counters.  Opclass and image loading functions increment
+ * backend-local counters, which are added to the cumulative counters in
+ * shared memory at the end of each top-level query and transaction.
+ * Cumulative counters are available only when imgsmlr is loaded via
+ * shared_preload_libraries.
+ *
+ * IDENTIFICATION
+ *    imgsmlr/imgsmlr_stats.c
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "imgsmlr.h"
+#include "access/htup_details.h"
+#include "access/xact.h"
+#include "executor/executor.h"
+#include "miscadmin.h"
+#include "port/atomics.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/memutils.h"
+#include "utils/tuplestore.h"
+
+PG_FUNCTION_INFO_V1(imgsmlr_stats);
+Datum		imgsmlr_stats(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(imgsmlr_stats_reset);
+Datum		imgsmlr_stats_reset(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(imgsmlr_ingest_stats);
+Datum		imgsmlr_ingest_stats(PG_FUNCTION_ARGS);
+
+typedef struct ImgsmlrSharedStats
+{
+	pg_atomic_uint64 counters[IMGSMLR_NUM_COUNTERS];
+	pg_atomic_uint64 ingestCounters[IMGSMLR_NUM_FORMATS][IMGSMLR_NUM_INGEST_COUNTERS];
+} ImgsmlrSharedStats;
+
+/* State of KNN scan kept in fn_extra of the distance function */
+typedef struct ImgsmlrScanStats
+{
+	Pointer		lastPage;
+} ImgsmlrScanStats;
+
+uint64		imgsmlrCounters[IMGSMLR_NUM_COUNTERS];
+uint64		imgsmlrIngestCounters[IMGSMLR_NUM_FORMATS][IMGSMLR_NUM_INGEST_COUNTERS];
+bool		imgsmlr_track_timing = false;
+
+const char *const imgsmlrFormatNames[IMGSMLR_NUM_FORMATS] = {
+	"jpeg",
+	"png",
+	"gif",
+	"pattern"
+};
+
+static bool imgsmlr_stats_notice = false;
+static uint64 flushedCounters[IMGSMLR_NUM_COUNTERS];
+static uint64 flushedIngestCounters[IMGSMLR_NUM_FORMATS][IMGSMLR_NUM_INGEST_COUNTERS];
+static uint64 queryStartCounters[IMGSMLR_NUM_COUNTERS];
+static int	nestingLevel = 0;
+static ImgsmlrSharedStats *sharedStats = NULL;
+
+static ExecutorStart_hook_type prev_ExecutorStart = NULL;
+static ExecutorEnd_hook_type prev_ExecutorEnd = NULL;
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+#endif
+
+static void imgsmlr_ExecutorStart(QueryDesc *queryDesc, int eflags);
+static void imgsmlr_ExecutorEnd(QueryDesc *queryDesc);
+static void imgsmlr_shmem_startup(void);
+#if PG_VERSION_NUM >= 150000
+static void imgsmlr_shmem_request(void);
+#endif
+static void imgsmlr_xact_callback(XactEvent event, void *arg);
+static void flushStats(void);
+static bool isIngestTime(int counter);
+static void emitStatsNotice(void);
+
+void
+statsInit(void)
+{
+	DefineCustomBoolVariable("imgsmlr.track_timing",
+							 "Collects timing of GiST penalty and picksplit calls.",
+							 NULL,
+							 &imgsmlr_track_timing,
+							 false,
+							 PGC_SUSET,
+							 0,
+							 NULL, NULL, NULL);
+	DefineCustomBoolVariable("imgsmlr.stats_notice",
+							 "Reports imgsmlr counters of each query as NOTICE.",
+							 NULL,
+							 &imgsmlr_stats_notice,
+							 false,
+							 PGC_USERSET,
+							 0,
+							 NULL, NULL, NULL);
+
+	if (process_shared_preload_libraries_in_progress)
+	{
+#if PG_VERSION_NUM >= 150000
+		prev_shmem_request_hook = shmem_request_hook;
+		shmem_request_hook = imgsmlr_shmem_request;
+#else
+		RequestAddinShmemSpace(MAXALIGN(sizeof(ImgsmlrSharedStats)));
+#endif
+		prev_shmem_startup_hook = shmem_startup_hook;
+		shmem_startup_hook = imgsmlr_shmem_startup;
+	}
+
+	prev_ExecutorStart = ExecutorStart_hook;
+	ExecutorStart_hook = imgsmlr_ExecutorStart;
+	prev_ExecutorEnd = ExecutorEnd_hook;
+	ExecutorEnd_hook = imgsmlr_ExecutorEnd;
+
+	RegisterXactCallback(imgsmlr_xact_callback, NULL);
+}
+
+#if PG_VERSION_NUM >= 150000
+static void
+imgsmlr_shmem_request(void)
+{
+	if (prev_shmem_request_hook)
+		prev_shmem_request_hook();
+	RequestAddinShmemSpace(MAXALIGN(sizeof(ImgsmlrSharedStats)));
+}
+#endif
+
+static void
+imgsmlr_shmem_startup(void)
+{
+	bool		found;
+	int			i;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+	sharedStats = (ImgsmlrSharedStats *)
+		ShmemInitStruct("imgsmlr stats", sizeof(ImgsmlrSharedStats), &found);
+	if (!found)
+	{
+		int			j;
+
+		for (i = 0; i < IMGSMLR_NUM_COUNTERS; i++)
+			pg_atomic_init_u64(&sharedStats->counters[i], 0);
+		for (i = 0; i < IMGSMLR_NUM_FORMATS; i++)
+			for (j = 0; j < IMGSMLR_NUM_INGEST_COUNTERS; j++)
+				pg_atomic_init_u64(&sharedStats->ingestCounters[i][j], 0);
+	}
+	LWLockRelease(AddinShmemInitLock);
+}
+
+/*
+ * Count KNN scans and index pages visited by them.  Distance function gets
+ * fresh FmgrInfo for each index scan, and GiST calls it for all the items
+ * of a page in a row.  So, page is counted when it differs from the page of
+ * previous call within the same scan.
+ */
+void
+imgsmlrCountPage(FmgrInfo *flinfo, Pointer page)
+{
+	ImgsmlrScanStats *scanStats = (ImgsmlrScanStats *) flinfo->fn_extra;
+
+	if (scanStats == NULL)
+	{
+		scanStats = (ImgsmlrScanStats *)
+			MemoryContextAllocZero(flinfo->fn_mcxt, sizeof(ImgsmlrScanStats));
+		flinfo->fn_extra = scanStats;
+		IMGSMLR_COUNT(IMGSMLR_KNN_SCANS);
+	}
+	if (scanStats->lastPage != page)
+	{
+		scanStats->lastPage = page;
+		IMGSMLR_COUNT(IMGSMLR_PAGES_VISITED);
+	}
+}
+
+/*
+ * Add counters collected since previous flush to the shared counters.
+ * Maximal image size is merged by maximum instead.
+ */
+static void
+flushStats(void)
+{
+	int			i,
+				j;
+
+	if (!sharedStats)
+		return;
+
+	for (i = 0; i < IMGSMLR_NUM_COUNTERS; i++)
+	{
+		uint64		delta = imgsmlrCounters[i] - flushedCounters[i];
+
+		if (delta > 0)
+			pg_atomic_fetch_add_u64(&sharedStats->counters[i], (int64) delta);
+		flushedCounters[i] = imgsmlrCounters[i];
+	}
+
+	for (i = 0; i < IMGSMLR_NUM_FORMATS; i++)
+	{
+		for (j = 0; j < IMGSMLR_NUM_INGEST_COUNTERS; j++)
+		{
+			pg_atomic_uint64 *shared = &sharedStats->ingestCounters[i][j];
+			uint64		value = imgsmlrIngestCounters[i][j];
+
+			if (j == IMGSMLR_INGEST_MAX_PIXELS)
+			{
+				uint64		old = pg_atomic_read_u64(shared);
+
+				while (value > old &&
+					   !pg_atomic_compare_exchange_u64(shared, &old, value))
+					;
+			}
+			else if (value > flushedIngestCounters[i][j])
+				pg_atomic_fetch_add_u64(shared,
+										(int64) (value - flushedIngestCounters[i][j]));
+			flushedIngestCounters[i][j] = value;
+		}
+	}
+}
+
+static void
+emitStatsNotice(void)
+{
+	uint64		delta[IMGSMLR_NUM_COUNTERS];
+	bool		changed = false;
+	int			i;
+
+	for (i = 0; i < IMGSMLR_NUM_COUNTERS; i++)
+	{
+		delta[i] = imgsmlrCounters[i] - queryStartCounters[i];
+		if (delta[i] > 0)
+			changed = true;
+	}
+	if (!changed)
+		return;
+
+	ereport(NOTICE,
+			(errmsg("imgsmlr: gist distance calls: %lu leaf, %lu internal; knn scans: %lu, pages visited: %lu; rechecks: %lu",
+					(unsigned long) delta[IMGSMLR_GIST_DISTANCE_LEAF],
+					(unsigned long) delta[IMGSMLR_GIST_DISTANCE_INTERNAL],
+					(unsigned long) delta[IMGSMLR_KNN_SCANS],
+					(unsigned long) delta[IMGSMLR_PAGES_VISITED],
+					(unsigned long) delta[IMGSMLR_CONSISTENT_RECHECKS]),
+			 errdetail("penalty calls: %lu (%.3f ms), picksplit calls: %lu (%.3f ms), pattern distance calls: %lu",
+					   (unsigned long) delta[IMGSMLR_PENALTY_CALLS],
+					   (double) delta[IMGSMLR_PENALTY_TIME] / 1000000.0,
+					   (unsigned long) delta[IMGSMLR_PICKSPLIT_CALLS],
+					   (double) delta[IMGSMLR_PICKSPLIT_TIME] / 1000000.0,
+					   (unsigned long) delta[IMGSMLR_PATTERN_DISTANCE_CALLS])));
+}
+
+static void
+imgsmlr_ExecutorStart(QueryDesc *queryDesc, int eflags)
+{
+	if (nestingLevel == 0)
+		memcpy(queryStartCounters, imgsmlrCounters, sizeof(imgsmlrCounters));
+	nestingLevel++;
+
+	if (prev_ExecutorStart)
+		prev_ExecutorStart(queryDesc, eflags);
+	else
+		standard_ExecutorStart(queryDesc, eflags);
+}
+
+static void
+imgsmlr_ExecutorEnd(QueryDesc *queryDesc)
+{
+	if (prev_ExecutorEnd)
+		prev_ExecutorEnd(queryDesc);
+	else
+		standard_ExecutorEnd(queryDesc);
+
+	if (nestingLevel > 0)
+		nestingLevel--;
+	if (nestingLevel == 0)
+	{
+		if (imgsmlr_stats_notice)
+			emitStatsNotice();
+		flushStats();
+	}
+}
+
+/*
+ * Flush counters of utility commands like CREATE INDEX, and forget about
+ * executor nesting after error.
+ */
+static void
+imgsmlr_xact_callback(XactEvent event, void *arg)
+{
+	switch (event)
+	{
+		case XACT_EVENT_ABORT:
+		case XACT_EVENT_PARALLEL_ABORT:
+			nestingLevel = 0;
+			flushStats();
+			break;
+		case XACT_EVENT_COMMIT:
+		case XACT_EVENT_PARALLEL_COMMIT:
+			flushStats();
+			break;
+		default:
+			break;
+	}
+}
+
+/*
+ * imgsmlr_stats(cumulative) returns counters of current backend or
+ * cumulative counters of all backends.
+ */
+Datum
+imgsmlr_stats(PG_FUNCTION_ARGS)
+{
+	bool		cumulative = PG_GETARG_BOOL(0);
+	uint64		counters[IMGSMLR_NUM_COUNTERS];
+	Datum		values[IMGSMLR_NUM_COUNTERS];
+	bool		nulls[IMGSMLR_NUM_COUNTERS];
+	TupleDesc	tupdesc;
+	int			i;
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	if (cumulative)
+	{
+		if (!sharedStats)
+			ereport(ERROR,
+					(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+					 errmsg("cumulative imgsmlr statistics are not available"),
+					 errhint("Add imgsmlr to shared_preload_libraries.")));
+		flushStats();
+		for (i = 0; i < IMGSMLR_NUM_COUNTERS; i++)
+			counters[i] = pg_atomic_read_u64(&sharedStats->counters[i]);
+	}
+	else
+		memcpy(counters, imgsmlrCounters, sizeof(counters));
+
+	for (i = 0; i < IMGSMLR_NUM_COUNTERS; i++)
+	{
+		nulls[i] = false;
+		/* Timings are reported in milliseconds */
+		if (i == IMGSMLR_PENALTY_TIME || i == IMGSMLR_PICKSPLIT_TIME)
+			values[i] = Float8GetDatum((double) counters[i] / 1000000.0);
+		else
+			values[i] = Int64GetDatum((int64) counters[i]);
+	}
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+Datum
+imgsmlr_stats_reset(PG_FUNCTION_ARGS)
+{
+	int			i;
+
+	memset(imgsmlrCounters, 0, sizeof(imgsmlrCounters));
+	memset(flushedCounters, 0, sizeof(flushedCounters));
+	memset(queryStartCounters, 0, sizeof(queryStartCounters));
+	memset(imgsmlrIngestCounters, 0, sizeof(imgsmlrIngestCounters));
+	memset(flushedIngestCounters, 0, sizeof(flushedIngestCounters));
+
+	if (sharedStats)
+	{
+		int			j;
+
+		for (i = 0; i < IMGSMLR_NUM_COUNTERS; i++)
+			pg_atomic_write_u64(&sharedStats->counters[i], 0);
+		for (i = 0; i < IMGSMLR_NUM_FORMATS; i++)
+			for (j = 0; j < IMGSMLR_NUM_INGEST_COUNTERS; j++)
+				pg_atomic_write_u64(&sharedStats->ingestCounters[i][j], 0);
+	}
+
+	PG_RETURN_VOID();
+}
+
+static bool
+isIngestTime(int counter)
+{
+	return counter >= IMGSMLR_INGEST_DECODE_TIME &&
+		counter <= IMGSMLR_INGEST_SHUFFLE_TIME;
+}
+
+/*
+ * imgsmlr_ingest_stats(cumulative) returns ingest counters of current
+ * backend or cumulative counters of all backends, one row per format.
+ */
+Datum
+imgsmlr_ingest_stats(PG_FUNCTION_ARGS)
+{
+	bool		cumulative = PG_GETARG_BOOL(0);
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext oldcontext;
+	int			i,
+				j;
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo) ||
+		!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	if (cumulative)
+	{
+		if (!sharedStats)
+			ereport(ERROR,
+					(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+					 errmsg("cumulative imgsmlr statistics are not available"),
+					 errhint("Add imgsmlr to shared_preload_libraries.")));
+		flushStats();
+	}
+
+	oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+	tupdesc = CreateTupleDescCopy(tupdesc);
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	MemoryContextSwitchTo(oldcontext);
+
+	for (i = 0; i < IMGSMLR_NUM_FORMATS; i++)
+	{
+		Datum		values[IMGSMLR_NUM_INGEST_COUNTERS + 1];
+		bool		nulls[IMGSMLR_NUM_INGEST_COUNTERS + 1];
+
+		memset(nulls, 0, sizeof(nulls));
+		values[0] = CStringGetTextDatum(imgsmlrFormatNames[i]);
+		for (j = 0; j < IMGSMLR_NUM_INGEST_COUNTERS; j++)
+		{
+			uint64		value;
+
+			if (cumulative)
+				value = pg_atomic_read_u64(&sharedStats->ingestCounters[i][j]);
+			else
+				value = imgsmlrIngestCounters[i][j];
+
+			/* Timings are reported in milliseconds */
+			if (isIngestTime(j))
+				values[j + 1] = Float8GetDatum((double) value / 1000000.0);
+			else
+				values[j + 1] = Int64GetDatum((int64) value);
+		}
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	return (Datum) 0;
+}
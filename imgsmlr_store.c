@@ -0,0 +1,780 @@
+/*-------------------------------------------------------------------------
+ *
+ *          Image similarity extension
+ *
+ * Copyright (c) 2015, PostgreSQL Global Development Group
+ *
+ * This software is released under the PostgreSQL Licence.
+ *
+ * Flat store of signatures: a file of fixed-size (TID, signature) records
+ * mirroring a signature column, which is scanned through mmap() without
+ * buffer manager and heap tuple overhead.
+ *
+ * The store is append-only.  Trigger appends a record for each inserted or
+ * updated row, so the store contains records of deleted, updated and aborted
+ * row versions as well.  It's neither WAL-logged nor transactional, so
+ * search verifies candidates against the heap: row version must be visible
+ * to the current snapshot and have the same signature as the record.
+ * Obsolete records are removed by signature_store_rebuild(), which must be
+ * also run after crash or on a standby.
+ *
+ * Records are addressed by TID, so they are meaningless once the table is
+ * rewritten by CLUSTER, VACUUM FULL, TRUNCATE or ALTER TABLE.  Header keeps
+ * relfilenode of the table the store was built for, and both search and
+ * trigger refuse to use the store after it's changed.
+ *
+ * IDENTIFICATION
+ *    imgsmlr/imgsmlr_store.c
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "imgsmlr.h"
+#include "access/heapam.h"
+#include "access/htup_details.h"
+#if PG_VERSION_NUM >= 120000
+#include "access/relation.h"
+#include "access/tableam.h"
+#include "catalog/pg_type.h"
+#include "executor/tuptable.h"
+#endif
+#include "catalog/pg_class.h"
+#include "commands/trigger.h"
+#include "miscadmin.h"
+#include "storage/fd.h"
+#include "storage/lmgr.h"
+#include "utils/acl.h"
+#include "utils/builtins.h"
+#include "utils/lsyscache.h"
+#include "utils/rel.h"
+#include "utils/rls.h"
+#include "utils/snapmgr.h"
+#include "utils/syscache.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+PG_FUNCTION_INFO_V1(signature_store_trigger);
+Datum		signature_store_trigger(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(signature_store_rebuild);
+Datum		signature_store_rebuild(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(signature_store_remove);
+Datum		signature_store_remove(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(signature_store_search);
+Datum		signature_store_search(PG_FUNCTION_ARGS);
+
+#define STORE_DIR		"pg_imgsmlr"
+#define STORE_MAGIC		0x494D4753	/* "IMGS" */
+#define STORE_VERSION	2
+
+/* Number of records written at once by rebuild */
+#define STORE_WRITE_BATCH 1024
+
+typedef struct
+{
+	uint32		magic;
+	uint32		version;
+	Oid			relid;
+	int32		attnum;
+	Oid			relfilenode;	/* of the heap the store was built for */
+} StoreHeader;
+
+typedef struct
+{
+	ItemPointerData tid;
+	uint16		padding;
+	Signature	signature;
+} StoreRecord;
+
+typedef struct
+{
+	ItemPointerData tid;
+	float		distance;		/* squared until returned */
+	uint32		record;
+} StoreCandidate;
+
+static void storeFilePath(char *path, Oid relid, AttrNumber attnum);
+static Oid	storeSignatureType(FunctionCallInfo fcinfo);
+static AttrNumber storeGetAttnum(Oid relid, const char *attname, Oid typid);
+static void storeWrite(int fd, const char *path, const void *data, Size len);
+static void storeCheckHeader(int fd, const char *path, Relation rel,
+							 AttrNumber attnum);
+static void storeCalcDistances(const StoreRecord *records, uint32 n,
+							   const Signature *query, float *distances);
+static int	storeSelect(const float *distances, uint32 n, int m,
+						StoreCandidate *candidates);
+static int	storeVerify(Relation rel, AttrNumber attnum,
+						const StoreRecord *records,
+						StoreCandidate *candidates, int n);
+
+static int
+cmp_candidate_tid(const void *a, const void *b)
+{
+	return ItemPointerCompare((ItemPointer) &((const StoreCandidate *) a)->tid,
+							  (ItemPointer) &((const StoreCandidate *) b)->tid);
+}
+
+static int
+cmp_candidate_distance(const void *a, const void *b)
+{
+	float		da = ((const StoreCandidate *) a)->distance;
+	float		db = ((const StoreCandidate *) b)->distance;
+
+	if (da < db)
+		return -1;
+	else if (da > db)
+		return 1;
+	else
+		return cmp_candidate_tid(a, b);
+}
+
+static void
+storeFilePath(char *path, Oid relid, AttrNumber attnum)
+{
+	snprintf(path, MAXPGPATH, "%s/%u_%u_%d.sig",
+			 STORE_DIR, MyDatabaseId, relid, (int) attnum);
+}
+
+/*
+ * Signature type belongs to the same schema as the functions of extension.
+ */
+static Oid
+storeSignatureType(FunctionCallInfo fcinfo)
+{
+	Oid			nsp = get_func_namespace(fcinfo->flinfo->fn_oid);
+
+#if PG_VERSION_NUM >= 120000
+	return GetSysCacheOid2(TYPENAMENSP, Anum_pg_type_oid,
+						   CStringGetDatum("signature"),
+						   ObjectIdGetDatum(nsp));
+#else
+	return GetSysCacheOid2(TYPENAMENSP,
+						   CStringGetDatum("signature"),
+						   ObjectIdGetDatum(nsp));
+#endif
+}
+
+static AttrNumber
+storeGetAttnum(Oid relid, const char *attname, Oid typid)
+{
+	AttrNumber	attnum = get_attnum(relid, attname);
+
+	if (attnum == InvalidAttrNumber)
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_COLUMN),
+				 errmsg("column \"%s\" of relation \"%s\" does not exist",
+						attname, get_rel_name(relid))));
+	if (get_atttype(relid, attnum) != typid)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATATYPE_MISMATCH),
+				 errmsg("column \"%s\" is not of signature type", attname)));
+	return attnum;
+}
+
+static void
+storeWrite(int fd, const char *path, const void *data, Size len)
+{
+	ssize_t		written;
+
+	errno = 0;
+	written = write(fd, data, len);
+	if (written != (ssize_t) len)
+	{
+		/* if write didn't set errno, assume problem is no disk space */
+		if (errno == 0)
+			errno = ENOSPC;
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not write file \"%s\": %m", path)));
+	}
+}
+
+/*
+ * Read header of the store file and make sure the store belongs to the
+ * current heap of the relation.
+ */
+static void
+storeCheckHeader(int fd, const char *path, Relation rel, AttrNumber attnum)
+{
+	StoreHeader header;
+	ssize_t		nread;
+
+	nread = pread(fd, &header, sizeof(header), 0);
+	if (nread < 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not read file \"%s\": %m", path)));
+	if (nread != sizeof(header) ||
+		header.magic != STORE_MAGIC || header.version != STORE_VERSION ||
+		header.relid != RelationGetRelid(rel) || header.attnum != attnum)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("invalid signature store \"%s\"", path),
+				 errhint("Run signature_store_rebuild() to rebuild the store.")));
+	if (header.relfilenode != rel->rd_rel->relfilenode)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("signature store of relation \"%s\" is out of date",
+						RelationGetRelationName(rel)),
+				 errdetail("Relation was rewritten after the store was built."),
+				 errhint("Run signature_store_rebuild() to rebuild the store.")));
+}
+
+static int
+storeOpen(const char *path, int flags)
+{
+#if PG_VERSION_NUM >= 110000
+	return OpenTransientFile(path, flags | PG_BINARY);
+#else
+	return OpenTransientFile((char *) path, flags | PG_BINARY, S_IRUSR | S_IWUSR);
+#endif
+}
+
+/*
+ * Trigger appending new row versions to the store.  Must be defined as
+ * AFTER INSERT OR UPDATE FOR EACH ROW with name of signature column as
+ * argument.  Every update moves row to the new TID, so trigger can't be
+ * restricted to updates of the signature column.
+ */
+Datum
+signature_store_trigger(PG_FUNCTION_ARGS)
+{
+	TriggerData *trigdata = (TriggerData *) fcinfo->context;
+	Relation	rel;
+	HeapTuple	tuple;
+	AttrNumber	attnum;
+	StoreRecord record;
+	char		path[MAXPGPATH];
+	Datum		value;
+	bool		isnull;
+	int			fd;
+
+	if (!CALLED_AS_TRIGGER(fcinfo))
+		elog(ERROR, "signature_store_trigger: not called by trigger manager");
+	if (!TRIGGER_FIRED_AFTER(trigdata->tg_event) ||
+		!TRIGGER_FIRED_FOR_ROW(trigdata->tg_event))
+		elog(ERROR, "signature_store_trigger: must be fired after row");
+	if (trigdata->tg_trigger->tgnargs != 1)
+		elog(ERROR, "signature_store_trigger: column name must be given");
+
+	rel = trigdata->tg_relation;
+	if (TRIGGER_FIRED_BY_UPDATE(trigdata->tg_event))
+		tuple = trigdata->tg_newtuple;
+	else if (TRIGGER_FIRED_BY_INSERT(trigdata->tg_event))
+		tuple = trigdata->tg_trigtuple;
+	else
+		elog(ERROR, "signature_store_trigger: must be fired for INSERT or UPDATE");
+
+	attnum = storeGetAttnum(RelationGetRelid(rel),
+							trigdata->tg_trigger->tgargs[0],
+							storeSignatureType(fcinfo));
+	value = heap_getattr(tuple, attnum, RelationGetDescr(rel), &isnull);
+	if (isnull)
+		return PointerGetDatum(NULL);
+
+	memset(&record, 0, sizeof(record));
+	record.tid = tuple->t_self;
+	memcpy(&record.signature, DatumGetPointer(value), sizeof(Signature));
+
+	/* Single write() of O_APPEND file doesn't interleave with others */
+	storeFilePath(path, RelationGetRelid(rel), attnum);
+	fd = storeOpen(path, O_RDWR | O_APPEND);
+	if (fd < 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not open signature store \"%s\": %m", path),
+				 errhint("Run signature_store_rebuild() to create the store.")));
+	storeCheckHeader(fd, path, rel, attnum);
+	storeWrite(fd, path, &record, sizeof(record));
+	CloseTransientFile(fd);
+
+	return PointerGetDatum(NULL);
+}
+
+/*
+ * signature_store_rebuild(rel, col) writes the store from scratch with
+ * signatures of rows visible now, and returns number of them.  Writers of
+ * the table are blocked meanwhile.
+ */
+Datum
+signature_store_rebuild(PG_FUNCTION_ARGS)
+{
+	Oid			relid = PG_GETARG_OID(0);
+	Name		attname = PG_GETARG_NAME(1);
+	AttrNumber	attnum;
+	Relation	rel;
+	Snapshot	snapshot;
+	StoreHeader header;
+	StoreRecord *records;
+	char		path[MAXPGPATH],
+				tmppath[MAXPGPATH];
+	int			fd,
+				nbuffered = 0;
+	int64		count = 0;
+	Datum		value;
+	bool		isnull;
+#if PG_VERSION_NUM >= 120000
+	TableScanDesc scan;
+	TupleTableSlot *slot;
+#else
+	HeapScanDesc scan;
+	HeapTuple	tuple;
+#endif
+
+#if PG_VERSION_NUM >= 160000
+	if (!object_ownercheck(RelationRelationId, relid, GetUserId()))
+#else
+	if (!pg_class_ownercheck(relid, GetUserId()))
+#endif
+		aclcheck_error(ACLCHECK_NOT_OWNER,
+#if PG_VERSION_NUM >= 110000
+					   OBJECT_TABLE,
+#else
+					   ACL_KIND_CLASS,
+#endif
+					   get_rel_name(relid));
+
+	attnum = storeGetAttnum(relid, NameStr(*attname), storeSignatureType(fcinfo));
+
+	rel = relation_open(relid, ShareLock);
+	if (rel->rd_rel->relkind != RELKIND_RELATION)
+		ereport(ERROR,
+				(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+				 errmsg("\"%s\" is not a table", RelationGetRelationName(rel))));
+
+	if (mkdir(STORE_DIR, S_IRWXU) < 0 && errno != EEXIST)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not create directory \"%s\": %m", STORE_DIR)));
+
+	storeFilePath(path, relid, attnum);
+	snprintf(tmppath, MAXPGPATH, "%s.tmp", path);
+	fd = storeOpen(tmppath, O_WRONLY | O_CREAT | O_TRUNC);
+	if (fd < 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not create file \"%s\": %m", tmppath)));
+
+	memset(&header, 0, sizeof(header));
+	header.magic = STORE_MAGIC;
+	header.version = STORE_VERSION;
+	header.relid = relid;
+	header.attnum = attnum;
+	header.relfilenode = rel->rd_rel->relfilenode;
+	storeWrite(fd, tmppath, &header, sizeof(header));
+
+	/* Rows committed while we waited for the lock must be seen */
+	snapshot = RegisterSnapshot(GetLatestSnapshot());
+	records = (StoreRecord *) palloc0(sizeof(StoreRecord) * STORE_WRITE_BATCH);
+
+#if PG_VERSION_NUM >= 120000
+	scan = table_beginscan(rel, snapshot, 0, NULL);
+	slot = table_slot_create(rel, NULL);
+	while (table_scan_getnextslot(scan, ForwardScanDirection, slot))
+	{
+		ItemPointerData tid = slot->tts_tid;
+
+		value = slot_getattr(slot, attnum, &isnull);
+#else
+	scan = heap_beginscan(rel, snapshot, 0, NULL);
+	while ((tuple = heap_getnext(scan, ForwardScanDirection)) != NULL)
+	{
+		ItemPointerData tid = tuple->t_self;
+
+		value = heap_getattr(tuple, attnum, RelationGetDescr(rel), &isnull);
+#endif
+		CHECK_FOR_INTERRUPTS();
+
+		if (isnull)
+			continue;
+
+		records[nbuffered].tid = tid;
+		memcpy(&records[nbuffered].signature, DatumGetPointer(value),
+			   sizeof(Signature));
+		count++;
+		if (++nbuffered == STORE_WRITE_BATCH)
+		{
+			storeWrite(fd, tmppath, records, sizeof(StoreRecord) * nbuffered);
+			nbuffered = 0;
+		}
+	}
+	storeWrite(fd, tmppath, records, sizeof(StoreRecord) * nbuffered);
+
+#if PG_VERSION_NUM >= 120000
+	ExecDropSingleTupleTableSlot(slot);
+	table_endscan(scan);
+#else
+	heap_endscan(scan);
+#endif
+	UnregisterSnapshot(snapshot);
+
+	if (pg_fsync(fd) != 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not fsync file \"%s\": %m", tmppath)));
+	CloseTransientFile(fd);
+	durable_rename(tmppath, path, ERROR);
+
+	pfree(records);
+	relation_close(rel, NoLock);
+
+	PG_RETURN_INT64(count);
+}
+
+/*
+ * signature_store_remove(rel, col) removes the store file.
+ */
+Datum
+signature_store_remove(PG_FUNCTION_ARGS)
+{
+	Oid			relid = PG_GETARG_OID(0);
+	Name		attname = PG_GETARG_NAME(1);
+	AttrNumber	attnum;
+	char		path[MAXPGPATH];
+
+#if PG_VERSION_NUM >= 160000
+	if (!object_ownercheck(RelationRelationId, relid, GetUserId()))
+#else
+	if (!pg_class_ownercheck(relid, GetUserId()))
+#endif
+		aclcheck_error(ACLCHECK_NOT_OWNER,
+#if PG_VERSION_NUM >= 110000
+					   OBJECT_TABLE,
+#else
+					   ACL_KIND_CLASS,
+#endif
+					   get_rel_name(relid));
+
+	attnum = storeGetAttnum(relid, NameStr(*attname), storeSignatureType(fcinfo));
+	storeFilePath(path, relid, attnum);
+	if (unlink(path) < 0 && errno != ENOENT)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not remove file \"%s\": %m", path)));
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * Squared distances from query to all the records.  Records are scanned
+ * sequentially and the inner loop has fixed trip count, so compiler
+ * vectorizes it.
+ */
+static void
+storeCalcDistances(const StoreRecord *records, uint32 n,
+				   const Signature *query, float *distances)
+{
+	uint32		i;
+
+	for (i = 0; i < n; i++)
+	{
+		const float *values = records[i].signature.values;
+		float		sum = 0.0f;
+		int			d;
+
+		for (d = 0; d < SIGNATURE_SIZE; d++)
+		{
+			float		diff = values[d] - query->values[d];
+
+			sum += diff * diff;
+		}
+		distances[i] = sum;
+
+		if ((i & 0xFFFF) == 0)
+			CHECK_FOR_INTERRUPTS();
+	}
+}
+
+/*
+ * Select up to m records of smallest distances using binary max-heap.
+ * Returns number of selected records.
+ */
+static int
+storeSelect(const float *distances, uint32 n, int m,
+			StoreCandidate *candidates)
+{
+	int			size = 0;
+	uint32		i;
+
+	for (i = 0; i < n; i++)
+	{
+		float		distance = distances[i];
+		int			pos;
+
+		if (isnan(distance))
+			continue;
+
+		if (size < m)
+		{
+			/* Sift up */
+			pos = size++;
+			while (pos > 0 && candidates[(pos - 1) / 2].distance < distance)
+			{
+				candidates[pos] = candidates[(pos - 1) / 2];
+				pos = (pos - 1) / 2;
+			}
+		}
+		else if (distance < candidates[0].distance)
+		{
+			/* Replace the root and sift down */
+			pos = 0;
+			while (true)
+			{
+				int			child = 2 * pos + 1;
+
+				if (child >= size)
+					break;
+				if (child + 1 < size &&
+					candidates[child + 1].distance > candidates[child].distance)
+					child++;
+				if (candidates[child].distance <= distance)
+					break;
+				candidates[pos] = candidates[child];
+				pos = child;
+			}
+		}
+		else
+			continue;
+
+		candidates[pos].distance = distance;
+		candidates[pos].record = i;
+	}
+	return size;
+}
+
+/*
+ * Keep only candidates whose row versions are visible and still have the
+ * signature of the record.  Returns number of remaining candidates, which
+ * are sorted by TID without duplicates.
+ */
+static int
+storeVerify(Relation rel, AttrNumber attnum, const StoreRecord *records,
+			StoreCandidate *candidates, int n)
+{
+	Snapshot	snapshot = GetActiveSnapshot();
+	BlockNumber nblocks = RelationGetNumberOfBlocks(rel);
+	int			nvalid = 0,
+				i;
+#if PG_VERSION_NUM >= 120000
+	TupleTableSlot *slot = table_slot_create(rel, NULL);
+#endif
+
+	for (i = 0; i < n; i++)
+		candidates[i].tid = records[candidates[i].record].tid;
+	qsort(candidates, n, sizeof(StoreCandidate), cmp_candidate_tid);
+
+	for (i = 0; i < n; i++)
+	{
+		StoreCandidate *c = &candidates[i];
+		const Signature *stored = &records[c->record].signature;
+		bool		valid = false;
+		bool		isnull;
+		Datum		value;
+
+		CHECK_FOR_INTERRUPTS();
+
+		/* The same row version might be appended twice */
+		if (nvalid > 0 && ItemPointerEquals(&candidates[nvalid - 1].tid, &c->tid))
+			continue;
+
+		/* TID may be stale after vacuum truncated the table */
+		if (ItemPointerGetBlockNumber(&c->tid) >= nblocks)
+			continue;
+
+#if PG_VERSION_NUM >= 120000
+		if (table_tuple_fetch_row_version(rel, &c->tid, snapshot, slot))
+		{
+			value = slot_getattr(slot, attnum, &isnull);
+			valid = !isnull &&
+				memcmp(DatumGetPointer(value), stored, sizeof(Signature)) == 0;
+			ExecClearTuple(slot);
+		}
+#else
+		{
+			HeapTupleData tuple;
+			Buffer		buffer;
+
+			tuple.t_self = c->tid;
+			if (heap_fetch(rel, snapshot, &tuple, &buffer, false, NULL))
+			{
+				value = heap_getattr(&tuple, attnum, RelationGetDescr(rel), &isnull);
+				valid = !isnull &&
+					memcmp(DatumGetPointer(value), stored, sizeof(Signature)) == 0;
+				ReleaseBuffer(buffer);
+			}
+		}
+#endif
+
+		if (valid)
+			candidates[nvalid++] = *c;
+	}
+
+#if PG_VERSION_NUM >= 120000
+	ExecDropSingleTupleTableSlot(slot);
+#endif
+	return nvalid;
+}
+
+/*
+ * Find up to k visible rows nearest to the query using the store.  Returns
+ * number of found rows; candidates are ordered by distance.
+ */
+static int
+storeSearch(FunctionCallInfo fcinfo, StoreCandidate **result)
+{
+	Oid			relid = PG_GETARG_OID(0);
+	Name		attname = PG_GETARG_NAME(1);
+	Signature  *query = (Signature *) PG_GETARG_POINTER(2);
+	int32		k = PG_GETARG_INT32(3);
+	AttrNumber	attnum;
+	Relation	rel;
+	AclResult	aclresult;
+	char		path[MAXPGPATH];
+	int			fd;
+	struct stat st;
+	char	   *map;
+	const StoreRecord *records;
+	uint32		n;
+	float	   *distances;
+	StoreCandidate *candidates = NULL;
+	int			m,
+				nvalid = 0;
+
+	aclresult = pg_class_aclcheck(relid, GetUserId(), ACL_SELECT);
+	if (aclresult != ACLCHECK_OK)
+		aclcheck_error(aclresult,
+#if PG_VERSION_NUM >= 110000
+					   OBJECT_TABLE,
+#else
+					   ACL_KIND_CLASS,
+#endif
+					   get_rel_name(relid));
+	if (check_enable_rls(relid, InvalidOid, false) == RLS_ENABLED)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("signature store is not supported for tables with row level security")));
+
+	attnum = storeGetAttnum(relid, NameStr(*attname), get_fn_expr_argtype(fcinfo->flinfo, 2));
+	if (k <= 0)
+	{
+		*result = NULL;
+		return 0;
+	}
+
+	rel = relation_open(relid, AccessShareLock);
+
+	storeFilePath(path, relid, attnum);
+	fd = storeOpen(path, O_RDONLY);
+	if (fd < 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not open signature store \"%s\": %m", path),
+				 errhint("Run signature_store_rebuild() to create the store.")));
+	if (fstat(fd, &st) < 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not stat file \"%s\": %m", path)));
+	storeCheckHeader(fd, path, rel, attnum);
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not mmap file \"%s\": %m", path)));
+	CloseTransientFile(fd);
+
+	/* Incomplete record being appended concurrently is ignored */
+	records = (const StoreRecord *) (map + sizeof(StoreHeader));
+	n = (st.st_size - sizeof(StoreHeader)) / sizeof(StoreRecord);
+
+	PG_TRY();
+	{
+#ifdef MADV_SEQUENTIAL
+		madvise(map, st.st_size, MADV_SEQUENTIAL);
+#endif
+		distances = (float *) palloc(sizeof(float) * Max(n, 1));
+		storeCalcDistances(records, n, query, distances);
+
+		/*
+		 * Some of the nearest records might be obsolete, so take more
+		 * candidates than needed and retry with more when it's not enough.
+		 */
+		m = Min((uint32) Max(2 * k, 16), Max(n, 1));
+		while (true)
+		{
+			int			selected;
+
+			candidates = (StoreCandidate *) palloc(sizeof(StoreCandidate) * m);
+			selected = storeSelect(distances, n, m, candidates);
+			nvalid = storeVerify(rel, attnum, records, candidates, selected);
+			if (nvalid >= k || selected < m || (uint32) m >= n)
+				break;
+			pfree(candidates);
+			m = (int) Min((uint64) m * 4, (uint64) n);
+		}
+		pfree(distances);
+	}
+	PG_CATCH();
+	{
+		munmap(map, st.st_size);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	munmap(map, st.st_size);
+	relation_close(rel, AccessShareLock);
+
+	qsort(candidates, nvalid, sizeof(StoreCandidate), cmp_candidate_distance);
+	*result = candidates;
+	return Min(nvalid, k);
+}
+
+/*
+ * signature_store_search(rel, col, query, k) returns up to k visible rows
+ * nearest to the query signature by exhaustive scan of the store.
+ */
+Datum
+signature_store_search(PG_FUNCTION_ARGS)
+{
+	FuncCallContext *funcctx;
+	StoreCandidate *candidates;
+
+	if (SRF_IS_FIRSTCALL())
+	{
+		MemoryContext oldCtx;
+		TupleDesc	tupdesc;
+
+		funcctx = SRF_FIRSTCALL_INIT();
+		oldCtx = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+			elog(ERROR, "return type must be a row type");
+		funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+		funcctx->max_calls = storeSearch(fcinfo, &candidates);
+		funcctx->user_fctx = candidates;
+
+		MemoryContextSwitchTo(oldCtx);
+	}
+
+	funcctx = SRF_PERCALL_SETUP();
+	candidates = (StoreCandidate *) funcctx->user_fctx;
+
+	if (funcctx->call_cntr < funcctx->max_calls)
+	{
+		StoreCandidate *c = &candidates[funcctx->call_cntr];
+		Datum		values[2];
+		bool		nulls[2] = {false, false};
+		HeapTuple	tuple;
+
+		values[0] = ItemPointerGetDatum(&c->tid);
+		values[1] = Float4GetDatum(sqrtf(c->distance));
+		tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+
+		SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+	}
+
+	SRF_RETURN_DONE(funcctx);
+}
@@ -0,0 +1,331 @@
+/*-------------------------------------------------------------------------
+ *
+ *          Image similarity extension
+ *
+ * Copyright (c) 2015, PostgreSQL Global Development Group
+ *
+ * This software is released under the PostgreSQL Licence.
+ *
+ * Author: Alexander Korotkov <aekorotkov@gmail.com>
+ *
+ * Transform of images into patterns and signatures.  This file is compiled
+ * into both the extension and the frontend imgsmlr_bulk tool.
+ *
+ * IDENTIFICATION
+ *    imgsmlr/imgsmlr_transform.c
+ *-------------------------------------------------------------------------
+ */
+#ifdef FRONTEND
+#include "postgres_fe.h"
+#else
+#include "postgres.h"
+#endif
+
+#include "imgsmlr_transform.h"
+
+#include <math.h>
+
+static float calcSumm(const float *pattern, int n, int x, int y, int sX, int sY);
+static void shuffle(float *dst, const float *src, int n, int x, int y, int sX, int sY, int w);
+
+/*
+ * Detect image format by magic bytes.  Returns false for unknown format.
+ */
+bool
+detectImageFormat(const unsigned char *data, size_t size, ImgsmlrFormat *format)
+{
+	if (size >= 3 && data[0] == 0xFF && data[1] == 0xD8 && data[2] == 0xFF)
+		*format = IMGSMLR_FORMAT_JPEG;
+	else if (size >= 8 && memcmp(data, "\x89PNG\r\n\x1a\n", 8) == 0)
+		*format = IMGSMLR_FORMAT_PNG;
+	else if (size >= 6 && memcmp(data, "GIF8", 4) == 0)
+		*format = IMGSMLR_FORMAT_GIF;
+	else
+		return false;
+	return true;
+}
+
+/*
+ * Decode image of given format.  Returns NULL on failure.
+ */
+gdImagePtr
+loadImageData(ImgsmlrFormat format, const void *data, size_t size)
+{
+	switch (format)
+	{
+		case IMGSMLR_FORMAT_JPEG:
+			return gdImageCreateFromJpegPtr((int) size, (void *) data);
+		case IMGSMLR_FORMAT_PNG:
+			return gdImageCreateFromPngPtr((int) size, (void *) data);
+		case IMGSMLR_FORMAT_GIF:
+			return gdImageCreateFromGifPtr((int) size, (void *) data);
+		default:
+			return NULL;
+	}
+}
+
+/*
+ * Shuffle pattern values in order to make further comparisons less sensitive
+ * to shift. Shuffling is actually a build of "w" radius in rectangle
+ * "(x, y) - (x + sX, y + sY)".
+ */
+static void
+shuffle(float *dst, const float *src, int n, int x, int y, int sX, int sY, int w)
+{
+	int i, j;
+
+	for (i = x; i < x + sX; i++)
+	{
+		for (j = y; j < y + sY; j++)
+		{
+			int ii, jj;
+			int ii_min = Max(x, i - w),
+				ii_max = Min(x + sX, i + w + 1),
+				jj_min = Max(y, j - w),
+				jj_max = Min(y + sY, j + w + 1);
+			float sum = 0.0f, sum_r = 0.0f;
+
+			for (ii = ii_min; ii < ii_max; ii++)
+			{
+				for (jj = jj_min; jj < jj_max; jj++)
+				{
+					float r = (i - ii) * (i - ii) + (j - jj) * (j - jj);
+					r = 1.0f - sqrt(r) / (float)w;
+					if (r <= 0.0f)
+						continue;
+					sum += PATTERN_VALUE(src, n, ii, jj) * PATTERN_VALUE(src, n, ii, jj) * r;
+					sum_r += r;
+				}
+			}
+			Assert (sum >= 0.0f);
+			Assert (sum_r > 0.0f);
+			PATTERN_VALUE(dst, n, i, j) = sqrt(sum / sum_r);
+		}
+	}
+}
+
+/*
+ * Shuffle pattern: call "shuffle" for each region of wavelet-transformed
+ * pattern. For each region, blur radius is selected accordingly to its size.
+ */
+void
+shufflePattern(float *dst, const float *src, int n)
+{
+	int size = n;
+
+	memcpy(dst, src, PATTERN_BYTES(n));
+
+	while (size > 4)
+	{
+		size /= 2;
+		shuffle(dst, src, n, size, 0, size, size, size / 4);
+		shuffle(dst, src, n, 0, size, size, size, size / 4);
+		shuffle(dst, src, n, size, size, size, size, size / 4);
+	}
+}
+
+/*
+ * Make pattern from gd image.
+ */
+void
+makePattern(gdImagePtr im, float *pattern, int size)
+{
+	int i, j;
+	for (i = 0; i < size; i++)
+		for (j = 0; j < size; j++)
+		{
+			int pixel = gdImageGetTrueColorPixel(im, i, j);
+			float red = (float) gdTrueColorGetRed(pixel) / 255.0,
+				  green = (float) gdTrueColorGetGreen(pixel) / 255.0,
+				  blue = (float) gdTrueColorGetBlue(pixel) / 255.0;
+			PATTERN_VALUE(pattern, size, i, j) = sqrt((red * red + green * green + blue * blue) / 3.0f);
+		}
+}
+
+/*
+ * Normalize pattern: make it minimal value equal to 0 and
+ * maximum value equal to 1.
+ */
+void
+normalizePattern(float *pattern, int size)
+{
+	float min = 1.0f, max = 0.0f, val;
+	int i, j;
+	for (i = 0; i < size; i++)
+	{
+		for (j = 0; j < size; j++)
+		{
+			val = PATTERN_VALUE(pattern, size, i, j);
+			if (val < min) min = val;
+			if (val > max) max = val;
+
+		}
+	}
+	for (i = 0; i < size; i++)
+	{
+		for (j = 0; j < size; j++)
+		{
+			PATTERN_VALUE(pattern, size, i, j) = (PATTERN_VALUE(pattern, size, i, j) - min) / (max - min);
+		}
+	}
+}
+
+/*
+ * Do Haar wavelet transform over pattern.  Each step puts differences of
+ * "size" x "size" level into the quadrants of "dst" and averages into the
+ * top-left quadrant of "src", which is processed by the next step.
+ */
+static pg_attribute_always_inline void
+waveletTransformKernel(float *dst, float *src, int n)
+{
+	int size = n;
+
+	while (size > 1)
+	{
+		int i, j;
+		size /= 2;
+		for (i = 0; i < size; i++)
+		{
+			for (j = 0; j < size; j++)
+			{
+				float a = PATTERN_VALUE(src, n, 2 * i, 2 * j),
+					  b = PATTERN_VALUE(src, n, 2 * i + 1, 2 * j),
+					  c = PATTERN_VALUE(src, n, 2 * i, 2 * j + 1),
+					  d = PATTERN_VALUE(src, n, 2 * i + 1, 2 * j + 1);
+
+				PATTERN_VALUE(dst, n, i + size, j) =        ( - a + b - c + d) / 4.0f;
+				PATTERN_VALUE(dst, n, i, j + size) =        ( - a - b + c + d) / 4.0f;
+				PATTERN_VALUE(dst, n, i + size, j + size) = (   a - b - c + d) / 4.0f;
+			}
+		}
+		for (i = 0; i < size; i++)
+		{
+			for (j = 0; j < size; j++)
+			{
+				PATTERN_VALUE(src, n, i, j) =               (   PATTERN_VALUE(src, n, 2 * i, 2 * j)     + PATTERN_VALUE(src, n, 2 * i + 1, 2 * j)
+				                                              + PATTERN_VALUE(src, n, 2 * i, 2 * j + 1) + PATTERN_VALUE(src, n, 2 * i + 1, 2 * j + 1)) / 4.0f;
+			}
+		}
+	}
+	dst[0] = src[0];
+}
+
+/*
+ * Call wavelet transform kernel specialized for common pattern sizes.
+ */
+void
+waveletTransform(float *dst, float *src, int size)
+{
+	switch (size)
+	{
+		case 32:
+			waveletTransformKernel(dst, src, 32);
+			break;
+		case 64:
+			waveletTransformKernel(dst, src, 64);
+			break;
+		default:
+			waveletTransformKernel(dst, src, size);
+			break;
+	}
+}
+
+/*
+ * Calculate summary of squares in rectangle "(x, y) - (x + sX, y + sY)".
+ */
+static pg_attribute_always_inline float
+calcSumm(const float *pattern, int n, int x, int y, int sX, int sY)
+{
+	int i, j;
+	float summ = 0.0f, val;
+	for (i = x; i < x + sX; i++)
+	{
+		for (j = y; j < y + sY; j++)
+		{
+			val = PATTERN_VALUE(pattern, n, i, j);
+			summ += val * val;
+		}
+	}
+	return sqrt(summ);
+}
+
+/*
+ * Make short signature from pattern.  Only levels fitting into
+ * SIGNATURE_PATTERN_SIZE block are used; levels missing in the smaller
+ * pattern are zero.
+ */
+static pg_attribute_always_inline void
+calcSignatureKernel(const float *pattern, int n, Signature *signature)
+{
+	int size = SIGNATURE_PATTERN_SIZE;
+	int i = 0;
+	float mult = 1.0f;
+
+	while (size > 1)
+	{
+		size /= 2;
+		if (2 * size <= n)
+		{
+			signature->values[i++] = mult * calcSumm(pattern, n, size, 0, size, size);
+			signature->values[i++] = mult * calcSumm(pattern, n, 0, size, size, size);
+			signature->values[i++] = mult * calcSumm(pattern, n, size, size, size, size);
+		}
+		else
+		{
+			signature->values[i++] = 0.0f;
+			signature->values[i++] = 0.0f;
+			signature->values[i++] = 0.0f;
+		}
+		mult *= 2.0f;
+	}
+	signature->values[SIGNATURE_SIZE - 1] = pattern[0];
+}
+
+/*
+ * Call signature kernel specialized for common pattern sizes.
+ */
+void
+calcSignature(const float *pattern, int size, Signature *signature)
+{
+	switch (size)
+	{
+		case 32:
+			calcSignatureKernel(pattern, 32, signature);
+			break;
+		case 64:
+			calcSignatureKernel(pattern, 64, signature);
+			break;
+		default:
+			calcSignatureKernel(pattern, size, signature);
+			break;
+	}
+}
+
+/*
+ * Make binary signature from pattern: sign bits of the coarse wavelet
+ * coefficients.  The average value is always positive, so its bit tells
+ * whether the image is brighter than the middle grey instead.
+ */
+void
+calcBitSignature(const float *pattern, int size, BitSignature *signature)
+{
+	int i, j;
+
+	memset(signature, 0, sizeof(BitSignature));
+	for (i = 0; i < BITSIGNATURE_SIDE; i++)
+	{
+		for (j = 0; j < BITSIGNATURE_SIDE; j++)
+		{
+			int bit = i * BITSIGNATURE_SIDE + j;
+			bool set;
+
+			if (bit == 0)
+				set = pattern[0] > 0.5f;
+			else
+				set = PATTERN_VALUE(pattern, size, i, j) > 0.0f;
+
+			if (set)
+				signature->words[bit / 64] |= UINT64CONST(1) << (bit % 64);
+		}
+	}
+}
@@ -0,0 +1,36 @@
+/*-------------------------------------------------------------------------
+ *
+ *          Image similarity extension
+ *
+ * Copyright (c) 2015, PostgreSQL Global Development Group
+ *
+ * This software is released under the PostgreSQL Licence.
+ *
+ * Transform of images into patterns and signatures.  These routines neither
+ * allocate memory nor report errors, so they are shared by the extension and
+ * the frontend imgsmlr_bulk tool.
+ *
+ * IDENTIFICATION
+ *    imgsmlr/imgsmlr_transform.h
+ *-------------------------------------------------------------------------
+ */
+#ifndef IMGSMLR_TRANSFORM_H
+#define IMGSMLR_TRANSFORM_H
+
+#include "imgsmlr.h"
+
+#include <gd.h>
+
+extern bool detectImageFormat(const unsigned char *data, size_t size,
+							  ImgsmlrFormat *format);
+extern gdImagePtr loadImageData(ImgsmlrFormat format, const void *data,
+								size_t size);
+extern void makePattern(gdImagePtr im, float *pattern, int size);
+extern void normalizePattern(float *pattern, int size);
+extern void waveletTransform(float *dst, float *src, int size);
+extern void shufflePattern(float *dst, const float *src, int size);
+extern void calcSignature(const float *pattern, int size, Signature *signature);
+extern void calcBitSignature(const float *pattern, int size,
+							 BitSignature *signature);
+
+#endif   /* IMGSMLR_TRANSFORM_H */
@@ -0,0 +1,160 @@
+/*-------------------------------------------------------------------------
+ *
+ *          Image similarity extension
+ *
+ * Copyright (c) 2015, PostgreSQL Global Development Group
+ *
+ * This software is released under the PostgreSQL Licence.
+ *
+ * Helpers shared by trained models: product quantizer codebooks and coarse
+ * quantizers.  Models are sampled from user tables, stored in extension
+ * tables and loaded by id into memory context of the function call site.
+ *
+ * IDENTIFICATION
+ *    imgsmlr/imgsmlr_util.c
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+#include "fmgr.h"
+#include "imgsmlr.h"
+#include "catalog/pg_type.h"
+#include "executor/spi.h"
+#include "utils/builtins.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/syscache.h"
+
+/* Maximal number of columns selected for a model */
+#define MODEL_MAX_COLUMNS	8
+
+/*
+ * Quoted name of the schema imgsmlr is installed into.
+ */
+char *
+extensionNamespace(FunctionCallInfo fcinfo)
+{
+	return quote_identifier(get_namespace_name(get_func_namespace(fcinfo->flinfo->fn_oid)));
+}
+
+/*
+ * Oid of the type of given name, which belongs to the same schema as the
+ * functions of extension.
+ */
+Oid
+extensionType(FunctionCallInfo fcinfo, const char *typname)
+{
+	Oid			nsp = get_func_namespace(fcinfo->flinfo->fn_oid);
+
+#if PG_VERSION_NUM >= 120000
+	return GetSysCacheOid2(TYPENAMENSP, Anum_pg_type_oid,
+						   CStringGetDatum(typname),
+						   ObjectIdGetDatum(nsp));
+#else
+	return GetSysCacheOid2(TYPENAMENSP,
+						   CStringGetDatum(typname),
+						   ObjectIdGetDatum(nsp));
+#endif
+}
+
+/*
+ * Make sure the model of given id is in the cache, loading it from the
+ * extension table when needed.  Model is made by parser from the values of
+ * selected columns in the own memory context of the cache, which is a child
+ * of fn_mcxt.  Returns true when the model was (re)loaded.
+ */
+bool
+loadModel(FunctionCallInfo fcinfo, ModelCache *cache, int32 id,
+		  const char *table, const char *columns, const char *kind,
+		  ModelParser parse)
+{
+	Oid			argtypes[1] = {INT4OID};
+	Datum		args[1];
+	Datum		values[MODEL_MAX_COLUMNS];
+	bool		isnull;
+	MemoryContext mcxt,
+				oldcontext;
+	int			ret,
+				i;
+
+	if (cache->mcxt && cache->id == id)
+		return false;
+
+	if (cache->mcxt)
+	{
+		MemoryContextDelete(cache->mcxt);
+		cache->mcxt = NULL;
+		cache->model = NULL;
+	}
+
+	args[0] = Int32GetDatum(id);
+
+	SPI_connect();
+	ret = SPI_execute_with_args(psprintf("SELECT %s FROM %s.%s WHERE id = $1",
+										 columns, extensionNamespace(fcinfo),
+										 table),
+								1, argtypes, args, NULL, true, 1);
+	if (ret != SPI_OK_SELECT)
+		elog(ERROR, "could not load %s: error code %d", kind, ret);
+	if (SPI_processed != 1)
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_OBJECT),
+				 errmsg("%s %d does not exist", kind, id)));
+
+	Assert(SPI_tuptable->tupdesc->natts <= MODEL_MAX_COLUMNS);
+	for (i = 0; i < SPI_tuptable->tupdesc->natts; i++)
+		values[i] = SPI_getbinval(SPI_tuptable->vals[0],
+								  SPI_tuptable->tupdesc, i + 1, &isnull);
+
+	mcxt = AllocSetContextCreate(fcinfo->flinfo->fn_mcxt,
+								 "imgsmlr model",
+								 ALLOCSET_SMALL_SIZES);
+	oldcontext = MemoryContextSwitchTo(mcxt);
+	cache->model = parse(values, id);
+	MemoryContextSwitchTo(oldcontext);
+	cache->mcxt = mcxt;
+	cache->id = id;
+
+	SPI_finish();
+
+	return true;
+}
+
+/*
+ * Select random sample of non-NULL values of given column into
+ * SPI_tuptable, the caller must be connected to SPI.  Column must be of the
+ * given type of extension, since the caller decodes sampled datums as values
+ * of that type.  Rows are taken randomly rather than first ones, since
+ * physical order of rows is often correlated with their values.  Returns
+ * number of sampled rows.
+ */
+int
+spiSampleColumn(FunctionCallInfo fcinfo, Oid relid, Name attname,
+				const char *typname, int sampleSize)
+{
+	const char *column = quote_identifier(NameStr(*attname));
+	AttrNumber	attnum = get_attnum(relid, NameStr(*attname));
+	int			ret;
+
+	if (attnum == InvalidAttrNumber)
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_COLUMN),
+				 errmsg("column \"%s\" of relation \"%s\" does not exist",
+						NameStr(*attname), get_rel_name(relid))));
+	if (get_atttype(relid, attnum) != extensionType(fcinfo, typname))
+		ereport(ERROR,
+				(errcode(ERRCODE_DATATYPE_MISMATCH),
+				 errmsg("column \"%s\" is not of %s type",
+						NameStr(*attname), typname)));
+
+	ret = SPI_execute(psprintf("SELECT %s FROM %s WHERE %s IS NOT NULL "
+							   "ORDER BY random() LIMIT %d",
+							   column,
+							   quote_qualified_identifier(get_namespace_name(get_rel_namespace(relid)),
+														  get_rel_name(relid)),
+							   column,
+							   sampleSize),
+					  true, 0);
+	if (ret != SPI_OK_SELECT)
+		elog(ERROR, "could not read sample: error code %d", ret);
+	return (int) SPI_processed;
+}
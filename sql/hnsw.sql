@@ -0,0 +1,50 @@
+SET enable_seqscan = OFF;
+
+BEGIN;
+DROP INDEX pat_signature_idx;
+CREATE INDEX pat_signature_hnsw_idx ON pat USING hnsw (signature);
+SELECT id FROM pat ORDER BY signature <-> (SELECT signature FROM pat WHERE id = 1) LIMIT 3;
+SELECT id FROM pat ORDER BY signature <-> (SELECT signature FROM pat WHERE id = 4) LIMIT 3;
+ROLLBACK;
+
+CREATE TABLE hnsw_bitsig AS (
+    SELECT
+        i AS id,
+        (repeat('f', i / 4) || substr('08ce', i % 4 + 1, 1) || repeat('0', 63 - i / 4))::bitsignature AS bitsig
+    FROM generate_series(0, 127) i
+);
+
+CREATE INDEX hnsw_bitsig_idx ON hnsw_bitsig USING hnsw (bitsig) WITH (m = 8, ef_construction = 32);
+
+INSERT INTO hnsw_bitsig (
+    SELECT
+        i AS id,
+        (repeat('f', i / 4) || substr('08ce', i % 4 + 1, 1) || repeat('0', 63 - i / 4))::bitsignature AS bitsig
+    FROM generate_series(128, 255) i
+);
+
+SET imgsmlr.hnsw_ef_search = 64;
+
+SELECT id, bitsig <-> repeat('0', 64)::bitsignature AS dist FROM hnsw_bitsig ORDER BY bitsig <-> repeat('0', 64)::bitsignature LIMIT 5;
+SELECT id, bitsig <-> repeat('f', 64)::bitsignature AS dist FROM hnsw_bitsig ORDER BY bitsig <-> repeat('f', 64)::bitsignature LIMIT 5;
+
+DELETE FROM hnsw_bitsig WHERE id < 2;
+VACUUM hnsw_bitsig;
+
+SELECT id, bitsig <-> repeat('0', 64)::bitsignature AS dist FROM hnsw_bitsig ORDER BY bitsig <-> repeat('0', 64)::bitsignature LIMIT 5;
+
+SET imgsmlr.hnsw_ef_search = 4;
+SELECT count(*) FROM (SELECT id FROM hnsw_bitsig ORDER BY bitsig <-> repeat('0', 64)::bitsignature LIMIT 100) x;
+SELECT count(*) FROM (SELECT id FROM hnsw_bitsig ORDER BY bitsig <-> repeat('0', 64)::bitsignature LIMIT 1000) x;
+SELECT count(DISTINCT id) FROM (SELECT id FROM hnsw_bitsig ORDER BY bitsig <-> repeat('0', 64)::bitsignature LIMIT 1000) x;
+
+RESET imgsmlr.hnsw_ef_search;
+
+SELECT opcname, amvalidate(c.oid) FROM pg_opclass c JOIN pg_am a ON a.oid = c.opcmethod WHERE a.amname = 'hnsw' ORDER BY opcname;
+
+BEGIN;
+CREATE OPERATOR CLASS hnsw_broken_ops FOR TYPE bitsignature USING hnsw AS
+    OPERATOR    1   <-> (bitsignature, bitsignature) FOR ORDER BY pg_catalog.float_ops,
+    FUNCTION    1   signature_distance (signature, signature);
+SELECT amvalidate(oid) FROM pg_opclass WHERE opcname = 'hnsw_broken_ops';
+ROLLBACK;
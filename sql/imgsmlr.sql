@@ -69,3 +69,176 @@ SELECT id FROM pat ORDER BY signature <-> (SELECT signature FROM pat WHERE id =
 SELECT id FROM pat ORDER BY signature <-> (SELECT signature FROM pat WHERE id = 4) LIMIT 3;
 SELECT id FROM pat ORDER BY signature <-> (SELECT signature FROM pat WHERE id = 7) LIMIT 3;
 SELECT id FROM pat ORDER BY signature <-> (SELECT signature FROM pat WHERE id = 10) LIMIT 3;
+
+SELECT 'ff00000000000000000000000000000000000000000000000000000000000000'::bitsignature <-> '0f00000000000000000000000000000000000000000000000000000000000001'::bitsignature;
+
+CREATE TABLE bitsig AS (
+    SELECT
+        i AS id,
+        (repeat('f', i / 4) || substr('08ce', i % 4 + 1, 1) || repeat('0', 63 - i / 4))::bitsignature AS bitsig
+    FROM generate_series(0, 255) i
+);
+
+CREATE INDEX bitsig_idx ON bitsig USING gist (bitsig);
+
+SELECT id, bitsig <-> repeat('0', 64)::bitsignature AS dist FROM bitsig ORDER BY bitsig <-> repeat('0', 64)::bitsignature LIMIT 5;
+SELECT id, bitsig <-> repeat('f', 64)::bitsignature AS dist FROM bitsig ORDER BY bitsig <-> repeat('f', 64)::bitsignature LIMIT 5;
+
+CREATE TABLE pat32 (id integer, pattern pattern(32));
+INSERT INTO pat32 (SELECT id, pattern FROM pat);
+SELECT format_type(atttypid, atttypmod) FROM pg_attribute WHERE attrelid = 'pat32'::regclass AND attname = 'pattern';
+SELECT id, pattern_size(pattern) FROM pat32 ORDER BY id LIMIT 3;
+SELECT p.id, round((pattern2signature(p.pattern) <-> pattern2signature(p32.pattern))::numeric, 4) FROM pat p JOIN pat32 p32 ON p.id = p32.id ORDER BY p.id LIMIT 3;
+SELECT id, round((pattern <-> pattern::pattern(128)::pattern(64))::numeric, 4) FROM pat ORDER BY id LIMIT 3;
+SELECT pattern_size(('(' || repeat('0, ', 16 * 16 - 1) || '0)')::pattern), pattern_size(('(' || repeat('0, ', 128 * 128 - 1) || '0)')::pattern);
+DO $$
+BEGIN
+	PERFORM ('(' || repeat('0, ', 128 * 128) || '0)')::pattern;
+EXCEPTION WHEN invalid_text_representation THEN
+	RAISE NOTICE 'pattern of too many values is rejected';
+END;
+$$;
+
+SELECT p.id FROM pattern_rerank('pat', 'pattern', (SELECT pattern FROM pat WHERE id = 1), ARRAY(SELECT ctid FROM pat ORDER BY signature <-> (SELECT signature FROM pat WHERE id = 1) LIMIT 6), 3) r JOIN pat p ON p.ctid = r.tid ORDER BY r.distance;
+
+SELECT imgsmlr_stats_reset();
+SELECT id FROM pat ORDER BY signature <-> (SELECT signature FROM pat WHERE id = 1) LIMIT 3;
+SELECT knn_scans, pages_visited > 0 AS pages_visited, gist_distance_leaf_calls > 0 AS leaf_calls FROM imgsmlr_stats(false);
+
+SELECT imgsmlr_stats_reset();
+SELECT count(jpeg2pattern(data)) FROM image WHERE id % 3 = 1;
+SELECT png2pattern(data) IS NULL FROM image WHERE id = 1;
+SELECT format, images, failures, bytes_in > 0 AS bytes_in, pixels > 0 AS pixels FROM imgsmlr_ingest_stats(false);
+
+SELECT length(pattern_send(pattern)), length(signature_send(signature)) FROM pat WHERE id = 1;
+CREATE TABLE pat_bin (id integer, pattern pattern, signature signature);
+\copy (SELECT id, pattern, signature FROM pat) to 'results/pat.bin' with (format binary)
+\copy pat_bin from 'results/pat.bin' with (format binary)
+SELECT count(*) FROM pat p JOIN pat_bin b ON p.id = b.id WHERE p.pattern <-> b.pattern = 0 AND p.signature <-> b.signature = 0;
+
+SELECT n, round((p <-> (SELECT CASE WHEN id % 3 = 1 THEN jpeg2pattern(data) WHEN id % 3 = 2 THEN png2pattern(data) ELSE gif2pattern(data) END FROM image WHERE id = n))::numeric, 4) FROM images2patterns(ARRAY(SELECT data FROM image ORDER BY id)) WITH ORDINALITY AS t(p, n);
+SELECT n, pattern_size(p) FROM images2patterns(ARRAY(SELECT data FROM image WHERE id <= 3 ORDER BY id), 32) WITH ORDINALITY AS t(p, n);
+SELECT n, p IS NULL FROM images2patterns(ARRAY['\x00'::bytea, NULL, (SELECT data FROM image WHERE id = 1)]) WITH ORDINALITY AS t(p, n);
+
+CREATE TABLE gallery (id integer PRIMARY KEY, pattern pattern, signature signature);
+INSERT INTO gallery (SELECT id FROM image);
+INSERT INTO imgsmlr_ingest_target (relid, key_column, shuffled_column, signature_column) VALUES ('gallery', 'id', 'pattern', 'signature');
+INSERT INTO imgsmlr_ingest_queue (relid, key, image) (SELECT 'gallery', id::text, data FROM image ORDER BY id);
+SELECT imgsmlr_ingest_process(5);
+SELECT imgsmlr_ingest_process();
+SELECT imgsmlr_ingest_process();
+SELECT count(*) FROM gallery g JOIN pat p ON p.id = g.id WHERE g.pattern <-> p.pattern < 0.001 AND g.signature <-> p.signature < 0.001;
+INSERT INTO imgsmlr_ingest_queue (relid, key, image) VALUES ('gallery', '1', '\x00'), ('pat', '1', (SELECT data FROM image WHERE id = 1)), ('gallery', '99999999999', (SELECT data FROM image WHERE id = 2)), ('gallery', '3', (SELECT data FROM image WHERE id = 3));
+SELECT imgsmlr_ingest_process();
+SELECT imgsmlr_ingest_process();
+SELECT key, error FROM imgsmlr_ingest_queue ORDER BY id;
+
+SET imgsmlr.cache_size = '1MB';
+SELECT imgsmlr_cache_reset();
+SELECT count(jpeg2pattern(data)) FROM image WHERE id % 3 = 1;
+SELECT count(*) FROM image i JOIN pat p ON p.id = i.id WHERE i.id % 3 = 1 AND shuffle_pattern(jpeg2pattern(i.data)) <-> p.pattern < 0.001;
+SELECT hits, misses, evictions, entries FROM imgsmlr_cache_stats();
+SET imgsmlr.cache_size = '64kB';
+SELECT evictions > 0 AS evicted, memory <= 65536 AS fits FROM imgsmlr_cache_stats();
+RESET imgsmlr.cache_size;
+
+SELECT count(DISTINCT signature), count(DISTINCT pattern) FROM (SELECT * FROM pat UNION ALL SELECT * FROM pat) x;
+SET enable_sort = off;
+SELECT count(*), sum(n) FROM (SELECT signature, count(*) AS n FROM (SELECT * FROM pat UNION ALL SELECT * FROM pat) x GROUP BY signature) g;
+RESET enable_sort;
+SELECT a = b AS eq, a < b AS lt, signature_hash(a) = signature_hash(b) AS same_hash
+	FROM (VALUES (('(0' || repeat(', 1', 15) || ')')::signature, ('(-0' || repeat(', 1', 15) || ')')::signature),
+				 (('(nan' || repeat(', 1', 15) || ')')::signature, ('(-nan' || repeat(', 1', 15) || ')')::signature),
+				 (('(1' || repeat(', 1', 15) || ')')::signature, ('(nan' || repeat(', 1', 15) || ')')::signature)) v(a, b);
+SELECT p1.id, p2.id FROM pat p1 JOIN pat p2 ON p1.pattern = p2.pattern ORDER BY p1.id LIMIT 3;
+SELECT pattern = pattern::pattern(32) AS eq, pattern > pattern::pattern(32) AS gt FROM pat WHERE id = 1;
+
+ANALYZE pat;
+SELECT null_frac, n_distinct FROM pg_stats WHERE tablename = 'pat' AND attname = 'signature';
+SELECT count(*) FROM pat WHERE signature_distance_within(signature, (SELECT signature FROM pat WHERE id = 1), 0);
+SELECT count(*) FROM pat WHERE signature_distance_within(signature, (SELECT signature FROM pat WHERE id = 1), 1000000);
+
+CREATE TABLE flat (id integer, signature signature);
+INSERT INTO flat (SELECT id, signature FROM pat WHERE id <= 8);
+SELECT signature_store_create('flat', 'signature');
+SELECT f.id, abs(s.distance - (f.signature <-> (SELECT signature FROM pat WHERE id = 1))) < 0.0001 AS same FROM signature_store_search('flat', 'signature', (SELECT signature FROM pat WHERE id = 1), 3) s JOIN flat f ON f.ctid = s.tid ORDER BY s.distance;
+SELECT id FROM flat ORDER BY signature <-> (SELECT signature FROM pat WHERE id = 1) LIMIT 3;
+INSERT INTO flat (SELECT id, signature FROM pat WHERE id > 8);
+UPDATE flat SET signature = (SELECT signature FROM pat WHERE id = 1) WHERE id = 12;
+DELETE FROM flat WHERE id = 1;
+SELECT f.id FROM signature_store_search('flat', 'signature', (SELECT signature FROM pat WHERE id = 1), 3) s JOIN flat f ON f.ctid = s.tid ORDER BY s.distance, f.id;
+SELECT count(*) FROM signature_store_search('flat', 'signature', (SELECT signature FROM pat WHERE id = 1), 100);
+VACUUM FULL flat;
+SELECT count(*) FROM signature_store_search('flat', 'signature', (SELECT signature FROM pat WHERE id = 1), 100);
+INSERT INTO flat VALUES (13, (SELECT signature FROM pat WHERE id = 1));
+SELECT signature_store_rebuild('flat', 'signature');
+SELECT count(*) FROM signature_store_search('flat', 'signature', (SELECT signature FROM pat WHERE id = 1), 100);
+SELECT signature_store_drop('flat', 'signature');
+
+SELECT pq_train('pat', 'pattern', 32);
+CREATE TABLE pat_pq AS (SELECT id, pattern2pq(pattern, 1) AS code FROM pat);
+SELECT pq_codebook(code), length(split_part(code::text, ':', 2)) FROM pat_pq WHERE id = 1;
+SELECT count(*) FROM pat_pq WHERE code::text::pq_pattern::text = code::text;
+SELECT count(*) FROM pat p JOIN pat_pq q ON p.id = q.id WHERE abs((q.code <-> (SELECT pattern FROM pat WHERE id = 1)) - (p.pattern <-> (SELECT pattern FROM pat WHERE id = 1))) <= 0.001 * (p.pattern <-> (SELECT pattern FROM pat WHERE id = 1)) + 0.001;
+SELECT id FROM pat_pq ORDER BY code <-> (SELECT pattern FROM pat WHERE id = 1) LIMIT 3;
+SELECT ('1:' || repeat('ff', 32))::pq_pattern <-> (SELECT pattern FROM pat WHERE id = 1);
+SELECT pq_train('pat', 'id', 32);
+SELECT pq_train('pat', 'signature', 32);
+CREATE ROLE regress_imgsmlr_user;
+GRANT SELECT ON pat, pat_pq TO regress_imgsmlr_user;
+SET ROLE regress_imgsmlr_user;
+SELECT count(*) FROM pat p JOIN pat_pq q ON p.id = q.id WHERE pattern2pq(p.pattern, 1)::text = q.code::text;
+SELECT id FROM pat_pq ORDER BY code <-> (SELECT pattern FROM pat WHERE id = 1) LIMIT 3;
+RESET ROLE;
+DROP OWNED BY regress_imgsmlr_user;
+DROP ROLE regress_imgsmlr_user;
+
+CREATE TABLE sig_ins (id int, signature signature);
+CREATE INDEX sig_ins_idx ON sig_ins USING gist (signature);
+INSERT INTO sig_ins SELECT g, ('(' || array_to_string(ARRAY(SELECT sin(g * d) FROM generate_series(1, 16) d), ', ') || ')')::signature FROM generate_series(1, 2000) g;
+SELECT count(*) FROM (SELECT id FROM sig_ins ORDER BY signature <-> (SELECT signature FROM sig_ins WHERE id = 1000) LIMIT 2000) x;
+SELECT id FROM sig_ins ORDER BY signature <-> (SELECT signature FROM sig_ins WHERE id = 1000) LIMIT 1;
+
+CREATE TABLE pat_z AS (SELECT id, pattern_compress(pattern) AS pattern FROM pat);
+SELECT count(*) FROM pat_z WHERE pg_column_size(pattern) < 4 * 64 * 64;
+SELECT count(*) FROM pat_z z JOIN pat p ON p.id = z.id WHERE z.pattern = p.pattern AND z.pattern::text = p.pattern::text AND pattern_size(z.pattern) = 64;
+SELECT count(*) FROM pat_z z JOIN pat p ON p.id = z.id WHERE (z.pattern <-> (SELECT pattern FROM pat_z WHERE id = 1)) = (p.pattern <-> (SELECT pattern FROM pat WHERE id = 1));
+SELECT count(*) FROM pat_z z JOIN pat p ON p.id = z.id WHERE pg_column_size(pattern_decompress(z.pattern)) = pg_column_size(p.pattern::text::pattern);
+SELECT p.id FROM pattern_rerank('pat_z', 'pattern', (SELECT pattern FROM pat WHERE id = 1), ARRAY(SELECT ctid FROM pat_z), 3) r JOIN pat_z p ON p.ctid = r.tid ORDER BY r.distance;
+SET imgsmlr.pattern_compression = on;
+SELECT pg_column_size(shuffle_pattern(pattern)) < 4 * 64 * 64 FROM pat WHERE id = 1;
+RESET imgsmlr.pattern_compression;
+
+SELECT length(signature_zorder(signature)) FROM pat WHERE id = 1;
+SELECT signature_zorder(('(0' || repeat(', 1', 15) || ')')::signature) = signature_zorder(('(-0' || repeat(', 1', 15) || ')')::signature),
+       signature_zorder(('(-1' || repeat(', 1', 15) || ')')::signature) < signature_zorder(('(0.5' || repeat(', 1', 15) || ')')::signature);
+CREATE TABLE pat_zo AS (SELECT id, signature FROM pat ORDER BY id DESC);
+SELECT signature_store_create('pat_zo', 'signature');
+SELECT correlation_before IS NOT NULL AS before, round(correlation_after::numeric, 6) AS after FROM imgsmlr_reorder('pat_zo', 'signature');
+SELECT count(*) FROM pat_zo;
+SELECT count(*) FROM signature_store_search('pat_zo', 'signature', (SELECT signature FROM pat WHERE id = 1), 100);
+SELECT signature_store_drop('pat_zo', 'signature');
+
+SELECT signature_quantizer_train('pat', 'signature', 3);
+SELECT bool_and(signature_assign(signature, 1) BETWEEN 0 AND 2) FROM pat;
+SELECT bool_and((signature_probe(signature, 1, 2))[1] = signature_assign(signature, 1)) FROM pat;
+SELECT array_length(signature_probe(signature, 1, 5), 1) FROM pat WHERE id = 1;
+CREATE TABLE pat_cell AS (SELECT id, signature, signature_assign(signature, 1) AS cell FROM pat);
+SELECT p.id FROM signature_probe_search('pat_cell', 'signature', 'cell', (SELECT signature FROM pat WHERE id = 1), 1, 3, 3) r JOIN pat_cell p ON p.ctid = r.tid ORDER BY r.distance;
+SELECT count(*) FROM signature_probe_search('pat_cell', 'signature', 'cell', (SELECT signature FROM pat WHERE id = 1), 1, 1, 12) r JOIN pat_cell p ON p.ctid = r.tid WHERE p.cell <> signature_assign((SELECT signature FROM pat WHERE id = 1), 1);
+SELECT signature_quantizer_train('pat', 'id', 3);
+SELECT signature_quantizer_train('pat', 'pattern', 3);
+CREATE ROLE regress_imgsmlr_user;
+GRANT SELECT ON pat, pat_cell TO regress_imgsmlr_user;
+SET ROLE regress_imgsmlr_user;
+SELECT count(*) FROM pat_cell WHERE signature_assign(signature, 1) = cell;
+SELECT array_length(signature_probe(signature, 1, 2), 1) FROM pat WHERE id = 1;
+SELECT p.id FROM signature_probe_search('pat_cell', 'signature', 'cell', (SELECT signature FROM pat WHERE id = 1), 1, 3, 3) r JOIN pat_cell p ON p.ctid = r.tid ORDER BY r.distance;
+RESET ROLE;
+DROP OWNED BY regress_imgsmlr_user;
+DROP ROLE regress_imgsmlr_user;
+
+SELECT part, pages, resident FROM imgsmlr_prewarm('pat_signature_idx');
+SELECT part, pages > 0 AS nonempty, resident FROM imgsmlr_prewarm('pat_signature_idx', 'pattern');
+SELECT part, pages > 0 AS nonempty, loaded, resident FROM imgsmlr_prewarm('pat_signature_idx', 'pattern', ARRAY(SELECT ctid FROM pat WHERE id <= 2));
+SELECT count(*) FROM imgsmlr_prewarm('pat_pkey');
@@ -0,0 +1,47 @@
+SET enable_seqscan = OFF;
+
+BEGIN;
+DROP INDEX pat_signature_idx;
+CREATE INDEX pat_signature_spgist_idx ON pat USING spgist (signature);
+SELECT id FROM pat ORDER BY signature <-> (SELECT signature FROM pat WHERE id = 1) LIMIT 3;
+SELECT id FROM pat ORDER BY signature <-> (SELECT signature FROM pat WHERE id = 4) LIMIT 3;
+ROLLBACK;
+
+CREATE TABLE spgist_sig AS (
+    SELECT
+        g AS id,
+        ('(' || array_to_string(ARRAY(SELECT sin(g * d) FROM generate_series(1, 16) d), ', ') || ')')::signature AS signature
+    FROM generate_series(1, 1000) g
+);
+
+CREATE INDEX spgist_sig_idx ON spgist_sig USING spgist (signature);
+
+INSERT INTO spgist_sig (
+    SELECT
+        g AS id,
+        ('(' || array_to_string(ARRAY(SELECT sin(g * d) FROM generate_series(1, 16) d), ', ') || ')')::signature AS signature
+    FROM generate_series(1001, 2000) g
+);
+
+CREATE TABLE spgist_knn AS (
+    SELECT
+        q.id,
+        ARRAY(SELECT s.signature <-> q.signature FROM spgist_sig s ORDER BY s.signature <-> q.signature LIMIT 10) AS dists
+    FROM spgist_sig q
+    WHERE q.id % 50 = 0
+);
+
+SELECT count(*) FROM (SELECT id FROM spgist_sig ORDER BY signature <-> (SELECT signature FROM spgist_sig WHERE id = 1000) LIMIT 2000) x;
+
+SET enable_seqscan = ON;
+SET enable_indexscan = OFF;
+SET enable_bitmapscan = OFF;
+
+SELECT count(*) FROM spgist_knn k WHERE k.dists = ARRAY(
+    SELECT s.signature <-> q.signature
+    FROM spgist_sig s, spgist_sig q
+    WHERE q.id = k.id
+    ORDER BY s.signature <-> q.signature LIMIT 10);
+
+RESET enable_indexscan;
+RESET enable_bitmapscan;
@@ -0,0 +1,48 @@
+#!/bin/bash
+#
+# Test of imgsmlr_bulk work distribution.  Images from data/ are converted
+# with different numbers of threads, including more threads than images,
+# so that workers steal the last item of each other's ranges.  Each image
+# must be written exactly once.
+#
+# Usage: test/bulk.sh path/to/imgsmlr_bulk
+#
+
+set -eu
+
+bulk=$1
+dir=$(cd "$(dirname "$0")/.." && pwd)
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+for f in "$dir"/data/*.jpg "$dir"/data/*.png "$dir"/data/*.gif; do
+	name=$(basename "$f")
+	printf '%s\t%s\n' "${name%%.*}" "$f"
+done > "$tmp/manifest"
+nimages=$(wc -l < "$tmp/manifest")
+expected=$(cut -f1 "$tmp/manifest" | sort -n)
+
+# Header, rows of 4 fields with 16x16 patterns, trailer
+rowsize=$((2 + 4 + 8 + 2 * (4 + 4 * 16 * 16) + 4 + 4 * 16))
+
+for threads in 1 2 5 $nimages $((nimages + 1)) 64; do
+	for run in 1 2 3 4 5; do
+		"$bulk" -j $threads -s 16 -m "$tmp/manifest" -o "$tmp/out.bin" 2> /dev/null
+
+		size=$(stat -c %s "$tmp/out.bin")
+		if [ "$size" -ne $((19 + nimages * rowsize + 2)) ]; then
+			echo "FAILED: $threads threads wrote $size bytes for $nimages images"
+			exit 1
+		fi
+
+		ids=$(for ((i = 0; i < nimages; i++)); do
+			echo $((16#$(xxd -p -s $((19 + i * rowsize + 6)) -l 8 "$tmp/out.bin")))
+		done | sort -n)
+		if [ "$ids" != "$expected" ]; then
+			echo "FAILED: $threads threads wrote ids" $ids
+			exit 1
+		fi
+	done
+done
+
+echo "ok"
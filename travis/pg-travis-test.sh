@@ -123,6 +123,9 @@ fi
 # run regression tests
 PGPORT=55435 PGUSER=$USER PG_CONFIG=$config_path make installcheck USE_PGXS=1 || status=$?
 
+# check standalone bulk generator
+make check-bulk USE_PGXS=1 PG_CONFIG=$config_path || status=$?
+
 # stop cluster
 $pg_ctl_path -D $CLUSTER_PATH stop -l postgres.log -w
 